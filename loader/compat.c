@@ -23,6 +23,15 @@
 
 struct _PEB _peb;
 
+#ifdef HIMEMCE_HOST
+size_t
+pread (HANDLE handle, char *buffer, size_t len, off_t offset)
+{
+  /* On the host, this is the POSIX pread and does not move the file
+     pointer.  */
+  return host_pread (handle, buffer, len, offset);
+}
+#else
 size_t
 pread (HANDLE handle, char *buffer, size_t len, off_t offset)
 {
@@ -33,6 +42,50 @@ pread (HANDLE handle, char *buffer, size_t len, off_t offset)
     return -1;
   return out;
 }
+#endif
+
+
+/* The PE headers of an image are parsed up to three times: for the
+   key of the image cache, by get_image_params and by map_image.  The
+   loader reads the start of the file into a struct image_header once
+   and hands it to all of them, and they read through
+   image_header_pread, which only goes to the file for what is not in
+   the buffer.  */
+BOOL
+image_header_read (struct image_header *header, HANDLE handle)
+{
+  size_t got = pread (handle, header->data, IMAGE_HEADER_BUFFER, 0);
+
+  if (got == (size_t) -1)
+    {
+      header->len = 0;
+      return FALSE;
+    }
+  header->len = got;
+  return TRUE;
+}
+
+
+size_t
+image_header_pread (const struct image_header *header, HANDLE handle,
+		    char *buffer, size_t len, off_t offset)
+{
+  if (offset >= 0 && offset + len <= header->len)
+    {
+      memcpy (buffer, header->data + offset, len);
+      return len;
+    }
+  if (header->len < IMAGE_HEADER_BUFFER)
+    {
+      /* The whole file is in the buffer.  */
+      if (offset < 0 || offset >= header->len)
+	return 0;
+      len = header->len - offset;
+      memcpy (buffer, header->data + offset, len);
+      return len;
+    }
+  return pread (handle, buffer, len, offset);
+}
 
 
 int get_prot_flags (int vprot)
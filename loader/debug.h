@@ -1,5 +1,11 @@
 #include <stdio.h>
 
 /* Debugging output.  FIXME: For now... */
+#ifdef HIMEMCE_HOST
+/* The host benchmark switches off tracing to time the load paths.  */
+extern int host_quiet;
+#define TRACE(...) ((void) (host_quiet || printf (__VA_ARGS__)))
+#else
 #define TRACE printf
+#endif
 #define ERR printf
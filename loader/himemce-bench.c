@@ -0,0 +1,270 @@
+/* himemce-bench.c - High Memory for Windows CE (host benchmark)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* Time the load paths of the loader on the build host.  Each image
+   is mapped, relocated and bound against the stub DLLs of the host
+   platform layer, but never run.  */
+
+#include <windows.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "wine.h"
+#include "kernel32_kernel_private.h"
+#include "himemce-map.h"
+
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "usage: %s [-v] [-l] [-c] [-b] [-L] [-D] [-p THREADS] [-s USEC] "
+	   "[-n ITERATIONS] [-d DLL]... IMAGE...\n"
+	   "  -v      show the loader trace\n"
+	   "  -l      load on demand, then touch every page\n"
+	   "  -c      use (and create) the relocated image cache\n"
+	   "  -b      bind imports from (and create) the bound imports "
+	   "snapshot\n"
+	   "  -L      bind imported functions lazily, then call each once\n"
+	   "  -D      discard relocations and discardable sections after "
+	   "binding\n"
+	   "  -p N    relocate with N threads (0: one per processor)\n"
+	   "  -s USEC wait USEC microseconds before every read (slow media)\n"
+	   "  -n N    load every image N times (default 10)\n"
+	   "  -d DLL  resolve imports from DLL with stubs\n", prog);
+  exit (1);
+}
+
+
+/* Load images on demand (-l), from the image cache (-c), or relocate
+   them with several threads (-p), and bind their imports from the
+   snapshot (-b) or lazily (-L).  */
+static DWORD load_flags;
+
+/* Decommit what is not needed after binding (-D).  */
+static int discard;
+
+
+/* Touch every page of the image at BASE, which makes a lazily loaded
+   image complete.  */
+static void
+touch_image (HMODULE base)
+{
+  IMAGE_NT_HEADERS *nt = MyRtlImageNtHeader (base);
+  volatile char *ptr = (volatile char *) base;
+  DWORD off;
+
+  for (off = 0; off < nt->OptionalHeader.SizeOfImage; off += 0x1000)
+    (void) ptr[off];
+}
+
+
+static int
+bench_image (const char *filename, int iterations)
+{
+  WCHAR wname[MAX_PATH];
+  char path[MAX_PATH];
+  double load_ms = 0;
+  double import_ms = 0;
+  double touch_ms = 0;
+  double lazy_ms = 0;
+  int nr_lazy = 0;
+  struct host_stats load_stats;
+  struct host_stats import_stats;
+  struct host_stats touch_stats;
+  struct host_stats lazy_stats;
+  DWORD committed = 0;
+  DWORD total = 0;
+  struct himemce_discarded ranges[HIMEMCE_MAX_DISCARDED];
+  int nr_ranges = 0;
+  int i;
+
+  if (! realpath (filename, path))
+    {
+      fprintf (stderr, "can not find %s\n", filename);
+      return 0;
+    }
+  host_path_to_wide (path, wname);
+
+  memset (&load_stats, 0, sizeof (load_stats));
+  memset (&import_stats, 0, sizeof (import_stats));
+  for (i = 0; i < iterations; i++)
+    {
+      struct binary_info info;
+      HANDLE hfile;
+      HMODULE hmod;
+      NTSTATUS nts;
+      double t0, t1, t2;
+
+      /* Follow the process start path: the image is opened and
+	 checked first, then loaded from the same handle.  */
+      host_stats_reset ();
+      t0 = now ();
+      hfile = CreateFileForMappingW (wname, GENERIC_READ, FILE_SHARE_READ,
+				     NULL, OPEN_EXISTING, 0, 0);
+      if (hfile == INVALID_HANDLE_VALUE)
+	{
+	  fprintf (stderr, "opening %s failed: %i\n", path, GetLastError ());
+	  return 0;
+	}
+      MODULE_get_binary_info (hfile, &info);
+      hmod = MyLoadLibraryExW (wname, hfile,
+			       DONT_RESOLVE_DLL_REFERENCES | load_flags);
+      CloseHandle (hfile);
+      t1 = now ();
+      if (! hmod)
+	{
+	  fprintf (stderr, "loading %s failed: %i\n", path, GetLastError ());
+	  return 0;
+	}
+      load_stats = host_stats;
+
+      host_stats_reset ();
+      nts = MyLdrResolveImports (hmod);
+      t2 = now ();
+      if (nts != STATUS_SUCCESS)
+	fprintf (stderr, "resolving imports of %s failed: %x\n", path, nts);
+      import_stats = host_stats;
+
+      load_ms += t1 - t0;
+      import_ms += t2 - t1;
+
+      if (load_flags & HIMEMCE_LAZY_BIND)
+	{
+	  double t3;
+
+	  host_stats_reset ();
+	  t3 = now ();
+	  nr_lazy = MyLdrBindLazyImports (hmod);
+	  lazy_ms += now () - t3;
+	  lazy_stats = host_stats;
+	}
+
+      if (discard)
+	nr_ranges = virtual_discard_image (hmod, ranges,
+					   HIMEMCE_MAX_DISCARDED);
+
+      if (load_flags & HIMEMCE_LAZY_LOAD)
+	{
+	  double t3;
+
+	  virtual_get_image_pages (hmod, &committed, &total);
+	  host_stats_reset ();
+	  touch_image (hmod);
+	  t3 = now ();
+	  touch_stats = host_stats;
+	  touch_ms += t3 - t2;
+	}
+      MyLdrUnloadDll (hmod);
+    }
+
+  printf ("%s: %i iterations\n", path, iterations);
+  printf ("  load:    %9.3f ms  reads %lu (%llu bytes)  seeks %lu  "
+	  "valloc %lu\n", load_ms / iterations, load_stats.reads,
+	  load_stats.read_bytes, load_stats.seeks, load_stats.valloc_calls);
+  printf ("  imports: %9.3f ms  LoadLibrary %lu  GetProcAddress %lu\n",
+	  import_ms / iterations, import_stats.load_library_calls,
+	  import_stats.get_proc_address_calls);
+  printf ("  cache:   LoadLibrary %lu of %lu avoided  GetProcAddress %lu of "
+	  "%lu avoided\n", himemce_dll_stats.dll_hits,
+	  himemce_dll_stats.dll_hits + himemce_dll_stats.dll_loads,
+	  himemce_dll_stats.proc_hits,
+	  himemce_dll_stats.proc_hits + himemce_dll_stats.proc_lookups);
+  if (load_flags & HIMEMCE_LAZY_BIND)
+    printf ("  calls:   %9.3f ms  GetProcAddress %lu  (%i imports bound "
+	    "lazily)\n", lazy_ms / iterations,
+	    lazy_stats.get_proc_address_calls, nr_lazy);
+  if (load_flags & HIMEMCE_LAZY_LOAD)
+    printf ("  touch:   %9.3f ms  faults %lu  (%u of %u pages "
+	    "committed after load)\n", touch_ms / iterations,
+	    touch_stats.faults, committed, total);
+  if (discard)
+    {
+      DWORD discarded = 0;
+
+      for (i = 0; i < nr_ranges; i++)
+	discarded += ranges[i].size;
+      printf ("  discard: %9u KB in %i ranges\n", discarded / 1024,
+	      nr_ranges);
+      for (i = 0; i < nr_ranges; i++)
+	printf ("    %-8.8s rva 0x%08x  size 0x%x\n", ranges[i].name,
+		ranges[i].rva, ranges[i].size);
+    }
+  return 1;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+  int iterations = 10;
+  int result = 0;
+  int i;
+
+  host_quiet = 1;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+      if (! strcmp (argv[i], "-v"))
+	host_quiet = 0;
+      else if (! strcmp (argv[i], "-s") && i + 1 < argc)
+	host_read_latency = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-c"))
+	load_flags |= HIMEMCE_CACHE_LOAD;
+      else if (! strcmp (argv[i], "-b"))
+	load_flags |= HIMEMCE_BIND_IMPORTS;
+      else if (! strcmp (argv[i], "-L"))
+	load_flags |= HIMEMCE_LAZY_BIND;
+      else if (! strcmp (argv[i], "-D"))
+	discard = 1;
+      else if (! strcmp (argv[i], "-p") && i + 1 < argc)
+	{
+	  load_flags |= HIMEMCE_PARALLEL_RELOC;
+	  virtual_reloc_threads = atoi (argv[++i]);
+	}
+      else if (! strcmp (argv[i], "-l"))
+	{
+	  load_flags |= HIMEMCE_LAZY_LOAD;
+	  host_set_fault_handler (virtual_handle_fault);
+	}
+      else if (! strcmp (argv[i], "-n") && i + 1 < argc)
+	iterations = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-d") && i + 1 < argc)
+	host_add_stub_dll (argv[++i]);
+      else
+	usage (argv[0]);
+    }
+  if (i == argc || iterations < 1)
+    usage (argv[0]);
+
+  for (; i < argc; i++)
+    if (! bench_image (argv[i], iterations))
+      result = 1;
+
+  return result;
+}
@@ -0,0 +1,318 @@
+/* himemce-bind.c - High Memory for Windows CE (pre-bound imports)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* Every start of a program resolves all its imports again, although
+   the DLLs in the himemce map stay at the same addresses for the
+   whole boot, and the system DLLs hardly ever change.  The bound
+   imports snapshot FILENAME.imports keeps the import address tables
+   of an image as they were after the last start, and the loader
+   copies them back instead of looking up every import.
+
+   The snapshot of an image is keyed by the PE header of the image and
+   the write time of the loader.  Each imported DLL in it is keyed by
+   its address, and by the write time of its file or, for DLLs from
+   the himemce map, the generation of the map.  The loader checks the
+   key of each DLL after loading it, and only resolves the imports
+   from DLLs that do not match.  The snapshot is written again at the
+   end if any of them did not.  */
+
+#include <windows.h>
+
+#include "wine.h"
+
+#define BIND_MAGIC   0x646e6268
+#define BIND_VERSION 1
+
+/* The header is followed by one entry for every import descriptor,
+   and then the import address tables, in the same order.  */
+struct bind_header
+{
+  DWORD magic;
+  DWORD version;
+
+  /* The key.  */
+  DWORD time_stamp;
+  DWORD checksum;
+  DWORD image_size;
+  FILETIME loader;
+
+  DWORD nr_imports;
+};
+
+
+struct bind_entry
+{
+  /* The import address table of the descriptor.  */
+  DWORD first_thunk;
+  DWORD nr_thunks;
+
+  /* The key of the imported DLL, zero if not bound.  */
+  DWORD base;
+  FILETIME stamp;
+};
+
+
+struct himemce_bind
+{
+  WCHAR name[MAX_PATH];
+  char *image;
+  struct bind_header hdr;
+
+  /* The entries of the snapshot read back, or NULL if there is none,
+     and their import address tables.  */
+  struct bind_entry *old;
+  DWORD *old_thunks;
+
+  /* The entries as bound now, and the index of the first thunk of
+     each in OLD_THUNKS.  */
+  struct bind_entry *cur;
+  DWORD *first;
+  int dirty;
+};
+
+
+static int
+get_bind_name (LPCWSTR name, WCHAR *bind_name)
+{
+  static const WCHAR suffix[] = L".imports";
+
+  if (wcslen (name) + wcslen (suffix) >= MAX_PATH)
+    return 0;
+  wcscpy (bind_name, name);
+  wcscat (bind_name, suffix);
+  return 1;
+}
+
+
+/* Store the write time of the file MODULE was loaded from in STAMP.
+   Returns false if it is not known.  */
+BOOL
+himemce_bind_module_stamp (HMODULE module, FILETIME *stamp)
+{
+  WCHAR filename[MAX_PATH];
+  HANDLE file;
+  BOOL ok;
+
+  if (! GetModuleFileName (module, filename, MAX_PATH))
+    return FALSE;
+  file = CreateFile (filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+		     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return FALSE;
+  ok = GetFileTime (file, NULL, NULL, stamp);
+  CloseHandle (file);
+  return ok;
+}
+
+
+/* Read the snapshot BIND->name into BIND, if its key matches.  */
+static void
+read_snapshot (struct himemce_bind *bind)
+{
+  struct bind_header hdr;
+  HANDLE file;
+  DWORD size;
+  DWORD nread;
+  DWORD nr_thunks = 0;
+  DWORD i;
+
+  file = CreateFile (bind->name, GENERIC_READ, FILE_SHARE_READ, NULL,
+		     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return;
+
+  if (! ReadFile (file, &hdr, sizeof (hdr), &nread, NULL)
+      || nread != sizeof (hdr)
+      || memcmp (&hdr, &bind->hdr, sizeof (hdr)))
+    {
+      TRACE ("bound imports %S are out of date\n", bind->name);
+      goto out;
+    }
+
+  for (i = 0; i < hdr.nr_imports; i++)
+    nr_thunks += bind->cur[i].nr_thunks;
+  size = hdr.nr_imports * sizeof (struct bind_entry)
+    + nr_thunks * sizeof (DWORD);
+  if (GetFileSize (file, NULL) != sizeof (hdr) + size)
+    goto out;
+
+  bind->old = malloc (size);
+  if (! bind->old)
+    goto out;
+  if (! ReadFile (file, bind->old, size, &nread, NULL) || nread != size)
+    goto fail;
+
+  /* The import descriptors must be the same.  */
+  for (i = 0; i < hdr.nr_imports; i++)
+    if (bind->old[i].first_thunk != bind->cur[i].first_thunk
+	|| bind->old[i].nr_thunks != bind->cur[i].nr_thunks)
+      goto fail;
+  bind->old_thunks = (DWORD *) &bind->old[hdr.nr_imports];
+  goto out;
+
+ fail:
+  free (bind->old);
+  bind->old = NULL;
+ out:
+  CloseHandle (file);
+}
+
+
+/* Open the bound imports snapshot of the image MODULE loaded from
+   NAME, which has the NR_IMPORTS import descriptors at IMPORTS.  The
+   import address tables must not be bound yet.  Returns NULL if out
+   of memory.  */
+struct himemce_bind *
+himemce_bind_open (LPCWSTR name, HMODULE module,
+		   const IMAGE_IMPORT_DESCRIPTOR *imports, int nr_imports)
+{
+  IMAGE_NT_HEADERS *nt = MyRtlImageNtHeader (module);
+  struct himemce_bind *bind;
+  DWORD first = 0;
+  int i;
+
+  bind = calloc (1, sizeof (*bind));
+  if (! bind)
+    return NULL;
+  bind->cur = calloc (nr_imports, sizeof (*bind->cur));
+  bind->first = malloc (nr_imports * sizeof (*bind->first));
+  if (! bind->cur || ! bind->first || ! get_bind_name (name, bind->name))
+    {
+      himemce_bind_close (bind);
+      return NULL;
+    }
+  bind->image = (char *) module;
+
+  bind->hdr.magic = BIND_MAGIC;
+  bind->hdr.version = BIND_VERSION;
+  bind->hdr.time_stamp = nt->FileHeader.TimeDateStamp;
+  bind->hdr.checksum = nt->OptionalHeader.CheckSum;
+  bind->hdr.image_size = nt->OptionalHeader.SizeOfImage;
+  himemce_bind_module_stamp (GetModuleHandle (NULL), &bind->hdr.loader);
+  bind->hdr.nr_imports = nr_imports;
+
+  for (i = 0; i < nr_imports; i++)
+    {
+      const IMAGE_THUNK_DATA *import_list;
+      DWORD nr = 0;
+
+      if (imports[i].OriginalFirstThunk)
+	import_list = himemce_cache_rva (bind->image,
+					 imports[i].OriginalFirstThunk);
+      else
+	import_list = himemce_cache_rva (bind->image, imports[i].FirstThunk);
+      while (import_list[nr].u1.Ordinal)
+	nr++;
+
+      bind->cur[i].first_thunk = imports[i].FirstThunk;
+      bind->cur[i].nr_thunks = nr;
+      bind->first[i] = first;
+      first += nr;
+    }
+
+  read_snapshot (bind);
+  return bind;
+}
+
+
+/* If the import descriptor IDX was bound to the DLL at BASE with the
+   time stamp STAMP in the snapshot, copy its import address table
+   into the image and return true.  */
+BOOL
+himemce_bind_apply (struct himemce_bind *bind, int idx, DWORD base,
+		    const FILETIME *stamp)
+{
+  struct bind_entry *entry;
+
+  if (! bind->old)
+    return FALSE;
+  entry = &bind->old[idx];
+  if (entry->base != base || ! base
+      || memcmp (&entry->stamp, stamp, sizeof (*stamp)))
+    return FALSE;
+
+  memcpy (himemce_cache_rva (bind->image, entry->first_thunk),
+	  &bind->old_thunks[bind->first[idx]],
+	  entry->nr_thunks * sizeof (DWORD));
+  return TRUE;
+}
+
+
+/* Record that the import descriptor IDX is now bound to the DLL at
+   BASE with the time stamp STAMP.  A BASE of zero keeps its table
+   from being applied again, for tables that can not be reused.  */
+void
+himemce_bind_record (struct himemce_bind *bind, int idx, DWORD base,
+		     const FILETIME *stamp)
+{
+  struct bind_entry *entry = &bind->cur[idx];
+
+  entry->base = base;
+  entry->stamp = *stamp;
+  if (! bind->old
+      || bind->old[idx].base != base
+      || memcmp (&bind->old[idx].stamp, stamp, sizeof (*stamp)))
+    bind->dirty = 1;
+}
+
+
+/* Write the snapshot if it changed, and release BIND.  */
+void
+himemce_bind_close (struct himemce_bind *bind)
+{
+  HANDLE file;
+  DWORD written;
+  DWORD i;
+  int ok;
+
+  if (bind->dirty)
+    {
+      file = CreateFile (bind->name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			 FILE_ATTRIBUTE_NORMAL, NULL);
+      if (file == INVALID_HANDLE_VALUE)
+	TRACE ("can not create bound imports %S: %i\n", bind->name,
+	       GetLastError ());
+      else
+	{
+	  ok = WriteFile (file, &bind->hdr, sizeof (bind->hdr), &written,
+			  NULL)
+	    && WriteFile (file, bind->cur,
+			  bind->hdr.nr_imports * sizeof (*bind->cur),
+			  &written, NULL);
+	  for (i = 0; ok && i < bind->hdr.nr_imports; i++)
+	    ok = WriteFile (file, himemce_cache_rva (bind->image,
+						     bind->cur[i].first_thunk),
+			    bind->cur[i].nr_thunks * sizeof (DWORD),
+			    &written, NULL);
+	  CloseHandle (file);
+	  if (ok)
+	    TRACE ("wrote bound imports %S\n", bind->name);
+	  else
+	    /* A partly written snapshot fails the size check.  */
+	    ERR ("writing bound imports %S failed: %i\n", bind->name,
+		 GetLastError ());
+	}
+    }
+
+  free (bind->old);
+  free (bind->first);
+  free (bind->cur);
+  free (bind);
+}
@@ -0,0 +1,597 @@
+/* himemce-cache.c - High Memory for Windows CE (relocated image cache)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* A relocated image costs twice: its sections are read and fixed up
+   on every start, and all its pages stay dirty in RAM for the life of
+   the process.  The image cache writes the relocated image to
+   FILENAME.cache after the first load, and later loads map that file
+   instead.  Its pages are clean, and the system can drop them and
+   read them back under memory pressure.
+
+   Only MapViewOfFile and not MapViewOfFileEx is available, so the
+   view ends up wherever the system puts it.  The cache records the
+   address it is relocated for.  If a later view lands somewhere else,
+   the cache is relocated in place once, and fits again from then on.
+
+   Windows CE has no copy-on-write views, so the sections that are
+   written at run time (writable sections and the import tables) can
+   not run in the view without writing to the cache file.  They run
+   in a private data block instead, which is committed and filled from
+   their copy in the cache on every load.  The fixups that point into
+   these sections are relocated for the data block, whose address is
+   recorded in the cache like the one of the image.  The copy in the
+   view is never written outside of relocation and stays the pristine
+   one.  The loader reaches the sections through himemce_cache_rva.
+   Images with HIGH or LOW fixups, which can not tell where they point
+   to, and code that addresses its data relative to the program
+   counter can not be cached.
+
+   The relocation index of the image (see himemce-reloc.h) is kept
+   after the image, so that relocating the cache does not have to
+   decode the relocation blocks again.  The cache file is held open
+   exclusively while the image is loaded, so a second instance of the
+   same program falls back to a normal load.  */
+
+#include <windows.h>
+
+#include "wine.h"
+#include "himemce-reloc.h"
+
+#define CACHE_MAGIC   0x68636d68
+#define CACHE_VERSION 3
+
+/* The header occupies the first page of the cache file, the image
+   follows, and then the relocation index.  */
+#define CACHE_HEADER_SIZE 0x1000
+
+/* The number of bytes of the source file covered by the checksum.  */
+#define CACHE_CHECKSUM_SIZE 0x1000
+
+struct cache_header
+{
+  DWORD magic;
+  DWORD version;
+
+  /* The key.  */
+  DWORD file_size;
+  FILETIME write_time;
+  DWORD checksum;
+
+  /* The addresses the cached image and its data block are relocated
+     for.  */
+  DWORD base;
+  DWORD data_base;
+  DWORD image_size;
+
+  /* The RVA and size of the span of the volatile sections, which the
+     data block covers.  */
+  DWORD data_start;
+  DWORD data_size;
+
+  DWORD relocs_size;
+};
+
+
+/* A section that is written at run time.  */
+struct cache_range
+{
+  DWORD rva;
+  DWORD size;
+};
+
+
+/* The cached images that are currently mapped.  */
+struct cached_image
+{
+  struct cached_image *next;
+  char *view;
+  HANDLE file;
+
+  /* The data block, which holds the volatile ranges, or NULL.  */
+  char *data;
+  DWORD data_start;
+  int nr_ranges;
+  struct cache_range range[1];
+};
+
+static struct cached_image *cached_images;
+
+
+static int
+get_cache_name (LPCWSTR name, WCHAR *cache_name)
+{
+  static const WCHAR suffix[] = L".cache";
+
+  if (wcslen (name) + wcslen (suffix) >= MAX_PATH)
+    return 0;
+  wcscpy (cache_name, name);
+  wcscat (cache_name, suffix);
+  return 1;
+}
+
+
+/* Fill in the key of the cache for the source image FILE, which
+   starts with HEADER.  The checksum is an FNV-1a hash over the
+   headers, which includes the time stamp and checksum fields of the
+   PE header.  */
+static int
+get_cache_key (HANDLE file, const struct image_header *header,
+	       struct cache_header *key)
+{
+  unsigned char buf[CACHE_CHECKSUM_SIZE];
+  size_t len;
+  size_t i;
+  DWORD hash = 2166136261U;
+
+  key->file_size = GetFileSize (file, NULL);
+  if (key->file_size == INVALID_FILE_SIZE)
+    return 0;
+  if (! GetFileTime (file, NULL, NULL, &key->write_time))
+    return 0;
+
+  len = min (key->file_size, sizeof (buf));
+  if (image_header_pread (header, file, (char *) buf, len, 0) != len)
+    return 0;
+  for (i = 0; i < len; i++)
+    hash = (hash ^ buf[i]) * 16777619U;
+  key->checksum = hash;
+  return 1;
+}
+
+
+/* Return true if the section SEC of the image with headers NT is
+   written to at run time.  */
+static int
+is_volatile_section (IMAGE_NT_HEADERS *nt, IMAGE_SECTION_HEADER *sec,
+		     DWORD size)
+{
+  static const WORD dirs[] = { IMAGE_DIRECTORY_ENTRY_IMPORT,
+			       IMAGE_DIRECTORY_ENTRY_IAT };
+  int i;
+
+  if (sec->Characteristics & IMAGE_SCN_MEM_WRITE)
+    return 1;
+  for (i = 0; i < sizeof (dirs) / sizeof (dirs[0]); i++)
+    {
+      DWORD va = nt->OptionalHeader.DataDirectory[dirs[i]].VirtualAddress;
+
+      if (va && va >= sec->VirtualAddress && va - sec->VirtualAddress < size)
+	return 1;
+    }
+  return 0;
+}
+
+
+static DWORD
+section_size (IMAGE_SECTION_HEADER *sec)
+{
+  DWORD size = sec->Misc.VirtualSize ? sec->Misc.VirtualSize
+    : sec->SizeOfRawData;
+
+  return (size + 0xfff) & ~0xfff;
+}
+
+
+/* Store the volatile sections of IMAGE in RANGES, in section order,
+   unless RANGES is NULL.  Returns their number.  */
+static int
+get_volatile_ranges (char *image, DWORD image_size,
+		     struct cache_range *ranges)
+{
+  IMAGE_NT_HEADERS *nt = MyRtlImageNtHeader ((HMODULE) image);
+  IMAGE_SECTION_HEADER *sec;
+  int nr = 0;
+  int i;
+
+  if (! nt)
+    return 0;
+  sec = (IMAGE_SECTION_HEADER *) ((char *) &nt->OptionalHeader
+				  + nt->FileHeader.SizeOfOptionalHeader);
+  for (i = 0; i < nt->FileHeader.NumberOfSections; i++, sec++)
+    {
+      DWORD size = section_size (sec);
+
+      if (sec->VirtualAddress >= image_size
+	  || size > image_size - sec->VirtualAddress
+	  || ! is_volatile_section (nt, sec, size))
+	continue;
+      if (ranges)
+	{
+	  ranges[nr].rva = sec->VirtualAddress;
+	  ranges[nr].size = size;
+	}
+      nr++;
+    }
+  return nr;
+}
+
+
+/* Return true if RVA lies in one of the NR_RANGES RANGES.  */
+static int
+in_ranges (const struct cache_range *ranges, int nr_ranges, DWORD rva)
+{
+  int i;
+
+  for (i = 0; i < nr_ranges; i++)
+    if (rva - ranges[i].rva < ranges[i].size)
+      return 1;
+  return 0;
+}
+
+
+/* Relocate the cached image IMAGE with the header HDR in place, with
+   the relocation index that follows it, for the data block at DATA.
+   Every fixup that points into one of the NR_RANGES volatile RANGES
+   moves with the data block, and every other one with the image.  */
+static int
+relocate_cache (char *image, const struct cache_header *hdr, char *data,
+		const struct cache_range *ranges, int nr_ranges)
+{
+  const struct himemce_relocs *relocs = (const struct himemce_relocs *)
+    (image + hdr->image_size);
+  const WORD *offsets = HIMEMCE_RELOC_OFFSETS (relocs);
+  INT_PTR delta = image - (char *) hdr->base;
+  INT_PTR data_delta = data - (char *) hdr->data_base;
+  DWORD i;
+  DWORD j;
+
+  if (! hdr->relocs_size || ! himemce_relocs_check (relocs, hdr->relocs_size,
+						    hdr->image_size))
+    return 0;
+  for (i = 0; i < relocs->nr_pages; i++)
+    {
+      const struct himemce_reloc_page *page = &relocs->page[i];
+      char *ptr = image + page->rva;
+
+      if (page->nr_high || page->nr_low)
+	return 0;
+      for (j = 0; j < page->nr_highlow; j++)
+	{
+	  DWORD *fixup = (DWORD *) (ptr + (offsets[page->first + j] & 0xfff));
+	  DWORD off = *fixup - hdr->data_base;
+
+	  if (off < hdr->data_size
+	      && in_ranges (ranges, nr_ranges, hdr->data_start + off))
+	    *fixup += data_delta;
+	  else
+	    *fixup += delta;
+	}
+    }
+  return 1;
+}
+
+
+/* Build the relocation index of IMAGE, or return NULL.  */
+static struct himemce_relocs *
+build_relocs (char *image, DWORD image_size)
+{
+  IMAGE_NT_HEADERS *nt = MyRtlImageNtHeader ((HMODULE) image);
+  const IMAGE_DATA_DIRECTORY *dir;
+
+  dir = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
+  if (! dir->VirtualAddress || ! dir->Size)
+    return NULL;
+  if (dir->VirtualAddress > image_size
+      || dir->Size > image_size - dir->VirtualAddress)
+    return NULL;
+  return himemce_relocs_build (image + dir->VirtualAddress, dir->Size,
+			       image_size);
+}
+
+
+/* Return true if RELOCS has fixups that change only half of a
+   value.  */
+static int
+has_split_fixups (const struct himemce_relocs *relocs)
+{
+  DWORD i;
+
+  for (i = 0; i < relocs->nr_pages; i++)
+    if (relocs->page[i].nr_high || relocs->page[i].nr_low)
+      return 1;
+  return 0;
+}
+
+
+/* Map the cached image for NAME, which is open as FILE and starts
+   with HEADER.  Returns the image base, or NULL if there is no valid
+   cache.  */
+void *
+himemce_cache_map (LPCWSTR name, HANDLE file,
+		   const struct image_header *header)
+{
+  WCHAR cache_name[MAX_PATH];
+  struct cache_header key;
+  struct cache_header *hdr;
+  struct cached_image *cached = NULL;
+  HANDLE cache_file;
+  HANDLE mapping;
+  char *view = NULL;
+  char *image;
+  char *data = NULL;
+  DWORD cache_size;
+  int nr_ranges;
+  int i;
+
+  if (! get_cache_name (name, cache_name)
+      || ! get_cache_key (file, header, &key))
+    return NULL;
+
+  cache_file = CreateFileForMappingW (cache_name, GENERIC_READ | GENERIC_WRITE,
+				      0, NULL, OPEN_EXISTING,
+				      FILE_ATTRIBUTE_NORMAL, NULL);
+  if (cache_file == INVALID_HANDLE_VALUE)
+    return NULL;
+  cache_size = GetFileSize (cache_file, NULL);
+  if (cache_size == INVALID_FILE_SIZE || cache_size < CACHE_HEADER_SIZE)
+    goto err;
+
+  mapping = CreateFileMapping (cache_file, NULL, PAGE_READWRITE, 0, 0, NULL);
+  if (! mapping || mapping == INVALID_HANDLE_VALUE)
+    goto err;
+  view = MapViewOfFile (mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+  CloseHandle (mapping);
+  if (! view)
+    goto err;
+
+  hdr = (struct cache_header *) view;
+  if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION
+      || hdr->file_size != key.file_size
+      || hdr->write_time.dwLowDateTime != key.write_time.dwLowDateTime
+      || hdr->write_time.dwHighDateTime != key.write_time.dwHighDateTime
+      || hdr->checksum != key.checksum
+      || hdr->image_size > cache_size - CACHE_HEADER_SIZE
+      || hdr->relocs_size > cache_size - CACHE_HEADER_SIZE - hdr->image_size)
+    {
+      TRACE ("image cache %S is stale\n", cache_name);
+      goto err;
+    }
+
+  image = view + CACHE_HEADER_SIZE;
+  nr_ranges = get_volatile_ranges (image, hdr->image_size, NULL);
+  cached = malloc (sizeof (*cached) + nr_ranges * sizeof (cached->range[0]));
+  if (! cached)
+    goto err;
+  get_volatile_ranges (image, hdr->image_size, cached->range);
+  if (nr_ranges
+      && (hdr->data_start != cached->range[0].rva
+	  || hdr->data_size != cached->range[nr_ranges - 1].rva
+	  + cached->range[nr_ranges - 1].size - hdr->data_start))
+    {
+      TRACE ("image cache %S is stale\n", cache_name);
+      goto err;
+    }
+
+  if (nr_ranges)
+    {
+      /* The data block goes where it was the last time, if it can.  */
+      data = VirtualAlloc ((void *) hdr->data_base, hdr->data_size,
+			   MEM_RESERVE, PAGE_NOACCESS);
+      if (! data)
+	data = VirtualAlloc (NULL, hdr->data_size, MEM_RESERVE,
+			     PAGE_NOACCESS);
+      if (! data)
+	goto err;
+    }
+
+  if (hdr->base != (DWORD) image || (data && hdr->data_base != (DWORD) data))
+    {
+      TRACE ("relocating image cache %S from %p to %p, data from %p to %p\n",
+	     cache_name, (void *) hdr->base, image, (void *) hdr->data_base,
+	     data);
+      /* The image is relocated in place, so the cache is invalid
+	 until that is done.  A crash in between leaves no magic.  */
+      hdr->magic = 0;
+      FlushViewOfFile (view, sizeof (*hdr));
+      if (! relocate_cache (image, hdr, data, cached->range, nr_ranges))
+	goto err;
+      hdr->base = (DWORD) image;
+      hdr->data_base = (DWORD) data;
+      FlushViewOfFile (view, 0);
+      hdr->magic = CACHE_MAGIC;
+      FlushViewOfFile (view, sizeof (*hdr));
+    }
+
+  for (i = 0; i < nr_ranges; i++)
+    {
+      char *dst = data + (cached->range[i].rva - hdr->data_start);
+
+      if (! VirtualAlloc (dst, cached->range[i].size, MEM_COMMIT,
+			  PAGE_EXECUTE_READWRITE))
+	goto err;
+      memcpy (dst, image + cached->range[i].rva, cached->range[i].size);
+    }
+
+  cached->view = view;
+  cached->file = cache_file;
+  cached->data = data;
+  cached->data_start = hdr->data_start;
+  cached->nr_ranges = nr_ranges;
+  cached->next = cached_images;
+  cached_images = cached;
+  TRACE ("mapped image cache %S at %p, data at %p\n", cache_name, image,
+	 data);
+  return image;
+
+ err:
+  free (cached);
+  if (data)
+    VirtualFree (data, 0, MEM_RELEASE);
+  if (view)
+    UnmapViewOfFile (view);
+  CloseHandle (cache_file);
+  return NULL;
+}
+
+
+/* Write the freshly loaded and relocated, but not yet bound, IMAGE
+   of NAME (open as FILE, which starts with HEADER) to its cache.  */
+void
+himemce_cache_save (LPCWSTR name, HANDLE file,
+		    const struct image_header *header, void *image)
+{
+  WCHAR cache_name[MAX_PATH];
+  IMAGE_NT_HEADERS *nt = MyRtlImageNtHeader ((HMODULE) image);
+  struct cache_header *hdr;
+  struct cache_range *ranges = NULL;
+  struct himemce_relocs *relocs = NULL;
+  HANDLE cache_file;
+  DWORD written;
+  int nr_ranges;
+  int ok = 0;
+
+  hdr = calloc (1, CACHE_HEADER_SIZE);
+  if (! hdr)
+    return;
+  if (! get_cache_name (name, cache_name)
+      || ! get_cache_key (file, header, hdr))
+    goto out;
+
+  /* The volatile sections must have pages of their own to be moved
+     to the data block.  */
+  if (nt->OptionalHeader.SectionAlignment < 0x1000)
+    {
+      TRACE ("can not cache %S, its sections share pages\n", name);
+      goto out;
+    }
+
+  hdr->version = CACHE_VERSION;
+  hdr->base = (DWORD) image;
+  hdr->image_size = (nt->OptionalHeader.SizeOfImage + 0xfff) & ~0xfff;
+  relocs = build_relocs (image, hdr->image_size);
+  if (relocs)
+    {
+      if (has_split_fixups (relocs))
+	{
+	  TRACE ("can not cache %S, it has HIGH or LOW fixups\n", name);
+	  goto out;
+	}
+      hdr->relocs_size = relocs->size;
+    }
+
+  /* The data block starts out where the sections are now, so that
+     the fixups are right for it.  */
+  nr_ranges = get_volatile_ranges (image, hdr->image_size, NULL);
+  if (nr_ranges)
+    {
+      ranges = malloc (nr_ranges * sizeof (*ranges));
+      if (! ranges)
+	goto out;
+      get_volatile_ranges (image, hdr->image_size, ranges);
+      hdr->data_start = ranges[0].rva;
+      hdr->data_size = ranges[nr_ranges - 1].rva + ranges[nr_ranges - 1].size
+	- hdr->data_start;
+      hdr->data_base = hdr->base + hdr->data_start;
+    }
+
+  cache_file = CreateFile (cache_name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			   FILE_ATTRIBUTE_NORMAL, NULL);
+  if (cache_file == INVALID_HANDLE_VALUE)
+    {
+      TRACE ("can not create image cache %S: %i\n", cache_name,
+	     GetLastError ());
+      goto out;
+    }
+
+  /* The magic goes in last, so that a partly written cache is never
+     used.  */
+  if (WriteFile (cache_file, hdr, CACHE_HEADER_SIZE, &written, NULL)
+      && WriteFile (cache_file, image, hdr->image_size, &written, NULL)
+      && (! relocs
+	  || WriteFile (cache_file, relocs, hdr->relocs_size,
+			&written, NULL))
+      && SetFilePointer (cache_file, 0, NULL, FILE_BEGIN) == 0)
+    {
+      hdr->magic = CACHE_MAGIC;
+      ok = WriteFile (cache_file, hdr, sizeof (*hdr), &written, NULL);
+    }
+  CloseHandle (cache_file);
+  if (ok)
+    TRACE ("wrote image cache %S\n", cache_name);
+  else
+    ERR ("writing image cache %S failed: %i\n", cache_name, GetLastError ());
+
+ out:
+  free (relocs);
+  free (ranges);
+  free (hdr);
+}
+
+
+/* Return the mapped cached image at IMAGE, or NULL.  */
+static struct cached_image *
+find_cached_image (void *image)
+{
+  struct cached_image *cached;
+
+  for (cached = cached_images; cached; cached = cached->next)
+    if (cached->view + CACHE_HEADER_SIZE == (char *) image)
+      return cached;
+  return NULL;
+}
+
+
+/* Return true if IMAGE is mapped from its cache.  */
+BOOL
+himemce_cache_is_mapped (void *image)
+{
+  return find_cached_image (image) != NULL;
+}
+
+
+/* Return the address of RVA in IMAGE, which is in the data block for
+   the volatile sections of a cached image.  */
+void *
+himemce_cache_rva (void *image, DWORD rva)
+{
+  struct cached_image *cached;
+
+  if (cached_images)
+    {
+      cached = find_cached_image (image);
+      if (cached && in_ranges (cached->range, cached->nr_ranges, rva))
+	return cached->data + (rva - cached->data_start);
+    }
+  return (char *) image + rva;
+}
+
+
+/* Release IMAGE if it was mapped from a cache.  */
+BOOL
+himemce_cache_unmap (void *image)
+{
+  struct cached_image **prevp;
+  struct cached_image *cached;
+
+  for (prevp = &cached_images; *prevp; prevp = &(*prevp)->next)
+    if ((*prevp)->view + CACHE_HEADER_SIZE == (char *) image)
+      break;
+  cached = *prevp;
+  if (! cached)
+    return FALSE;
+
+  *prevp = cached->next;
+  if (cached->data)
+    VirtualFree (cached->data, 0, MEM_RELEASE);
+  UnmapViewOfFile (cached->view);
+  CloseHandle (cached->file);
+  free (cached);
+  return TRUE;
+}
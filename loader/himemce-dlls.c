@@ -0,0 +1,360 @@
+/* himemce-dlls.c - High Memory for Windows CE (system DLL cache)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* Imports from the DLLs of the system go through LoadLibrary and
+   GetProcAddress, and most images import the same functions from
+   coredll.dll and ws2.dll, so the preloader makes the same calls over
+   and over.  This caches the module handle for every DLL name, and
+   the address for every name or ordinal in a module, for the life of
+   the process.  Missing functions are cached as well, failed loads
+   are not.
+
+   The DLLs are never freed by the loaders, so a handle stays valid,
+   but LoadLibrary is called only once per DLL, and the reference
+   count of the DLL does not go up for every import descriptor.  */
+
+#include <windows.h>
+#include <string.h>
+
+#include "wine.h"
+
+struct himemce_dll_stats himemce_dll_stats;
+
+
+struct dll_entry
+{
+  unsigned int hash;
+  /* In lower case, NULL if the entry is free.  */
+  char *name;
+  HMODULE module;
+};
+
+struct proc_entry
+{
+  unsigned int hash;
+  /* NULL if the entry is free.  */
+  HMODULE module;
+  /* A copy of the name, or the ordinal if below 0x10000.  */
+  const char *name;
+  FARPROC proc;
+};
+
+/* Open addressing with linear probing, grown to keep the load below
+   3/4.  */
+static struct dll_entry *dlls;
+static unsigned int dlls_mask;
+static unsigned int nr_dlls;
+
+static struct proc_entry *procs;
+static unsigned int procs_mask;
+static unsigned int nr_procs;
+
+/* Lazily bound imports are resolved from any thread.  The lock is
+   not held while calling into the system.  */
+static LONG lock;
+
+
+static void
+lock_cache (void)
+{
+  while (InterlockedExchange (&lock, 1))
+    Sleep (0);
+}
+
+
+static void
+unlock_cache (void)
+{
+  InterlockedExchange (&lock, 0);
+}
+
+
+static unsigned int
+hash_dll_name (const char *name, size_t len)
+{
+  unsigned int hash = 2166136261U;
+
+  while (len--)
+    {
+      unsigned char chr = *name++;
+
+      if (chr >= 'A' && chr <= 'Z')
+	chr += 'a' - 'A';
+      hash = (hash ^ chr) * 16777619U;
+    }
+  return hash;
+}
+
+
+static unsigned int
+hash_proc_name (HMODULE module, const char *name)
+{
+  unsigned int hash = 2166136261U ^ (unsigned int) (ULONG_PTR) module;
+
+  if ((ULONG_PTR) name < 0x10000)
+    return (hash ^ (unsigned int) (ULONG_PTR) name) * 16777619U;
+  while (*name)
+    hash = (hash ^ (unsigned char) *name++) * 16777619U;
+  return hash;
+}
+
+
+static int
+same_proc_name (const char *a, const char *b)
+{
+  if ((ULONG_PTR) a < 0x10000 || (ULONG_PTR) b < 0x10000)
+    return a == b;
+  return ! strcmp (a, b);
+}
+
+
+/* Return the entry for NAME of LEN bytes, or the free entry where it
+   goes.  */
+static struct dll_entry *
+find_dll (const char *name, size_t len, unsigned int hash)
+{
+  unsigned int idx;
+
+  for (idx = hash & dlls_mask; dlls[idx].name; idx = (idx + 1) & dlls_mask)
+    if (dlls[idx].hash == hash && ! _strnicmp (dlls[idx].name, name, len)
+	&& ! dlls[idx].name[len])
+      break;
+  return &dlls[idx];
+}
+
+
+static struct proc_entry *
+find_proc (HMODULE module, const char *name, unsigned int hash)
+{
+  unsigned int idx;
+
+  for (idx = hash & procs_mask; procs[idx].module;
+       idx = (idx + 1) & procs_mask)
+    if (procs[idx].hash == hash && procs[idx].module == module
+	&& same_proc_name (procs[idx].name, name))
+      break;
+  return &procs[idx];
+}
+
+
+static int
+grow_dlls (void)
+{
+  struct dll_entry *old = dlls;
+  unsigned int old_size = old ? dlls_mask + 1 : 0;
+  unsigned int size = old ? 2 * old_size : 16;
+  unsigned int i;
+
+  dlls = calloc (size, sizeof (*dlls));
+  if (! dlls)
+    {
+      dlls = old;
+      return 0;
+    }
+  dlls_mask = size - 1;
+  for (i = 0; i < old_size; i++)
+    if (old[i].name)
+      *find_dll (old[i].name, strlen (old[i].name), old[i].hash) = old[i];
+  free (old);
+  return 1;
+}
+
+
+static int
+grow_procs (void)
+{
+  struct proc_entry *old = procs;
+  unsigned int old_size = old ? procs_mask + 1 : 0;
+  unsigned int size = old ? 2 * old_size : 256;
+  unsigned int i;
+
+  procs = calloc (size, sizeof (*procs));
+  if (! procs)
+    {
+      procs = old;
+      return 0;
+    }
+  procs_mask = size - 1;
+  for (i = 0; i < old_size; i++)
+    if (old[i].module)
+      *find_proc (old[i].module, old[i].name, old[i].hash) = old[i];
+  free (old);
+  return 1;
+}
+
+
+/* Load the DLL with the ASCII name NAME of LEN bytes, or return its
+   handle if it was loaded before.  Returns NULL on failure, with the
+   last error set.  */
+HMODULE
+himemce_dll_load (const char *name, size_t len)
+{
+  unsigned int hash = hash_dll_name (name, len);
+  struct dll_entry *entry;
+  WCHAR buffer[32];
+  WCHAR *wname = buffer;
+  HMODULE module;
+  char *copy;
+  size_t i;
+
+  lock_cache ();
+  if (dlls)
+    {
+      entry = find_dll (name, len, hash);
+      if (entry->name)
+	{
+	  module = entry->module;
+	  himemce_dll_stats.dll_hits++;
+	  unlock_cache ();
+	  return module;
+	}
+    }
+  unlock_cache ();
+
+  if (len >= sizeof (buffer) / sizeof (buffer[0]))
+    {
+      wname = malloc ((len + 1) * sizeof (WCHAR));
+      if (! wname)
+	{
+	  SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+	  return NULL;
+	}
+    }
+  /* Straight ASCII to Unicode, without depending on the code
+     page.  */
+  for (i = 0; i < len; i++)
+    wname[i] = (unsigned char) name[i];
+  wname[len] = 0;
+  module = LoadLibrary (wname);
+  if (wname != buffer)
+    free (wname);
+  himemce_dll_stats.dll_loads++;
+  if (! module)
+    {
+      if (! GetLastError ())
+	SetLastError (ERROR_MOD_NOT_FOUND);
+      return NULL;
+    }
+
+  copy = malloc (len + 1);
+  if (! copy)
+    return module;
+  for (i = 0; i < len; i++)
+    copy[i] = (name[i] >= 'A' && name[i] <= 'Z')
+      ? name[i] + 'a' - 'A' : name[i];
+  copy[len] = 0;
+
+  lock_cache ();
+  if ((4 * (nr_dlls + 1) <= 3 * (dlls ? dlls_mask + 1 : 0) || grow_dlls ())
+      && ! (entry = find_dll (name, len, hash))->name)
+    {
+      entry->hash = hash;
+      entry->name = copy;
+      entry->module = module;
+      nr_dlls++;
+      copy = NULL;
+    }
+  unlock_cache ();
+  free (copy);
+  return module;
+}
+
+
+/* CreateThread is exported by coredll.dll with this ordinal.  */
+#define COREDLL_CREATETHREAD 492
+
+/* Return the function that replaces PROC, the function NAME of
+   MODULE, or PROC itself.  Threads are started through libhimemce.dll,
+   so that they run under the exception filter of the loader (see
+   himemce_create_thread).  */
+static FARPROC
+interpose_proc (HMODULE module, const char *name, FARPROC proc)
+{
+  HMODULE lib;
+  FARPROC replacement;
+
+  if (! proc)
+    return proc;
+  if ((ULONG_PTR) name < 0x10000
+      ? (ULONG_PTR) name != COREDLL_CREATETHREAD
+      : strcmp (name, "CreateThread"))
+    return proc;
+  if (module != himemce_dll_load ("coredll.dll", 11))
+    return proc;
+  lib = himemce_dll_load ("libhimemce.dll", 14);
+  replacement = lib ? GetProcAddressA (lib, "himemce_create_thread") : NULL;
+  return replacement ? replacement : proc;
+}
+
+
+/* Return the address of the function NAME, or the ordinal NAME if
+   that is below 0x10000, in MODULE, or NULL if there is none.  */
+FARPROC
+himemce_dll_proc (HMODULE module, const char *name)
+{
+  unsigned int hash = hash_proc_name (module, name);
+  struct proc_entry *entry;
+  FARPROC proc;
+  char *copy = NULL;
+
+  lock_cache ();
+  if (procs)
+    {
+      entry = find_proc (module, name, hash);
+      if (entry->module)
+	{
+	  proc = entry->proc;
+	  himemce_dll_stats.proc_hits++;
+	  unlock_cache ();
+	  return proc;
+	}
+    }
+  unlock_cache ();
+
+  if ((ULONG_PTR) name < 0x10000)
+    proc = interpose_proc (module, name,
+			   GetProcAddress (module, (LPCWSTR) name));
+  else
+    {
+      proc = interpose_proc (module, name, GetProcAddressA (module, name));
+      copy = malloc (strlen (name) + 1);
+      if (! copy)
+	return proc;
+      strcpy (copy, name);
+      name = copy;
+    }
+  himemce_dll_stats.proc_lookups++;
+
+  lock_cache ();
+  if ((4 * (nr_procs + 1) <= 3 * (procs ? procs_mask + 1 : 0)
+       || grow_procs ())
+      && ! (entry = find_proc (module, name, hash))->module)
+    {
+      entry->hash = hash;
+      entry->module = module;
+      entry->name = name;
+      entry->proc = proc;
+      nr_procs++;
+      copy = NULL;
+    }
+  unlock_cache ();
+  free (copy);
+  return proc;
+}
@@ -0,0 +1,251 @@
+/* himemce-export-bench.c - High Memory for Windows CE (export lookup benchmark)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* Time the lookup of exported names on the build host.  A module
+   with the given number of exports is generated, with mangled C++
+   names that share long prefixes like those of the Qt libraries.
+   Every name is looked up once, in random order, after a missed hint,
+   by binary search over AddressOfNames and in the export index of the
+   himemce map.  Names that are not exported are looked up as well.
+   The exit status is 1 if a module can not be indexed, or the index
+   gives a wrong result.  */
+
+#include <windows.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "himemce-map.h"
+
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "usage: %s [-n ITERATIONS] [EXPORTS...]\n"
+	   "  -n N     look up every name N times (default 20)\n"
+	   "  EXPORTS  the number of exports of each module "
+	   "(default 1000 10000 30000)\n", prog);
+  exit (1);
+}
+
+
+/* A generated module: the name strings, followed by the sorted
+   AddressOfNames array.  */
+struct module
+{
+  char *base;
+  unsigned int *names;
+  unsigned int nr_names;
+};
+
+
+static const char *const classes[] =
+  { "QString", "QObject", "QWidget", "QAbstractItemModel",
+    "QGraphicsItem", "QTextDocument", "QNetworkAccessManager" };
+static const char *const methods[] =
+  { "append", "setProperty", "metaObject", "qt_metacall", "event",
+    "paintEvent", "setGeometry", "data", "index", "insertRows" };
+static const char *const params[] =
+  { "Ev", "ERKS_", "Ei", "EP7QObject", "ERK7QStringi", "EPKc" };
+
+
+static const struct module *sort_module;
+
+static int
+compare_names (const void *a, const void *b)
+{
+  return strcmp (sort_module->base + *(const unsigned int *) a,
+		 sort_module->base + *(const unsigned int *) b);
+}
+
+
+/* Generate the name with number NR, and return its length.  Names
+   with odd NR are not exported.  */
+static int
+make_name (char *buf, unsigned int nr)
+{
+  const char *cls = classes[nr % 7];
+  const char *meth = methods[(nr / 7) % 10];
+
+  return sprintf (buf, "_ZN%i%s%i%s%u%s", (int) strlen (cls), cls,
+		  (int) strlen (meth), meth, nr / 70, params[(nr / 2) % 6]);
+}
+
+
+static int
+make_module (struct module *mod, unsigned int nr_names)
+{
+  unsigned int size = 0;
+  unsigned int i;
+
+  mod->base = malloc ((size_t) nr_names * 64 + nr_names * 4);
+  if (! mod->base)
+    return 0;
+  for (i = 0; i < nr_names; i++)
+    size += make_name (mod->base + size, 2 * i) + 1;
+  size = (size + 3) & ~3;
+  mod->names = (unsigned int *) (mod->base + size);
+  mod->nr_names = nr_names;
+  size = 0;
+  for (i = 0; i < nr_names; i++)
+    {
+      mod->names[i] = size;
+      size += strlen (mod->base + size) + 1;
+    }
+  sort_module = mod;
+  qsort (mod->names, nr_names, sizeof (mod->names[0]), compare_names);
+  return 1;
+}
+
+
+/* The lookup of find_named_export without an index.  */
+static int
+find_binary (const struct module *mod, const char *name)
+{
+  int min = 0, max = mod->nr_names - 1;
+
+  while (min <= max)
+    {
+      int res, pos = (min + max) / 2;
+
+      if (! (res = strcmp (mod->base + mod->names[pos], name)))
+	return pos;
+      if (res > 0)
+	max = pos - 1;
+      else
+	min = pos + 1;
+    }
+  return -1;
+}
+
+
+static int
+bench_module (unsigned int nr_names, int iterations)
+{
+  struct module mod;
+  struct himemce_export_index *index;
+  size_t index_size;
+  char (*lookups)[64];
+  unsigned int nr_lookups = 2 * nr_names;
+  double start, binary_ms, index_ms;
+  int errors = 0;
+  unsigned int i;
+  int k;
+
+  index_size = himemce_map_export_index_size (nr_names);
+  if (! index_size)
+    {
+      fprintf (stderr, "too many exports: %u\n", nr_names);
+      return 1;
+    }
+  lookups = malloc (nr_lookups * sizeof (*lookups));
+  index = malloc (index_size);
+  if (! lookups || ! index || ! make_module (&mod, nr_names))
+    {
+      fprintf (stderr, "can not allocate module with %u exports\n",
+	       nr_names);
+      exit (1);
+    }
+  himemce_map_build_export_index (index, mod.base, mod.names, nr_names);
+  if (! himemce_map_check_export_index (index))
+    {
+      fprintf (stderr, "invalid index for %u exports\n", nr_names);
+      errors++;
+    }
+
+  /* Half of the lookups miss.  */
+  for (i = 0; i < nr_lookups; i++)
+    make_name (lookups[i], i);
+  srand (1);
+  for (i = nr_lookups - 1; i > 0; i--)
+    {
+      unsigned int j = rand () % (i + 1);
+      char tmp[64];
+
+      memcpy (tmp, lookups[i], sizeof (tmp));
+      memcpy (lookups[i], lookups[j], sizeof (tmp));
+      memcpy (lookups[j], tmp, sizeof (tmp));
+    }
+
+  for (i = 0; i < nr_lookups; i++)
+    if (find_binary (&mod, lookups[i])
+	!= himemce_map_find_export (index, mod.base, lookups[i]))
+      errors++;
+
+  start = now ();
+  for (k = 0; k < iterations; k++)
+    for (i = 0; i < nr_lookups; i++)
+      find_binary (&mod, lookups[i]);
+  binary_ms = (now () - start) / iterations;
+
+  start = now ();
+  for (k = 0; k < iterations; k++)
+    for (i = 0; i < nr_lookups; i++)
+      himemce_map_find_export (index, mod.base, lookups[i]);
+  index_ms = (now () - start) / iterations;
+
+  printf ("%6u exports (index %4lu KB): binary %7.1f ns  index %6.1f ns  "
+	  "%5.2fx%s\n", nr_names, (unsigned long) (index_size / 1024),
+	  binary_ms * 1e6 / nr_lookups, index_ms * 1e6 / nr_lookups,
+	  binary_ms / index_ms, errors ? "  WRONG RESULTS" : "");
+
+  free (lookups);
+  free (index);
+  free (mod.base);
+  return errors != 0;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+  static const unsigned int default_exports[] = { 1000, 10000, 30000 };
+  int iterations = 20;
+  int failed = 0;
+  int i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+      if (! strcmp (argv[i], "-n") && i + 1 < argc)
+	iterations = atoi (argv[++i]);
+      else
+	usage (argv[0]);
+    }
+  if (iterations < 1)
+    usage (argv[0]);
+
+  if (i == argc)
+    for (i = 0; i < sizeof (default_exports) / sizeof (default_exports[0]);
+	 i++)
+      failed |= bench_module (default_exports[i], iterations);
+  else
+    for (; i < argc; i++)
+      failed |= bench_module (strtoul (argv[i], NULL, 0), iterations);
+  return failed;
+}
@@ -0,0 +1,120 @@
+/* himemce-fault-test.c - High Memory for Windows CE (fault test)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* Check that pages of the copy area are brought in when a thread
+   other than the one that set it up touches them first.  */
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "wine.h"
+#include "himemce.h"
+
+
+#define AREA_PAGES 4
+
+/* The range that is copied starts in the middle of the first page
+   and ends in the middle of the third.  */
+#define RANGE_START 0x100
+#define RANGE_SIZE (2 * 0x1000 + 0x80)
+
+static char *area;
+static char src[RANGE_SIZE];
+static int thread_ok;
+
+
+/* Return nonzero if the SIZE bytes at OFF of the range arrived.  */
+static int
+check_range (SIZE_T off, SIZE_T size)
+{
+  SIZE_T i;
+
+  for (i = off; i < off + size; i++)
+    if (area[RANGE_START + i] != src[i])
+      return 0;
+  return 1;
+}
+
+
+static DWORD WINAPI
+touch_thread (LPVOID arg)
+{
+  /* The second page, which nobody touched yet.  */
+  thread_ok = check_range (0x1000 - RANGE_START, 0x1000);
+  return 0;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+  HANDLE thread;
+  DWORD committed, total;
+  int i;
+
+  host_set_fault_handler (virtual_handle_fault);
+  for (i = 0; i < RANGE_SIZE; i++)
+    src[i] = i * 7 + 1;
+
+  area = VirtualAlloc (NULL, AREA_PAGES * 0x1000, MEM_RESERVE, PAGE_NOACCESS);
+  if (! area || ! virtual_copy_area_init (area, AREA_PAGES * 0x1000)
+      || ! virtual_copy_lazily (area + RANGE_START, src, RANGE_SIZE))
+    {
+      printf ("FAIL: can not set up the copy area\n");
+      return 1;
+    }
+
+  /* Bring in the first page from this thread.  */
+  if (! check_range (0, 0x10))
+    {
+      printf ("FAIL: first page\n");
+      return 1;
+    }
+
+  thread = himemce_create_thread (NULL, 0, touch_thread, NULL, 0, NULL);
+  if (! thread)
+    {
+      printf ("FAIL: can not start thread\n");
+      return 1;
+    }
+  WaitForSingleObject (thread, INFINITE);
+  CloseHandle (thread);
+  if (! thread_ok)
+    {
+      printf ("FAIL: second page, touched by another thread\n");
+      return 1;
+    }
+
+  if (! virtual_get_copy_area_pages (&committed, &total)
+      || committed != 2 || total != AREA_PAGES)
+    {
+      printf ("FAIL: %u of %u pages committed, expected 2 of %u\n",
+	      committed, total, AREA_PAGES);
+      return 1;
+    }
+
+  if (! check_range (0, RANGE_SIZE))
+    {
+      printf ("FAIL: whole range\n");
+      return 1;
+    }
+  printf ("PASS\n");
+  return 0;
+}
@@ -0,0 +1,121 @@
+/* himemce-low-test.c - High Memory for Windows CE (low section test)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* Check the lookup of low sections when two small sections of a
+   module are packed into the same low memory page.  The lookup with
+   a cached section, as used for every fixup by the preloader, must
+   agree with the plain lookup, whatever section was cached.  */
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "himemce-map-provider.h"
+
+
+#define IMAGE_BASE ((void *) 0x10000000)
+
+/* Two sections of the image, each on its own image page.  */
+static const struct
+{
+  unsigned int rva;
+  unsigned int size;
+} sections[] = { { 0x1000, 0x48 }, { 0x2000, 0x100 } };
+#define NR_SECTIONS (sizeof (sections) / sizeof (sections[0]))
+
+/* RVAs to look up: section starts, ends and page ends, and some
+   outside of any section.  */
+static const unsigned int rvas[] =
+  { 0x0fff, 0x1000, 0x1047, 0x1048, 0x1fff, 0x2000, 0x20ff, 0x2100,
+    0x2fff, 0x3000 };
+#define NR_RVAS (sizeof (rvas) / sizeof (rvas[0]))
+
+
+int
+main (int argc, char *argv[])
+{
+  struct himemce_map *map;
+  struct himemce_module *mod;
+  struct himemce_low_section *low;
+  struct himemce_low_section *last;
+  int failed = 0;
+  int i, j;
+
+  map = map_create ();
+  if (! map)
+    return 1;
+  mod = map_add_module (map, L"test.dll", IMAGE_BASE);
+  low = map_alloc (map, NR_SECTIONS * sizeof (*low));
+  if (! mod || ! low)
+    {
+      printf ("FAIL: can not set up the map\n");
+      return 1;
+    }
+  for (i = 0; i < NR_SECTIONS; i++)
+    {
+      low[i].rva = sections[i].rva;
+      low[i].size = sections[i].size;
+      low[i].init_size = sections[i].size;
+      low[i].low = map_reserve_low (map, sections[i].size);
+    }
+  mod->nr_low_sections = NR_SECTIONS;
+  mod->low_sections = himemce_map_ref (map, low);
+
+  if ((UINT_PTR) low[0].low / HIMEMCE_MAP_LOW_PAGE
+      != (UINT_PTR) low[1].low / HIMEMCE_MAP_LOW_PAGE)
+    {
+      printf ("FAIL: sections at %p and %p are not in one page\n",
+	      low[0].low, low[1].low);
+      return 1;
+    }
+
+  /* Every lookup after every other one.  */
+  for (i = 0; i < NR_RVAS; i++)
+    for (j = 0; j < NR_RVAS; j++)
+      {
+	struct himemce_low_section *sec;
+	struct himemce_low_section *cached;
+
+	last = himemce_map_find_low_section (map, mod, rvas[i]);
+	sec = himemce_map_find_low_section (map, mod, rvas[j]);
+	cached = himemce_map_find_low_section_cached (map, mod, rvas[j],
+						      &last);
+	if (sec != cached || last != sec)
+	  {
+	    printf ("FAIL: 0x%x after 0x%x: section %i, cached %i\n",
+		    rvas[j], rvas[i], sec ? (int) (sec - low) : -1,
+		    cached ? (int) (cached - low) : -1);
+	    failed = 1;
+	  }
+      }
+
+  /* The end of the first section, which the second one follows in
+     low memory, belongs to the first.  */
+  last = &low[1];
+  if (himemce_map_find_low_section_cached (map, mod, 0x1048, &last)
+      != &low[0])
+    {
+      printf ("FAIL: end of the first section\n");
+      failed = 1;
+    }
+
+  if (! failed)
+    printf ("PASS\n");
+  return failed;
+}
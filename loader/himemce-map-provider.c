@@ -20,6 +20,7 @@
    02111-1307, USA.  */
 
 #include <windows.h>
+#include <string.h>
 
 #include "debug.h"
 #include "himemce-map-provider.h"
@@ -31,6 +32,7 @@ map_create (void)
 {
   HANDLE *hnd;
   struct himemce_map *map;
+  int i;
 
   hnd = CreateFileMapping (INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
 			   HIMEMCE_MAP_SIZE, HIMEMCE_MAP_NAME);
@@ -39,7 +41,7 @@ map_create (void)
       ERR ("creating himemce map file failed: %i\n", GetLastError ());
       return NULL;
     }
-  map = MapViewOfFile (hnd, FILE_MAP_READ, 0, 0, 0);
+  map = MapViewOfFile (hnd, FILE_MAP_WRITE, 0, 0, 0);
   CloseHandle (hnd);
   if (! map)
     {
@@ -55,87 +57,325 @@ map_create (void)
       return NULL;
     }
 
-  /* Set the defaults.  */
-  map->magic = HIMEMCE_MAP_MAGIC;
+  /* Set the defaults.  The magic number is set last, as it makes the
+     map valid for others.  */
+  map->version = HIMEMCE_MAP_VERSION;
+  map->header_size = sizeof (struct himemce_map);
   map->size = sizeof (struct himemce_map);
   map->low_start = _HIMEMCE_MAP_LOW_BASE;
+  for (i = 0; i < HIMEMCE_MAP_SEGMENTS; i++)
+    map->segment[i].chunk = -1;
+  map->magic = HIMEMCE_MAP_MAGIC;
   return map;
 }
 
 
+/* Start a new chunk for the segment TYPE of MAP, with room for at
+   least SIZE bytes.  */
+static struct himemce_map_chunk *
+map_add_chunk (struct himemce_map *map, int type, unsigned int size)
+{
+  struct himemce_map_segment *seg = &map->segment[type];
+  struct himemce_map_chunk *chunk;
+  int idx = map->nr_chunks;
+  char *base;
+
+  if (idx == HIMEMCE_MAP_MAX_CHUNKS)
+    {
+      ERR ("out of map chunks allocating %u bytes\n", size);
+      return NULL;
+    }
+
+  /* Chunks grow with the segment, so that a few of them suffice.  */
+  size += sizeof (struct himemce_map_chunk_header);
+  if (size < seg->size)
+    size = seg->size;
+  size = ALIGN (size, HIMEMCE_MAP_CHUNK_SIZE);
+  if (size > HIMEMCE_MAP_MAX_CHUNK_SIZE)
+    {
+      ERR ("map chunk of 0x%x bytes too large\n", size);
+      return NULL;
+    }
+
+  chunk = &map->chunk[idx];
+  base = himemce_map_attach_chunk (map, idx, size);
+  if (! base)
+    {
+      ERR ("creating himemce map chunk %i failed: %i\n", idx,
+	   GetLastError ());
+      return NULL;
+    }
+  chunk->segment = type;
+  chunk->size = size;
+  chunk->used = sizeof (struct himemce_map_chunk_header);
+  map->nr_chunks++;
+
+  seg->chunk = idx;
+  seg->size += size;
+  seg->used += chunk->used;
+  map->size += chunk->used;
+  TRACE ("new map chunk %i for segment %i at %p (size 0x%x)\n", idx, type,
+	 base, size);
+  return chunk;
+}
+
+
 void *
-map_alloc (struct himemce_map *map, int size)
+map_alloc_segment (struct himemce_map *map, int type, int size)
 {
-  void *ptr = ((char *) map) + map->size;
+  struct himemce_map_segment *seg = &map->segment[type];
+  struct himemce_map_chunk *chunk = NULL;
+  void *ptr;
 
   /* Word-align.  */
-  map->size += ALIGN (size, 4);
-  if (size >= HIMEMCE_MAP_SIZE)
+  if (size < 0 || size > 0x10000000)
     {
       ERR ("out of map memory allocating %i bytes\n", size);
       return NULL;
     }
+  size = ALIGN (size, 4);
+
+  if (seg->chunk >= 0)
+    chunk = &map->chunk[seg->chunk];
+  if (! chunk || (unsigned int) size > chunk->size - chunk->used)
+    {
+      chunk = map_add_chunk (map, type, size);
+      if (! chunk)
+	return NULL;
+    }
+
+  ptr = himemce_map_ptr (map, HIMEMCE_MAP_REF (seg->chunk, chunk->used), 0);
+  chunk->used += size;
+  seg->used += size;
+  map->size += size;
   return ptr;
 }
 
 
+void *
+map_alloc (struct himemce_map *map, int size)
+{
+  return map_alloc_segment (map, HIMEMCE_MAP_SEG_DATA, size);
+}
+
+
+/* The free ends of the last pages of sections in low memory, which
+   smaller sections can fill.  */
+#define MAX_LOW_TAILS 64
+
+struct low_tail
+{
+  char *start;
+  int size;
+};
+
+static struct low_tail low_tails[MAX_LOW_TAILS];
+static int nr_low_tails;
+
+
+/* Keep the free end of a page at START of SIZE bytes for later
+   sections, unless it is too small to be worth it.  */
+static void
+add_low_tail (char *start, int size)
+{
+  int i;
+
+  if (size < HIMEMCE_MAP_LOW_ALIGN)
+    return;
+  i = nr_low_tails;
+  if (nr_low_tails == MAX_LOW_TAILS)
+    {
+      /* Give up the smallest one.  */
+      int j;
+
+      i = 0;
+      for (j = 1; j < nr_low_tails; j++)
+	if (low_tails[j].size < low_tails[i].size)
+	  i = j;
+      if (low_tails[i].size >= size)
+	return;
+    }
+  else
+    nr_low_tails++;
+  low_tails[i].start = start;
+  low_tails[i].size = size;
+}
+
+
+/* Forget the free page ends that are not in the same granule as PTR,
+   so that sections are only packed with their neighbours in load
+   order, and processes do not have to reserve granules for
+   modules they do not load.  */
+static void
+close_low_tails (char *ptr)
+{
+  UINT_PTR granule = (UINT_PTR) ptr / HIMEMCE_MAP_LOW_GRANULE;
+  int i = 0;
+
+  while (i < nr_low_tails)
+    if ((UINT_PTR) low_tails[i].start / HIMEMCE_MAP_LOW_GRANULE != granule)
+      low_tails[i] = low_tails[--nr_low_tails];
+    else
+      i++;
+}
+
+
+/* Allocate SIZE bytes of low memory for a section.  Sections that
+   fit into the free end of a page of a section placed before get the
+   smallest such space that fits.  Everything else starts on a fresh
+   page.  */
 void *
 map_reserve_low (struct himemce_map *map, int size)
 {
-  void *ptr = ((char *) map->low_start) + map->low_size;
+  char *ptr;
+  int best = -1;
+  int i;
 
-  /* Alignment for module sections.  */
-  map->low_size += ALIGN (size, 1024);
+  size = ALIGN (size, HIMEMCE_MAP_LOW_ALIGN);
+  if (size < HIMEMCE_MAP_LOW_PAGE)
+    for (i = 0; i < nr_low_tails; i++)
+      if (low_tails[i].size >= size
+	  && (best < 0 || low_tails[i].size < low_tails[best].size))
+	best = i;
+  if (best >= 0)
+    {
+      ptr = low_tails[best].start;
+      low_tails[best].start += size;
+      low_tails[best].size -= size;
+      if (low_tails[best].size < HIMEMCE_MAP_LOW_ALIGN)
+	low_tails[best] = low_tails[--nr_low_tails];
+      return ptr;
+    }
+
+  ptr = ((char *) map->low_start) + map->low_size;
+  map->low_size += ALIGN (size, HIMEMCE_MAP_LOW_PAGE);
+  close_low_tails (ptr);
+  add_low_tail (ptr + size, ALIGN (size, HIMEMCE_MAP_LOW_PAGE) - size);
   return ptr;
 }
 
 
+/* Make room for twice as many modules in the module table of
+   MAP.  */
+static int
+grow_module_table (struct himemce_map *map)
+{
+  int max = map->max_modules ? 2 * map->max_modules : 64;
+  himemce_map_ref_t *table;
+
+  table = map_alloc_segment (map, HIMEMCE_MAP_SEG_INDEX,
+			     max * sizeof (*table));
+  if (! table)
+    return 0;
+  if (map->nr_modules)
+    memcpy (table, himemce_map_ptr (map, map->module, map->nr_modules
+				    * sizeof (*table)),
+	    map->nr_modules * sizeof (*table));
+  map->module = himemce_map_ref (map, table);
+  map->max_modules = max;
+  return 1;
+}
+
+
+/* Double the number of slots of the name index of MAP.  */
+static int
+grow_name_index (struct himemce_map *map)
+{
+  unsigned int nr_slots = map->name_index ? 2 * (map->name_mask + 1) : 128;
+  unsigned int *index;
+  int i;
+
+  index = map_alloc_segment (map, HIMEMCE_MAP_SEG_INDEX,
+			     nr_slots * sizeof (*index));
+  if (! index)
+    return 0;
+  memset (index, 0, nr_slots * sizeof (*index));
+  for (i = 0; i < map->nr_modules; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (map, i);
+      unsigned int idx = mod->name_hash & (nr_slots - 1);
+
+      while (index[idx])
+	idx = (idx + 1) & (nr_slots - 1);
+      index[idx] = i + 1;
+    }
+  map->name_index = himemce_map_ref (map, index);
+  map->name_mask = nr_slots - 1;
+  return 1;
+}
+
+
 struct himemce_module *
 map_add_module (struct himemce_map *map, wchar_t *filename, void *base)
 {
   struct himemce_module *mod;
+  wchar_t *fname;
+  char *name;
+  unsigned int *name_index;
+  himemce_map_ref_t *table;
   int len;
   int idx;
 
-  if (map->nr_modules == HIMEMCE_MAP_MAX_MODULES)
-    {
-      ERR ("too many modules\n");
-      return NULL;
-    }
+  if (map->nr_modules == map->max_modules && ! grow_module_table (map))
+    return NULL;
+  /* At most half of the slots of the name index are used.  */
+  if (2 * (map->nr_modules + 1) > map->name_mask + 1
+      && ! grow_name_index (map))
+    return NULL;
 
-  mod = &map->module[map->nr_modules];
+  mod = map_alloc_segment (map, HIMEMCE_MAP_SEG_MODULES, sizeof (*mod));
+  if (! mod)
+    return NULL;
+  memset (mod, 0, sizeof (*mod));
+  mod->index = map->nr_modules;
 
   len = wcslen (filename);
-  mod->filename = map_alloc (map, (len + 1) * sizeof (wchar_t));
-  if (! mod->filename)
+  fname = map_alloc (map, (len + 1) * sizeof (wchar_t));
+  if (! fname)
     return NULL;
-  wcscpy (mod->filename, filename);
+  wcscpy (fname, filename);
   idx = len;
-  while (idx > 0 && mod->filename[idx - 1] != '\\'
-	 && mod->filename[idx - 1] != '/')
+  while (idx > 0 && fname[idx - 1] != '\\' && fname[idx - 1] != '/')
     idx--;
-  mod->dllname = &mod->filename[idx];
+  mod->filename = himemce_map_ref (map, fname);
+  mod->dllname = himemce_map_ref (map, &fname[idx]);
   mod->base = base;
 
-  len = WideCharToMultiByte (CP_UTF8, 0, mod->dllname, -1, NULL, 0, NULL, NULL);
+  len = WideCharToMultiByte (CP_UTF8, 0, &fname[idx], -1, NULL, 0, NULL, NULL);
   if (len == 0)
     {
       ERR ("conversion failure: %i\n", GetLastError ());
       return NULL;
     }
-  mod->name = map_alloc (map, len);
-  if (! mod->name)
+  name = map_alloc (map, len);
+  if (! name)
     return NULL;
 
-  if (WideCharToMultiByte (CP_UTF8, 0, mod->dllname, -1, mod->name, len,
+  if (WideCharToMultiByte (CP_UTF8, 0, &fname[idx], -1, name, len,
 			   NULL, NULL) != len)
     {
       ERR ("conversion inconsistency: %i\n", GetLastError ());
       return NULL;
     }
+  mod->name = himemce_map_ref (map, name);
+
+  mod->name_len = len - 1;
+  mod->name_hash = himemce_map_name_hash (name, mod->name_len);
+  if (himemce_map_find_module_n (map, name, mod->name_len))
+    {
+      ERR ("module %s is already mapped\n", name);
+      return NULL;
+    }
+  name_index = himemce_map_ptr (map, map->name_index, (map->name_mask + 1)
+				* sizeof (*name_index));
+  for (idx = mod->name_hash & map->name_mask; name_index[idx];
+       idx = (idx + 1) & map->name_mask)
+    ;
+  name_index[idx] = map->nr_modules + 1;
+  table = himemce_map_ptr (map, map->module, map->max_modules
+			   * sizeof (*table));
+  table[map->nr_modules] = himemce_map_ref (map, mod);
 
   map->nr_modules++;
   return mod;
 }
-
-
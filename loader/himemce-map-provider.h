@@ -27,8 +27,14 @@
 
 struct himemce_map *map_create (void);
 
+/* Allocate SIZE bytes in the segment TYPE of MAP.  */
+void *map_alloc_segment (struct himemce_map *map, int type, int size);
+
+/* The same for the data segment.  */
 void *map_alloc (struct himemce_map *map, int size);
 
+/* Allocate low memory for a section of SIZE bytes.  Sections are
+   packed by page.  */
 void *map_reserve_low (struct himemce_map *map, int size);
 
 struct himemce_module *map_add_module (struct himemce_map *map,
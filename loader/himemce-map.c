@@ -20,15 +20,98 @@
    02111-1307, USA.  */
 
 #include <windows.h>
+#include <string.h>
 
 #include "himemce-map.h"
 
+/* The chunks of the map as mapped into this process.  */
+static char *map_view[HIMEMCE_MAP_MAX_CHUNKS];
+
+
+/* Check that the NR module indices at REF are in MAP.  */
+static int
+check_indices (struct himemce_map *map, himemce_map_ref_t ref, int nr)
+{
+  const unsigned int *list;
+  int i;
+
+  if (nr <= 0)
+    return nr == 0;
+  list = himemce_map_ptr (map, ref, nr * sizeof (*list));
+  if (! list)
+    return 0;
+  for (i = 0; i < nr; i++)
+    if (list[i] >= (unsigned int) map->nr_modules)
+      return 0;
+  return 1;
+}
+
+
+/* Check that the NR elements of SIZE bytes at REF are in MAP.  */
+static int
+check_array (struct himemce_map *map, himemce_map_ref_t ref, int nr,
+	     size_t size)
+{
+  if (nr <= 0)
+    return nr == 0;
+  return himemce_map_ptr (map, ref, nr * size) != NULL;
+}
+
+
+/* Check that everything the module MOD refers to is in MAP, so that
+   users of the accessors need not.  */
+static int
+check_module (struct himemce_map *map, struct himemce_module *mod)
+{
+  const char *name = himemce_map_str (map, mod->name);
+  struct himemce_low_section *low;
+  int i;
+
+  if (! name || strlen (name) != mod->name_len
+      || ! himemce_map_wstr (map, mod->filename)
+      || ! himemce_map_wstr (map, mod->dllname))
+    return 0;
+  if (! check_array (map, mod->low_sections, mod->nr_low_sections,
+		     sizeof (struct himemce_low_section))
+      || ! check_array (map, mod->discarded, mod->nr_discarded,
+			sizeof (struct himemce_discarded))
+      || ! check_array (map, mod->forwards, mod->nr_forwards,
+			sizeof (struct himemce_forward))
+      || ! check_array (map, mod->sys_dlls, mod->nr_sys_dlls,
+			sizeof (himemce_map_ref_t))
+      || ! check_indices (map, mod->deps, mod->nr_deps)
+      || ! check_indices (map, mod->closure, mod->nr_closure))
+    return 0;
+  for (i = 0; i < mod->nr_sys_dlls; i++)
+    if (! himemce_module_sys_dll (map, mod, i))
+      return 0;
+  if (mod->low_size
+      && (mod->low < (char *) map->low_start
+	  || mod->low_size > (unsigned int) map->low_size
+	  || (unsigned int) (mod->low - (char *) map->low_start)
+	  > map->low_size - mod->low_size))
+    return 0;
+  low = himemce_module_low_sections (map, mod);
+  for (i = 0; i < mod->nr_low_sections; i++)
+    if (low[i].init_size > low[i].size
+	|| low[i].low < mod->low || low[i].size > mod->low_size
+	|| (unsigned int) (low[i].low - mod->low)
+	> mod->low_size - low[i].size)
+      return 0;
+  if (mod->exports && ! himemce_module_exports (map, mod))
+    return 0;
+  return 1;
+}
+
+
 /* Open the map data (which must exist).  */
 struct himemce_map *
 himemce_map_open (void)
 {
   HANDLE *hnd;
   struct himemce_map *map;
+  const unsigned int *name_index;
+  int i;
 
   hnd = CreateFileMapping (INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
 			   HIMEMCE_MAP_SIZE, HIMEMCE_MAP_NAME);
@@ -38,10 +121,52 @@ himemce_map_open (void)
   CloseHandle (hnd);
   if (! map)
     return NULL;
-  if (map->magic != HIMEMCE_MAP_MAGIC)
-    return NULL;
+  if (map->magic != HIMEMCE_MAP_MAGIC
+      || map->version != HIMEMCE_MAP_VERSION
+      || map->header_size != sizeof (struct himemce_map)
+      || map->nr_chunks < 0 || map->nr_chunks > HIMEMCE_MAP_MAX_CHUNKS)
+    goto fail;
+
+  for (i = 0; i < map->nr_chunks; i++)
+    if (! himemce_map_attach_chunk (map, i, 0))
+      goto fail;
+
+  /* Everything the module table, the name index and the load order
+     refer to must be in the map.  */
+  if (map->nr_modules < 0 || map->nr_modules > map->max_modules
+      || ! check_array (map, map->module, map->nr_modules,
+			sizeof (himemce_map_ref_t)))
+    goto fail;
+  for (i = 0; i < map->nr_modules; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (map, i);
+
+      if (! mod || mod->index != (unsigned int) i || ! check_module (map, mod))
+	goto fail;
+    }
+  if (map->nr_modules)
+    {
+      if ((map->name_mask & (map->name_mask + 1))
+	  || map->name_mask + 1 < 2 * (unsigned int) map->nr_modules)
+	goto fail;
+      name_index = himemce_map_ptr (map, map->name_index,
+				    (map->name_mask + 1)
+				    * sizeof (*name_index));
+      if (! name_index)
+	goto fail;
+      for (i = 0; i <= (int) map->name_mask; i++)
+	if (name_index[i] > (unsigned int) map->nr_modules)
+	  goto fail;
+    }
+  if (map->load_order
+      && ! check_indices (map, map->load_order, map->nr_modules))
+    goto fail;
 
   return map;
+
+ fail:
+  himemce_map_close (map);
+  return NULL;
 }
 
 
@@ -49,22 +174,483 @@ himemce_map_open (void)
 void
 himemce_map_close (struct himemce_map *map)
 {
+  int i;
+
+  for (i = 0; i < HIMEMCE_MAP_MAX_CHUNKS; i++)
+    if (map_view[i])
+      {
+	UnmapViewOfFile (map_view[i]);
+	map_view[i] = NULL;
+      }
   UnmapViewOfFile (map);
 }
 
 
-/* Find the DLL with the name DLLNAME in the map.  */
+/* Map the chunk IDX of MAP into the process.  */
+char *
+himemce_map_attach_chunk (struct himemce_map *map, int idx,
+			  unsigned int size)
+{
+  struct himemce_map_chunk_header *hdr;
+  wchar_t name[sizeof (HIMEMCE_MAP_NAME) / sizeof (wchar_t) + 12];
+  wchar_t digits[12];
+  HANDLE hnd;
+  int create = size != 0;
+  int len = 0;
+  int nr = idx;
+
+  if (idx < 0 || idx >= HIMEMCE_MAP_MAX_CHUNKS)
+    return NULL;
+  if (map_view[idx])
+    return map_view[idx];
+  if (! create)
+    {
+      size = map->chunk[idx].size;
+      if (size < sizeof (*hdr) || map->chunk[idx].used > size)
+	return NULL;
+    }
+
+  do
+    digits[len++] = L'0' + nr % 10;
+  while ((nr /= 10));
+  wcscpy (name, HIMEMCE_MAP_NAME);
+  nr = wcslen (name);
+  name[nr++] = L'.';
+  while (len)
+    name[nr++] = digits[--len];
+  name[nr] = L'\0';
+
+  hnd = CreateFileMapping (INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+			   size, name);
+  if (! hnd)
+    return NULL;
+  hdr = MapViewOfFile (hnd, create ? FILE_MAP_WRITE : FILE_MAP_READ,
+		       0, 0, 0);
+  CloseHandle (hnd);
+  if (! hdr)
+    return NULL;
+
+  if (create)
+    {
+      hdr->magic = HIMEMCE_MAP_MAGIC;
+      hdr->chunk = idx;
+    }
+  else if (hdr->magic != HIMEMCE_MAP_MAGIC || hdr->chunk != (unsigned int) idx)
+    {
+      UnmapViewOfFile (hdr);
+      return NULL;
+    }
+  map_view[idx] = (char *) hdr;
+  return map_view[idx];
+}
+
+
+/* Return the address of REF in MAP.  */
+void *
+himemce_map_ptr (struct himemce_map *map, himemce_map_ref_t ref,
+		 size_t size)
+{
+  unsigned int chunk = HIMEMCE_MAP_REF_CHUNK (ref);
+  unsigned int offset = HIMEMCE_MAP_REF_OFFSET (ref);
+  unsigned int used;
+
+  if (! ref || chunk >= (unsigned int) map->nr_chunks || ! map_view[chunk])
+    return NULL;
+  used = map->chunk[chunk].used;
+  if (offset > used || size > used - offset)
+    return NULL;
+  return map_view[chunk] + offset;
+}
+
+
+const char *
+himemce_map_str (struct himemce_map *map, himemce_map_ref_t ref)
+{
+  const char *str = himemce_map_ptr (map, ref, 1);
+
+  if (! str || ! memchr (str, '\0', map->chunk[HIMEMCE_MAP_REF_CHUNK (ref)].used
+			 - HIMEMCE_MAP_REF_OFFSET (ref)))
+    return NULL;
+  return str;
+}
+
+
+const wchar_t *
+himemce_map_wstr (struct himemce_map *map, himemce_map_ref_t ref)
+{
+  const wchar_t *str = himemce_map_ptr (map, ref, sizeof (wchar_t));
+  size_t len;
+
+  if (! str)
+    return NULL;
+  len = (map->chunk[HIMEMCE_MAP_REF_CHUNK (ref)].used
+	 - HIMEMCE_MAP_REF_OFFSET (ref)) / sizeof (wchar_t);
+  while (len--)
+    if (! str[len])
+      return str;
+  return NULL;
+}
+
+
+/* Return the reference to PTR in MAP.  */
+himemce_map_ref_t
+himemce_map_ref (struct himemce_map *map, const void *ptr)
+{
+  const char *addr = ptr;
+  int i;
+
+  if (! addr)
+    return 0;
+  for (i = 0; i < map->nr_chunks; i++)
+    if (map_view[i] && addr > map_view[i]
+	&& (size_t) (addr - map_view[i]) < map->chunk[i].size)
+      return HIMEMCE_MAP_REF (i, addr - map_view[i]);
+  return 0;
+}
+
+
+/* Return the module IDX of MAP.  */
+struct himemce_module *
+himemce_map_module (struct himemce_map *map, unsigned int idx)
+{
+  himemce_map_ref_t *table;
+
+  if (idx >= (unsigned int) map->nr_modules)
+    return NULL;
+  table = himemce_map_ptr (map, map->module,
+			   map->nr_modules * sizeof (*table));
+  if (! table)
+    return NULL;
+  return himemce_map_ptr (map, table[idx], sizeof (struct himemce_module));
+}
+
+
+unsigned int *
+himemce_map_load_order (struct himemce_map *map)
+{
+  return himemce_map_ptr (map, map->load_order,
+			  map->nr_modules * sizeof (unsigned int));
+}
+
+
+const char *
+himemce_module_name (struct himemce_map *map, struct himemce_module *mod)
+{
+  return himemce_map_str (map, mod->name);
+}
+
+
+const wchar_t *
+himemce_module_filename (struct himemce_map *map, struct himemce_module *mod)
+{
+  return himemce_map_wstr (map, mod->filename);
+}
+
+
+const wchar_t *
+himemce_module_dllname (struct himemce_map *map, struct himemce_module *mod)
+{
+  return himemce_map_wstr (map, mod->dllname);
+}
+
+
+struct himemce_low_section *
+himemce_module_low_sections (struct himemce_map *map,
+			     struct himemce_module *mod)
+{
+  return himemce_map_ptr (map, mod->low_sections, mod->nr_low_sections
+			  * sizeof (struct himemce_low_section));
+}
+
+
+struct himemce_export_index *
+himemce_module_exports (struct himemce_map *map, struct himemce_module *mod)
+{
+  struct himemce_export_index *index;
+
+  index = himemce_map_ptr (map, mod->exports, sizeof (*index));
+  if (! index || ! himemce_map_check_export_index (index)
+      || ! himemce_map_ptr (map, mod->exports,
+			    offsetof (struct himemce_export_index, slot)
+			    + (index->mask + 1) * sizeof (unsigned int)))
+    return NULL;
+  return index;
+}
+
+
+struct himemce_discarded *
+himemce_module_discarded (struct himemce_map *map, struct himemce_module *mod)
+{
+  return himemce_map_ptr (map, mod->discarded, mod->nr_discarded
+			  * sizeof (struct himemce_discarded));
+}
+
+
+struct himemce_forward *
+himemce_module_forwards (struct himemce_map *map, struct himemce_module *mod)
+{
+  return himemce_map_ptr (map, mod->forwards, mod->nr_forwards
+			  * sizeof (struct himemce_forward));
+}
+
+
+unsigned int *
+himemce_module_deps (struct himemce_map *map, struct himemce_module *mod)
+{
+  return himemce_map_ptr (map, mod->deps,
+			  mod->nr_deps * sizeof (unsigned int));
+}
+
+
+unsigned int *
+himemce_module_closure (struct himemce_map *map, struct himemce_module *mod)
+{
+  return himemce_map_ptr (map, mod->closure,
+			  mod->nr_closure * sizeof (unsigned int));
+}
+
+
+const char *
+himemce_module_sys_dll (struct himemce_map *map, struct himemce_module *mod,
+			int idx)
+{
+  himemce_map_ref_t *names;
+
+  if (idx < 0 || idx >= mod->nr_sys_dlls)
+    return NULL;
+  names = himemce_map_ptr (map, mod->sys_dlls,
+			   mod->nr_sys_dlls * sizeof (*names));
+  if (! names)
+    return NULL;
+  return himemce_map_str (map, names[idx]);
+}
+
+
+/* Module names are hashed with FNV-1a over the name in lower
+   case.  */
+unsigned int
+himemce_map_name_hash (const char *name, size_t len)
+{
+  unsigned int hash = 2166136261U;
+
+  while (len--)
+    {
+      unsigned char chr = *name++;
+
+      if (chr >= 'A' && chr <= 'Z')
+	chr += 'a' - 'A';
+      hash = (hash ^ chr) * 16777619U;
+    }
+  return hash;
+}
+
+
+/* Find the DLL with the name NAME of LEN bytes in the map.  */
+struct himemce_module *
+himemce_map_find_module_n (struct himemce_map *map, const char *name,
+			   size_t len)
+{
+  unsigned int hash = himemce_map_name_hash (name, len);
+  const unsigned int *name_index;
+  unsigned int idx;
+
+  if (! map->nr_modules)
+    return NULL;
+  name_index = himemce_map_ptr (map, map->name_index, (map->name_mask + 1)
+				* sizeof (*name_index));
+  if (! name_index)
+    return NULL;
+  for (idx = hash & map->name_mask; name_index[idx];
+       idx = (idx + 1) & map->name_mask)
+    {
+      struct himemce_module *mod = himemce_map_module (map,
+						       name_index[idx] - 1);
+
+      if (mod && mod->name_hash == hash && mod->name_len == len
+	  && ! _strnicmp (himemce_module_name (map, mod), name, len))
+	return mod;
+    }
+  return NULL;
+}
+
+
+/* Find the DLL with the name NAME in the map.  */
 struct himemce_module *
 himemce_map_find_module (struct himemce_map *map, const char *name)
 {
-  int i;
+  return himemce_map_find_module_n (map, name, strlen (name));
+}
 
-  for (i = 0; i < map->nr_modules; i++)
-    if (! _stricmp (map->module[i].name, name))
-      break;
 
-  if (i < map->nr_modules)
-    return &map->module[i];
+/* Find the read-write section of MOD that contains RVA.  */
+struct himemce_low_section *
+himemce_map_find_low_section (struct himemce_map *map,
+			      struct himemce_module *mod, unsigned int rva)
+{
+  struct himemce_low_section *low = himemce_module_low_sections (map, mod);
+  int lo = 0;
+  int hi = mod->nr_low_sections - 1;
+
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+      struct himemce_low_section *sec = &low[mid];
+
+      if (rva < sec->rva)
+	hi = mid - 1;
+      else if (rva - sec->rva >= HIMEMCE_MAP_LOW_SPAN (sec))
+	lo = mid + 1;
+      else
+	return sec;
+    }
+  return NULL;
+}
+
+
+struct himemce_low_section *
+himemce_map_find_low_section_cached (struct himemce_map *map,
+				     struct himemce_module *mod,
+				     unsigned int rva,
+				     struct himemce_low_section **last)
+{
+  if (! *last || rva < (*last)->rva
+      || rva - (*last)->rva >= HIMEMCE_MAP_LOW_SPAN (*last))
+    *last = himemce_map_find_low_section (map, mod, rva);
+  return *last;
+}
+
+
+/* Find the forwarded export ORDINAL of MOD.  */
+struct himemce_forward *
+himemce_map_find_forward (struct himemce_map *map, struct himemce_module *mod,
+			  unsigned int ordinal)
+{
+  struct himemce_forward *forwards = himemce_module_forwards (map, mod);
+  int lo = 0;
+  int hi = mod->nr_forwards - 1;
 
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+      struct himemce_forward *fwd = &forwards[mid];
+
+      if (ordinal < fwd->ordinal)
+	hi = mid - 1;
+      else if (ordinal > fwd->ordinal)
+	lo = mid + 1;
+      else
+	return fwd;
+    }
   return NULL;
 }
+
+
+/* Get the DLL name of the forward string FORWARD.  */
+const char *
+himemce_map_forward_dll (const char *forward, char *name, size_t size)
+{
+  /* Exported names can not contain a dot, DLL names can.  */
+  const char *end = strrchr (forward, '.');
+  size_t len;
+
+  if (! end || end == forward || ! end[1])
+    return NULL;
+  len = end - forward;
+  if (len + sizeof (".dll") > size)
+    return NULL;
+  memcpy (name, forward, len);
+  name[len] = '\0';
+  if (! memchr (name, '.', len))
+    strcpy (name + len, ".dll");
+  return end + 1;
+}
+
+
+/* Export names are hashed with FNV-1a.  The low bits of the hash
+   select the first slot, the upper 16 bits are kept in the slot, so
+   that a probe only compares the name if they match.  */
+static unsigned int
+export_hash (const char *name)
+{
+  unsigned int hash = 2166136261U;
+
+  while (*name)
+    {
+      hash ^= (unsigned char) *name++;
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+
+size_t
+himemce_map_export_index_size (unsigned int nr_names)
+{
+  unsigned int nr_slots = 16;
+
+  if (nr_names >= 0xffff)
+    return 0;
+  /* At most three of four slots are used.  */
+  while (nr_slots / 4 * 3 < nr_names)
+    nr_slots *= 2;
+  if (nr_slots > HIMEMCE_EXPORT_INDEX_MAX_SLOTS)
+    return 0;
+  return offsetof (struct himemce_export_index, slot)
+    + nr_slots * sizeof (unsigned int);
+}
+
+
+int
+himemce_map_check_export_index (const struct himemce_export_index *index)
+{
+  return index->mask < HIMEMCE_EXPORT_INDEX_MAX_SLOTS
+    && ! (index->mask & (index->mask + 1));
+}
+
+
+void
+himemce_map_build_export_index (struct himemce_export_index *index,
+				const char *base, const unsigned int *names,
+				unsigned int nr_names)
+{
+  size_t size = himemce_map_export_index_size (nr_names);
+  unsigned int i;
+
+  index->mask = (size - offsetof (struct himemce_export_index, slot))
+    / sizeof (unsigned int) - 1;
+  index->names = (const char *) names - base;
+  memset (index->slot, 0, (index->mask + 1) * sizeof (unsigned int));
+  for (i = 0; i < nr_names; i++)
+    {
+      unsigned int hash = export_hash (base + names[i]);
+      unsigned int pos = hash & index->mask;
+
+      while (index->slot[pos])
+	pos = (pos + 1) & index->mask;
+      index->slot[pos] = (hash & 0xffff0000) | (i + 1);
+    }
+}
+
+
+int
+himemce_map_find_export (const struct himemce_export_index *index,
+			 const char *base, const char *name)
+{
+  const unsigned int *names = (const unsigned int *) (base + index->names);
+  unsigned int hash = export_hash (name);
+  unsigned int pos = hash & index->mask;
+  unsigned int slot;
+
+  while ((slot = index->slot[pos]))
+    {
+      if ((slot & 0xffff0000) == (hash & 0xffff0000))
+	{
+	  int idx = (slot & 0xffff) - 1;
+
+	  if (! strcmp (base + names[idx], name))
+	    return idx;
+	}
+      pos = (pos + 1) & index->mask;
+    }
+  return -1;
+}
@@ -25,29 +25,205 @@
 #include <stddef.h>
 
 /* The preloader makes its information available at a shared memory
-   object of this name and size.  */
+   object of this name and size, the header of the map.  The data is
+   kept in further shared memory objects, the chunks, which are named
+   like the header with a dot and the number of the chunk appended.  */
 #define HIMEMCE_MAP_NAME L"himemcemap"
-#define HIMEMCE_MAP_SIZE (128 * 1024)
-#define HIMEMCE_MAP_MAGIC 0x400b1337
+#define HIMEMCE_MAP_SIZE (4 * 1024)
+#define HIMEMCE_MAP_MAGIC 0x400b1338
+
+/* The version of the layout of the map.  Increment it with every
+   incompatible change.  */
+#define HIMEMCE_MAP_VERSION 4
+
+/* The minimum size of a chunk.  A segment that runs out of space gets
+   a new chunk at least as large as all its chunks so far.  */
+#define HIMEMCE_MAP_CHUNK_SIZE (64 * 1024)
+
+/* Maximum number of chunks.  As chunks grow, this does not limit the
+   number of modules in practice.  */
+#define HIMEMCE_MAP_MAX_CHUNKS 64
+
+/* Maximum size of a chunk.  */
+#define HIMEMCE_MAP_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+
+/* Data in the map refers to other data in the map by the number of
+   the chunk (in the upper 8 bits) and the offset in the chunk (in the
+   lower 24 bits), never by address, so that the map is valid wherever
+   its chunks are mapped, and could be saved to a file and mapped back
+   as a whole.  0 is the null reference, as every chunk starts with
+   its header.  The addresses of module images and of low memory are
+   absolute, as they are the same in all processes.  Use
+   himemce_map_ptr and the accessor functions below to follow a
+   reference.  */
+typedef unsigned int himemce_map_ref_t;
+
+#define HIMEMCE_MAP_REF(chunk, offset) (((chunk) << 24) | (offset))
+#define HIMEMCE_MAP_REF_CHUNK(ref) ((ref) >> 24)
+#define HIMEMCE_MAP_REF_OFFSET(ref) ((ref) & 0xffffff)
 
 /* The default base address.  Users should take the actual value from
    the LOW_START member of struct himemce_map.  */
 #define _HIMEMCE_MAP_LOW_BASE ((void *) (2 * 1024 * 1024))
 
-/* Maximum number of DLLs that can be mapped.  */
-#define HIMEMCE_MAP_MAX_MODULES 64
+/* Low memory is reserved in pieces of this size, the allocation
+   granularity of Windows CE.  */
+#define HIMEMCE_MAP_LOW_GRANULE (64 * 1024)
+
+/* Sections are packed into low memory pages of HIMEMCE_MAP_LOW_PAGE
+   bytes at this alignment.  An address of a section is translated to
+   low memory up to the end of its last page, so that pointers to the
+   end of the section stay low.  */
+#define HIMEMCE_MAP_LOW_PAGE 4096
+#define HIMEMCE_MAP_LOW_ALIGN 64
+
+
+/* The segments of the map, which keep data of the same kind
+   together.  */
+enum himemce_map_segment_type
+  {
+    /* The module descriptors.  */
+    HIMEMCE_MAP_SEG_MODULES,
+    /* The module table, the name index and the load order.  */
+    HIMEMCE_MAP_SEG_INDEX,
+    /* Everything else: names, section tables, export indices...  */
+    HIMEMCE_MAP_SEG_DATA,
+
+    HIMEMCE_MAP_SEGMENTS
+  };
+
+
+/* An entry in the chunk directory of the map.  */
+struct himemce_map_chunk
+{
+  /* The segment the chunk belongs to.  */
+  unsigned int segment;
+
+  /* The size of the chunk, and the bytes used of it.  */
+  unsigned int size;
+  unsigned int used;
+};
+
+/* Each chunk starts with this.  */
+struct himemce_map_chunk_header
+{
+  /* Must be HIMEMCE_MAP_MAGIC.  */
+  unsigned int magic;
+
+  /* The number of the chunk.  */
+  unsigned int chunk;
+};
+
+
+/* A segment of the map.  */
+struct himemce_map_segment
+{
+  /* The chunk that is allocated from, or -1 if there is none yet.  */
+  int chunk;
+
+  /* The size of all chunks of the segment, and the bytes used.  */
+  unsigned int size;
+  unsigned int used;
+};
+
+
+/* A read-write section of a module, which is copied to low
+   memory.  */
+struct himemce_low_section
+{
+  /* The RVA and the size of the section in the image.  */
+  unsigned int rva;
+  unsigned int size;
+
+  /* The size of the initialized data at the start of the section.
+     The rest of it is zero-filled, and is neither copied nor touched
+     when the section is loaded.  */
+  unsigned int init_size;
+
+  /* The low (in-process) address of the section.  */
+  char *low;
+};
+
+/* The number of bytes from the start of the low section SEC that are
+   translated to low memory (see HIMEMCE_MAP_LOW_PAGE).  */
+#define HIMEMCE_MAP_LOW_SPAN(sec) \
+  (((sec)->size + HIMEMCE_MAP_LOW_PAGE - 1) & ~(HIMEMCE_MAP_LOW_PAGE - 1))
+
+
+/* A range of a module image that is decommitted after loading, as
+   it is not used anymore (discardable sections and relocations).  */
+struct himemce_discarded
+{
+  unsigned int rva;
+  unsigned int size;
+
+  /* The section name, not terminated if it has eight
+     characters.  */
+  char name[8];
+};
+
+/* Maximum number of discarded ranges recorded per module.  */
+#define HIMEMCE_MAX_DISCARDED 8
+
+
+/* A hash index of the exported names of a module.  Open addressing
+   with linear probing.  */
+struct himemce_export_index
+{
+  /* The number of slots minus one.  The number of slots is a power
+     of two.  */
+  unsigned int mask;
+
+  /* The RVA of the AddressOfNames array of the module.  */
+  unsigned int names;
+
+  /* Per slot: the upper 16 bits of the hash of the name, and in the
+     lower 16 bits the index into NAMES plus one, or 0 if the slot is
+     free.  */
+  unsigned int slot[1];
+};
+
+/* The most slots an export index has.  The name index takes 16 bits,
+   so there are fewer than 0xffff names, and at most three of four
+   slots are used.  */
+#define HIMEMCE_EXPORT_INDEX_MAX_SLOTS 0x20000
+
+
+/* A forwarded export of a module, resolved by the preloader.  */
+struct himemce_forward
+{
+  /* The index into the AddressOfFunctions array.  */
+  unsigned int ordinal;
+
+  /* The RVA of the forward string in the image, of the form DLL.NAME
+     or DLL.#ORDINAL.  */
+  unsigned int forward;
+
+  /* The address at the end of the forward chain, or NULL if it could
+     not be resolved.  */
+  void *target;
+};
 
 
 /* Each module provides this.  */
 struct himemce_module
 {
-  wchar_t *filename;
+  /* A wide string.  */
+  himemce_map_ref_t filename;
 
   /* Points into filename.  */
-  wchar_t *dllname;
+  himemce_map_ref_t dllname;
+
+  /* The index of the module in the map.  */
+  unsigned int index;
 
   /* Export DLL name (same as DLLNAME, but in ASCII).  */
-  char *name;
+  himemce_map_ref_t name;
+
+  /* The length of NAME and its hash for the name index.  */
+  unsigned int name_len;
+  unsigned int name_hash;
 
   /* The base address of the module image.  */
   void *base;
@@ -55,6 +231,43 @@ struct himemce_module
   /* The low (in-process) address of read-write sections is available
      in the PointerToLinenumbers in the section header, which is
      recycled for that purpose.  */
+
+  /* The read-write sections again, sorted by RVA, to map addresses
+     without walking the section headers.  */
+  int nr_low_sections;
+  himemce_map_ref_t low_sections;
+
+  /* The range of low memory that holds all of these sections.  The
+     loader reserves it when it loads the module.  */
+  char *low;
+  unsigned int low_size;
+
+  /* The index of the exported names (struct himemce_export_index), or
+     0 if there is none.  */
+  himemce_map_ref_t exports;
+
+  /* The ranges of the image decommitted by the preloader.  */
+  int nr_discarded;
+  himemce_map_ref_t discarded;
+
+  /* The forwarded exports, sorted by ordinal.  */
+  int nr_forwards;
+  himemce_map_ref_t forwards;
+
+  /* The indices of the modules in the map that this module imports
+     or forwards to.  */
+  int nr_deps;
+  himemce_map_ref_t deps;
+
+  /* The same for the DLLs of the system: references to their
+     names.  */
+  int nr_sys_dlls;
+  himemce_map_ref_t sys_dlls;
+
+  /* The indices of all modules that must be loaded with this one, in
+     the order they must be loaded, ending with this one.  */
+  int nr_closure;
+  himemce_map_ref_t closure;
 };
 
 
@@ -63,19 +276,50 @@ struct himemce_map
   /* Must be HIMEMCE_MAP_MAGIC.  */
   unsigned int magic;
 
-  /* Actual size of the map.  */
+  /* Must be HIMEMCE_MAP_VERSION and the size of this header.  */
+  unsigned int version;
+  unsigned int header_size;
+
+  /* Actual size of the map: the header and the used part of all
+     chunks.  */
   unsigned int size;
 
-  /* The low addresses of sections are within this range, which must
-     be reserved by the program that wants to use mapped modules as
-     soon as possible.  */
+  /* The low addresses of sections are within this range.  Programs
+     that use mapped modules reserve the parts of it that the modules
+     they load need, in units of HIMEMCE_MAP_LOW_GRANULE.  The
+     preloader lays it out in load order, so that these are few.  */
   void *low_start;
   int low_size;
 
-  /* Number of mapped modules.  */
+  /* A hash over the modules and their layout, which keys data
+     derived from the map (such as bound imports).  It is the same
+     after a reboot if nothing changed, and zero while the preloader
+     is still running.  */
+  unsigned int generation;
+
+  /* Number of mapped modules, and the table of references to them.
+     The table has room for MAX_MODULES entries and is replaced by a
+     larger one when it is full.  Use himemce_map_module to look up a
+     module.  */
   int nr_modules;
+  int max_modules;
+  himemce_map_ref_t module;
 
-  struct himemce_module module[HIMEMCE_MAP_MAX_MODULES];
+  /* The name index: open addressing with linear probing over the
+     hashes of the module names, with the index of the module plus
+     one in each used slot, and 0 in free ones.  The number of slots
+     is a power of two, and at most half of them are used.  */
+  unsigned int name_mask;
+  himemce_map_ref_t name_index;
+
+  /* The indices of all modules, dependencies first.  Dependency loops
+     are broken at an arbitrary point.  */
+  himemce_map_ref_t load_order;
+
+  /* The segment and chunk directories.  */
+  struct himemce_map_segment segment[HIMEMCE_MAP_SEGMENTS];
+  int nr_chunks;
+  struct himemce_map_chunk chunk[HIMEMCE_MAP_MAX_CHUNKS];
 };
 
 
@@ -85,8 +329,117 @@ struct himemce_map *himemce_map_open (void);
 /* Release the map data.  */
 void himemce_map_close (struct himemce_map *map);
 
-/* Find the DLL with the name DLLNAME in the map.  */
+/* Map the chunk IDX of MAP into the process, creating it with SIZE
+   bytes if SIZE is not 0.  Returns the address of the chunk, or NULL
+   on failure.  */
+char *himemce_map_attach_chunk (struct himemce_map *map, int idx,
+				unsigned int size);
+
+/* Return the address of the SIZE bytes at REF in MAP, or NULL if
+   REF is the null reference or they are not within the used part of
+   a chunk.  */
+void *himemce_map_ptr (struct himemce_map *map, himemce_map_ref_t ref,
+		       size_t size);
+
+/* The same for the string at REF, which must be terminated within
+   its chunk.  */
+const char *himemce_map_str (struct himemce_map *map, himemce_map_ref_t ref);
+const wchar_t *himemce_map_wstr (struct himemce_map *map,
+				 himemce_map_ref_t ref);
+
+/* Return the reference to PTR, which points into MAP, or 0.  */
+himemce_map_ref_t himemce_map_ref (struct himemce_map *map, const void *ptr);
+
+/* Return the module IDX of MAP, or NULL if there is no such
+   module.  */
+struct himemce_module *himemce_map_module (struct himemce_map *map,
+					   unsigned int idx);
+
+/* Return the load order of MAP, with NR_MODULES entries, or NULL if
+   there is none.  */
+unsigned int *himemce_map_load_order (struct himemce_map *map);
+
+/* Accessors for the data of the module MOD of MAP.  Arrays have as
+   many elements as the corresponding NR_ member says.  */
+const char *himemce_module_name (struct himemce_map *map,
+				 struct himemce_module *mod);
+const wchar_t *himemce_module_filename (struct himemce_map *map,
+					struct himemce_module *mod);
+const wchar_t *himemce_module_dllname (struct himemce_map *map,
+				       struct himemce_module *mod);
+struct himemce_low_section *himemce_module_low_sections
+     (struct himemce_map *map, struct himemce_module *mod);
+struct himemce_export_index *himemce_module_exports
+     (struct himemce_map *map, struct himemce_module *mod);
+struct himemce_discarded *himemce_module_discarded
+     (struct himemce_map *map, struct himemce_module *mod);
+struct himemce_forward *himemce_module_forwards (struct himemce_map *map,
+						 struct himemce_module *mod);
+unsigned int *himemce_module_deps (struct himemce_map *map,
+				   struct himemce_module *mod);
+unsigned int *himemce_module_closure (struct himemce_map *map,
+				      struct himemce_module *mod);
+/* The name of the system DLL IDX.  */
+const char *himemce_module_sys_dll (struct himemce_map *map,
+				    struct himemce_module *mod, int idx);
+
+/* Return the hash of the module name NAME of LEN bytes, which does
+   not depend on the case of ASCII letters.  */
+unsigned int himemce_map_name_hash (const char *name, size_t len);
+
+/* Find the DLL with the name NAME in the map, ignoring case.  */
 struct himemce_module *himemce_map_find_module (struct himemce_map *map,
 					     const char *name);
 
+/* The same for the name NAME of LEN bytes, which need not be
+   terminated.  */
+struct himemce_module *himemce_map_find_module_n (struct himemce_map *map,
+						  const char *name,
+						  size_t len);
+
+/* Find the read-write section of MOD that contains RVA.  Returns
+   NULL if RVA is not in a read-write section.  */
+struct himemce_low_section *himemce_map_find_low_section
+     (struct himemce_map *map, struct himemce_module *mod, unsigned int rva);
+
+/* The same, but try *LAST first, and store the result there.  */
+struct himemce_low_section *himemce_map_find_low_section_cached
+     (struct himemce_map *map, struct himemce_module *mod, unsigned int rva,
+      struct himemce_low_section **last);
+
+/* Find the forwarded export ORDINAL (an index into the
+   AddressOfFunctions array) of MOD.  Returns NULL if it is not
+   known.  */
+struct himemce_forward *himemce_map_find_forward
+     (struct himemce_map *map, struct himemce_module *mod,
+      unsigned int ordinal);
+
+/* Store the file name of the DLL of the forward string FORWARD in
+   NAME of SIZE bytes, with ".dll" appended if it has no extension.
+   Returns the part after the DLL, or NULL if FORWARD is malformed or
+   NAME too small.  */
+const char *himemce_map_forward_dll (const char *forward, char *name,
+				     size_t size);
+
+/* Return the size of an export index for NR_NAMES names, or 0 if
+   there are too many.  */
+size_t himemce_map_export_index_size (unsigned int nr_names);
+
+/* Return nonzero if the number of slots of INDEX is valid.  */
+int himemce_map_check_export_index (const struct himemce_export_index *index);
+
+/* Build the export index INDEX of the size returned by
+   himemce_map_export_index_size for the NR_NAMES names at NAMES of the
+   module at BASE.  */
+void himemce_map_build_export_index (struct himemce_export_index *index,
+				     const char *base,
+				     const unsigned int *names,
+				     unsigned int nr_names);
+
+/* Look up NAME in the export index INDEX of the module at BASE.
+   Returns the index into the AddressOfNames array, or -1 if NAME is
+   not exported.  */
+int himemce_map_find_export (const struct himemce_export_index *index,
+			     const char *base, const char *name);
+
 #endif /* HIMEMCE_MAP_H */
@@ -27,15 +27,14 @@
 #include "kernel32_kernel_private.h"
 #include "wine.h"
 #include "himemce-map-provider.h"
+#include "himemce-reloc.h"
+#include "himemce-stub.h"
 
 
 # define page_mask  0xfff
 # define page_shift 12
 # define page_size  0x1000
 
-#define ROUND_SIZE(size) \
-  (((SIZE_T)(size) + page_mask) & ~page_mask)
-
 #define SECTION_IS_LOW(sec) \
       (((sec)->Characteristics & IMAGE_SCN_MEM_WRITE) &&	\
        ! ((sec)->Characteristics & IMAGE_SCN_MEM_SHARED))
@@ -140,179 +139,228 @@ find_modules (struct himemce_map *map)
 }
 
 
+/* The size of section SEC in memory, without rounding it up to
+   whole pages, so that sections can be packed in low memory.  */
 static SIZE_T
 section_size (IMAGE_SECTION_HEADER *sec)
 {
-  static const SIZE_T sector_align = 0x1ff;
-  SIZE_T map_size, file_size, end;
-  
   if (!sec->Misc.VirtualSize)
-    map_size = ROUND_SIZE( sec->SizeOfRawData );
+    return sec->SizeOfRawData;
   else
-    map_size = ROUND_SIZE( sec->Misc.VirtualSize );
-  
-  file_size = (sec->SizeOfRawData + (sec->PointerToRawData & sector_align) + sector_align) & ~sector_align;
-  if (file_size > map_size) file_size = map_size;
-  end = ROUND_SIZE( file_size );
-  if (end > map_size) end = map_size;
-  return end;
+    return sec->Misc.VirtualSize;
+}
+
+
+/* The size of the data of section SEC that comes from the file.  The
+   rest of it is zero-filled.  */
+static SIZE_T
+section_init_size (IMAGE_SECTION_HEADER *sec)
+{
+  SIZE_T size = section_size (sec);
+
+  if (!sec->PointerToRawData)
+    return 0;
+  return sec->SizeOfRawData < size ? sec->SizeOfRawData : size;
 }
 
 
 static void *
-get_rva_low (char *module, size_t rva)
+get_rva_low (struct himemce_map *map, struct himemce_module *mod, size_t rva)
 {
-  IMAGE_DOS_HEADER *dos = (IMAGE_DOS_HEADER *)module;
-  IMAGE_NT_HEADERS *nt = (IMAGE_NT_HEADERS *)(module + dos->e_lfanew);
-  IMAGE_SECTION_HEADER *sec;
-  int sec_cnt;
-  int idx;
+  struct himemce_low_section *sec;
+
+  sec = himemce_map_find_low_section (map, mod, rva);
+  if (! sec)
+    return (void *)((char *)mod->base + rva);
 
-  sec = (IMAGE_SECTION_HEADER*)((char*)&nt->OptionalHeader+nt->FileHeader.SizeOfOptionalHeader);
-  sec_cnt = nt->FileHeader.NumberOfSections;
+  return (void *)(sec->low + (rva - sec->rva));
+}
+
+  
+/* Return the low address for the high address ADDR in the module
+   MOD, or ADDR if it does not point into a low section.  *LAST caches
+   the last hit, as consecutive fixups mostly point into the same
+   section.  */
+static size_t
+low_address (struct himemce_map *map, struct himemce_module *mod,
+	     struct himemce_low_section **last, size_t addr)
+{
+  size_t off;
 
-  for (idx = 0; idx < sec_cnt; idx++)
+  if ((void *) addr < mod->base)
     {
-      if (! sec[idx].PointerToLinenumbers)
-	continue;
-      if (rva >= sec[idx].VirtualAddress
-	  && rva < sec[idx].VirtualAddress + section_size (&sec[idx]))
-		break;
+      ERR ("ignoring relocation that points below image");
+      return addr;
     }
-  if (idx == sec_cnt)
-    return (void *)((char *)module + rva);
-  
-  return (void *)((char *)sec[idx].PointerToLinenumbers
-		  + (rva - sec[idx].VirtualAddress));
+  off = ((char *) addr) - ((char *) mod->base);
+
+  /* Check if ADDR points into a rw segment.  */
+  if (! himemce_map_find_low_section_cached (map, mod, off, last))
+    return addr;
+  return (size_t) (*last)->low + (off - (*last)->rva);
 }
 
-  
-static IMAGE_BASE_RELOCATION *
-LowLdrProcessRelocationBlock (void *base, void *page, UINT count,
-			      USHORT *relocs)
+
+/* Rewrite the fixups of PAGE from the relocation index RELOCS of the
+   module MOD that point into low sections.  */
+static void
+LowLdrProcessRelocationPage (struct himemce_map *map,
+			     struct himemce_module *mod,
+			     const struct himemce_relocs *relocs,
+			     const struct himemce_reloc_page *page)
 {
+  const WORD *offset = HIMEMCE_RELOC_OFFSETS (relocs) + page->first;
+  struct himemce_low_section *last = NULL;
   char *ptr;
-  IMAGE_DOS_HEADER *dos;
-  IMAGE_NT_HEADERS *nt;
-  IMAGE_SECTION_HEADER *sec;
-  int sec_cnt;
-  int idx;
+  int i;
 
-  ptr = base;
-  dos = (IMAGE_DOS_HEADER *) ptr;
-  nt = (IMAGE_NT_HEADERS *) (ptr + dos->e_lfanew);
-  sec = (IMAGE_SECTION_HEADER *) ((char*) &nt->OptionalHeader
-				  + nt->FileHeader.SizeOfOptionalHeader);
-  sec_cnt = nt->FileHeader.NumberOfSections;
-  idx = sec_cnt;
+  ptr = (char *) mod->base + page->rva;
+  for (i = 0; i < page->nr_highlow; i++)
+    {
+      size_t addr = *(int *) (ptr + offset[i]);
+      size_t new_addr = low_address (map, mod, &last, addr);
 
-  /* Small optimization: Exclude read-only sections at the start and
-     end of the list.  */
-  while (sec_cnt > 0 && SECTION_IS_LOW (sec))
+      if (new_addr != addr)
+	*(int *) (ptr + offset[i]) = new_addr;
+    }
+  offset += page->nr_highlow;
+  for (i = 0; i < page->nr_high; i++)
     {
-      sec++;
-      sec_cnt--;
+      size_t addr = HIWORD (*(short *) (ptr + offset[i]));
+      size_t new_addr = low_address (map, mod, &last, addr);
+
+      if (new_addr != addr)
+	*(short *) (ptr + offset[i]) = HIWORD (new_addr);
     }
-  while (sec_cnt > 0 && SECTION_IS_LOW (&sec[sec_cnt - 1]))
-    sec_cnt--;
-  
-  while (count--)
+  offset += page->nr_high;
+  for (i = 0; i < page->nr_low; i++)
+    {
+      size_t addr = LOWORD (*(short *) (ptr + offset[i]));
+      size_t new_addr = low_address (map, mod, &last, addr);
+
+      if (new_addr != addr)
+	*(short *) (ptr + offset[i]) = LOWORD (new_addr);
+    }
+}
+
+
+/* Rewrite the COUNT fixups RELOCS of the relocation block for the
+   page at PAGE of the module MOD that point into low sections.  This
+   is for images whose relocations can not be indexed.  */
+static void
+LowLdrProcessRelocationBlock (struct himemce_map *map,
+			      struct himemce_module *mod, char *page,
+			      UINT count, const USHORT *relocs)
+{
+  struct himemce_low_section *last = NULL;
+
+  for (; count--; relocs++)
     {
       USHORT offset = *relocs & 0xfff;
       int type = *relocs >> 12;
       size_t addr;
-      size_t old_addr;
-      size_t off;
+      size_t new_addr;
 
-      switch(type)
-        {
-        case IMAGE_REL_BASED_ABSOLUTE:
-	  goto nextreloc;
-        case IMAGE_REL_BASED_HIGH:
-	  addr = HIWORD (*(short *)((char *)page + offset));
+      switch (type)
+	{
+	case IMAGE_REL_BASED_ABSOLUTE:
 	  break;
-        case IMAGE_REL_BASED_LOW:
-	  addr = LOWORD (*(short *)((char *)page + offset));
+	case IMAGE_REL_BASED_HIGH:
+	  addr = HIWORD (*(short *) (page + offset));
+	  new_addr = low_address (map, mod, &last, addr);
+	  if (new_addr != addr)
+	    *(short *) (page + offset) = HIWORD (new_addr);
 	  break;
-        case IMAGE_REL_BASED_HIGHLOW:
-	  addr = *(int *)((char *)page + offset);
+	case IMAGE_REL_BASED_LOW:
+	  addr = LOWORD (*(short *) (page + offset));
+	  new_addr = low_address (map, mod, &last, addr);
+	  if (new_addr != addr)
+	    *(short *) (page + offset) = LOWORD (new_addr);
+	  break;
+	case IMAGE_REL_BASED_HIGHLOW:
+	  addr = *(int *) (page + offset);
+	  new_addr = low_address (map, mod, &last, addr);
+	  if (new_addr != addr)
+	    *(int *) (page + offset) = new_addr;
+	  break;
+	default:
+	  ERR ("unknown/unsupported fixup type %x at %p\n", type,
+	       page + offset);
 	  break;
-        default:
-	  TRACE("Unknown/unsupported fixup type %x.\n", type);
-	  goto nextreloc;
-        }
-
-      if ((void *) addr < base)
-	{
-	  ERR ("ignoring relocation that points below image");
-	  goto nextreloc;
 	}
-      off = ((char *) addr) - ((char *) base);
+    }
+}
 
-      /* Check if ADDR points into a rw segment.  First check the
-	 cached index.  */
-      if (idx < sec_cnt)
-	{
-	  if (off >= sec[idx].VirtualAddress
-	      && off < sec[idx].VirtualAddress + section_size (&sec[idx]))
-	    ; /* Found it.  */
-	  else
-	    idx = sec_cnt;
-	}
-      if (idx == sec_cnt)
-	{
-	  for (idx = 0; idx < sec_cnt; idx++)
-	    {
-	      if (! sec[idx].PointerToLinenumbers)
-		continue;
-	      if (off >= sec[idx].VirtualAddress
-		  && off < sec[idx].VirtualAddress + section_size (&sec[idx]))
-		break;
-	    }
-	  if (idx == sec_cnt)
-	    goto nextreloc;
-	}
-      old_addr = addr;
-      addr = sec[idx].PointerToLinenumbers + (off - sec[idx].VirtualAddress);
 
-#if 0
-      TRACE ("rewriting relocation at %p to rw section from %p to %p\n",
-	     ((char *)page + offset), old_addr, addr);
-#endif
+/* Record the low sections of MOD in its section table, sorted by
+   RVA.  */
+static int
+add_low_sections (struct himemce_map *map, struct himemce_module *mod,
+		  IMAGE_SECTION_HEADER *sec, int sec_cnt)
+{
+  struct himemce_low_section *low;
+  char *end;
+  int nr = 0;
+  int i;
 
-      switch(type)
-        {
-        case IMAGE_REL_BASED_HIGH:
-	  *(short *)((char *)page + offset) = HIWORD(addr);
-	  break;
-        case IMAGE_REL_BASED_LOW:
-	  *(short *)((char *)page + offset) = LOWORD(addr);
-	  break;
-        case IMAGE_REL_BASED_HIGHLOW:
-	  *(int *)((char *)page + offset) = addr;
-	  break;
-        }
-    nextreloc:
-      relocs++;
+  for (i = 0; i < sec_cnt; i++)
+    if (sec[i].PointerToLinenumbers)
+      nr++;
+  mod->nr_low_sections = 0;
+  mod->low_sections = 0;
+  mod->low = NULL;
+  mod->low_size = 0;
+  if (! nr)
+    return 1;
+  low = map_alloc (map, nr * sizeof (*low));
+  if (! low)
+    return 0;
+
+  /* Section headers are sorted already, almost always.  */
+  nr = 0;
+  for (i = 0; i < sec_cnt; i++)
+    {
+      int j;
+
+      if (! sec[i].PointerToLinenumbers)
+	continue;
+      for (j = nr; j > 0 && low[j - 1].rva > sec[i].VirtualAddress; j--)
+	low[j] = low[j - 1];
+      low[j].rva = sec[i].VirtualAddress;
+      low[j].size = section_size (&sec[i]);
+      low[j].init_size = section_init_size (&sec[i]);
+      low[j].low = (char *) sec[i].PointerToLinenumbers;
+      nr++;
     }
-  return (IMAGE_BASE_RELOCATION *)relocs;  /* return address of next block */
+  mod->nr_low_sections = nr;
+  mod->low_sections = himemce_map_ref (map, low);
+
+  /* The range the loader reserves for the module.  */
+  mod->low = low[0].low;
+  end = low[0].low + low[0].size;
+  for (i = 1; i < nr; i++)
+    {
+      if (low[i].low < mod->low)
+	mod->low = low[i].low;
+      if (low[i].low + low[i].size > end)
+	end = low[i].low + low[i].size;
+    }
+  mod->low_size = end - mod->low;
+  return 1;
 }
 
 
+/* Reserve low memory for the writable sections of MOD.  */
 static void
-relocate_rw_sections (struct himemce_map *map, void *base)
+place_low_sections (struct himemce_map *map, struct himemce_module *mod)
 {
   char *ptr;
   IMAGE_DOS_HEADER *dos;
   IMAGE_NT_HEADERS *nt;
   IMAGE_SECTION_HEADER *sec;
   int i;
-  IMAGE_BASE_RELOCATION *rel, *end;
-  const IMAGE_DATA_DIRECTORY *relocs;
 
-  TRACE ("adjusting rw sections at %p\n", base);
-
-  ptr = base;
+  ptr = mod->base;
   dos = (IMAGE_DOS_HEADER *) ptr;
   nt = (IMAGE_NT_HEADERS *) (ptr + dos->e_lfanew);
   sec = (IMAGE_SECTION_HEADER *) ((char*) &nt->OptionalHeader
@@ -324,12 +372,7 @@ relocate_rw_sections (struct himemce_map *map, void *base)
     {
       if (SECTION_IS_LOW (sec))
 	{
-	  SIZE_T map_size;
-
-	  if (! sec->Misc.VirtualSize)
-	    map_size = ROUND_SIZE (sec->SizeOfRawData);
-	  else
-	    map_size = ROUND_SIZE (sec->Misc.VirtualSize);
+	  SIZE_T map_size = section_size (sec);
 
 	  sec->PointerToLinenumbers = (DWORD) map_reserve_low (map, map_size);
 
@@ -342,51 +385,221 @@ relocate_rw_sections (struct himemce_map *map, void *base)
       else
 	sec->PointerToLinenumbers = 0;
     }
+  sec -= nt->FileHeader.NumberOfSections;
+  if (! add_low_sections (map, mod, sec, nt->FileHeader.NumberOfSections))
+    {
+      ERR ("can not record low sections of %p\n", mod->base);
+      exit (1);
+    }
+}
+
+
+/* Show how well the writable sections are packed into low
+   memory.  */
+static void
+report_low_packing (struct himemce_map *map)
+{
+  unsigned int used = 0;
+  int nr = 0;
+  int i;
+  int j;
+
+  for (i = 0; i < map->nr_modules; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (map, i);
+      struct himemce_low_section *low = himemce_module_low_sections (map,
+								     mod);
+
+      for (j = 0; j < mod->nr_low_sections; j++)
+	used += low[j].size;
+      nr += mod->nr_low_sections;
+    }
+  if (map->low_size)
+    TRACE ("packed %i sections of 0x%x bytes into 0x%x bytes of low "
+	   "memory (%u%%)\n", nr, used, map->low_size,
+	   used * 100 / map->low_size);
+}
+
+
+/* Adjust the relocations of MOD that point into its writable
+   sections to their low addresses.  */
+static void
+relocate_rw_sections (struct himemce_map *map, struct himemce_module *mod)
+{
+  char *ptr = mod->base;
+  IMAGE_NT_HEADERS *nt = MyRtlImageNtHeader (mod->base);
+  const IMAGE_DATA_DIRECTORY *dir;
+  struct himemce_relocs *relocs;
+  DWORD page;
+
+  if (! mod->nr_low_sections)
+    return;
+
+  TRACE ("adjusting rw sections at %p\n", mod->base);
 
   /* Perform base relocations pointing into low sections.  Before
      that, these relocations point into the high mem address.  */
 
-  relocs = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
-  rel = (IMAGE_BASE_RELOCATION *)(ptr + relocs->VirtualAddress);
-  end = (IMAGE_BASE_RELOCATION *)(ptr + relocs->VirtualAddress + relocs->Size);
-  
-  while (rel < end - 1 && rel->SizeOfBlock)
+  dir = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
+  if (! dir->VirtualAddress || ! dir->Size)
+    return;
+  relocs = himemce_relocs_build (ptr + dir->VirtualAddress, dir->Size,
+				 nt->OptionalHeader.SizeOfImage);
+  if (! relocs)
     {
-      rel = LowLdrProcessRelocationBlock
-	(base, ptr + rel->VirtualAddress,
-	 (rel->SizeOfBlock - sizeof (*rel)) / sizeof (USHORT),
-	 (USHORT *)(rel + 1));
+      IMAGE_BASE_RELOCATION *rel;
+      IMAGE_BASE_RELOCATION *end;
+
+      /* Walk the blocks instead, so that no fixup is left pointing
+	 to the shared high copy.  */
+      TRACE ("can not index relocations of %p, walking them\n", mod->base);
+      rel = (IMAGE_BASE_RELOCATION *) (ptr + dir->VirtualAddress);
+      end = (IMAGE_BASE_RELOCATION *) (ptr + dir->VirtualAddress
+				       + dir->Size);
+      while (rel < end - 1 && rel->SizeOfBlock >= sizeof (*rel)
+	     && rel->SizeOfBlock <= (char *) end - (char *) rel)
+	{
+	  if (rel->VirtualAddress < nt->OptionalHeader.SizeOfImage)
+	    LowLdrProcessRelocationBlock
+	      (map, mod, ptr + rel->VirtualAddress,
+	       (rel->SizeOfBlock - sizeof (*rel)) / sizeof (USHORT),
+	       (USHORT *) (rel + 1));
+	  rel = (IMAGE_BASE_RELOCATION *) ((char *) rel + rel->SizeOfBlock);
+	}
+      if (rel < end - 1 && rel->SizeOfBlock)
+	{
+	  ERR ("malformed relocation block at %p\n", rel);
+	  exit (1);
+	}
+      return;
     }
+  for (page = 0; page < relocs->nr_pages; page++)
+    LowLdrProcessRelocationPage (map, mod, relocs, &relocs->page[page]);
+  free (relocs);
 }
 
 
-/* convert PE image VirtualAddress to Real Address */
-static void *
-get_rva (HMODULE module, DWORD va)
+/* Build the index of the exported names of MOD in the map.  Modules
+   whose index does not fit into the map do without.  */
+static void
+index_exports (struct himemce_map *map, struct himemce_module *mod)
 {
-  return (void *) ((char *) module + va);
+  const IMAGE_EXPORT_DIRECTORY *exports;
+  DWORD exp_size;
+  size_t size;
+  struct himemce_export_index *index;
+
+  mod->exports = 0;
+  exports = MyRtlImageDirectoryEntryToData (mod->base, TRUE,
+					    IMAGE_DIRECTORY_ENTRY_EXPORT,
+					    &exp_size);
+  if (! exports || ! exports->NumberOfNames)
+    return;
+  size = himemce_map_export_index_size (exports->NumberOfNames);
+  if (! size)
+    return;
+  index = map_alloc (map, size);
+  if (! index)
+    {
+      TRACE ("no room to index %i exports of %s\n", exports->NumberOfNames,
+	     himemce_module_name (map, mod));
+      return;
+    }
+  himemce_map_build_export_index (index, mod->base,
+				  (const unsigned int *)
+				  ((char *) mod->base
+				   + exports->AddressOfNames),
+				  exports->NumberOfNames);
+  mod->exports = himemce_map_ref (map, index);
 }
 
 
-/* convert from straight ASCII to Unicode without depending on the
-   current codepage */
+/* Decommit the parts of MOD that are not needed anymore, and record
+   them in the map.  */
 static void
-ascii_to_unicode (WCHAR *dst, const char *src, size_t len)
+discard_sections (struct himemce_map *map, struct himemce_module *mod)
+{
+  struct himemce_discarded ranges[HIMEMCE_MAX_DISCARDED];
+  struct himemce_discarded *discarded;
+  int nr;
+
+  mod->nr_discarded = 0;
+  mod->discarded = 0;
+  nr = virtual_discard_image (mod->base, ranges, HIMEMCE_MAX_DISCARDED);
+  if (! nr)
+    return;
+  discarded = map_alloc (map, nr * sizeof (ranges[0]));
+  if (! discarded)
+    return;
+  memcpy (discarded, ranges, nr * sizeof (ranges[0]));
+  mod->discarded = himemce_map_ref (map, discarded);
+  mod->nr_discarded = nr;
+}
+
+
+static unsigned int
+hash_bytes (unsigned int hash, const void *data, size_t len)
 {
+  const unsigned char *ptr = data;
+
   while (len--)
-    *dst++ = (unsigned char) *src++;
+    hash = (hash ^ *ptr++) * 16777619U;
+  return hash;
 }
 
 
-#define allocate_stub(x,y) ((void *)0xdeadbeef)
+/* Set the generation of MAP from the modules in it, their headers
+   and where they and their read-write sections are.  */
+static void
+stamp_map (struct himemce_map *map)
+{
+  unsigned int hash = 2166136261U;
+  int i;
+  int j;
+
+  hash = hash_bytes (hash, &map->low_start, sizeof (map->low_start));
+  for (i = 0; i < map->nr_modules; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (map, i);
+      IMAGE_NT_HEADERS *nt = MyRtlImageNtHeader (mod->base);
+      struct himemce_low_section *low = himemce_module_low_sections (map,
+								     mod);
+
+      hash = hash_bytes (hash, himemce_module_name (map, mod), mod->name_len);
+      hash = hash_bytes (hash, &mod->base, sizeof (mod->base));
+      hash = hash_bytes (hash, &nt->FileHeader.TimeDateStamp,
+			 sizeof (nt->FileHeader.TimeDateStamp));
+      hash = hash_bytes (hash, &nt->OptionalHeader.CheckSum,
+			 sizeof (nt->OptionalHeader.CheckSum));
+      hash = hash_bytes (hash, &nt->OptionalHeader.SizeOfImage,
+			 sizeof (nt->OptionalHeader.SizeOfImage));
+      for (j = 0; j < mod->nr_low_sections; j++)
+	hash = hash_bytes (hash, &low[j], sizeof (low[j]));
+    }
+  map->generation = hash ? hash : 1;
+}
+
+
+/* convert PE image VirtualAddress to Real Address */
+static void *
+get_rva (HMODULE module, DWORD va)
+{
+  return (void *) ((char *) module + va);
+}
+
+
+static FARPROC find_forwarded_export (struct himemce_map *map,
+				      const char *forward);
 
 
 static FARPROC
-find_ordinal_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
+find_ordinal_export (struct himemce_map *map, struct himemce_module *mod,
+		     const IMAGE_EXPORT_DIRECTORY *exports,
 		     DWORD exp_size, DWORD ordinal)
 {
   FARPROC proc;
-  const DWORD *functions = get_rva (module, exports->AddressOfFunctions);
+  const DWORD *functions = get_rva (mod->base, exports->AddressOfFunctions);
+  DWORD exp_rva = (const char *) exports - (const char *) mod->base;
   
   if (ordinal >= exports->NumberOfFunctions)
     {
@@ -395,22 +608,30 @@ find_ordinal_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
     }
   if (!functions[ordinal]) return NULL;
   
-#if 0
   /* if the address falls into the export dir, it's a forward */
-  if (((const char *)proc >= (const char *)exports) && 
-      ((const char *)proc < (const char *)exports + exp_size))
-    return find_forwarded_export( module, (const char *)proc, load_path );
-#endif
+  if (functions[ordinal] >= exp_rva
+      && functions[ordinal] < exp_rva + exp_size)
+    {
+      struct himemce_forward *fwd = himemce_map_find_forward (map, mod,
+							      ordinal);
 
-  proc = get_rva_low (module, functions[ordinal]);
+      if (fwd)
+	return fwd->target;
+      return find_forwarded_export (map, get_rva (mod->base,
+						  functions[ordinal]));
+    }
+
+  proc = get_rva_low (map, mod, functions[ordinal]);
   return proc;
 }
 
 
 static FARPROC
-find_named_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
+find_named_export (struct himemce_map *map, struct himemce_module *mod,
+		   const IMAGE_EXPORT_DIRECTORY *exports,
 		   DWORD exp_size, const char *name, int hint)
 {
+  void *module = mod->base;
   const WORD *ordinals = get_rva (module, exports->AddressOfNameOrdinals);
   const DWORD *names = get_rva (module, exports->AddressOfNames);
   int min = 0, max = exports->NumberOfNames - 1;
@@ -420,16 +641,27 @@ find_named_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
     {
       char *ename = get_rva( module, names[hint] );
       if (!strcmp( ename, name ))
-	return find_ordinal_export( module, exports, exp_size, ordinals[hint]);
+	return find_ordinal_export( map, mod, exports, exp_size, ordinals[hint]);
     }
 
-  /* then do a binary search */
+  /* then look it up in the index */
+  if (mod->exports)
+    {
+      int pos = himemce_map_find_export (himemce_module_exports (map, mod),
+					 module, name);
+
+      if (pos < 0)
+	return NULL;
+      return find_ordinal_export (map, mod, exports, exp_size, ordinals[pos]);
+    }
+
+  /* or do a binary search */
   while (min <= max)
     {
       int res, pos = (min + max) / 2;
       char *ename = get_rva( module, names[pos] );
       if (!(res = strcmp( ename, name )))
-	return find_ordinal_export( module, exports, exp_size, ordinals[pos]);
+	return find_ordinal_export( map, mod, exports, exp_size, ordinals[pos]);
       if (res > 0) max = pos - 1;
       else min = pos + 1;
     }
@@ -437,6 +669,365 @@ find_named_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
 }
 
 
+/* Forward chains longer than this are taken to be loops.  */
+#define MAX_FORWARD_DEPTH 16
+
+/* Resolve the forward string FORWARD to the address at the end of its
+   chain.  DLLs that are not in the map are loaded by the system
+   loader, which puts them at the same address in every process.  */
+static FARPROC
+find_forwarded_export (struct himemce_map *map, const char *forward)
+{
+  static int depth;
+  struct himemce_module *mod;
+  const IMAGE_EXPORT_DIRECTORY *exports;
+  DWORD exp_size;
+  char name[MAX_PATH];
+  const char *symbol;
+  FARPROC proc = NULL;
+
+  symbol = himemce_map_forward_dll (forward, name, sizeof (name));
+  if (! symbol)
+    {
+      ERR ("invalid forward %s\n", forward);
+      return NULL;
+    }
+  if (depth >= MAX_FORWARD_DEPTH)
+    {
+      ERR ("forward loop at %s\n", forward);
+      return NULL;
+    }
+  depth++;
+
+  mod = himemce_map_find_module (map, name);
+  if (mod)
+    {
+      exports = MyRtlImageDirectoryEntryToData (mod->base, TRUE,
+						IMAGE_DIRECTORY_ENTRY_EXPORT,
+						&exp_size);
+      if (! exports)
+	;
+      else if (symbol[0] == '#')
+	proc = find_ordinal_export (map, mod, exports, exp_size,
+				    atoi (symbol + 1) - exports->Base);
+      else
+	proc = find_named_export (map, mod, exports, exp_size, symbol, -1);
+    }
+  else
+    {
+      HMODULE imp_mod = himemce_dll_load (name, strlen (name));
+
+      if (imp_mod && symbol[0] == '#')
+	proc = himemce_dll_proc (imp_mod,
+				 (const char *) (ULONG_PTR) atoi (symbol + 1));
+      else if (imp_mod)
+	proc = himemce_dll_proc (imp_mod, symbol);
+    }
+  TRACE ("--- forward %s = %p\n", forward, proc);
+
+  depth--;
+  return proc;
+}
+
+
+/* Resolve the forwarded exports of MOD, and keep them in the map for
+   the loader.  */
+static void
+resolve_forwards (struct himemce_map *map, struct himemce_module *mod)
+{
+  const IMAGE_EXPORT_DIRECTORY *exports;
+  const DWORD *functions;
+  DWORD exp_size;
+  DWORD exp_rva;
+  DWORD i;
+  int nr = 0;
+  struct himemce_forward *forwards;
+
+  mod->nr_forwards = 0;
+  mod->forwards = 0;
+  exports = MyRtlImageDirectoryEntryToData (mod->base, TRUE,
+					    IMAGE_DIRECTORY_ENTRY_EXPORT,
+					    &exp_size);
+  if (! exports)
+    return;
+  functions = get_rva (mod->base, exports->AddressOfFunctions);
+  exp_rva = (const char *) exports - (const char *) mod->base;
+
+  for (i = 0; i < exports->NumberOfFunctions; i++)
+    if (functions[i] >= exp_rva && functions[i] < exp_rva + exp_size)
+      nr++;
+  if (! nr)
+    return;
+  forwards = map_alloc (map, nr * sizeof (*forwards));
+  if (! forwards)
+    {
+      TRACE ("no room for %i forwarded exports of %s\n", nr,
+	     himemce_module_name (map, mod));
+      return;
+    }
+  mod->forwards = himemce_map_ref (map, forwards);
+
+  /* The table is only used once it is complete, so that loops are
+     caught by find_forwarded_export.  */
+  nr = 0;
+  for (i = 0; i < exports->NumberOfFunctions; i++)
+    if (functions[i] >= exp_rva && functions[i] < exp_rva + exp_size)
+      {
+	struct himemce_forward *fwd = &forwards[nr++];
+
+	fwd->ordinal = i;
+	fwd->forward = functions[i];
+	fwd->target = find_forwarded_export (map, get_rva (mod->base,
+							   functions[i]));
+	if (! fwd->target)
+	  ERR ("can not resolve %s.%i, forwarded to %s\n",
+	       himemce_module_name (map, mod), i + exports->Base,
+	       (char *) get_rva (mod->base, functions[i]));
+      }
+  mod->nr_forwards = nr;
+}
+
+
+/* The dependencies of a module while the plan is made.  */
+struct plan_deps
+{
+  int nr_deps;
+  unsigned int *deps;
+  int nr_sys_dlls;
+  int max_sys_dlls;
+  himemce_map_ref_t *sys_dlls;
+};
+
+
+/* Add the DLL NAME of LEN bytes to DEPS, unless it is there already
+   or is MOD itself.  */
+static int
+plan_add_dep (struct himemce_map *map, struct himemce_module *mod,
+	      struct plan_deps *deps, const char *name, size_t len)
+{
+  struct himemce_module *dep;
+  char buf[MAX_PATH];
+  char *sys_dll;
+  int i;
+
+  dep = himemce_map_find_module_n (map, name, len);
+  if (dep)
+    {
+      unsigned int idx = dep->index;
+
+      if (dep == mod)
+	return 1;
+      for (i = 0; i < deps->nr_deps; i++)
+	if (deps->deps[i] == idx)
+	  return 1;
+      deps->deps[deps->nr_deps++] = idx;
+      return 1;
+    }
+
+  if (len >= sizeof (buf))
+    return 1;
+  memcpy (buf, name, len);
+  buf[len] = '\0';
+  for (i = 0; i < deps->nr_sys_dlls; i++)
+    if (! _stricmp (himemce_map_str (map, deps->sys_dlls[i]), buf))
+      return 1;
+  if (deps->nr_sys_dlls == deps->max_sys_dlls)
+    return 1;
+  sys_dll = map_alloc (map, len + 1);
+  if (! sys_dll)
+    return 0;
+  strcpy (sys_dll, buf);
+  deps->sys_dlls[deps->nr_sys_dlls++] = himemce_map_ref (map, sys_dll);
+  return 1;
+}
+
+
+/* Record in MOD the DLLs it imports or forwards to.  Delay loaded
+   DLLs are not dependencies.  */
+static int
+plan_module (struct himemce_map *map, struct himemce_module *mod)
+{
+  struct plan_deps deps;
+  const IMAGE_IMPORT_DESCRIPTOR *imports;
+  const IMAGE_EXPORT_DIRECTORY *exports;
+  const DWORD *functions = NULL;
+  DWORD exp_rva = 0;
+  DWORD exp_size = 0;
+  unsigned int *list;
+  himemce_map_ref_t *sys_dlls;
+  DWORD size;
+  int nr_imports = 0;
+  int nr_forwards = 0;
+  DWORD i;
+  int ok = 1;
+
+  imports = MyRtlImageDirectoryEntryToData (mod->base, TRUE,
+					    IMAGE_DIRECTORY_ENTRY_IMPORT,
+					    &size);
+  if (imports)
+    while (imports[nr_imports].Name && imports[nr_imports].FirstThunk)
+      nr_imports++;
+
+  /* The forwarded exports are taken from the export directory, as the
+     plan is made before they are resolved.  */
+  exports = MyRtlImageDirectoryEntryToData (mod->base, TRUE,
+					    IMAGE_DIRECTORY_ENTRY_EXPORT,
+					    &exp_size);
+  if (exports)
+    {
+      functions = get_rva (mod->base, exports->AddressOfFunctions);
+      exp_rva = (const char *) exports - (const char *) mod->base;
+      for (i = 0; i < exports->NumberOfFunctions; i++)
+	if (functions[i] >= exp_rva && functions[i] < exp_rva + exp_size)
+	  nr_forwards++;
+    }
+
+  /* A module can depend on every other one.  */
+  deps.nr_deps = 0;
+  deps.deps = malloc (map->nr_modules * sizeof (*deps.deps));
+  if (! deps.deps)
+    return 0;
+  deps.nr_sys_dlls = 0;
+  deps.max_sys_dlls = nr_imports + nr_forwards;
+  deps.sys_dlls = NULL;
+  if (deps.max_sys_dlls)
+    {
+      deps.sys_dlls = malloc (deps.max_sys_dlls * sizeof (*deps.sys_dlls));
+      if (! deps.sys_dlls)
+	{
+	  free (deps.deps);
+	  return 0;
+	}
+    }
+
+  for (i = 0; ok && i < (DWORD) nr_imports; i++)
+    {
+      const char *name = get_rva (mod->base, imports[i].Name);
+      size_t len = strlen (name);
+
+      while (len && name[len - 1] == ' ')
+	len--;
+      ok = plan_add_dep (map, mod, &deps, name, len);
+    }
+  for (i = 0; ok && nr_forwards && i < exports->NumberOfFunctions; i++)
+    {
+      char name[MAX_PATH];
+
+      if (functions[i] >= exp_rva && functions[i] < exp_rva + exp_size
+	  && himemce_map_forward_dll (get_rva (mod->base, functions[i]),
+				      name, sizeof (name)))
+	ok = plan_add_dep (map, mod, &deps, name, strlen (name));
+    }
+
+  if (ok && deps.nr_deps)
+    {
+      list = map_alloc (map, deps.nr_deps * sizeof (*list));
+      if (list)
+	{
+	  memcpy (list, deps.deps, deps.nr_deps * sizeof (*list));
+	  mod->deps = himemce_map_ref (map, list);
+	  mod->nr_deps = deps.nr_deps;
+	}
+      else
+	ok = 0;
+    }
+  if (ok && deps.nr_sys_dlls)
+    {
+      sys_dlls = map_alloc (map, deps.nr_sys_dlls * sizeof (*sys_dlls));
+      if (sys_dlls)
+	{
+	  memcpy (sys_dlls, deps.sys_dlls,
+		  deps.nr_sys_dlls * sizeof (*sys_dlls));
+	  mod->sys_dlls = himemce_map_ref (map, sys_dlls);
+	  mod->nr_sys_dlls = deps.nr_sys_dlls;
+	}
+      else
+	ok = 0;
+    }
+  free (deps.deps);
+  free (deps.sys_dlls);
+  return ok;
+}
+
+
+/* Append IDX and the modules it depends on that are not in VISITED
+   yet to ORDER, dependencies first.  */
+static void
+plan_visit (struct himemce_map *map, int idx, char *visited,
+	    unsigned int *order, int *nr)
+{
+  struct himemce_module *mod = himemce_map_module (map, idx);
+  unsigned int *deps = himemce_module_deps (map, mod);
+  int i;
+
+  if (visited[idx])
+    return;
+  visited[idx] = 1;
+  for (i = 0; i < mod->nr_deps; i++)
+    plan_visit (map, deps[i], visited, order, nr);
+  order[(*nr)++] = idx;
+}
+
+
+/* Compute the dependencies of all modules in MAP, the modules each
+   of them needs in load order, and the load order of all modules, so
+   that processes can load modules without looking at their
+   imports.  */
+static int
+plan_loads (struct himemce_map *map)
+{
+  char *visited;
+  unsigned int *order;
+  unsigned int *list;
+  int nr;
+  int i;
+  int ok = 0;
+
+  for (i = 0; i < map->nr_modules; i++)
+    if (! plan_module (map, himemce_map_module (map, i)))
+      return 0;
+
+  visited = malloc (map->nr_modules);
+  order = malloc (map->nr_modules * sizeof (*order));
+  if (! visited || ! order)
+    goto out;
+
+  for (i = 0; i < map->nr_modules; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (map, i);
+
+      memset (visited, 0, map->nr_modules);
+      nr = 0;
+      plan_visit (map, i, visited, order, &nr);
+      list = map_alloc (map, nr * sizeof (*list));
+      if (! list)
+	goto out;
+      memcpy (list, order, nr * sizeof (*list));
+      mod->closure = himemce_map_ref (map, list);
+      mod->nr_closure = nr;
+      TRACE ("%s: %i dependencies, %i system DLLs, loads %i modules\n",
+	     himemce_module_name (map, mod), mod->nr_deps, mod->nr_sys_dlls,
+	     mod->nr_closure);
+    }
+
+  memset (visited, 0, map->nr_modules);
+  nr = 0;
+  for (i = 0; i < map->nr_modules; i++)
+    plan_visit (map, i, visited, order, &nr);
+  list = map_alloc_segment (map, HIMEMCE_MAP_SEG_INDEX, nr * sizeof (*list));
+  if (! list)
+    goto out;
+  memcpy (list, order, nr * sizeof (*list));
+  map->load_order = himemce_map_ref (map, list);
+  ok = 1;
+
+ out:
+  free (visited);
+  free (order);
+  return ok;
+}
+
+
 /*************************************************************************
  *              import_dll
  *
@@ -453,10 +1044,10 @@ import_dll (struct himemce_map *map, HMODULE module,
   const IMAGE_THUNK_DATA *import_list;
   IMAGE_THUNK_DATA *thunk_list;
   void *imp_base = 0;
+  struct himemce_module *imp_map_mod = NULL;
   HMODULE imp_mod = 0;
   const IMAGE_EXPORT_DIRECTORY *exports;
   DWORD exp_size;
-  WCHAR buffer[32];
   int i;
 
   thunk_list = get_rva (module, (DWORD)descr->FirstThunk);
@@ -468,34 +1059,17 @@ import_dll (struct himemce_map *map, HMODULE module,
   while (len && name[len-1] == ' ') len--;  /* remove trailing spaces */
 
   /* First check for the modules in the map.  */
-  for (i = 0; i < map->nr_modules; i++)
-    {
-      if (! strncmp (name, map->module[i].name, len))
-	break;
-    }
-  if (i < map->nr_modules)
+  imp_map_mod = himemce_map_find_module_n (map, name, len);
+  if (imp_map_mod)
     {
-      imp_base = map->module[i].base;
+      imp_base = imp_map_mod->base;
       TRACE("Loading library %s internal\n", name);
     }
-  else if (len * sizeof(WCHAR) < sizeof(buffer))
-    {
-      ascii_to_unicode( buffer, name, len );
-      buffer[len] = 0;
-      imp_mod = LoadLibrary (buffer);
-      if (imp_mod == INVALID_HANDLE_VALUE)
-	status = GetLastError ();
-    }
   else
     {
-      WCHAR *ptr = malloc ((len + 1) * sizeof(WCHAR) );
-      if (!ptr) return NULL;
-      ascii_to_unicode( ptr, name, len );
-      ptr[len] = 0;
-      imp_mod = LoadLibrary (ptr);
-      if (imp_mod == INVALID_HANDLE_VALUE)
+      imp_mod = himemce_dll_load (name, len);
+      if (! imp_mod)
 	status = GetLastError ();
-      free (ptr);
     }
   if (status)
     {
@@ -513,23 +1087,24 @@ import_dll (struct himemce_map *map, HMODULE module,
 						&exp_size);
       if (!exports)
 	{
-	  /* set all imported function to deadbeef */
+	  /* bind all imported functions to stubs */
 	  while (import_list->u1.Ordinal)
 	    {
 	      if (IMAGE_SNAP_BY_ORDINAL(import_list->u1.Ordinal))
 		{
 		  int ordinal = IMAGE_ORDINAL(import_list->u1.Ordinal);
-		  TRACE ("No implementation for %s.%d", name, ordinal);
+		  ERR ("No implementation for %s.%d\n", name, ordinal);
 		  thunk_list->u1.Function
-		    = (PDWORD) allocate_stub (name, IntToPtr (ordinal));
+		    = (PDWORD) himemce_stub_missing (name, IntToPtr (ordinal));
 		}
 	      else
 		{
 		  IMAGE_IMPORT_BY_NAME *pe_name
 		    = get_rva (module, (DWORD) import_list->u1.AddressOfData);
-		  TRACE ("No implementation for %s.%s", name, pe_name->Name);
+		  ERR ("No implementation for %s.%s\n", name, pe_name->Name);
 		  thunk_list->u1.Function
-		    = (PDWORD) allocate_stub (name, (const char*) pe_name->Name);
+		    = (PDWORD) himemce_stub_missing (name,
+						     (const char*) pe_name->Name);
 		}
 	      import_list++;
 	      thunk_list++;
@@ -546,15 +1121,16 @@ import_dll (struct himemce_map *map, HMODULE module,
 
 	  if (imp_base)
 	    thunk_list->u1.Function = (PDWORD)(ULONG_PTR)
-	      find_ordinal_export (imp_base, exports, exp_size,
+	      find_ordinal_export (map, imp_map_mod, exports, exp_size,
 				   ordinal - exports->Base);
 	  else
 	    thunk_list->u1.Function = (PDWORD)(ULONG_PTR)
-	      GetProcAddress (imp_mod, (void *) (ordinal & 0xffff));
+	      himemce_dll_proc (imp_mod, (void *) (ordinal & 0xffff));
 	  if (!thunk_list->u1.Function)
             {
-	      thunk_list->u1.Function = (PDWORD) allocate_stub( name, IntToPtr(ordinal) );
-	      TRACE("No implementation for %s.%d imported, setting to %p\n",
+	      thunk_list->u1.Function
+		= (PDWORD) himemce_stub_missing (name, IntToPtr (ordinal));
+	      ERR ("No implementation for %s.%d imported, setting to %p\n",
 		    name, ordinal,
 		    (void *)thunk_list->u1.Function );
             }
@@ -566,16 +1142,16 @@ import_dll (struct himemce_map *map, HMODULE module,
 	  pe_name = get_rva( module, (DWORD)import_list->u1.AddressOfData );
 	  if (imp_base)
 	    thunk_list->u1.Function = (PDWORD)(ULONG_PTR)
-	      find_named_export (imp_base, exports, exp_size,
+	      find_named_export (map, imp_map_mod, exports, exp_size,
 				 (const char*)pe_name->Name, pe_name->Hint);
 	  else
 	    thunk_list->u1.Function = (PDWORD)(ULONG_PTR)
-	      GetProcAddressA (imp_mod, (const char*)pe_name->Name);
+	      himemce_dll_proc (imp_mod, (const char*)pe_name->Name);
 	  if (!thunk_list->u1.Function)
             {
 	      thunk_list->u1.Function
-		= (PDWORD) allocate_stub (name, (const char*)pe_name->Name);
-	      TRACE ("No implementation for %s.%s imported, setting to %p\n",
+		= (PDWORD) himemce_stub_missing (name, (const char*)pe_name->Name);
+	      ERR ("No implementation for %s.%s imported, setting to %p\n",
 		     name, pe_name->Name, (void *)thunk_list->u1.Function);
             }
 	  TRACE("--- %s %s.%d = %p\n",
@@ -621,10 +1197,57 @@ fixup_imports (struct himemce_map *map, void *base)
 }
 
 
+/* Bind the delay loaded imports of the module at BASE from DLLs in
+   the map right away, as these are loaded anyway.  Those from other
+   DLLs are left to the delay load helper linked into the image, which
+   uses the system loader in the process that calls them.  */
+static void
+fixup_delay_imports (struct himemce_map *map, void *base)
+{
+  const struct himemce_delay_descr *descr;
+  DWORD size;
+  int i;
+
+  descr = MyRtlImageDirectoryEntryToData (base, TRUE,
+					  IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT,
+					  &size);
+  if (! descr)
+    return;
+
+  for (i = 0; (i + 1) * sizeof (*descr) <= size
+	 && descr[i].rvaDLLName && descr[i].rvaIAT; i++)
+    {
+      const char *name = get_rva (base, descr[i].rvaDLLName);
+      struct himemce_module *imp_map_mod;
+      IMAGE_IMPORT_DESCRIPTOR imp;
+
+      if (! (descr[i].grAttrs & HIMEMCE_DELAY_RVA) || ! descr[i].rvaINT)
+	continue;
+      imp_map_mod = himemce_map_find_module (map, name);
+      if (! imp_map_mod)
+	{
+	  TRACE ("%s is delay loaded by the system loader\n", name);
+	  continue;
+	}
+
+      memset (&imp, 0, sizeof (imp));
+      imp.OriginalFirstThunk = descr[i].rvaINT;
+      imp.Name = descr[i].rvaDLLName;
+      imp.FirstThunk = descr[i].rvaIAT;
+      if (! import_dll (map, base, &imp))
+	continue;
+      if (descr[i].rvaHmod)
+	*(DWORD *) get_rva (base, descr[i].rvaHmod) = (DWORD) imp_map_mod->base;
+      TRACE ("bound delay loaded imports from %s\n", name);
+    }
+}
+
+
 int
 main (int argc, char *argv[])
 {
   struct himemce_map *map;
+  unsigned int *load_order;
   int result = 0;
   int i;
 
@@ -645,42 +1268,89 @@ main (int argc, char *argv[])
   /* For each module: load it high without resolving references.  */
   for (i = 0; i < map->nr_modules; i++)
     {
-      struct himemce_module *mod = &map->module[i];
-      void *base = MyLoadLibraryExW (mod->filename, 0,
+      struct himemce_module *mod = himemce_map_module (map, i);
+      void *base = MyLoadLibraryExW (himemce_module_filename (map, mod), 0,
 				     DONT_RESOLVE_DLL_REFERENCES);
 
       if (! base)
 	{
-	  ERR ("could not load %S: %i\n", mod->filename, GetLastError());
+	  ERR ("could not load %S: %i\n", himemce_module_filename (map, mod),
+	       GetLastError());
 	  exit (1);
 	}
       mod->base = base;
     }
 
+  /* Export entries are handled at time of import on the other side,
+     when we check for low memory mapped sections and adjust the
+     imported address accordingly.  To make that fast, the export
+     names are indexed once here.  */
+
+  TRACE ("indexing exports...\n");
+
+  for (i = 0; i < map->nr_modules; i++)
+    index_exports (map, himemce_map_module (map, i));
+
+  TRACE ("planning module loads...\n");
+
+  if (! plan_loads (map))
+    {
+      ERR ("could not plan module loads\n");
+      exit (1);
+    }
+
   TRACE ("relocationg writable sections...\n");
 
+  /* Low memory is laid out in load order, so that the modules a
+     process loads together are close, and it reserves little more
+     than it needs.  */
+  load_order = himemce_map_load_order (map);
+  for (i = 0; i < map->nr_modules; i++)
+    place_low_sections (map, himemce_map_module (map, load_order[i]));
+  report_low_packing (map);
+
   for (i = 0; i < map->nr_modules; i++)
     {
-      struct himemce_module *mod = &map->module[i];
+      struct himemce_module *mod = himemce_map_module (map, i);
 
-      /* Allocate low mem for read-write sections and adjust
-	 relocations pointing into them.  */
-      relocate_rw_sections (map, mod->base);
+      /* Adjust relocations pointing into read-write sections.  */
+      relocate_rw_sections (map, mod);
     }
 
-  /* Export entries are handled at time of import on the other side,
-     when we check for low memory mapped sections and adjust the
-     imported address accordingly.  */
+  TRACE ("resolving forwarded exports...\n");
+
+  for (i = 0; i < map->nr_modules; i++)
+    resolve_forwards (map, himemce_map_module (map, i));
 
   TRACE ("resolve module dependencies...\n");
 
   for (i = 0; i < map->nr_modules; i++)
     {
-      struct himemce_module *mod = &map->module[i];
+      struct himemce_module *mod = himemce_map_module (map, i);
 
       /* Fixup imports (this loads all dependencies as well!).  */
       fixup_imports (map, mod->base);
+      fixup_delay_imports (map, mod->base);
     }
+  TRACE ("system DLLs: %lu loaded, %lu cache hits; "
+	 "functions: %lu looked up, %lu cache hits\n",
+	 himemce_dll_stats.dll_loads, himemce_dll_stats.dll_hits,
+	 himemce_dll_stats.proc_lookups, himemce_dll_stats.proc_hits);
+
+  TRACE ("discarding sections...\n");
+
+  for (i = 0; i < map->nr_modules; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (map, i);
+
+      /* The relocations and discardable sections are not needed
+	 anymore.  */
+      discard_sections (map, mod);
+    }
+
+  /* Data derived from the map in earlier boots is still good if this
+     stays the same.  */
+  stamp_map (map);
 
   TRACE ("sleeping...");
 
@@ -21,6 +21,7 @@
 
 
 #include <stdio.h>
+#include <string.h>
 
 #define KB(x) ((x) * 1024)
 #define MB(x) (KB(x) * 1024)
@@ -33,8 +34,9 @@ const char teststr_ro[] = { 'R', 'e', 'a', 'd', '-',
 char teststr_rw[MB(4)] = { 'R', 'e', 'a', 'd', '-',
 			   'w', 'r', 'i', 't', 'e', '.', '\0' };
 
-/* FIXME: TODO: Add BSS test.  */
-// char teststr_bs[512];
+/* Test a large zero-filled data section, which costs no file data
+   and should not cost memory either until it is used.  */
+char teststr_bs[MB(4)];
 
 
 /* Test static constructors/destructors.  */
@@ -65,6 +67,8 @@ main (int argc, char *argv[])
 
   printf ("TEST: RO: %s\n", teststr_ro);
   printf ("TEST: RW: %s\n", teststr_rw);
-  // printf ("TEST: BS: %s\n", teststr_bs);
+  strcpy (teststr_bs, "Zero-fill.");
+  printf ("TEST: BS: %s (%s)\n", teststr_bs,
+	  teststr_bs[sizeof (teststr_bs) - 1] ? "dirty" : "clean");
   return 0;
 }
@@ -0,0 +1,330 @@
+/* himemce-reloc-bench.c - High Memory for Windows CE (relocation benchmark)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* Time the relocation of generated images on the build host.  Every
+   image has a number of HIGHLOW fixups spread evenly over its pages,
+   followed by its relocation blocks.  It is relocated back and forth
+   with an increasing number of threads, or, with -k, with the
+   HIGHLOW kernels on images with dense and sparse fixups.  */
+
+#include <windows.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "wine.h"
+#include "himemce-reloc.h"
+
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "usage: %s [-n ITERATIONS] [-t THREADS] [-d DENSITY] "
+	   "[-k] [FIXUPS...]\n"
+	   "  -n N    relocate every image N times (default 20)\n"
+	   "  -t N    try 1, 2, 4, ... up to N threads (default 4)\n"
+	   "  -d N    one fixup every N bytes (default 16)\n"
+	   "  -k      compare the HIGHLOW kernels with one fixup every\n"
+	   "          4, 16, 64 and 256 bytes, instead of thread counts\n"
+	   "  FIXUPS  the number of fixups of each image "
+	   "(default 16384 131072 1048576)\n", prog);
+  exit (1);
+}
+
+
+/* An image of SIZE bytes with NR fixups, the relocation blocks of
+   which are described by RELOCS.  */
+struct image
+{
+  char *base;
+  SIZE_T size;
+  IMAGE_DATA_DIRECTORY relocs;
+};
+
+
+/* Generate an image with NR_FIXUPS fixups, one every DENSITY bytes.  */
+static int
+make_image (struct image *img, DWORD nr_fixups, DWORD density)
+{
+  DWORD per_page = 0x1000 / density;
+  DWORD nr_pages = (nr_fixups + per_page - 1) / per_page;
+  SIZE_T data_size = (SIZE_T) nr_pages * 0x1000;
+  SIZE_T reloc_size = (SIZE_T) nr_pages
+    * (sizeof (IMAGE_BASE_RELOCATION) + (per_page + 1) * sizeof (USHORT));
+  IMAGE_BASE_RELOCATION *rel;
+  DWORD page;
+  DWORD left = nr_fixups;
+
+  img->size = data_size + ((reloc_size + 0xfff) & ~0xfff);
+  img->base = VirtualAlloc (NULL, img->size, MEM_COMMIT | MEM_RESERVE,
+			    PAGE_READWRITE);
+  if (! img->base)
+    return 0;
+  img->relocs.VirtualAddress = data_size;
+
+  rel = (IMAGE_BASE_RELOCATION *) (img->base + data_size);
+  for (page = 0; page < nr_pages; page++)
+    {
+      USHORT *entry = (USHORT *) (rel + 1);
+      DWORD nr = min (per_page, left);
+      DWORD i;
+
+      rel->VirtualAddress = page * 0x1000;
+      for (i = 0; i < nr; i++)
+	{
+	  DWORD offset = i * density;
+
+	  *(DWORD *) (img->base + rel->VirtualAddress + offset) =
+	    0x10000000 + rel->VirtualAddress + offset;
+	  entry[i] = (IMAGE_REL_BASED_HIGHLOW << 12) | offset;
+	}
+      /* Blocks are padded to 32 bits.  */
+      if (nr & 1)
+	entry[nr++] = IMAGE_REL_BASED_ABSOLUTE << 12;
+      rel->SizeOfBlock = sizeof (*rel) + nr * sizeof (USHORT);
+      left -= min (per_page, left);
+      rel = (IMAGE_BASE_RELOCATION *) ((char *) rel + rel->SizeOfBlock);
+    }
+  img->relocs.Size = (char *) rel - (img->base + data_size);
+  return 1;
+}
+
+
+/* Check that the image is back at its original base.  */
+static int
+check_image (struct image *img, DWORD nr_fixups, DWORD density)
+{
+  DWORD per_page = 0x1000 / density;
+  DWORD i;
+
+  for (i = 0; i < nr_fixups; i++)
+    {
+      DWORD rva = (i / per_page) * 0x1000 + (i % per_page) * density;
+
+      if (*(DWORD *) (img->base + rva) != 0x10000000 + rva)
+	return 0;
+    }
+  return 1;
+}
+
+
+static void
+bench_image (DWORD nr_fixups, DWORD density, int max_threads,
+	     int iterations)
+{
+  struct image img;
+  double single = 0;
+  int threads;
+
+  if (! make_image (&img, nr_fixups, density))
+    {
+      fprintf (stderr, "can not allocate image for %u fixups\n", nr_fixups);
+      return;
+    }
+
+  printf ("%u fixups (%lu KB image, %u KB relocations):\n", nr_fixups,
+	  (unsigned long) (img.size / 1024), img.relocs.Size / 1024);
+  for (threads = 1; threads <= max_threads; threads *= 2)
+    {
+      double start, ms;
+      int i;
+
+      start = now ();
+      for (i = 0; i < iterations; i++)
+	virtual_relocate (img.base, img.size, &img.relocs,
+			  (i & 1) ? -0x10000 : 0x10000, threads);
+      ms = (now () - start) / iterations;
+      if (iterations & 1)
+	virtual_relocate (img.base, img.size, &img.relocs, -0x10000, 1);
+      if (! check_image (&img, nr_fixups, density))
+	printf ("  %2i threads: wrong result\n", threads);
+      if (threads == 1)
+	single = ms;
+      printf ("  %2i threads: %9.3f ms  %6.2fx  %7.1f fixups/us\n",
+	      threads, ms, single / ms, nr_fixups / (ms * 1000));
+    }
+  VirtualFree (img.base, 0, MEM_RELEASE);
+}
+
+
+/* The relocation loop before HIGHLOW fixups were batched, to compare
+   against.  */
+static void
+relocate_switch (struct image *img, INT_PTR delta)
+{
+  IMAGE_BASE_RELOCATION *rel = (IMAGE_BASE_RELOCATION *)
+    (img->base + img->relocs.VirtualAddress);
+  IMAGE_BASE_RELOCATION *end = (IMAGE_BASE_RELOCATION *)
+    ((char *) rel + img->relocs.Size);
+
+  while (rel < end && rel->SizeOfBlock)
+    {
+      char *page = img->base + rel->VirtualAddress;
+      USHORT *entry = (USHORT *) (rel + 1);
+      UINT count = (rel->SizeOfBlock - sizeof (*rel)) / sizeof (USHORT);
+
+      while (count--)
+	{
+	  USHORT offset = *entry & 0xfff;
+
+	  switch (*entry >> 12)
+	    {
+	    case IMAGE_REL_BASED_ABSOLUTE:
+	      break;
+	    case IMAGE_REL_BASED_HIGH:
+	      *(short *) (page + offset) += HIWORD (delta);
+	      break;
+	    case IMAGE_REL_BASED_LOW:
+	      *(short *) (page + offset) += LOWORD (delta);
+	      break;
+	    case IMAGE_REL_BASED_HIGHLOW:
+	      *(int *) (page + offset) += delta;
+	      break;
+	    default:
+	      return;
+	    }
+	  entry++;
+	}
+      rel = (IMAGE_BASE_RELOCATION *) entry;
+    }
+}
+
+
+/* Time relocating IMG with the switch loop if VECTOR is negative,
+   otherwise with the batched loop, with or without vector
+   instructions.  */
+static double
+time_kernel (struct image *img, int vector, int iterations)
+{
+  double start, ms;
+  int i;
+
+  himemce_reloc_vector = vector;
+  start = now ();
+  for (i = 0; i < iterations; i++)
+    {
+      INT_PTR delta = (i & 1) ? -0x10000 : 0x10000;
+
+      if (vector < 0)
+	relocate_switch (img, delta);
+      else
+	virtual_relocate (img->base, img->size, &img->relocs, delta, 1);
+    }
+  ms = (now () - start) / iterations;
+  if (iterations & 1)
+    relocate_switch (img, -0x10000);
+  himemce_reloc_vector = 1;
+  return ms;
+}
+
+
+static void
+bench_kernels (DWORD nr_fixups, int iterations)
+{
+  static const DWORD densities[] = { 4, 16, 64, 256 };
+  int i;
+
+  printf ("%u fixups, %s kernel:\n", nr_fixups, himemce_reloc_kernel ());
+  printf ("  density      switch      scalar      vector\n");
+  for (i = 0; i < sizeof (densities) / sizeof (densities[0]); i++)
+    {
+      struct image img;
+      double ms[3];
+      int k;
+
+      if (! make_image (&img, nr_fixups, densities[i]))
+	{
+	  fprintf (stderr, "can not allocate image for %u fixups\n",
+		   nr_fixups);
+	  return;
+	}
+      for (k = 0; k < 3; k++)
+	{
+	  ms[k] = time_kernel (&img, k - 1, iterations);
+	  if (! check_image (&img, nr_fixups, densities[i]))
+	    printf ("  %4u bytes: wrong result\n", densities[i]);
+	}
+      printf ("  %4u bytes  %7.3f ms  %7.3f ms  %7.3f ms  %5.2fx\n",
+	      densities[i], ms[0], ms[1], ms[2], ms[0] / ms[2]);
+      VirtualFree (img.base, 0, MEM_RELEASE);
+    }
+}
+
+
+int
+main (int argc, char *argv[])
+{
+  static const DWORD default_fixups[] = { 16384, 131072, 1048576 };
+  int iterations = 20;
+  int max_threads = 4;
+  DWORD density = 16;
+  int kernels = 0;
+  SYSTEM_INFO info;
+  int i;
+
+  host_quiet = 1;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+      if (! strcmp (argv[i], "-n") && i + 1 < argc)
+	iterations = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-t") && i + 1 < argc)
+	max_threads = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-d") && i + 1 < argc)
+	density = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-k"))
+	kernels = 1;
+      else
+	usage (argv[0]);
+    }
+  if (iterations < 1 || max_threads < 1 || density < 4 || density > 0x1000
+      || (density & 3))
+    usage (argv[0]);
+
+  if (kernels)
+    {
+      if (i == argc)
+	bench_kernels (131072, iterations);
+      for (; i < argc; i++)
+	bench_kernels (strtoul (argv[i], NULL, 0), iterations);
+      return 0;
+    }
+
+  GetSystemInfo (&info);
+  printf ("%u processors, one fixup every %u bytes\n",
+	  info.dwNumberOfProcessors, density);
+
+  if (i == argc)
+    for (i = 0; i < sizeof (default_fixups) / sizeof (default_fixups[0]); i++)
+      bench_image (default_fixups[i], density, max_threads, iterations);
+  else
+    for (; i < argc; i++)
+      bench_image (strtoul (argv[i], NULL, 0), density, max_threads,
+		   iterations);
+  return 0;
+}
@@ -0,0 +1,512 @@
+/* himemce-reloc.c - High Memory for Windows CE (relocation index)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* The .reloc section is a stream of blocks of 16 bit entries, each
+   with the fixup type in the upper four bits.  Applying it means
+   decoding every entry and switching on its type, and finding the
+   fixups of one page means walking the stream from the start.  The
+   relocation index decodes the stream once, so that any page can be
+   relocated on its own with one tight loop per fixup type.  */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "debug.h"
+#include "himemce-reloc.h"
+
+/* The host build uses SSE2, the device build NEON if it is built
+   for it.  */
+#if defined (__SSE2__)
+# define RELOC_SSE2 1
+# include <emmintrin.h>
+#elif defined (__ARM_NEON__) || defined (__ARM_NEON)
+# define RELOC_NEON 1
+# include <arm_neon.h>
+#endif
+
+#define RELOC_PAGE_SIZE 0x1000
+#define RELOC_TYPE_HIGHLOW (IMAGE_REL_BASED_HIGHLOW << 12)
+
+int himemce_reloc_vector = 1;
+
+
+static int
+compare_offsets (const void *a, const void *b)
+{
+  return *(const WORD *) a - *(const WORD *) b;
+}
+
+
+static int
+compare_pages (const void *a, const void *b)
+{
+  const struct himemce_reloc_page *pa = a;
+  const struct himemce_reloc_page *pb = b;
+
+  if (pa->rva != pb->rva)
+    return pa->rva < pb->rva ? -1 : 1;
+  return 0;
+}
+
+
+static const IMAGE_BASE_RELOCATION *
+next_block (const IMAGE_BASE_RELOCATION *rel)
+{
+  return (const IMAGE_BASE_RELOCATION *) ((const char *) rel
+					  + rel->SizeOfBlock);
+}
+
+
+/* Append the offsets of the fixups of TYPE in the blocks REL up to
+   END to OFFSETS, and return their number.  */
+static DWORD
+collect_offsets (const IMAGE_BASE_RELOCATION *rel,
+		 const IMAGE_BASE_RELOCATION *end, int type, WORD *offsets)
+{
+  DWORD nr = 0;
+
+  for (; rel < end; rel = next_block (rel))
+    {
+      const USHORT *entry = (const USHORT *) (rel + 1);
+      DWORD count = (rel->SizeOfBlock - sizeof (*rel)) / sizeof (USHORT);
+      DWORD i;
+
+      for (i = 0; i < count; i++)
+	if ((entry[i] >> 12) == type)
+	  offsets[nr++] = entry[i] & 0xfff;
+    }
+  return nr;
+}
+
+
+/* Sort the NR offsets at OFFSETS if needed, and return whether the
+   last one, for a fixup of SIZE bytes, reaches into the next page.  */
+static int
+finish_offsets (WORD *offsets, DWORD nr, DWORD size)
+{
+  DWORD i;
+
+  if (! nr)
+    return 0;
+  /* The linker emits the entries of a block in order, so this is
+     rarely needed.  */
+  for (i = 1; i < nr; i++)
+    if (offsets[i] < offsets[i - 1])
+      {
+	qsort (offsets, nr, sizeof (WORD), compare_offsets);
+	break;
+      }
+  return offsets[nr - 1] > RELOC_PAGE_SIZE - size;
+}
+
+
+struct himemce_relocs *
+himemce_relocs_build (const void *data, DWORD size, DWORD image_size)
+{
+  const char *start = data;
+  const char *end = start + size;
+  const IMAGE_BASE_RELOCATION *rel;
+  const IMAGE_BASE_RELOCATION *last;
+  struct himemce_relocs *relocs;
+  WORD *offsets;
+  DWORD nr_blocks = 0;
+  DWORD nr_pages = 0;
+  DWORD nr = 0;
+  DWORD prev_rva = 0;
+  int sorted = 1;
+  DWORD i;
+
+  /* Check the block headers.  Every block is at most one page, and
+     every fixup at most one offset.  */
+  rel = (const IMAGE_BASE_RELOCATION *) start;
+  while ((const char *) (rel + 1) <= end && rel->SizeOfBlock)
+    {
+      if ((rel->VirtualAddress & (RELOC_PAGE_SIZE - 1))
+	  || rel->VirtualAddress >= image_size
+	  || rel->SizeOfBlock < sizeof (*rel)
+	  || rel->SizeOfBlock > end - (const char *) rel)
+	{
+	  TRACE ("invalid relocation block %p\n", rel);
+	  return NULL;
+	}
+      nr_blocks++;
+      rel = next_block (rel);
+    }
+  last = rel;
+
+  relocs = malloc (offsetof (struct himemce_relocs, page)
+		   + nr_blocks * sizeof (struct himemce_reloc_page)
+		   + size);
+  if (! relocs)
+    return NULL;
+  relocs->nr_pages = nr_blocks;
+  offsets = HIMEMCE_RELOC_OFFSETS (relocs);
+
+  /* Decode the blocks of every page in one go.  HIGHLOW fixups are
+     collected on the way, the rare HIGH and LOW fixups in another
+     pass over the blocks of the page.  */
+  rel = (const IMAGE_BASE_RELOCATION *) start;
+  while (rel < last)
+    {
+      struct himemce_reloc_page *page = &relocs->page[nr_pages];
+      const IMAGE_BASE_RELOCATION *next = rel;
+      int others = 0;
+
+      page->rva = rel->VirtualAddress;
+      page->first = nr;
+      page->flags = 0;
+      do
+	{
+	  const USHORT *entry = (const USHORT *) (next + 1);
+	  DWORD count = (next->SizeOfBlock - sizeof (*next)) / sizeof (USHORT);
+
+	  for (i = 0; i < count; i++)
+	    {
+	      switch (entry[i] >> 12)
+		{
+		case IMAGE_REL_BASED_HIGHLOW:
+		  offsets[nr++] = entry[i] & 0xfff;
+		  break;
+		case IMAGE_REL_BASED_ABSOLUTE:
+		  break;
+		case IMAGE_REL_BASED_HIGH:
+		case IMAGE_REL_BASED_LOW:
+		  others = 1;
+		  break;
+		default:
+		  TRACE ("unsupported fixup type %x\n", entry[i] >> 12);
+		  goto error;
+		}
+	    }
+	  next = next_block (next);
+	}
+      while (next < last && next->VirtualAddress == page->rva);
+
+      if (nr - page->first > 0xffff)
+	goto error;
+      page->nr_highlow = nr - page->first;
+      page->nr_high = 0;
+      page->nr_low = 0;
+      if (others)
+	{
+	  page->nr_high = collect_offsets (rel, next, IMAGE_REL_BASED_HIGH,
+					   offsets + nr);
+	  nr += page->nr_high;
+	  page->nr_low = collect_offsets (rel, next, IMAGE_REL_BASED_LOW,
+					  offsets + nr);
+	  nr += page->nr_low;
+	}
+
+      if (finish_offsets (offsets + page->first, page->nr_highlow,
+			  sizeof (DWORD))
+	  || finish_offsets (offsets + page->first + page->nr_highlow,
+			     page->nr_high, sizeof (WORD))
+	  || finish_offsets (offsets + nr - page->nr_low, page->nr_low,
+			     sizeof (WORD)))
+	page->flags |= HIMEMCE_RELOC_SPANS;
+
+      if (nr == page->first)
+	;  /* Only padding.  */
+      else
+	{
+	  if (nr_pages && page->rva <= prev_rva)
+	    sorted = 0;
+	  prev_rva = page->rva;
+	  nr_pages++;
+	}
+      rel = next;
+    }
+
+  if (! sorted)
+    {
+      qsort (relocs->page, nr_pages, sizeof (relocs->page[0]), compare_pages);
+      for (i = 1; i < nr_pages; i++)
+	if (relocs->page[i].rva == relocs->page[i - 1].rva)
+	  {
+	    /* The blocks of one page are not adjacent.  */
+	    TRACE ("relocation blocks for page %x are split\n",
+		   relocs->page[i].rva);
+	    goto error;
+	  }
+    }
+
+  /* Move the offsets down behind the actual page array.  */
+  relocs->nr_pages = nr_pages;
+  relocs->nr_offsets = nr;
+  memmove (HIMEMCE_RELOC_OFFSETS (relocs), offsets, nr * sizeof (WORD));
+  relocs->size = (char *) (HIMEMCE_RELOC_OFFSETS (relocs) + nr)
+    - (char *) relocs;
+  return relocs;
+
+ error:
+  free (relocs);
+  return NULL;
+}
+
+
+BOOL
+himemce_relocs_check (const struct himemce_relocs *relocs, DWORD size,
+		      DWORD image_size)
+{
+  DWORD header = offsetof (struct himemce_relocs, page);
+  DWORD i;
+
+  if (size < header || relocs->size != size
+      || relocs->nr_pages > (size - header)
+      / sizeof (struct himemce_reloc_page)
+      || relocs->nr_offsets > (size - header - relocs->nr_pages
+			       * sizeof (struct himemce_reloc_page))
+      / sizeof (WORD))
+    return FALSE;
+  for (i = 0; i < relocs->nr_pages; i++)
+    {
+      const struct himemce_reloc_page *page = &relocs->page[i];
+
+      if (page->rva >= image_size
+	  || (i && page->rva <= relocs->page[i - 1].rva)
+	  || page->first > relocs->nr_offsets
+	  || (DWORD) page->nr_highlow + page->nr_high + page->nr_low
+	  > relocs->nr_offsets - page->first)
+	return FALSE;
+    }
+  return TRUE;
+}
+
+
+const struct himemce_reloc_page *
+himemce_relocs_find (const struct himemce_relocs *relocs, DWORD rva)
+{
+  int lo = 0;
+  int hi = relocs->nr_pages - 1;
+
+  rva &= ~(RELOC_PAGE_SIZE - 1);
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+
+      if (relocs->page[mid].rva == rva)
+	return &relocs->page[mid];
+      if (relocs->page[mid].rva < rva)
+	lo = mid + 1;
+      else
+	hi = mid - 1;
+    }
+  return NULL;
+}
+
+
+/* Blocks are mostly HIGHLOW fixups at increasing offsets, and
+   pointer tables such as vtables and jump tables give long runs of
+   fixups four bytes apart.  The vector kernels check eight entries at
+   a time for such a run, and relocate it with one load, add and store
+   of 32 bytes.  Other groups are applied one by one.  A gather and
+   scatter of scattered words is not faster than the scalar loop.  */
+
+DWORD
+himemce_reloc_count_highlow (const WORD *entries, DWORD count)
+{
+  DWORD i = 0;
+
+#if defined (RELOC_SSE2)
+  {
+    const __m128i type = _mm_set1_epi16 (IMAGE_REL_BASED_HIGHLOW);
+
+    for (; i + 8 <= count; i += 8)
+      {
+	__m128i v = _mm_loadu_si128 ((const __m128i *) (entries + i));
+
+	if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_srli_epi16 (v, 12), type))
+	    != 0xffff)
+	  break;
+      }
+  }
+#elif defined (RELOC_NEON)
+  {
+    const uint16x8_t type = vdupq_n_u16 (IMAGE_REL_BASED_HIGHLOW);
+
+    for (; i + 8 <= count; i += 8)
+      {
+	uint16x8_t v = vld1q_u16 (entries + i);
+	uint64x2_t eq = vreinterpretq_u64_u16
+	  (vceqq_u16 (vshrq_n_u16 (v, 12), type));
+
+	if ((vgetq_lane_u64 (eq, 0) & vgetq_lane_u64 (eq, 1)) != ~0ULL)
+	  break;
+      }
+  }
+#endif
+  for (; i < count; i++)
+    if ((entries[i] & 0xf000) != RELOC_TYPE_HIGHLOW)
+      break;
+  return i;
+}
+
+
+static void
+highlow_scalar (char *page, const WORD *entries, DWORD count, int delta)
+{
+  DWORD i;
+
+  for (i = 0; i + 4 <= count; i += 4)
+    {
+      *(int *) (page + (entries[i] & 0xfff)) += delta;
+      *(int *) (page + (entries[i + 1] & 0xfff)) += delta;
+      *(int *) (page + (entries[i + 2] & 0xfff)) += delta;
+      *(int *) (page + (entries[i + 3] & 0xfff)) += delta;
+    }
+  for (; i < count; i++)
+    *(int *) (page + (entries[i] & 0xfff)) += delta;
+}
+
+
+#ifdef RELOC_SSE2
+static void
+highlow_sse2 (char *page, const WORD *entries, DWORD count, int delta)
+{
+  const __m128i mask = _mm_set1_epi16 (0xfff);
+  const __m128i steps = _mm_setr_epi16 (0, 4, 8, 12, 16, 20, 24, 28);
+  const __m128i add = _mm_set1_epi32 (delta);
+  DWORD i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+    {
+      __m128i off = _mm_and_si128
+	(_mm_loadu_si128 ((const __m128i *) (entries + i)), mask);
+      WORD first = entries[i] & 0xfff;
+      __m128i run = _mm_add_epi16 (_mm_set1_epi16 (first), steps);
+
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (off, run)) == 0xffff)
+	{
+	  __m128i *ptr = (__m128i *) (page + first);
+
+	  _mm_storeu_si128 (ptr, _mm_add_epi32 (_mm_loadu_si128 (ptr), add));
+	  _mm_storeu_si128 (ptr + 1,
+			    _mm_add_epi32 (_mm_loadu_si128 (ptr + 1), add));
+	}
+      else
+	highlow_scalar (page, entries + i, 8, delta);
+    }
+  highlow_scalar (page, entries + i, count - i, delta);
+}
+#endif /* RELOC_SSE2 */
+
+
+#ifdef RELOC_NEON
+static void
+highlow_neon (char *page, const WORD *entries, DWORD count, int delta)
+{
+  static const uint16_t step_values[8] = { 0, 4, 8, 12, 16, 20, 24, 28 };
+  const uint16x8_t mask = vdupq_n_u16 (0xfff);
+  const uint16x8_t steps = vld1q_u16 (step_values);
+  const int32x4_t add = vdupq_n_s32 (delta);
+  DWORD i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+    {
+      uint16x8_t off = vandq_u16 (vld1q_u16 (entries + i), mask);
+      WORD first = entries[i] & 0xfff;
+      uint64x2_t eq = vreinterpretq_u64_u16
+	(vceqq_u16 (off, vaddq_u16 (vdupq_n_u16 (first), steps)));
+
+      /* Only aligned runs, the device may trap unaligned vector
+	 accesses.  */
+      if (! (first & 3)
+	  && (vgetq_lane_u64 (eq, 0) & vgetq_lane_u64 (eq, 1)) == ~0ULL)
+	{
+	  int32_t *ptr = (int32_t *) (page + first);
+
+	  vst1q_s32 (ptr, vaddq_s32 (vld1q_s32 (ptr), add));
+	  vst1q_s32 (ptr + 4, vaddq_s32 (vld1q_s32 (ptr + 4), add));
+	}
+      else
+	highlow_scalar (page, entries + i, 8, delta);
+    }
+  highlow_scalar (page, entries + i, count - i, delta);
+}
+#endif /* RELOC_NEON */
+
+
+void
+himemce_reloc_highlow (void *page, const WORD *entries, DWORD count,
+		       INT_PTR delta)
+{
+#if defined (RELOC_SSE2)
+  if (himemce_reloc_vector)
+    {
+      highlow_sse2 (page, entries, count, (int) delta);
+      return;
+    }
+#elif defined (RELOC_NEON)
+  if (himemce_reloc_vector)
+    {
+      highlow_neon (page, entries, count, (int) delta);
+      return;
+    }
+#endif
+  highlow_scalar (page, entries, count, (int) delta);
+}
+
+
+const char *
+himemce_reloc_kernel (void)
+{
+#if defined (RELOC_SSE2)
+  if (himemce_reloc_vector)
+    return "sse2";
+#elif defined (RELOC_NEON)
+  if (himemce_reloc_vector)
+    return "neon";
+#endif
+  return "scalar";
+}
+
+
+void
+himemce_relocs_apply_page (const struct himemce_relocs *relocs,
+			   const struct himemce_reloc_page *page,
+			   char *base, INT_PTR delta)
+{
+  const WORD *offset = HIMEMCE_RELOC_OFFSETS (relocs) + page->first;
+  char *ptr = base + page->rva;
+  WORD high = HIWORD (delta);
+  WORD low = LOWORD (delta);
+  int i;
+
+  himemce_reloc_highlow (ptr, offset, page->nr_highlow, delta);
+  offset += page->nr_highlow;
+  for (i = 0; i < page->nr_high; i++)
+    *(short *) (ptr + offset[i]) += high;
+  offset += page->nr_high;
+  for (i = 0; i < page->nr_low; i++)
+    *(short *) (ptr + offset[i]) += low;
+}
+
+
+void
+himemce_relocs_apply (const struct himemce_relocs *relocs, char *base,
+		      INT_PTR delta)
+{
+  DWORD i;
+
+  for (i = 0; i < relocs->nr_pages; i++)
+    himemce_relocs_apply_page (relocs, &relocs->page[i], base, delta);
+}
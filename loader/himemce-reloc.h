@@ -0,0 +1,120 @@
+/* himemce-reloc.h - High Memory for Windows CE (relocation index)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef HIMEMCE_RELOC_H
+#define HIMEMCE_RELOC_H 1
+
+#include <windows.h>
+
+/* The base relocations of an image, decoded once.  For every page
+   with fixups, the offsets into the page are stored sorted and
+   grouped by fixup type: first the HIGHLOW fixups, then HIGH, then
+   LOW.  ABSOLUTE (padding) entries are dropped.  Pages are sorted by
+   RVA, and a page that has several blocks in the image gets a single
+   entry.
+
+   The index is a single block of memory without pointers, so it can
+   be copied into other memory (such as the preloader map) as is.  */
+
+/* Set in the flags of a page if a fixup reaches into the next
+   page.  */
+#define HIMEMCE_RELOC_SPANS 1
+
+struct himemce_reloc_page
+{
+  /* The RVA of the page.  */
+  DWORD rva;
+
+  /* The index of the first offset of this page.  */
+  DWORD first;
+
+  /* The number of offsets of each type.  */
+  WORD nr_highlow;
+  WORD nr_high;
+  WORD nr_low;
+
+  /* HIMEMCE_RELOC_*.  */
+  WORD flags;
+};
+
+
+struct himemce_relocs
+{
+  /* The size of the index in bytes.  */
+  DWORD size;
+
+  DWORD nr_pages;
+  DWORD nr_offsets;
+
+  /* The offsets follow the page array.  */
+  struct himemce_reloc_page page[1];
+};
+
+#define HIMEMCE_RELOC_OFFSETS(relocs) \
+  ((WORD *) &(relocs)->page[(relocs)->nr_pages])
+
+
+/* Build the index for the relocation blocks at RELOCS of SIZE bytes,
+   for an image of IMAGE_SIZE bytes.  Returns NULL if there are fixup
+   types other than HIGHLOW, HIGH and LOW, if the blocks are not valid,
+   or if out of memory.  The index is freed with free.  */
+struct himemce_relocs *himemce_relocs_build (const void *relocs,
+					     DWORD size, DWORD image_size);
+
+/* Return true if the SIZE bytes at RELOCS are a valid index for an
+   image of IMAGE_SIZE bytes.  For indices read back from storage.  */
+BOOL himemce_relocs_check (const struct himemce_relocs *relocs, DWORD size,
+			   DWORD image_size);
+
+/* Return the entry for the page at RVA, or NULL if it has no
+   fixups.  */
+const struct himemce_reloc_page *
+himemce_relocs_find (const struct himemce_relocs *relocs, DWORD rva);
+
+/* Apply the fixups for PAGE to the image at BASE, by DELTA.  */
+void himemce_relocs_apply_page (const struct himemce_relocs *relocs,
+				const struct himemce_reloc_page *page,
+				char *base, INT_PTR delta);
+
+/* Apply all fixups to the image at BASE, by DELTA.  */
+void himemce_relocs_apply (const struct himemce_relocs *relocs,
+			   char *base, INT_PTR delta);
+
+
+/* Return the number of HIGHLOW entries at the start of the COUNT
+   relocation block entries at ENTRIES.  */
+DWORD himemce_reloc_count_highlow (const WORD *entries, DWORD count);
+
+/* Add DELTA to the 32 bit words at the offsets in the low 12 bits of
+   the COUNT entries at ENTRIES into PAGE.  The upper four bits are
+   ignored, so this takes both HIGHLOW block entries and index
+   offsets.  The result is the same as applying them one by one, also
+   for overlapping fixups.  */
+void himemce_reloc_highlow (void *page, const WORD *entries, DWORD count,
+			    INT_PTR delta);
+
+/* If zero, himemce_reloc_highlow never uses vector instructions.  For
+   benchmarks.  */
+extern int himemce_reloc_vector;
+
+/* The name of the kernel used by himemce_reloc_highlow.  */
+const char *himemce_reloc_kernel (void);
+
+#endif /* HIMEMCE_RELOC_H */
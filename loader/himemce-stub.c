@@ -0,0 +1,337 @@
+/* himemce-stub.c - High Memory for Windows CE (import stubs)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* The compiler for the device has no inline assembler, so all code
+   here is written out as ARM instruction words at run time.  Every
+   piece of code keeps its constants right behind it and loads them
+   PC-relative (the PC reads as the address of the instruction plus
+   8).  */
+
+#include <windows.h>
+#include <string.h>
+
+#include "wine.h"
+#include "himemce-stub.h"
+
+
+/* Stubs for missing imports.  */
+
+/* r0 = code, r1 = flags, r2 = number of parameters, r3 = parameters,
+   and on to RaiseException.  LR is still that of the caller, so the
+   exception looks like it was raised by the call.  */
+static const DWORD missing_code[] =
+  {
+    0xe59f0010,		/* ldr r0, [pc, #16]	; code */
+    0xe3a01001,		/* mov r1, #1		; noncontinuable */
+    0xe3a02002,		/* mov r2, #2 */
+    0xe28f300c,		/* add r3, pc, #12	; dll, name */
+    0xe59fc004,		/* ldr ip, [pc, #4]	; RaiseException */
+    0xe12fff1c,		/* bx ip */
+  };
+
+struct missing_stub
+{
+  DWORD code[sizeof (missing_code) / sizeof (missing_code[0])];
+  DWORD exception;
+  DWORD raise;
+  DWORD dll;
+  DWORD name;
+  /* The names follow.  */
+};
+
+/* The stubs are allocated from one reservation.  Only with NOACCESS
+   does Windows CE put it into the high memory area, which is shared
+   by all processes.  */
+#define STUB_AREA_SIZE (2 * 1024 * 1024)
+
+static char *stub_area;
+static DWORD stub_used;
+static DWORD stub_committed;
+static LONG stub_lock;
+
+
+static void *
+alloc_stub_area (DWORD size)
+{
+  char *ptr = NULL;
+
+  size = (size + 7) & ~7;
+  while (InterlockedExchange (&stub_lock, 1))
+    Sleep (0);
+
+  if (! stub_area)
+    stub_area = VirtualAlloc (NULL, STUB_AREA_SIZE, MEM_RESERVE,
+			      PAGE_NOACCESS);
+  if (! stub_area || size > STUB_AREA_SIZE - stub_used)
+    goto out;
+  if (stub_used + size > stub_committed)
+    {
+      DWORD end = (stub_used + size + 0xfff) & ~0xfff;
+
+      if (! VirtualAlloc (stub_area + stub_committed, end - stub_committed,
+			  MEM_COMMIT, PAGE_EXECUTE_READWRITE))
+	goto out;
+      stub_committed = end;
+    }
+  ptr = stub_area + stub_used;
+  stub_used += size;
+
+ out:
+  InterlockedExchange (&stub_lock, 0);
+  return ptr;
+}
+
+
+static FARPROC
+get_raise_exception (void)
+{
+  static FARPROC raise;
+  HMODULE coredll;
+
+  if (! raise)
+    {
+      coredll = GetModuleHandle (L"coredll.dll");
+      if (coredll)
+	raise = GetProcAddress (coredll, L"RaiseException");
+    }
+  return raise;
+}
+
+
+void *
+himemce_stub_missing (const char *dll, const char *name)
+{
+  struct missing_stub *stub;
+  size_t dll_len = strlen (dll) + 1;
+  size_t name_len = 0;
+  char *str;
+
+  if ((ULONG_PTR) name >= 0x10000)
+    name_len = strlen (name) + 1;
+  stub = alloc_stub_area (sizeof (*stub) + dll_len + name_len);
+  if (! stub)
+    return NULL;
+
+  memcpy (stub->code, missing_code, sizeof (missing_code));
+  stub->exception = EXCEPTION_WINE_STUB;
+  stub->raise = (DWORD) get_raise_exception ();
+  str = (char *) (stub + 1);
+  memcpy (str, dll, dll_len);
+  stub->dll = (DWORD) str;
+  if (name_len)
+    {
+      memcpy (str + dll_len, name, name_len);
+      stub->name = (DWORD) (str + dll_len);
+    }
+  else
+    stub->name = (DWORD) name;
+
+  FlushInstructionCache (GetCurrentProcess (), stub, sizeof (*stub));
+  return stub;
+}
+
+
+/* Lazy binding.  */
+
+/* The code shared by the trampolines of a block.  IP holds the
+   import.  The argument registers are kept on the stack around the
+   call to himemce_lazy_bind (with IP, to keep the stack aligned to 8
+   bytes), and then the import is called with them.  */
+static const DWORD lazy_entry_code[] =
+  {
+    0xe92d500f,		/* stmfd sp!, {r0-r3, ip, lr} */
+    0xe1a0000c,		/* mov r0, ip */
+    0xe59fc018,		/* ldr ip, [pc, #24]	; himemce_lazy_bind */
+    0xe1a0e00f,		/* mov lr, pc */
+    0xe12fff1c,		/* bx ip */
+    0xe1a0c000,		/* mov ip, r0 */
+    0xe8bd000f,		/* ldmfd sp!, {r0-r3} */
+    0xe59de004,		/* ldr lr, [sp, #4] */
+    0xe28dd008,		/* add sp, sp, #8 */
+    0xe12fff1c,		/* bx ip */
+  };
+
+struct lazy_entry
+{
+  DWORD code[sizeof (lazy_entry_code) / sizeof (lazy_entry_code[0])];
+  DWORD bind;
+};
+
+
+/* The trampoline of one import: IP = import, on to the entry.  */
+static const DWORD trampoline_code[] =
+  {
+    0xe59fc000,		/* ldr ip, [pc, #0]	; import */
+    0xe59ff000,		/* ldr pc, [pc, #0]	; entry */
+  };
+
+struct trampoline
+{
+  DWORD code[sizeof (trampoline_code) / sizeof (trampoline_code[0])];
+  DWORD import;
+  DWORD entry;
+};
+
+
+struct himemce_lazy_block
+{
+  int nr;
+  DWORD size;
+  struct lazy_entry entry;
+  struct trampoline *trampolines;
+  struct himemce_lazy_import *imports;
+};
+
+
+struct himemce_lazy_block *
+himemce_lazy_alloc (int nr)
+{
+  struct himemce_lazy_block *block;
+  DWORD size;
+
+  size = sizeof (*block) + nr * (sizeof (struct trampoline)
+				 + sizeof (struct himemce_lazy_import));
+  block = VirtualAlloc (NULL, size, MEM_RESERVE | MEM_COMMIT,
+			PAGE_EXECUTE_READWRITE);
+  if (! block)
+    return NULL;
+
+  block->nr = nr;
+  block->size = size;
+  memcpy (block->entry.code, lazy_entry_code, sizeof (lazy_entry_code));
+  block->entry.bind = (DWORD) himemce_lazy_bind;
+  block->trampolines = (struct trampoline *) (block + 1);
+  block->imports = (struct himemce_lazy_import *) (block->trampolines + nr);
+  return block;
+}
+
+
+void
+himemce_lazy_set (struct himemce_lazy_block *block, int idx, DWORD *slot,
+		  himemce_lazy_resolver resolver, void *source,
+		  const IMAGE_THUNK_DATA *import)
+{
+  struct trampoline *tramp = &block->trampolines[idx];
+  struct himemce_lazy_import *imp = &block->imports[idx];
+
+  imp->slot = slot;
+  imp->resolve = resolver;
+  imp->source = source;
+  imp->import = import;
+
+  memcpy (tramp->code, trampoline_code, sizeof (trampoline_code));
+  tramp->import = (DWORD) imp;
+  tramp->entry = (DWORD) &block->entry;
+  *slot = (DWORD) tramp;
+}
+
+
+void
+himemce_lazy_commit (struct himemce_lazy_block *block)
+{
+  FlushInstructionCache (GetCurrentProcess (), block, block->size);
+}
+
+
+void
+himemce_lazy_free (struct himemce_lazy_block *block)
+{
+  VirtualFree (block, 0, MEM_RELEASE);
+}
+
+
+int
+himemce_lazy_bind_all (struct himemce_lazy_block *block)
+{
+  int nr = 0;
+  int i;
+
+  for (i = 0; i < block->nr; i++)
+    if (block->imports[i].slot
+	&& *block->imports[i].slot == (DWORD) &block->trampolines[i])
+      {
+	himemce_lazy_bind (&block->imports[i]);
+	nr++;
+      }
+  return nr;
+}
+
+
+int
+himemce_lazy_resolved (struct himemce_lazy_block *block)
+{
+  int nr = 0;
+  int i;
+
+  for (i = 0; i < block->nr; i++)
+    if (block->imports[i].slot
+	&& *block->imports[i].slot != (DWORD) &block->trampolines[i])
+      nr++;
+  return nr;
+}
+
+
+void *
+himemce_lazy_bind (struct himemce_lazy_import *imp)
+{
+  void *proc = imp->resolve (imp);
+
+  /* Several threads may get here for the same import, but they all
+     store the same address.  */
+  *imp->slot = (DWORD) proc;
+  return proc;
+}
+
+
+/* Data can only be told from functions by the decoration of C++
+   names.  Microsoft names encode the storage class of data as a
+   digit right after the "@@" that ends the qualified name (functions
+   have a letter there), so any "@@" followed by a digit counts as
+   data; back references in argument lists also look like this, which
+   is the safe side.  Itanium names of functions end with their
+   argument types, so names that end in "E" (the end of a nested
+   name) count as data, as do the special names for vtables, typeinfo
+   and guard variables.  Unmangled names are taken to be functions,
+   as the system DLLs export hardly any data.  */
+BOOL
+himemce_lazy_is_code (const char *name)
+{
+  if (name[0] == '?')
+    {
+      const char *ptr = name;
+
+      while ((ptr = strstr (ptr, "@@")))
+	{
+	  ptr += 2;
+	  if (*ptr >= '0' && *ptr <= '9')
+	    return FALSE;
+	}
+      return TRUE;
+    }
+  if (name[0] == '_' && name[1] == 'Z')
+    {
+      size_t len = strlen (name);
+
+      if (name[2] == 'T' || (name[2] == 'G' && name[3] == 'V'))
+	return FALSE;
+      return name[len - 1] != 'E';
+    }
+  return TRUE;
+}
@@ -0,0 +1,101 @@
+/* himemce-stub.h - High Memory for Windows CE (import stubs)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef HIMEMCE_STUB_H
+#define HIMEMCE_STUB_H 1
+
+#include <windows.h>
+
+/* Code generated at load time for import address table slots.  The
+   code is ARM code, which Thumb callers reach through BX as usual for
+   imports, and which continues with BX, so that the targets can be
+   Thumb code as well.  On the build host, the code is generated the
+   same way, but never run.  */
+
+/* The exception raised when a stub for a missing import is called.
+   The parameters are the DLL name and the function name, or the
+   ordinal if that is below 0x10000.  The same code as in Wine.  */
+#define EXCEPTION_WINE_STUB 0x80000100
+
+/* Return a stub for the function NAME, or the ordinal NAME if that
+   is below 0x10000, of DLL, which raises EXCEPTION_WINE_STUB.  The
+   stub and the copies of the names it keeps are in the high memory
+   area, so that stubs made by the preloader work in every process.
+   Stubs are never freed.  Returns NULL if out of memory.  */
+void *himemce_stub_missing (const char *dll, const char *name);
+
+
+/* Lazy binding: every import address table slot points to a
+   trampoline first, which calls the resolver of its import, stores
+   the result in the slot, and jumps to it.  */
+
+struct himemce_lazy_import;
+
+/* Return the address of the import IMP.  */
+typedef void *(*himemce_lazy_resolver) (struct himemce_lazy_import *imp);
+
+struct himemce_lazy_import
+{
+  /* The import address table slot.  */
+  DWORD *slot;
+
+  himemce_lazy_resolver resolve;
+
+  /* For the resolver.  */
+  void *source;
+  const IMAGE_THUNK_DATA *import;
+};
+
+/* The trampolines of one image.  */
+struct himemce_lazy_block;
+
+/* Allocate a block with NR trampolines.  Returns NULL if out of
+   memory.  */
+struct himemce_lazy_block *himemce_lazy_alloc (int nr);
+
+/* Set up trampoline IDX of BLOCK for the import IMPORT with the
+   RESOLVER and its SOURCE, and point SLOT to it.  */
+void himemce_lazy_set (struct himemce_lazy_block *block, int idx,
+		       DWORD *slot, himemce_lazy_resolver resolver,
+		       void *source, const IMAGE_THUNK_DATA *import);
+
+/* Make the trampolines of BLOCK ready to run.  */
+void himemce_lazy_commit (struct himemce_lazy_block *block);
+
+void himemce_lazy_free (struct himemce_lazy_block *block);
+
+/* Bind the imports of BLOCK that were not called yet, and return
+   their number.  */
+int himemce_lazy_bind_all (struct himemce_lazy_block *block);
+
+/* The number of imports resolved so far in BLOCK.  */
+int himemce_lazy_resolved (struct himemce_lazy_block *block);
+
+/* Resolve IMP, store the result in its slot and return it.  This is
+   what the trampolines call.  A missing import is bound to a stub
+   from himemce_stub_missing.  */
+void *himemce_lazy_bind (struct himemce_lazy_import *imp);
+
+/* Return true if the imported symbol NAME is known to be a function
+   by its mangling, or is not mangled at all.  Imported data must not
+   be bound lazily.  */
+BOOL himemce_lazy_is_code (const char *name);
+
+#endif /* HIMEMCE_STUB_H */
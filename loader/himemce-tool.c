@@ -28,6 +28,9 @@ int
 main (int argc, char *argv[])
 {
   struct himemce_map *map;
+  unsigned int discarded = 0;
+  unsigned int zero_filled = 0;
+  unsigned int low_used = 0;
   int i;
 
   /* Open the map data (which must exist).  */
@@ -41,13 +44,59 @@ main (int argc, char *argv[])
   printf ("Found map at %p (size 0x%x)\n", map, map->size);
   printf ("Low memory reserve at %p (size 0x%x)\n",
 	  map->low_start, map->low_size);
+  printf ("Generation 0x%08x\n", map->generation);
+  printf ("Version %u\n", map->version);
+  for (i = 0; i < map->nr_chunks; i++)
+    printf ("chunk[%2i] = segment %u (size 0x%x, used 0x%x)\n", i,
+	    map->chunk[i].segment, map->chunk[i].size, map->chunk[i].used);
   printf ("Listing %i modules:\n", map->nr_modules);
   for (i = 0; i < map->nr_modules; i++)
     {
-      struct himemce_module *mod = &map->module[i];
-      printf ("module[%2i] = %s %p\n", i, mod->name, mod->base);
+      struct himemce_module *mod = himemce_map_module (map, i);
+      struct himemce_low_section *low = himemce_module_low_sections (map, mod);
+      struct himemce_discarded *ranges = himemce_module_discarded (map, mod);
+      struct himemce_forward *forwards = himemce_module_forwards (map, mod);
+      unsigned int *closure = himemce_module_closure (map, mod);
+      int j;
+
+      printf ("module[%2i] = %s %p\n", i, himemce_module_name (map, mod),
+	      mod->base);
+      if (mod->low_size)
+	printf ("  low memory at %p (size 0x%x)\n", mod->low, mod->low_size);
       /* TODO: Loop through sections, show some more info.  */
+      for (j = 0; j < mod->nr_low_sections; j++)
+	{
+	  printf ("  low %p at %p (size 0x%x, initialized 0x%x)\n",
+		  (char *) mod->base + low[j].rva, low[j].low, low[j].size,
+		  low[j].init_size);
+	  zero_filled += low[j].size - low[j].init_size;
+	  low_used += low[j].size;
+	}
+      for (j = 0; j < mod->nr_discarded; j++)
+	{
+	  struct himemce_discarded *range = &ranges[j];
+
+	  printf ("  discarded %-8.8s at %p (size 0x%x)\n", range->name,
+		  (char *) mod->base + range->rva, range->size);
+	  discarded += range->size;
+	}
+      printf ("  loads");
+      for (j = 0; j < mod->nr_closure; j++)
+	printf (" %s", himemce_module_name
+		(map, himemce_map_module (map, closure[j])));
+      for (j = 0; j < mod->nr_sys_dlls; j++)
+	printf (" %s", himemce_module_sys_dll (map, mod, j));
+      printf ("\n");
+      for (j = 0; j < mod->nr_forwards; j++)
+	printf ("  forward #%u to %s = %p\n", forwards[j].ordinal,
+		(char *) mod->base + forwards[j].forward, forwards[j].target);
     }
+  printf ("Discarded 0x%x bytes\n", discarded);
+  printf ("Zero-filled 0x%x bytes of low memory\n", zero_filled);
+  if (map->low_size)
+    printf ("Packed 0x%x bytes of sections into 0x%x bytes of low memory "
+	    "(%u%%)\n", low_used, map->low_size,
+	    low_used * 100 / map->low_size);
 
   himemce_map_close (map);
   return 0;
@@ -56,23 +56,61 @@ get_app_name (void)
 }
   
 
+/* If the command line *CMDLINE starts with OPTION, skip it and return
+   true.  */
+static int
+skip_option (WCHAR **cmdline, const WCHAR *option)
+{
+  size_t len = wcslen (option);
+
+  if (wcsncmp (*cmdline, option, len)
+      || ((*cmdline)[len] != L' ' && (*cmdline)[len] != L'\0'))
+    return 0;
+
+  *cmdline += len;
+  while (**cmdline == L' ')
+    (*cmdline)++;
+  return 1;
+}
+
+
 int
 main (int argc, char *argv[])
 {
   WCHAR *app_name;
   WCHAR *cmdline;
+  DWORD flags = 0;
   BOOL ret;
   int result = 0;
 
   app_name = get_app_name ();
   cmdline = GetCommandLine ();
 
+  /* Options for the loader come first and are not passed on.  */
+  for (;;)
+    {
+      if (skip_option (&cmdline, L"--himemce-lazy"))
+	flags |= HIMEMCE_LAZY_LOAD;
+      else if (skip_option (&cmdline, L"--himemce-cache"))
+	flags |= HIMEMCE_CACHE_LOAD;
+      else if (skip_option (&cmdline, L"--himemce-threads"))
+	flags |= HIMEMCE_PARALLEL_RELOC;
+      else if (skip_option (&cmdline, L"--himemce-bind"))
+	flags |= HIMEMCE_BIND_IMPORTS;
+      else if (skip_option (&cmdline, L"--himemce-lazy-bind"))
+	flags |= HIMEMCE_LAZY_BIND;
+      else if (skip_option (&cmdline, L"--himemce-lazy-low"))
+	flags |= HIMEMCE_LAZY_LOW;
+      else
+	break;
+    }
+
   TRACE ("starting %S %S\n", app_name, cmdline);
 
   /* Note that this does not spawn a new process, but just calls into
      the startup function of the app eventually, and returns with its
      exit code.  */
-  ret = MyCreateProcessW (app_name, cmdline, &result);
+  ret = MyCreateProcessW (app_name, cmdline, flags, &result);
   if (! ret)
     {
       ERR ("starting %S failed: %i\n", app_name, GetLastError());
@@ -39,6 +39,10 @@ extern int verbose;
 
 /* libhimemce.c */
 void himemce_set_dllmain_cb (void (*cb) (DWORD, LPVOID));
+void himemce_set_fault_filter (int (*filter) (EXCEPTION_POINTERS *));
+HANDLE himemce_create_thread (LPSECURITY_ATTRIBUTES sa, DWORD stack_size,
+			      LPTHREAD_START_ROUTINE start, LPVOID param,
+			      DWORD flags, LPDWORD id);
 
 
 #endif /* HIMEMCE_H */
@@ -0,0 +1,1527 @@
+/* host-platform.c - High Memory for Windows CE (host platform layer)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* The subset of the Windows CE API used by the loader, implemented on
+   POSIX: virtual memory on mmap, file mappings on memfd, files on
+   file descriptors and the system loader on a table of stub DLLs.
+   This is enough to map, relocate and bind real ARM/Thumb images on
+   a build host, but not to run them.  */
+
+#define _GNU_SOURCE 1
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdio.h>
+
+#include "windows.h"
+
+#ifndef MAP_32BIT
+#define MAP_32BIT 0
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define HOST_PAGE_MASK 0xfff
+#define HOST_ROUND(size) (((size) + HOST_PAGE_MASK) & ~(SIZE_T) HOST_PAGE_MASK)
+
+
+struct host_stats host_stats;
+
+int host_quiet;
+
+unsigned int host_read_latency;
+
+static __thread DWORD last_error;
+
+
+DWORD
+GetLastError (void)
+{
+  return last_error;
+}
+
+
+void
+SetLastError (DWORD error)
+{
+  last_error = error;
+}
+
+
+static void
+set_errno_error (void)
+{
+  switch (errno)
+    {
+    case ENOENT:
+      SetLastError (ERROR_FILE_NOT_FOUND);
+      break;
+    case ENOMEM:
+      SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+      break;
+    case EEXIST:
+    case EINVAL:
+      SetLastError (ERROR_INVALID_ADDRESS);
+      break;
+    case EBADF:
+      SetLastError (ERROR_INVALID_HANDLE);
+      break;
+    default:
+      SetLastError (ERROR_INVALID_PARAMETER);
+    }
+}
+
+
+void
+host_stats_reset (void)
+{
+  memset (&host_stats, 0, sizeof (host_stats));
+}
+
+
+void
+Sleep (DWORD msec)
+{
+  usleep ((useconds_t) msec * 1000);
+}
+
+
+void
+GetSystemInfo (LPSYSTEM_INFO info)
+{
+  long nr = sysconf (_SC_NPROCESSORS_ONLN);
+
+  memset (info, 0, sizeof (*info));
+  info->dwPageSize = 0x1000;
+  info->dwAllocationGranularity = 0x10000;
+  info->lpMinimumApplicationAddress = (LPVOID) 0x10000;
+  info->lpMaximumApplicationAddress = (LPVOID) 0x7fffffff;
+  info->dwNumberOfProcessors = nr > 0 ? nr : 1;
+  info->dwActiveProcessorMask = info->dwNumberOfProcessors >= 32
+    ? 0xffffffff : (1UL << info->dwNumberOfProcessors) - 1;
+}
+
+
+ULONG
+MyRtlNtStatusToDosError (NTSTATUS status)
+{
+  /* Only the codes the loader can generate.  The full table lives in
+     ntdll_error.c, which needs the complete SDK headers.  */
+  switch (status)
+    {
+    case STATUS_SUCCESS:
+      return ERROR_SUCCESS;
+    case STATUS_NO_MEMORY:
+      return ERROR_NOT_ENOUGH_MEMORY;
+    case STATUS_DLL_NOT_FOUND:
+      return ERROR_MOD_NOT_FOUND;
+    case STATUS_PROCEDURE_NOT_FOUND:
+      return ERROR_PROC_NOT_FOUND;
+    case STATUS_INVALID_IMAGE_FORMAT:
+    case STATUS_INVALID_FILE_FOR_SECTION:
+      return ERROR_BAD_EXE_FORMAT;
+    case STATUS_CONFLICTING_ADDRESSES:
+      return ERROR_INVALID_ADDRESS;
+    case STATUS_NOT_IMPLEMENTED:
+    case STATUS_NOT_SUPPORTED:
+      return ERROR_NOT_SUPPORTED;
+    case STATUS_INVALID_PARAMETER:
+      return ERROR_INVALID_PARAMETER;
+    }
+  if (! (status & 0xc0000000))
+    return status;
+  return ERROR_MR_MID_NOT_FOUND;
+}
+
+
+
+/* Strings.  */
+
+static char *
+wide_to_host (LPCWSTR src)
+{
+  int len = WideCharToMultiByte (CP_UTF8, 0, src, -1, NULL, 0, NULL, NULL);
+  char *dst = malloc (len ? len : 1);
+
+  if (! dst)
+    return NULL;
+  WideCharToMultiByte (CP_UTF8, 0, src, -1, dst, len, NULL, NULL);
+  return dst;
+}
+
+
+LPWSTR
+host_path_to_wide (const char *path, WCHAR *buf)
+{
+  int i;
+
+  for (i = 0; path[i] && i < MAX_PATH - 1; i++)
+    buf[i] = (unsigned char) path[i];
+  buf[i] = 0;
+  return buf;
+}
+
+
+int
+WideCharToMultiByte (UINT codepage, DWORD flags, LPCWSTR src, int srclen,
+		     LPSTR dst, int dstlen, LPCSTR defchar, BOOL *used_defchar)
+{
+  int out = 0;
+  int i;
+
+  if (srclen < 0)
+    srclen = wcslen (src) + 1;
+
+  for (i = 0; i < srclen; i++)
+    {
+      unsigned long c = src[i];
+      unsigned char tmp[4];
+      int n;
+
+      if (c < 0x80)
+	{
+	  tmp[0] = c;
+	  n = 1;
+	}
+      else if (c < 0x800)
+	{
+	  tmp[0] = 0xc0 | (c >> 6);
+	  tmp[1] = 0x80 | (c & 0x3f);
+	  n = 2;
+	}
+      else if (c < 0x10000)
+	{
+	  tmp[0] = 0xe0 | (c >> 12);
+	  tmp[1] = 0x80 | ((c >> 6) & 0x3f);
+	  tmp[2] = 0x80 | (c & 0x3f);
+	  n = 3;
+	}
+      else
+	{
+	  tmp[0] = 0xf0 | (c >> 18);
+	  tmp[1] = 0x80 | ((c >> 12) & 0x3f);
+	  tmp[2] = 0x80 | ((c >> 6) & 0x3f);
+	  tmp[3] = 0x80 | (c & 0x3f);
+	  n = 4;
+	}
+
+      if (dstlen)
+	{
+	  if (out + n > dstlen)
+	    {
+	      SetLastError (ERROR_INVALID_PARAMETER);
+	      return 0;
+	    }
+	  memcpy (dst + out, tmp, n);
+	}
+      out += n;
+    }
+  if (used_defchar)
+    *used_defchar = FALSE;
+  return out;
+}
+
+
+
+/* Handles.  */
+
+enum host_object_type
+  {
+    HOST_FILE = 1,
+    HOST_MAPPING,
+    HOST_FIND,
+    HOST_EVENT,
+    HOST_THREAD
+  };
+
+/* Guards against foreign pointers passed as handles.  */
+#define HOST_OBJECT_MAGIC 0x686d6365
+
+struct host_object
+{
+  unsigned int magic;
+  enum host_object_type type;
+  int fd;
+
+  /* For HOST_MAPPING: the size of the object.  */
+  SIZE_T size;
+
+  /* For HOST_FIND.  */
+  DIR *dir;
+  char *dirname;
+  char *pattern;
+
+  /* For HOST_EVENT and HOST_THREAD, which can be waited for.  A
+     thread is signaled when it exits.  A running thread holds a
+     reference to its object, in addition to the handle.  */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int signaled;
+  int manual_reset;
+  int refs;
+  LPTHREAD_START_ROUTINE start;
+  LPVOID param;
+};
+
+
+static struct host_object *
+new_object (enum host_object_type type, int fd)
+{
+  struct host_object *obj = calloc (1, sizeof (*obj));
+
+  if (! obj)
+    {
+      SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+      return NULL;
+    }
+  obj->magic = HOST_OBJECT_MAGIC;
+  obj->type = type;
+  obj->fd = fd;
+  return obj;
+}
+
+
+static struct host_object *
+get_object (HANDLE handle, enum host_object_type type)
+{
+  struct host_object *obj = handle;
+
+  if (! obj || handle == INVALID_HANDLE_VALUE
+      || obj->magic != HOST_OBJECT_MAGIC || obj->type != type)
+    {
+      SetLastError (ERROR_INVALID_HANDLE);
+      return NULL;
+    }
+  return obj;
+}
+
+
+BOOL
+CloseHandle (HANDLE handle)
+{
+  struct host_object *obj = handle;
+
+  if (! obj || handle == INVALID_HANDLE_VALUE
+      || obj->magic != HOST_OBJECT_MAGIC)
+    {
+      SetLastError (ERROR_INVALID_HANDLE);
+      return FALSE;
+    }
+  obj->magic = 0;
+  if (obj->type == HOST_EVENT || obj->type == HOST_THREAD)
+    {
+      int refs;
+
+      pthread_mutex_lock (&obj->lock);
+      refs = --obj->refs;
+      pthread_mutex_unlock (&obj->lock);
+      if (refs)
+	return TRUE;
+      pthread_mutex_destroy (&obj->lock);
+      pthread_cond_destroy (&obj->cond);
+    }
+  if (obj->fd >= 0)
+    close (obj->fd);
+  if (obj->dir)
+    closedir (obj->dir);
+  free (obj->dirname);
+  free (obj->pattern);
+  free (obj);
+  return TRUE;
+}
+
+
+
+/* Files.  */
+
+HANDLE
+CreateFile (LPCWSTR name, DWORD access, DWORD share, void *sa,
+	    DWORD creation, DWORD flags, HANDLE template)
+{
+  struct host_object *obj;
+  char *path;
+  int oflags;
+  int fd;
+
+  if ((access & GENERIC_READ) && (access & GENERIC_WRITE))
+    oflags = O_RDWR;
+  else if (access & GENERIC_WRITE)
+    oflags = O_WRONLY;
+  else
+    oflags = O_RDONLY;
+  if (creation == CREATE_ALWAYS)
+    oflags |= O_CREAT | O_TRUNC;
+  else if (creation == CREATE_NEW)
+    oflags |= O_CREAT | O_EXCL;
+
+  path = wide_to_host (name);
+  if (! path)
+    {
+      SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+      return INVALID_HANDLE_VALUE;
+    }
+  fd = open (path, oflags | O_CLOEXEC, 0644);
+  free (path);
+  if (fd < 0)
+    {
+      set_errno_error ();
+      return INVALID_HANDLE_VALUE;
+    }
+  obj = new_object (HOST_FILE, fd);
+  if (! obj)
+    {
+      close (fd);
+      return INVALID_HANDLE_VALUE;
+    }
+  return obj;
+}
+
+
+HANDLE
+CreateFileForMappingW (LPCWSTR name, DWORD access, DWORD share, void *sa,
+		       DWORD creation, DWORD flags, HANDLE template)
+{
+  return CreateFile (name, access, share, sa, creation, flags, template);
+}
+
+
+BOOL
+ReadFile (HANDLE file, LPVOID buffer, DWORD len, LPDWORD nread,
+	  void *overlapped)
+{
+  struct host_object *obj = get_object (file, HOST_FILE);
+  ssize_t res;
+
+  if (! obj)
+    return FALSE;
+  host_stats.reads++;
+  if (host_read_latency)
+    usleep (host_read_latency);
+  res = read (obj->fd, buffer, len);
+  if (res < 0)
+    {
+      set_errno_error ();
+      return FALSE;
+    }
+  host_stats.read_bytes += res;
+  if (nread)
+    *nread = res;
+  return TRUE;
+}
+
+
+BOOL
+WriteFile (HANDLE file, LPCVOID buffer, DWORD len, LPDWORD written,
+	   void *overlapped)
+{
+  struct host_object *obj = get_object (file, HOST_FILE);
+  ssize_t res;
+
+  if (! obj)
+    return FALSE;
+  res = write (obj->fd, buffer, len);
+  if (res < 0)
+    {
+      set_errno_error ();
+      return FALSE;
+    }
+  if (written)
+    *written = res;
+  return TRUE;
+}
+
+
+DWORD
+SetFilePointer (HANDLE file, LONG offset, LONG *offset_high, DWORD method)
+{
+  struct host_object *obj = get_object (file, HOST_FILE);
+  off_t pos = offset;
+  off_t res;
+
+  if (! obj)
+    return (DWORD) -1;
+  if (offset_high)
+    pos = (off_t) (((unsigned long long) *offset_high << 32) | (DWORD) offset);
+  host_stats.seeks++;
+  res = lseek (obj->fd, pos, method == FILE_END ? SEEK_END
+	       : (method == FILE_CURRENT ? SEEK_CUR : SEEK_SET));
+  if (res < 0)
+    {
+      set_errno_error ();
+      return (DWORD) -1;
+    }
+  if (offset_high)
+    *offset_high = (LONG) (res >> 32);
+  return (DWORD) res;
+}
+
+
+DWORD
+GetFileSize (HANDLE file, LPDWORD size_high)
+{
+  struct host_object *obj = get_object (file, HOST_FILE);
+  struct stat st;
+
+  if (! obj)
+    return INVALID_FILE_SIZE;
+  if (fstat (obj->fd, &st) < 0)
+    {
+      set_errno_error ();
+      return INVALID_FILE_SIZE;
+    }
+  if (size_high)
+    *size_high = (DWORD) ((unsigned long long) st.st_size >> 32);
+  return (DWORD) st.st_size;
+}
+
+
+/* Convert TS to a FILETIME (100 ns units since 1601).  */
+static void
+host_filetime (const struct timespec *ts, LPFILETIME ft)
+{
+  unsigned long long t;
+
+  if (! ft)
+    return;
+  t = ((unsigned long long) ts->tv_sec + 11644473600ULL) * 10000000ULL
+    + ts->tv_nsec / 100;
+  ft->dwLowDateTime = (DWORD) t;
+  ft->dwHighDateTime = (DWORD) (t >> 32);
+}
+
+
+BOOL
+GetFileTime (HANDLE file, LPFILETIME creation, LPFILETIME access,
+	     LPFILETIME write)
+{
+  struct host_object *obj = get_object (file, HOST_FILE);
+  struct stat st;
+
+  if (! obj)
+    return FALSE;
+  if (fstat (obj->fd, &st) < 0)
+    {
+      set_errno_error ();
+      return FALSE;
+    }
+  host_filetime (&st.st_ctim, creation);
+  host_filetime (&st.st_atim, access);
+  host_filetime (&st.st_mtim, write);
+  return TRUE;
+}
+
+
+size_t
+host_pread (HANDLE handle, void *buffer, size_t len, long long offset)
+{
+  struct host_object *obj = get_object (handle, HOST_FILE);
+  ssize_t res;
+
+  if (! obj)
+    return -1;
+  host_stats.reads++;
+  if (host_read_latency)
+    usleep (host_read_latency);
+  res = pread (obj->fd, buffer, len, offset);
+  if (res < 0)
+    {
+      set_errno_error ();
+      return -1;
+    }
+  host_stats.read_bytes += res;
+  return res;
+}
+
+
+HANDLE
+FindFirstFile (LPCWSTR pattern, WIN32_FIND_DATA *data)
+{
+  struct host_object *obj;
+  char *path;
+  char *slash;
+
+  path = wide_to_host (pattern);
+  if (! path)
+    {
+      SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+      return INVALID_HANDLE_VALUE;
+    }
+  obj = new_object (HOST_FIND, -1);
+  if (! obj)
+    {
+      free (path);
+      return INVALID_HANDLE_VALUE;
+    }
+  slash = strrchr (path, '/');
+  if (! slash)
+    slash = strrchr (path, '\\');
+  if (slash)
+    {
+      *slash = '\0';
+      obj->dirname = strdup (*path ? path : "/");
+      obj->pattern = strdup (slash + 1);
+    }
+  else
+    {
+      obj->dirname = strdup (".");
+      obj->pattern = strdup (path);
+    }
+  free (path);
+  if (! obj->dirname || ! obj->pattern)
+    {
+      CloseHandle (obj);
+      SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+      return INVALID_HANDLE_VALUE;
+    }
+
+  obj->dir = opendir (obj->dirname);
+  if (! obj->dir)
+    {
+      set_errno_error ();
+      CloseHandle (obj);
+      return INVALID_HANDLE_VALUE;
+    }
+  if (! FindNextFile (obj, data))
+    {
+      CloseHandle (obj);
+      SetLastError (ERROR_FILE_NOT_FOUND);
+      return INVALID_HANDLE_VALUE;
+    }
+  return obj;
+}
+
+
+BOOL
+FindNextFile (HANDLE find, WIN32_FIND_DATA *data)
+{
+  struct host_object *obj = get_object (find, HOST_FIND);
+  struct dirent *ent;
+
+  if (! obj)
+    return FALSE;
+  while ((ent = readdir (obj->dir)))
+    {
+      if (fnmatch (obj->pattern, ent->d_name, FNM_CASEFOLD))
+	continue;
+      memset (data, 0, sizeof (*data));
+      data->dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+      host_path_to_wide (ent->d_name, data->cFileName);
+      return TRUE;
+    }
+  SetLastError (ERROR_NO_MORE_FILES);
+  return FALSE;
+}
+
+
+BOOL
+FindClose (HANDLE find)
+{
+  if (! get_object (find, HOST_FIND))
+    return FALSE;
+  return CloseHandle (find);
+}
+
+
+
+/* Virtual memory.  The host keeps track of reservations, so that
+   MEM_RELEASE can free them as a whole.  All memory is allocated in
+   the low 4 GB, because the loader stores addresses in 32 bit PE
+   fields (for example the low section address in
+   PointerToLinenumbers).  Images are never run, so nothing is ever
+   mapped executable.  */
+
+struct host_region
+{
+  struct host_region *next;
+  char *base;
+  SIZE_T size;
+  /* Nonzero if this is a view of a file mapping.  */
+  int is_view;
+};
+
+static struct host_region *regions;
+
+/* Protects REGIONS.  The SIGSEGV handler commits pages of lazily
+   loaded images, and takes the lock like any other thread.  Nothing
+   done under the lock touches memory that can fault, so the handler
+   never runs in a thread that holds it.  */
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int
+host_prot (DWORD protect)
+{
+  switch (protect & 0xff)
+    {
+    case PAGE_READONLY:
+    case PAGE_EXECUTE:
+    case PAGE_EXECUTE_READ:
+      return PROT_READ;
+    case PAGE_READWRITE:
+    case PAGE_WRITECOPY:
+    case PAGE_EXECUTE_READWRITE:
+    case PAGE_EXECUTE_WRITECOPY:
+      return PROT_READ | PROT_WRITE;
+    default:
+      return PROT_NONE;
+    }
+}
+
+
+static struct host_region *
+find_region (const void *addr, int exact)
+{
+  struct host_region *reg;
+
+  for (reg = regions; reg; reg = reg->next)
+    {
+      if (exact && reg->base == addr)
+	return reg;
+      if (! exact && (char *) addr >= reg->base
+	  && (char *) addr < reg->base + reg->size)
+	return reg;
+    }
+  return NULL;
+}
+
+
+static struct host_region *
+add_region (void *base, SIZE_T size, int is_view)
+{
+  struct host_region *reg = malloc (sizeof (*reg));
+
+  if (! reg)
+    return NULL;
+  reg->base = base;
+  reg->size = size;
+  reg->is_view = is_view;
+  reg->next = regions;
+  regions = reg;
+  return reg;
+}
+
+
+static void
+remove_region (struct host_region *reg)
+{
+  struct host_region **prevp;
+
+  for (prevp = &regions; *prevp; prevp = &(*prevp)->next)
+    if (*prevp == reg)
+      {
+	*prevp = reg->next;
+	free (reg);
+	return;
+      }
+}
+
+
+static void *
+host_mmap (void *addr, SIZE_T size, int prot, int flags, int fd, off_t off)
+{
+  void *ptr;
+
+  if (addr)
+    flags |= MAP_FIXED_NOREPLACE;
+  else
+    flags |= MAP_32BIT;
+  ptr = mmap (addr, size, prot, flags, fd, off);
+  if (ptr == MAP_FAILED)
+    {
+      set_errno_error ();
+      return NULL;
+    }
+  if (addr && ptr != addr)
+    {
+      /* Kernels without MAP_FIXED_NOREPLACE treat it as a hint.  */
+      munmap (ptr, size);
+      SetLastError (ERROR_INVALID_ADDRESS);
+      return NULL;
+    }
+  return ptr;
+}
+
+
+LPVOID
+VirtualAlloc (LPVOID addr, SIZE_T size, DWORD type, DWORD protect)
+{
+  char *ptr;
+
+  host_stats.valloc_calls++;
+  if (! size)
+    {
+      SetLastError (ERROR_INVALID_PARAMETER);
+      return NULL;
+    }
+
+  if ((type & MEM_RESERVE) || ! addr)
+    {
+      int prot = (type & MEM_COMMIT) ? host_prot (protect) : PROT_NONE;
+
+      size = HOST_ROUND (size);
+      pthread_mutex_lock (&regions_lock);
+      ptr = host_mmap (addr, size, prot,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (ptr && ! add_region (ptr, size, 0))
+	{
+	  munmap (ptr, size);
+	  SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+	  ptr = NULL;
+	}
+      pthread_mutex_unlock (&regions_lock);
+      return ptr;
+    }
+
+  /* Commit inside an existing reservation.  Fresh pages read as
+     zero, as on Windows.  The reservation must not go away in
+     between.  */
+  ptr = (char *) ((UINT_PTR) addr & ~(UINT_PTR) HOST_PAGE_MASK);
+  size = HOST_ROUND (size + ((char *) addr - ptr));
+  pthread_mutex_lock (&regions_lock);
+  if (! find_region (ptr, 0))
+    {
+      SetLastError (ERROR_INVALID_ADDRESS);
+      addr = NULL;
+    }
+  else if (mprotect (ptr, size, host_prot (protect)) < 0)
+    {
+      set_errno_error ();
+      addr = NULL;
+    }
+  pthread_mutex_unlock (&regions_lock);
+  return addr;
+}
+
+
+BOOL
+VirtualFree (LPVOID addr, SIZE_T size, DWORD type)
+{
+  struct host_region *reg;
+  BOOL ok = TRUE;
+
+  host_stats.vfree_calls++;
+  if (type & MEM_RELEASE)
+    {
+      /* Windows CE accepts the size of the reservation here.  */
+      pthread_mutex_lock (&regions_lock);
+      reg = find_region (addr, 1);
+      if (! reg || reg->is_view)
+	{
+	  SetLastError (ERROR_INVALID_PARAMETER);
+	  ok = FALSE;
+	}
+      else
+	{
+	  munmap (reg->base, reg->size);
+	  remove_region (reg);
+	}
+      pthread_mutex_unlock (&regions_lock);
+      return ok;
+    }
+
+  if (type & MEM_DECOMMIT)
+    {
+      char *ptr = (char *) ((UINT_PTR) addr & ~(UINT_PTR) HOST_PAGE_MASK);
+
+      size = HOST_ROUND (size + ((char *) addr - ptr));
+      pthread_mutex_lock (&regions_lock);
+      if (! find_region (ptr, 0))
+	{
+	  SetLastError (ERROR_INVALID_ADDRESS);
+	  ok = FALSE;
+	}
+      /* Replacing the pages drops their contents, like a decommit.  */
+      else if (mmap (ptr, size, PROT_NONE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+		     -1, 0) == MAP_FAILED)
+	{
+	  set_errno_error ();
+	  ok = FALSE;
+	}
+      pthread_mutex_unlock (&regions_lock);
+      return ok;
+    }
+
+  SetLastError (ERROR_INVALID_PARAMETER);
+  return FALSE;
+}
+
+
+
+/* File mappings.  Anonymous mappings are backed by memfd.  Named
+   mappings are kept in a registry for the lifetime of the process, so
+   that a later CreateFileMapping with the same name opens the same
+   object (the preloader and the loader can run in one host process
+   for benchmarking).  */
+
+struct named_mapping
+{
+  struct named_mapping *next;
+  WCHAR *name;
+  int fd;
+  SIZE_T size;
+};
+
+static struct named_mapping *named_mappings;
+
+
+HANDLE
+CreateFileMapping (HANDLE file, void *sa, DWORD protect, DWORD size_high,
+		   DWORD size_low, LPCWSTR name)
+{
+  struct host_object *obj;
+  SIZE_T size = ((SIZE_T) size_high << 32) | size_low;
+  int fd;
+
+  host_stats.mappings++;
+  SetLastError (0);
+
+  if (file == INVALID_HANDLE_VALUE)
+    {
+      struct named_mapping *nm = NULL;
+
+      if (name)
+	for (nm = named_mappings; nm; nm = nm->next)
+	  if (! wcscmp (nm->name, name))
+	    break;
+
+      if (nm)
+	{
+	  fd = dup (nm->fd);
+	  size = nm->size;
+	  if (fd < 0)
+	    {
+	      set_errno_error ();
+	      return NULL;
+	    }
+	  obj = new_object (HOST_MAPPING, fd);
+	  if (! obj)
+	    {
+	      close (fd);
+	      return NULL;
+	    }
+	  obj->size = size;
+	  SetLastError (ERROR_ALREADY_EXISTS);
+	  return obj;
+	}
+
+      if (! size)
+	{
+	  SetLastError (ERROR_INVALID_PARAMETER);
+	  return NULL;
+	}
+      fd = memfd_create ("himemce", MFD_CLOEXEC);
+      if (fd < 0 || ftruncate (fd, size) < 0)
+	{
+	  set_errno_error ();
+	  if (fd >= 0)
+	    close (fd);
+	  return NULL;
+	}
+      if (name)
+	{
+	  nm = malloc (sizeof (*nm));
+	  if (nm)
+	    nm->name = wcsdup (name);
+	  if (! nm || ! nm->name || (nm->fd = dup (fd)) < 0)
+	    {
+	      free (nm);
+	      close (fd);
+	      SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+	      return NULL;
+	    }
+	  nm->size = size;
+	  nm->next = named_mappings;
+	  named_mappings = nm;
+	}
+    }
+  else
+    {
+      struct host_object *fobj = get_object (file, HOST_FILE);
+      struct stat st;
+
+      if (! fobj)
+	return NULL;
+      fd = dup (fobj->fd);
+      if (fd < 0 || fstat (fd, &st) < 0)
+	{
+	  set_errno_error ();
+	  if (fd >= 0)
+	    close (fd);
+	  return NULL;
+	}
+      if (! size || size > (SIZE_T) st.st_size)
+	size = st.st_size;
+    }
+
+  obj = new_object (HOST_MAPPING, fd);
+  if (! obj)
+    {
+      close (fd);
+      return NULL;
+    }
+  obj->size = size;
+  return obj;
+}
+
+
+LPVOID
+MapViewOfFile (HANDLE mapping, DWORD access, DWORD offset_high,
+	       DWORD offset_low, SIZE_T size)
+{
+  struct host_object *obj = get_object (mapping, HOST_MAPPING);
+  off_t offset = ((off_t) offset_high << 32) | offset_low;
+  int prot = PROT_READ;
+  int flags = MAP_SHARED;
+  void *ptr;
+
+  if (! obj)
+    return NULL;
+  if (! size)
+    size = obj->size - offset;
+  if (access & FILE_MAP_WRITE)
+    prot |= PROT_WRITE;
+  if (access == FILE_MAP_COPY)
+    {
+      prot |= PROT_WRITE;
+      flags = MAP_PRIVATE;
+    }
+
+  host_stats.views++;
+  pthread_mutex_lock (&regions_lock);
+  ptr = host_mmap (NULL, size, prot, flags, obj->fd, offset);
+  if (ptr && ! add_region (ptr, size, 1))
+    {
+      munmap (ptr, size);
+      SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+      ptr = NULL;
+    }
+  pthread_mutex_unlock (&regions_lock);
+  return ptr;
+}
+
+
+BOOL
+UnmapViewOfFile (LPCVOID addr)
+{
+  struct host_region *reg;
+  BOOL ok = TRUE;
+
+  pthread_mutex_lock (&regions_lock);
+  reg = find_region (addr, 1);
+  if (! reg || ! reg->is_view)
+    {
+      SetLastError (ERROR_INVALID_ADDRESS);
+      ok = FALSE;
+    }
+  else
+    {
+      munmap (reg->base, reg->size);
+      remove_region (reg);
+    }
+  pthread_mutex_unlock (&regions_lock);
+  return ok;
+}
+
+
+BOOL
+FlushViewOfFile (LPCVOID addr, SIZE_T size)
+{
+  struct host_region *reg;
+  char *start = (char *) ((UINT_PTR) addr & ~(UINT_PTR) 0xfff);
+  BOOL ok = TRUE;
+
+  pthread_mutex_lock (&regions_lock);
+  reg = find_region (addr, 0);
+  if (! reg || ! reg->is_view)
+    {
+      SetLastError (ERROR_INVALID_ADDRESS);
+      ok = FALSE;
+    }
+  else
+    {
+      if (! size)
+	size = reg->base + reg->size - (char *) addr;
+      if (msync (start, (char *) addr + size - start, MS_SYNC))
+	{
+	  SetLastError (ERROR_INVALID_ADDRESS);
+	  ok = FALSE;
+	}
+    }
+  pthread_mutex_unlock (&regions_lock);
+  return ok;
+}
+
+
+
+/* Threads and events.  */
+
+static struct host_object *
+new_waitable (enum host_object_type type, int manual_reset, int signaled)
+{
+  struct host_object *obj = new_object (type, -1);
+
+  if (! obj)
+    return NULL;
+  pthread_mutex_init (&obj->lock, NULL);
+  pthread_cond_init (&obj->cond, NULL);
+  obj->manual_reset = manual_reset;
+  obj->signaled = signaled;
+  obj->refs = 1;
+  return obj;
+}
+
+
+static struct host_object *
+get_waitable (HANDLE handle)
+{
+  struct host_object *obj = handle;
+
+  if (! obj || handle == INVALID_HANDLE_VALUE
+      || obj->magic != HOST_OBJECT_MAGIC
+      || (obj->type != HOST_EVENT && obj->type != HOST_THREAD))
+    {
+      SetLastError (ERROR_INVALID_HANDLE);
+      return NULL;
+    }
+  return obj;
+}
+
+
+static void
+set_signaled (struct host_object *obj, int signaled)
+{
+  pthread_mutex_lock (&obj->lock);
+  obj->signaled = signaled;
+  if (signaled)
+    pthread_cond_broadcast (&obj->cond);
+  pthread_mutex_unlock (&obj->lock);
+}
+
+
+HANDLE
+CreateEvent (void *sa, BOOL manual_reset, BOOL initial_state, LPCWSTR name)
+{
+  if (name)
+    {
+      /* Named events are not needed by the loader.  */
+      SetLastError (ERROR_INVALID_PARAMETER);
+      return NULL;
+    }
+  return new_waitable (HOST_EVENT, manual_reset, initial_state);
+}
+
+
+BOOL
+SetEvent (HANDLE event)
+{
+  struct host_object *obj = get_waitable (event);
+
+  if (! obj || obj->type != HOST_EVENT)
+    return FALSE;
+  set_signaled (obj, 1);
+  return TRUE;
+}
+
+
+BOOL
+ResetEvent (HANDLE event)
+{
+  struct host_object *obj = get_waitable (event);
+
+  if (! obj || obj->type != HOST_EVENT)
+    return FALSE;
+  set_signaled (obj, 0);
+  return TRUE;
+}
+
+
+static void *
+thread_start (void *arg)
+{
+  struct host_object *obj = arg;
+  int refs;
+
+  obj->start (obj->param);
+
+  pthread_mutex_lock (&obj->lock);
+  obj->signaled = 1;
+  pthread_cond_broadcast (&obj->cond);
+  refs = --obj->refs;
+  pthread_mutex_unlock (&obj->lock);
+  if (! refs)
+    {
+      pthread_mutex_destroy (&obj->lock);
+      pthread_cond_destroy (&obj->cond);
+      free (obj);
+    }
+  return NULL;
+}
+
+
+HANDLE
+CreateThread (void *sa, SIZE_T stack_size, LPTHREAD_START_ROUTINE start,
+	      LPVOID param, DWORD flags, LPDWORD thread_id)
+{
+  struct host_object *obj = new_waitable (HOST_THREAD, 1, 0);
+  pthread_t thread;
+  int err;
+
+  if (! obj)
+    return NULL;
+  obj->start = start;
+  obj->param = param;
+  obj->refs = 2;
+  err = pthread_create (&thread, NULL, thread_start, obj);
+  if (err)
+    {
+      obj->refs = 1;
+      CloseHandle (obj);
+      errno = err;
+      set_errno_error ();
+      return NULL;
+    }
+  pthread_detach (thread);
+  if (thread_id)
+    *thread_id = (DWORD) (UINT_PTR) obj;
+  return obj;
+}
+
+
+DWORD
+WaitForSingleObject (HANDLE handle, DWORD timeout)
+{
+  struct host_object *obj = get_waitable (handle);
+  struct timespec deadline;
+  DWORD res = WAIT_OBJECT_0;
+
+  if (! obj)
+    return WAIT_FAILED;
+
+  if (timeout != INFINITE)
+    {
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += timeout / 1000;
+      deadline.tv_nsec += (timeout % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+	{
+	  deadline.tv_sec++;
+	  deadline.tv_nsec -= 1000000000L;
+	}
+    }
+
+  pthread_mutex_lock (&obj->lock);
+  while (! obj->signaled)
+    {
+      if (timeout == INFINITE)
+	pthread_cond_wait (&obj->cond, &obj->lock);
+      else if (pthread_cond_timedwait (&obj->cond, &obj->lock, &deadline)
+	       == ETIMEDOUT)
+	{
+	  res = WAIT_TIMEOUT;
+	  break;
+	}
+    }
+  if (res == WAIT_OBJECT_0 && ! obj->manual_reset)
+    obj->signaled = 0;
+  pthread_mutex_unlock (&obj->lock);
+  return res;
+}
+
+
+
+/* Page faults.  Lazily loaded images are reserved but not committed,
+   and their pages are brought in from the access violation handler.
+   On Windows CE this is an exception filter around the entry point,
+   on the host it is a SIGSEGV handler.  */
+
+static int (*fault_handler) (void *addr);
+
+
+static void
+host_sigsegv (int sig, siginfo_t *info, void *context)
+{
+  host_stats.faults++;
+  if (fault_handler && fault_handler (info->si_addr))
+    return;
+
+  /* Returning retries the access, which now faults fatally.  */
+  signal (sig, SIG_DFL);
+}
+
+
+void
+host_set_fault_handler (int (*handler) (void *addr))
+{
+  struct sigaction sa;
+
+  fault_handler = handler;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_sigaction = host_sigsegv;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGSEGV, &sa, NULL);
+}
+
+
+
+/* The system loader.  System DLLs are replaced by stubs: each one has
+   a page of address space, and every export resolves to an address
+   in it, derived from the ordinal or a hash of the name.  The
+   addresses are stable and distinct enough to check import
+   resolution, and trap if anything ever jumps there.  */
+
+#define STUB_SLOTS 4096
+#define STUB_SLOT_SIZE 16
+
+struct stub_dll
+{
+  struct stub_dll *next;
+  char *name;
+  char *arena;
+};
+
+static const char *const default_stub_dlls[] =
+  {
+    "coredll.dll", "ws2.dll", "winsock.dll", "commctrl.dll",
+    "commdlg.dll", "ole32.dll", "oleaut32.dll", "aygshell.dll",
+    "ceshell.dll", "mmtimer.dll", "crypt32.dll", "iphlpapi.dll",
+    "toolhelp.dll", "note_prj.dll", "secur32.dll", "wininet.dll",
+    "libhimemce.dll", NULL
+  };
+
+static struct stub_dll *stub_dlls;
+static int stub_dlls_initialized;
+
+
+void
+host_add_stub_dll (const char *name)
+{
+  struct stub_dll *dll = calloc (1, sizeof (*dll));
+
+  if (! dll)
+    return;
+  dll->name = strdup (name);
+  if (! dll->name)
+    {
+      free (dll);
+      return;
+    }
+  dll->next = stub_dlls;
+  stub_dlls = dll;
+}
+
+
+static struct stub_dll *
+find_stub_dll (const char *name)
+{
+  struct stub_dll *dll;
+  const char *base;
+
+  if (! stub_dlls_initialized)
+    {
+      int i;
+
+      stub_dlls_initialized = 1;
+      for (i = 0; default_stub_dlls[i]; i++)
+	host_add_stub_dll (default_stub_dlls[i]);
+    }
+
+  base = strrchr (name, '\\');
+  if (! base)
+    base = strrchr (name, '/');
+  base = base ? base + 1 : name;
+
+  for (dll = stub_dlls; dll; dll = dll->next)
+    if (! strcasecmp (dll->name, base))
+      return dll;
+  return NULL;
+}
+
+
+HMODULE
+LoadLibrary (LPCWSTR name)
+{
+  struct stub_dll *dll;
+  char *hname;
+
+  host_stats.load_library_calls++;
+  hname = wide_to_host (name);
+  if (! hname)
+    {
+      SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+      return NULL;
+    }
+  dll = find_stub_dll (hname);
+  free (hname);
+  if (! dll)
+    {
+      SetLastError (ERROR_MOD_NOT_FOUND);
+      return NULL;
+    }
+  if (! dll->arena)
+    {
+      dll->arena = host_mmap (NULL, STUB_SLOTS * STUB_SLOT_SIZE, PROT_NONE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			      -1, 0);
+      if (! dll->arena)
+	return NULL;
+    }
+  return dll;
+}
+
+
+BOOL
+FreeLibrary (HMODULE module)
+{
+  /* Stubs stay loaded.  */
+  return module != NULL;
+}
+
+
+static struct stub_dll *
+get_stub_dll (HMODULE module)
+{
+  struct stub_dll *dll;
+
+  for (dll = stub_dlls; dll; dll = dll->next)
+    if (dll == module)
+      return dll;
+  return NULL;
+}
+
+
+static FARPROC
+stub_proc (struct stub_dll *dll, unsigned int slot)
+{
+  return (FARPROC) (dll->arena + (slot % STUB_SLOTS) * STUB_SLOT_SIZE);
+}
+
+
+FARPROC
+GetProcAddress (HMODULE module, LPCWSTR name)
+{
+  struct stub_dll *dll = get_stub_dll (module);
+  unsigned int hash = 5381;
+
+  host_stats.get_proc_address_calls++;
+  if (! dll || ! dll->arena)
+    {
+      SetLastError (ERROR_INVALID_HANDLE);
+      return NULL;
+    }
+  if ((ULONG_PTR) name < 0x10000)
+    return stub_proc (dll, (unsigned int) (ULONG_PTR) name);
+  while (*name)
+    hash = hash * 33 + (unsigned int) *name++;
+  return stub_proc (dll, hash);
+}
+
+
+FARPROC
+GetProcAddressA (HMODULE module, LPCSTR name)
+{
+  struct stub_dll *dll = get_stub_dll (module);
+  unsigned int hash = 5381;
+
+  host_stats.get_proc_address_calls++;
+  if (! dll || ! dll->arena)
+    {
+      SetLastError (ERROR_INVALID_HANDLE);
+      return NULL;
+    }
+  if ((ULONG_PTR) name < 0x10000)
+    return stub_proc (dll, (unsigned int) (ULONG_PTR) name);
+  while (*name)
+    hash = hash * 33 + (unsigned char) *name++;
+  return stub_proc (dll, hash);
+}
+
+
+/* The module handle of the running program.  */
+static char self_module;
+
+
+HMODULE
+GetModuleHandle (LPCWSTR name)
+{
+  if (! name)
+    return &self_module;
+  SetLastError (ERROR_MOD_NOT_FOUND);
+  return NULL;
+}
+
+
+HANDLE
+GetCurrentProcess (void)
+{
+  return (HANDLE) -1;
+}
+
+
+BOOL
+FlushInstructionCache (HANDLE process, LPCVOID base, SIZE_T size)
+{
+  return TRUE;
+}
+
+
+DWORD
+GetModuleFileName (HMODULE module, LPWSTR filename, DWORD size)
+{
+  char path[MAX_PATH];
+  ssize_t len;
+  DWORD i;
+
+  if (module != &self_module)
+    {
+      SetLastError (ERROR_MOD_NOT_FOUND);
+      return 0;
+    }
+  len = readlink ("/proc/self/exe", path, sizeof (path) - 1);
+  if (len < 0)
+    {
+      set_errno_error ();
+      return 0;
+    }
+  path[len] = '\0';
+  for (i = 0; i + 1 < size && path[i]; i++)
+    filename[i] = (unsigned char) path[i];
+  if (size)
+    filename[i] = 0;
+  return i;
+}
+
+
+LPWSTR
+GetCommandLine (void)
+{
+  static WCHAR empty[1];
+  return empty;
+}
@@ -0,0 +1,677 @@
+/* windows.h - High Memory for Windows CE (host platform layer)
+   Copyright (C) 2010 g10 Code GmbH
+
+   This file is part of HiMemCE.
+
+   HiMemCE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of
+   the License, or (at your option) any later version.
+
+   HiMemCE is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* This is a minimal replacement for the Windows CE SDK header, just
+   enough to compile the PE loading core on a POSIX host.  The images
+   are mapped, relocated and bound, but never run, so the structures
+   describe the 32 bit PE format regardless of the host word size.
+   The API subset is implemented in host-platform.c.  */
+
+#ifndef HIMEMCE_HOST_WINDOWS_H
+#define HIMEMCE_HOST_WINDOWS_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <wchar.h>
+
+
+/* Basic types.  */
+
+typedef uint8_t BYTE, *PBYTE;
+typedef uint16_t WORD, *PWORD;
+typedef uint32_t DWORD, *PDWORD, *LPDWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int16_t SHORT;
+typedef uint16_t USHORT;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef char CHAR;
+typedef wchar_t WCHAR;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef intptr_t INT_PTR, LONG_PTR;
+typedef uintptr_t UINT_PTR, ULONG_PTR, DWORD_PTR;
+typedef size_t SIZE_T;
+typedef void *PVOID, *LPVOID;
+typedef const void *LPCVOID;
+typedef char *LPSTR;
+typedef const char *LPCSTR;
+typedef WCHAR *LPWSTR;
+typedef const WCHAR *LPCWSTR;
+typedef void *HANDLE;
+typedef void *HMODULE;
+typedef void *HINSTANCE;
+typedef LONG NTSTATUS;
+typedef DWORD ACCESS_MASK;
+typedef int (*FARPROC) (void);
+
+typedef union _LARGE_INTEGER
+{
+  struct
+  {
+    DWORD LowPart;
+    LONG HighPart;
+  } u;
+  LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define WINAPI
+#define APIENTRY
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+
+#define LOWORD(l) ((WORD) ((DWORD_PTR) (l) & 0xffff))
+#define HIWORD(l) ((WORD) ((DWORD_PTR) (l) >> 16))
+#define IntToPtr(i) ((void *) (INT_PTR) (i))
+#ifndef min
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define _stricmp strcasecmp
+#define _strnicmp strncasecmp
+#define _wcsicmp wcscasecmp
+
+
+/* Status and error codes used by the loader.  */
+
+#define STATUS_SUCCESS                  ((NTSTATUS) 0x00000000)
+#define STATUS_IMAGE_NOT_AT_BASE        ((NTSTATUS) 0x40000003)
+#define STATUS_NOT_IMPLEMENTED          ((NTSTATUS) 0xC0000002)
+#define STATUS_ACCESS_VIOLATION         ((NTSTATUS) 0xC0000005)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS) 0xC000000D)
+#define STATUS_NO_MEMORY                ((NTSTATUS) 0xC0000017)
+#define STATUS_CONFLICTING_ADDRESSES    ((NTSTATUS) 0xC0000018)
+#define STATUS_INVALID_FILE_FOR_SECTION ((NTSTATUS) 0xC0000020)
+#define STATUS_PROCEDURE_NOT_FOUND      ((NTSTATUS) 0xC000007A)
+#define STATUS_INVALID_IMAGE_FORMAT     ((NTSTATUS) 0xC000007B)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS) 0xC00000BB)
+#define STATUS_DLL_NOT_FOUND            ((NTSTATUS) 0xC0000135)
+
+#define ERROR_SUCCESS             0
+#define ERROR_FILE_NOT_FOUND      2
+#define ERROR_INVALID_HANDLE      6
+#define ERROR_NOT_ENOUGH_MEMORY   8
+#define ERROR_NO_MORE_FILES       18
+#define ERROR_NOT_SUPPORTED       50
+#define ERROR_INVALID_PARAMETER   87
+#define ERROR_MOD_NOT_FOUND       126
+#define ERROR_PROC_NOT_FOUND      127
+#define ERROR_ALREADY_EXISTS      183
+#define ERROR_BAD_EXE_FORMAT      193
+#define ERROR_MR_MID_NOT_FOUND    317
+#define ERROR_INVALID_ADDRESS     487
+#define ERROR_DLL_NOT_FOUND       1157
+
+
+/* Virtual memory.  */
+
+#define MEM_COMMIT   0x00001000
+#define MEM_RESERVE  0x00002000
+#define MEM_DECOMMIT 0x00004000
+#define MEM_RELEASE  0x00008000
+
+#define PAGE_NOACCESS          0x01
+#define PAGE_READONLY          0x02
+#define PAGE_READWRITE         0x04
+#define PAGE_WRITECOPY         0x08
+#define PAGE_EXECUTE           0x10
+#define PAGE_EXECUTE_READ      0x20
+#define PAGE_EXECUTE_READWRITE 0x40
+#define PAGE_EXECUTE_WRITECOPY 0x80
+#define PAGE_GUARD             0x100
+#define PAGE_NOCACHE           0x200
+
+#define SEC_IMAGE   0x01000000
+#define SEC_RESERVE 0x04000000
+#define SEC_COMMIT  0x08000000
+#define SEC_NOCACHE 0x10000000
+
+#define SECTION_QUERY        0x0001
+#define SECTION_MAP_WRITE    0x0002
+#define SECTION_MAP_READ     0x0004
+#define SECTION_MAP_EXECUTE  0x0008
+#define STANDARD_RIGHTS_REQUIRED 0x000F0000
+
+#define FILE_MAP_COPY       0x0001
+#define FILE_MAP_WRITE      0x0002
+#define FILE_MAP_READ       0x0004
+#define FILE_MAP_ALL_ACCESS 0x000F001F
+
+LPVOID VirtualAlloc (LPVOID addr, SIZE_T size, DWORD type, DWORD protect);
+BOOL VirtualFree (LPVOID addr, SIZE_T size, DWORD type);
+
+HANDLE CreateFileMapping (HANDLE file, void *sa, DWORD protect,
+			  DWORD size_high, DWORD size_low, LPCWSTR name);
+LPVOID MapViewOfFile (HANDLE mapping, DWORD access, DWORD offset_high,
+		      DWORD offset_low, SIZE_T size);
+BOOL UnmapViewOfFile (LPCVOID addr);
+BOOL FlushViewOfFile (LPCVOID addr, SIZE_T size);
+
+
+/* Files.  */
+
+#define GENERIC_READ  0x80000000
+#define GENERIC_WRITE 0x40000000
+
+#define FILE_READ_DATA  0x0001
+#define FILE_WRITE_DATA 0x0002
+
+#define FILE_SHARE_READ  0x00000001
+#define FILE_SHARE_WRITE 0x00000002
+
+#define CREATE_NEW    1
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+
+#define FILE_BEGIN   0
+#define FILE_CURRENT 1
+#define FILE_END     2
+
+#define INVALID_HANDLE_VALUE ((HANDLE) (LONG_PTR) -1)
+#define INVALID_FILE_SIZE ((DWORD) 0xFFFFFFFF)
+
+typedef struct _FILETIME
+{
+  DWORD dwLowDateTime;
+  DWORD dwHighDateTime;
+} FILETIME, *LPFILETIME;
+
+typedef struct _WIN32_FIND_DATA
+{
+  DWORD dwFileAttributes;
+  DWORD nFileSizeHigh;
+  DWORD nFileSizeLow;
+  WCHAR cFileName[MAX_PATH];
+} WIN32_FIND_DATA;
+
+HANDLE CreateFile (LPCWSTR name, DWORD access, DWORD share, void *sa,
+		   DWORD creation, DWORD flags, HANDLE template);
+HANDLE CreateFileForMappingW (LPCWSTR name, DWORD access, DWORD share,
+			      void *sa, DWORD creation, DWORD flags,
+			      HANDLE template);
+BOOL ReadFile (HANDLE file, LPVOID buffer, DWORD len, LPDWORD read,
+	       void *overlapped);
+BOOL WriteFile (HANDLE file, LPCVOID buffer, DWORD len, LPDWORD written,
+		void *overlapped);
+DWORD SetFilePointer (HANDLE file, LONG offset, LONG *offset_high,
+		      DWORD method);
+DWORD GetFileSize (HANDLE file, LPDWORD size_high);
+BOOL GetFileTime (HANDLE file, LPFILETIME creation, LPFILETIME access,
+		  LPFILETIME write);
+BOOL CloseHandle (HANDLE handle);
+
+HANDLE FindFirstFile (LPCWSTR pattern, WIN32_FIND_DATA *data);
+BOOL FindNextFile (HANDLE find, WIN32_FIND_DATA *data);
+BOOL FindClose (HANDLE find);
+
+
+/* Modules and processes.  */
+
+#define DONT_RESOLVE_DLL_REFERENCES 0x00000001
+#define LOAD_LIBRARY_AS_DATAFILE    0x00000002
+
+#define DLL_PROCESS_DETACH 0
+#define DLL_PROCESS_ATTACH 1
+#define DLL_THREAD_ATTACH  2
+#define DLL_THREAD_DETACH  3
+
+HMODULE LoadLibrary (LPCWSTR name);
+BOOL FreeLibrary (HMODULE module);
+/* Windows CE only has the wide version of GetProcAddress and the
+   explicit narrow GetProcAddressA.  */
+FARPROC GetProcAddress (HMODULE module, LPCWSTR name);
+FARPROC GetProcAddressA (HMODULE module, LPCSTR name);
+HMODULE GetModuleHandle (LPCWSTR name);
+DWORD GetModuleFileName (HMODULE module, LPWSTR filename, DWORD size);
+LPWSTR GetCommandLine (void);
+HANDLE GetCurrentProcess (void);
+/* Does nothing, as images are never run on the build host.  */
+BOOL FlushInstructionCache (HANDLE process, LPCVOID base, SIZE_T size);
+
+DWORD GetLastError (void);
+void SetLastError (DWORD error);
+void Sleep (DWORD msec);
+
+typedef struct _SYSTEM_INFO
+{
+  WORD wProcessorArchitecture;
+  WORD wReserved;
+  DWORD dwPageSize;
+  LPVOID lpMinimumApplicationAddress;
+  LPVOID lpMaximumApplicationAddress;
+  DWORD_PTR dwActiveProcessorMask;
+  DWORD dwNumberOfProcessors;
+  DWORD dwProcessorType;
+  DWORD dwAllocationGranularity;
+  WORD wProcessorLevel;
+  WORD wProcessorRevision;
+} SYSTEM_INFO, *LPSYSTEM_INFO;
+
+void GetSystemInfo (LPSYSTEM_INFO info);
+
+#define CP_ACP  0
+#define CP_UTF8 65001
+
+int WideCharToMultiByte (UINT codepage, DWORD flags, LPCWSTR src, int srclen,
+			 LPSTR dst, int dstlen, LPCSTR defchar,
+			 BOOL *used_defchar);
+
+
+/* The PE image format (32 bit flavour, as used on Windows CE).  */
+
+#define IMAGE_DOS_SIGNATURE 0x5A4D
+#define IMAGE_OS2_SIGNATURE 0x454E
+#define IMAGE_NT_SIGNATURE  0x00004550
+
+typedef struct _IMAGE_DOS_HEADER
+{
+  WORD e_magic;
+  WORD e_cblp;
+  WORD e_cp;
+  WORD e_crlc;
+  WORD e_cparhdr;
+  WORD e_minalloc;
+  WORD e_maxalloc;
+  WORD e_ss;
+  WORD e_sp;
+  WORD e_csum;
+  WORD e_ip;
+  WORD e_cs;
+  WORD e_lfarlc;
+  WORD e_ovno;
+  WORD e_res[4];
+  WORD e_oemid;
+  WORD e_oeminfo;
+  WORD e_res2[10];
+  LONG e_lfanew;
+} IMAGE_DOS_HEADER, *PIMAGE_DOS_HEADER;
+
+typedef struct _IMAGE_OS2_HEADER
+{
+  WORD ne_magic;
+  BYTE ne_ver;
+  BYTE ne_rev;
+  WORD ne_enttab;
+  WORD ne_cbenttab;
+  LONG ne_crc;
+  WORD ne_flags;
+  WORD ne_autodata;
+  WORD ne_heap;
+  WORD ne_stack;
+  DWORD ne_csip;
+  DWORD ne_sssp;
+  WORD ne_cseg;
+  WORD ne_cmod;
+  WORD ne_cbnrestab;
+  WORD ne_segtab;
+  WORD ne_rsrctab;
+  WORD ne_restab;
+  WORD ne_modtab;
+  WORD ne_imptab;
+  DWORD ne_nrestab;
+  WORD ne_cmovent;
+  WORD ne_align;
+  WORD ne_cres;
+  BYTE ne_exetyp;
+  BYTE ne_flagsothers;
+  WORD ne_pretthunks;
+  WORD ne_psegrefbytes;
+  WORD ne_swaparea;
+  WORD ne_expver;
+} IMAGE_OS2_HEADER;
+
+#define IMAGE_FILE_MACHINE_UNKNOWN 0x0000
+#define IMAGE_FILE_MACHINE_I386    0x014c
+#define IMAGE_FILE_MACHINE_R3000   0x0162
+#define IMAGE_FILE_MACHINE_R4000   0x0166
+#define IMAGE_FILE_MACHINE_R10000  0x0168
+#define IMAGE_FILE_MACHINE_ALPHA   0x0184
+#define IMAGE_FILE_MACHINE_ARM     0x01c0
+#define IMAGE_FILE_MACHINE_THUMB   0x01c2
+#define IMAGE_FILE_MACHINE_POWERPC 0x01f0
+#define IMAGE_FILE_MACHINE_IA64    0x0200
+#define IMAGE_FILE_MACHINE_ALPHA64 0x0284
+
+#define IMAGE_FILE_RELOCS_STRIPPED 0x0001
+#define IMAGE_FILE_DLL             0x2000
+
+typedef struct _IMAGE_FILE_HEADER
+{
+  WORD Machine;
+  WORD NumberOfSections;
+  DWORD TimeDateStamp;
+  DWORD PointerToSymbolTable;
+  DWORD NumberOfSymbols;
+  WORD SizeOfOptionalHeader;
+  WORD Characteristics;
+} IMAGE_FILE_HEADER, *PIMAGE_FILE_HEADER;
+
+typedef struct _IMAGE_DATA_DIRECTORY
+{
+  DWORD VirtualAddress;
+  DWORD Size;
+} IMAGE_DATA_DIRECTORY, *PIMAGE_DATA_DIRECTORY;
+
+#define IMAGE_NUMBEROF_DIRECTORY_ENTRIES 16
+
+#define IMAGE_DIRECTORY_ENTRY_EXPORT       0
+#define IMAGE_DIRECTORY_ENTRY_IMPORT       1
+#define IMAGE_DIRECTORY_ENTRY_RESOURCE     2
+#define IMAGE_DIRECTORY_ENTRY_EXCEPTION    3
+#define IMAGE_DIRECTORY_ENTRY_SECURITY     4
+#define IMAGE_DIRECTORY_ENTRY_BASERELOC    5
+#define IMAGE_DIRECTORY_ENTRY_DEBUG        6
+#define IMAGE_DIRECTORY_ENTRY_TLS          9
+#define IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG 10
+#define IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT 11
+#define IMAGE_DIRECTORY_ENTRY_IAT         12
+#define IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT 13
+
+#define IMAGE_NT_OPTIONAL_HDR32_MAGIC 0x10b
+#define IMAGE_NT_OPTIONAL_HDR64_MAGIC 0x20b
+
+typedef struct _IMAGE_OPTIONAL_HEADER32
+{
+  WORD Magic;
+  BYTE MajorLinkerVersion;
+  BYTE MinorLinkerVersion;
+  DWORD SizeOfCode;
+  DWORD SizeOfInitializedData;
+  DWORD SizeOfUninitializedData;
+  DWORD AddressOfEntryPoint;
+  DWORD BaseOfCode;
+  DWORD BaseOfData;
+  DWORD ImageBase;
+  DWORD SectionAlignment;
+  DWORD FileAlignment;
+  WORD MajorOperatingSystemVersion;
+  WORD MinorOperatingSystemVersion;
+  WORD MajorImageVersion;
+  WORD MinorImageVersion;
+  WORD MajorSubsystemVersion;
+  WORD MinorSubsystemVersion;
+  DWORD Win32VersionValue;
+  DWORD SizeOfImage;
+  DWORD SizeOfHeaders;
+  DWORD CheckSum;
+  WORD Subsystem;
+  WORD DllCharacteristics;
+  DWORD SizeOfStackReserve;
+  DWORD SizeOfStackCommit;
+  DWORD SizeOfHeapReserve;
+  DWORD SizeOfHeapCommit;
+  DWORD LoaderFlags;
+  DWORD NumberOfRvaAndSizes;
+  IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER32, IMAGE_OPTIONAL_HEADER;
+
+typedef struct _IMAGE_OPTIONAL_HEADER64
+{
+  WORD Magic;
+  BYTE MajorLinkerVersion;
+  BYTE MinorLinkerVersion;
+  DWORD SizeOfCode;
+  DWORD SizeOfInitializedData;
+  DWORD SizeOfUninitializedData;
+  DWORD AddressOfEntryPoint;
+  DWORD BaseOfCode;
+  ULONGLONG ImageBase;
+  DWORD SectionAlignment;
+  DWORD FileAlignment;
+  WORD MajorOperatingSystemVersion;
+  WORD MinorOperatingSystemVersion;
+  WORD MajorImageVersion;
+  WORD MinorImageVersion;
+  WORD MajorSubsystemVersion;
+  WORD MinorSubsystemVersion;
+  DWORD Win32VersionValue;
+  DWORD SizeOfImage;
+  DWORD SizeOfHeaders;
+  DWORD CheckSum;
+  WORD Subsystem;
+  WORD DllCharacteristics;
+  ULONGLONG SizeOfStackReserve;
+  ULONGLONG SizeOfStackCommit;
+  ULONGLONG SizeOfHeapReserve;
+  ULONGLONG SizeOfHeapCommit;
+  DWORD LoaderFlags;
+  DWORD NumberOfRvaAndSizes;
+  IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER64;
+
+typedef struct _IMAGE_NT_HEADERS32
+{
+  DWORD Signature;
+  IMAGE_FILE_HEADER FileHeader;
+  IMAGE_OPTIONAL_HEADER32 OptionalHeader;
+} IMAGE_NT_HEADERS32, IMAGE_NT_HEADERS, *PIMAGE_NT_HEADERS;
+
+typedef struct _IMAGE_NT_HEADERS64
+{
+  DWORD Signature;
+  IMAGE_FILE_HEADER FileHeader;
+  IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+} IMAGE_NT_HEADERS64;
+
+#define IMAGE_SIZEOF_SHORT_NAME 8
+
+#define IMAGE_SCN_CNT_CODE               0x00000020
+#define IMAGE_SCN_CNT_INITIALIZED_DATA   0x00000040
+#define IMAGE_SCN_CNT_UNINITIALIZED_DATA 0x00000080
+#define IMAGE_SCN_MEM_DISCARDABLE        0x02000000
+#define IMAGE_SCN_MEM_SHARED             0x10000000
+#define IMAGE_SCN_MEM_EXECUTE            0x20000000
+#define IMAGE_SCN_MEM_READ               0x40000000
+#define IMAGE_SCN_MEM_WRITE              0x80000000
+
+typedef struct _IMAGE_SECTION_HEADER
+{
+  BYTE Name[IMAGE_SIZEOF_SHORT_NAME];
+  union
+  {
+    DWORD PhysicalAddress;
+    DWORD VirtualSize;
+  } Misc;
+  DWORD VirtualAddress;
+  DWORD SizeOfRawData;
+  DWORD PointerToRawData;
+  DWORD PointerToRelocations;
+  DWORD PointerToLinenumbers;
+  WORD NumberOfRelocations;
+  WORD NumberOfLinenumbers;
+  DWORD Characteristics;
+} IMAGE_SECTION_HEADER, *PIMAGE_SECTION_HEADER;
+
+#define IMAGE_REL_BASED_ABSOLUTE    0
+#define IMAGE_REL_BASED_HIGH        1
+#define IMAGE_REL_BASED_LOW         2
+#define IMAGE_REL_BASED_HIGHLOW     3
+#define IMAGE_REL_BASED_HIGHADJ     4
+#define IMAGE_REL_BASED_ARM_MOV32A  5
+#define IMAGE_REL_BASED_THUMB_MOV32 7
+#define IMAGE_REL_BASED_DIR64      10
+
+typedef struct _IMAGE_BASE_RELOCATION
+{
+  DWORD VirtualAddress;
+  DWORD SizeOfBlock;
+} IMAGE_BASE_RELOCATION, *PIMAGE_BASE_RELOCATION;
+
+typedef struct _IMAGE_EXPORT_DIRECTORY
+{
+  DWORD Characteristics;
+  DWORD TimeDateStamp;
+  WORD MajorVersion;
+  WORD MinorVersion;
+  DWORD Name;
+  DWORD Base;
+  DWORD NumberOfFunctions;
+  DWORD NumberOfNames;
+  DWORD AddressOfFunctions;
+  DWORD AddressOfNames;
+  DWORD AddressOfNameOrdinals;
+} IMAGE_EXPORT_DIRECTORY, *PIMAGE_EXPORT_DIRECTORY;
+
+typedef struct _IMAGE_IMPORT_BY_NAME
+{
+  WORD Hint;
+  BYTE Name[1];
+} IMAGE_IMPORT_BY_NAME, *PIMAGE_IMPORT_BY_NAME;
+
+/* The thunk slots are 32 bit wide in the image, so they can not hold
+   host pointers.  */
+typedef struct _IMAGE_THUNK_DATA32
+{
+  union
+  {
+    DWORD ForwarderString;
+    DWORD Function;
+    DWORD Ordinal;
+    DWORD AddressOfData;
+  } u1;
+} IMAGE_THUNK_DATA32, IMAGE_THUNK_DATA, *PIMAGE_THUNK_DATA;
+
+#define IMAGE_ORDINAL_FLAG 0x80000000
+#define IMAGE_SNAP_BY_ORDINAL(ordinal) (((ordinal) & IMAGE_ORDINAL_FLAG) != 0)
+#define IMAGE_ORDINAL(ordinal) ((ordinal) & 0xffff)
+
+typedef struct _IMAGE_IMPORT_DESCRIPTOR
+{
+  union
+  {
+    DWORD Characteristics;
+    DWORD OriginalFirstThunk;
+  };
+  DWORD TimeDateStamp;
+  DWORD ForwarderChain;
+  DWORD Name;
+  DWORD FirstThunk;
+} IMAGE_IMPORT_DESCRIPTOR, *PIMAGE_IMPORT_DESCRIPTOR;
+
+
+/* Threads and synchronization.  */
+
+#define INFINITE      0xFFFFFFFF
+#define WAIT_OBJECT_0 0x00000000
+#define WAIT_TIMEOUT  0x00000102
+#define WAIT_FAILED   0xFFFFFFFF
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE) (LPVOID param);
+
+typedef void *LPSECURITY_ATTRIBUTES;
+
+/* Only passed around; faults are caught by host_set_fault_handler.  */
+typedef struct _EXCEPTION_POINTERS EXCEPTION_POINTERS;
+
+HANDLE CreateThread (void *sa, SIZE_T stack_size,
+		     LPTHREAD_START_ROUTINE start, LPVOID param,
+		     DWORD flags, LPDWORD thread_id);
+HANDLE CreateEvent (void *sa, BOOL manual_reset, BOOL initial_state,
+		    LPCWSTR name);
+BOOL SetEvent (HANDLE event);
+BOOL ResetEvent (HANDLE event);
+DWORD WaitForSingleObject (HANDLE handle, DWORD timeout);
+
+static inline LONG
+InterlockedIncrement (LONG volatile *addend)
+{
+  return __atomic_add_fetch (addend, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG
+InterlockedDecrement (LONG volatile *addend)
+{
+  return __atomic_sub_fetch (addend, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG
+InterlockedExchange (LONG volatile *target, LONG value)
+{
+  return __atomic_exchange_n (target, value, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG
+InterlockedExchangeAdd (LONG volatile *addend, LONG value)
+{
+  return __atomic_fetch_add (addend, value, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG
+InterlockedCompareExchange (LONG volatile *dest, LONG exchange,
+			    LONG comparand)
+{
+  __atomic_compare_exchange_n (dest, &comparand, exchange, 0,
+			       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+
+
+/* Host only: statistics gathered by the platform layer, so that the
+   load paths can be measured.  */
+struct host_stats
+{
+  unsigned long reads;
+  unsigned long long read_bytes;
+  unsigned long seeks;
+  unsigned long valloc_calls;
+  unsigned long vfree_calls;
+  unsigned long mappings;
+  unsigned long views;
+  unsigned long load_library_calls;
+  unsigned long get_proc_address_calls;
+  unsigned long faults;
+};
+
+extern struct host_stats host_stats;
+
+/* Microseconds to wait before every read, to model slow media.  */
+extern unsigned int host_read_latency;
+
+/* Reset HOST_STATS.  */
+void host_stats_reset (void);
+
+/* Read LEN bytes at OFFSET from the file HANDLE without moving the
+   file pointer.  Returns the number of bytes read or -1.  */
+size_t host_pread (HANDLE handle, void *buffer, size_t len,
+		   long long offset);
+
+/* Add NAME to the table of DLLs that LoadLibrary knows about.  */
+void host_add_stub_dll (const char *name);
+
+/* Call HANDLER with the address of every access violation.  If it
+   returns zero, the fault is fatal.  */
+void host_set_fault_handler (int (*handler) (void *addr));
+
+/* Convert the host path PATH to a wide character string in the static
+   buffer BUF of size MAX_PATH.  */
+LPWSTR host_path_to_wide (const char *path, WCHAR *buf);
+
+#endif /* HIMEMCE_HOST_WINDOWS_H */
@@ -33,12 +33,16 @@ void MODULE_get_binary_info (HANDLE hfile, struct binary_info *info)
     IMAGE_DOS_HEADER mz;
   } header;
   
+  /* The extended header is near the start as well, so one read of
+     the start of the file serves both.  */
+  struct image_header start;
   DWORD len;
 
   memset( info, 0, sizeof(*info) );
-  /* Seek to the start of the file and read the header information. */
-  if (SetFilePointer( hfile, 0, NULL, SEEK_SET ) == -1) return;
-  if (!ReadFile( hfile, &header, sizeof(header), &len, NULL ) || len != sizeof(header)) return;
+  /* Read the header information from the start of the file. */
+  if (!image_header_read( &start, hfile )) return;
+  len = image_header_pread( &start, hfile, (char *) &header, sizeof(header), 0 );
+  if (len != sizeof(header)) return;
   
   if (header.mz.e_magic == IMAGE_DOS_SIGNATURE)
     {
@@ -56,8 +60,9 @@ void MODULE_get_binary_info (HANDLE hfile, struct binary_info *info)
        * to read or not.
        */
       info->type = BINARY_DOS;
-      if (SetFilePointer( hfile, header.mz.e_lfanew, NULL, SEEK_SET ) == -1) return;
-      if (!ReadFile( hfile, &ext_header, sizeof(ext_header), &len, NULL ) || len < 4) return;
+      len = image_header_pread( &start, hfile, (char *) &ext_header, sizeof(ext_header),
+				header.mz.e_lfanew );
+      if (len == (DWORD) -1 || len < 4) return;
       
       /* Reading the magic field succeeded so
        * we will try to determine what type it is.
@@ -90,7 +95,7 @@ void MODULE_get_binary_info (HANDLE hfile, struct binary_info *info)
 }
 
 
-static HMODULE load_library( LPCWSTR libname, DWORD flags )
+static HMODULE load_library( LPCWSTR libname, HANDLE hfile, DWORD flags )
 {
   NTSTATUS nts;
   HMODULE hModule;
@@ -103,7 +108,10 @@ static HMODULE load_library( LPCWSTR libname, DWORD flags )
       return NULL;
     }
 
-  nts = MyLdrLoadDll( NULL, flags, libname, &hModule );
+  if (hfile)
+    nts = MyLdrLoadDllFile( libname, hfile, flags, &hModule );
+  else
+    nts = MyLdrLoadDll( NULL, flags, libname, &hModule );
   if (nts != STATUS_SUCCESS)
     {
       hModule = 0;
@@ -119,11 +127,13 @@ HMODULE MyLoadLibraryExW(LPCWSTR libnameW, HANDLE hfile, DWORD flags)
    that is only implemented for DLLs.  Also, base addresses are
    restricted to the process slot, but we want to load at high
    addresses.  */
+/* Unlike with the native LoadLibraryEx, HFILE may be the image file
+   LIBNAMEW, already opened by the caller.  */
   TRACE ("MyLoadLibraryExW (\"%S\", 0x%p, 0x%x)\n", libnameW, hfile, flags);
   if (!libnameW)
     {
       SetLastError(ERROR_INVALID_PARAMETER);
       return 0;
     }
-  return load_library( libnameW, flags );
+  return load_library( libnameW, hfile, flags );
 }
@@ -23,6 +23,8 @@
 
 #include <windef.h>
 #include "wine.h"
+#include "himemce.h"
+#include "himemce-stub.h"
 #include "kernel32_kernel_private.h"
 
 
@@ -57,14 +59,61 @@ static BOOL start_process( PEB *peb )
 }
 
 
+#ifndef HIMEMCE_HOST
+/* Report calls to missing imports, and bring in the pages of a
+   lazily loaded image.  Other threads get it through
+   himemce_create_thread.  */
+static int fault_filter (EXCEPTION_POINTERS *ep)
+{
+  EXCEPTION_RECORD *rec = ep->ExceptionRecord;
+
+  if (rec->ExceptionCode == EXCEPTION_WINE_STUB && rec->NumberParameters >= 2)
+    {
+      const char *dll = (const char *)rec->ExceptionInformation[0];
+      const char *name = (const char *)rec->ExceptionInformation[1];
+
+      if ((ULONG_PTR)name >> 16)
+        ERR( "call to unimplemented function %s.%s\n", dll, name );
+      else
+        ERR( "call to unimplemented function %s.%d\n", dll, (int)(ULONG_PTR)name );
+      return EXCEPTION_EXECUTE_HANDLER;
+    }
+  if (rec->ExceptionCode == EXCEPTION_ACCESS_VIOLATION
+      && rec->NumberParameters >= 2
+      && virtual_handle_fault ((void *) rec->ExceptionInformation[1]))
+    return EXCEPTION_CONTINUE_EXECUTION;
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+#endif
+
+
 static BOOL __wine_kernel_init (HANDLE hFile, LPCWSTR main_exe_name,
-				LPWSTR cmd_line, int *exit_code)
+				LPWSTR cmd_line, DWORD flags, int *exit_code)
 {
   PEB *peb = current_peb();
 
+#ifndef HIMEMCE_HOST
+  /* Threads that system DLLs start, for the C runtime or for
+     callbacks, run without the fault filter, and there is no way to
+     catch their faults on Windows CE.  So pages can not be brought in
+     on demand.  On the host, one signal handler covers all
+     threads.  */
+  if (flags & (HIMEMCE_LAZY_LOAD | HIMEMCE_LAZY_LOW))
+    {
+      ERR ("loading on demand is not supported, loading %S as a whole\n",
+	   main_exe_name);
+      flags &= ~(HIMEMCE_LAZY_LOAD | HIMEMCE_LAZY_LOW);
+    }
+#endif
+
   peb->CommandLine = cmd_line;
-  peb->ImageBaseAddress = MyLoadLibraryExW( main_exe_name, 0,
-					    DONT_RESOLVE_DLL_REFERENCES );
+  peb->ImageBaseAddress = MyLoadLibraryExW( main_exe_name, hFile,
+					    DONT_RESOLVE_DLL_REFERENCES
+					    | (flags & (HIMEMCE_LAZY_LOAD | HIMEMCE_CACHE_LOAD
+							| HIMEMCE_PARALLEL_RELOC
+							| HIMEMCE_BIND_IMPORTS
+							| HIMEMCE_LAZY_BIND
+							| HIMEMCE_LAZY_LOW)) );
 
   if (! peb->ImageBaseAddress)
     {
@@ -73,7 +122,20 @@ static BOOL __wine_kernel_init (HANDLE hFile, LPCWSTR main_exe_name,
     }
 
   /* FIXME: Error checking?  */
+#ifndef HIMEMCE_HOST
+  himemce_set_fault_filter (fault_filter);
+  __try
+    {
+      MyLdrInitializeThunk( start_process, 0, 0, 0 );
+    }
+  __except (fault_filter (GetExceptionInformation ()))
+    {
+      ERR ("unhandled exception in %S\n", main_exe_name);
+      peb->ExitStatus = 1;
+    }
+#else
   MyLdrInitializeThunk( start_process, 0, 0, 0 );
+#endif
 
   *exit_code = peb->ExitStatus;
   return TRUE;
@@ -93,7 +155,7 @@ static HANDLE open_exe_file (LPCWSTR name, struct binary_info *binary_info)
 }
 
 
-BOOL MyCreateProcessW (LPCWSTR app_name, LPWSTR cmd_line,
+BOOL MyCreateProcessW (LPCWSTR app_name, LPWSTR cmd_line, DWORD flags,
 		       int *exit_code)
 {
   BOOL retv = FALSE;
@@ -136,10 +198,10 @@ BOOL MyCreateProcessW (LPCWSTR app_name, LPWSTR cmd_line,
       return FALSE;
     }
 
-  retv = __wine_kernel_init (hFile, app_name, cmd_line, exit_code);
+  retv = __wine_kernel_init (hFile, app_name, cmd_line, flags, exit_code);
 
  err:
-  if (hFile)
+  if (hFile && hFile != INVALID_HANDLE_VALUE)
     CloseHandle( hFile );
   
   return retv;
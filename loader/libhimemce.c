@@ -1,6 +1,7 @@
 #include <windows.h>
+#include <stdlib.h>
 
-static void dllmain_cb (DWORD reason, LPVOID reserved);
+static void (*dllmain_cb) (DWORD reason, LPVOID reserved);
 
 
 /* This library is necessary, because if DLLs are loaded high, they
@@ -15,6 +16,7 @@ DllMain (HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 
   if (dllmain_cb)
     (*dllmain_cb) (fdwReason, lpvReserved);
+  return TRUE;
 }
 
 
@@ -23,3 +25,81 @@ himemce_set_dllmain_cb (void (*cb) (DWORD, LPVOID))
 {
   dllmain_cb = cb;
 }
+
+
+/* Calls to missing imports are reported by an exception filter,
+   which the system only calls for the thread whose frames contain it.
+   So the threads of the program and of the preloaded DLLs are started
+   through himemce_create_thread, which their imports of CreateThread
+   are bound to.  The filter is that of the loader of the process, if
+   there is one.  Threads that system DLLs start are not covered, which
+   is why pages are not loaded on demand on Windows CE.  */
+
+static int (*fault_filter) (EXCEPTION_POINTERS *ep);
+
+struct thread_start
+{
+  LPTHREAD_START_ROUTINE start;
+  LPVOID param;
+};
+
+
+void
+himemce_set_fault_filter (int (*filter) (EXCEPTION_POINTERS *))
+{
+  fault_filter = filter;
+}
+
+
+#ifndef HIMEMCE_HOST
+static int
+thread_filter (EXCEPTION_POINTERS *ep)
+{
+  if (! fault_filter)
+    return EXCEPTION_CONTINUE_SEARCH;
+  return (*fault_filter) (ep);
+}
+#endif
+
+
+static DWORD WINAPI
+thread_start (LPVOID arg)
+{
+  struct thread_start ts = *(struct thread_start *) arg;
+  DWORD result = 1;
+
+  free (arg);
+#ifndef HIMEMCE_HOST
+  __try
+    {
+      result = (*ts.start) (ts.param);
+    }
+  __except (thread_filter (GetExceptionInformation ()))
+    {
+    }
+#else
+  /* The host catches faults for all threads.  */
+  result = (*ts.start) (ts.param);
+#endif
+  return result;
+}
+
+
+HANDLE
+himemce_create_thread (LPSECURITY_ATTRIBUTES sa, DWORD stack_size,
+		       LPTHREAD_START_ROUTINE start, LPVOID param,
+		       DWORD flags, LPDWORD id)
+{
+  struct thread_start *ts;
+  HANDLE thread;
+
+  ts = malloc (sizeof (*ts));
+  if (! ts)
+    return NULL;
+  ts->start = start;
+  ts->param = param;
+  thread = CreateThread (sa, stack_size, thread_start, ts, flags, id);
+  if (! thread)
+    free (ts);
+  return thread;
+}
@@ -32,11 +32,14 @@
 #endif
 
 #include "wine.h"
+#include "himemce-reloc.h"
+#include "himemce-stub.h"
 
-/* convert PE image VirtualAddress to Real Address */
+/* convert PE image VirtualAddress to Real Address, which is in the
+   data block for the writable sections of a cached image */
 static void *get_rva( HMODULE module, DWORD va )
 {
-  return (void *)((char *)module + va);
+  return himemce_cache_rva( module, va );
 }
 
 
@@ -44,43 +47,93 @@ static void *get_rva( HMODULE module, DWORD va )
 #ifdef USE_HIMEMCE_MAP
 /* Support for DLL loading.  */
 
+#include "himemce.h"
 #include "himemce-map.h"
 
 static int himemce_map_initialized;
 static struct himemce_map *himemce_map;
-int himemce_mod_loaded[HIMEMCE_MAP_MAX_MODULES];
+/* The read-write sections are copied as they are touched
+   (HIMEMCE_LAZY_LOW).  */
+static int himemce_map_lazy_low;
+/* Per module of the map: the module is loaded.  */
+static int *himemce_mod_loaded;
+/* DllMain was called with DLL_PROCESS_ATTACH.  Delay loaded DLLs are
+   attached after the others.  */
+static LONG *himemce_mod_attached;
+
+/* The low memory reserved so far, one flag per
+   HIMEMCE_MAP_LOW_GRANULE from HIMEMCE_LOW_BASE on.  */
+static char *himemce_low_reserved;
+static int himemce_low_nr_reserved;
+
+#define HIMEMCE_LOW_BASE \
+  ((char *) ((UINT_PTR) himemce_map->low_start \
+	     & ~(UINT_PTR) (HIMEMCE_MAP_LOW_GRANULE - 1)))
 
 void
 himemce_invoke_dll_mains (DWORD reason, LPVOID reserved)
 {
+  unsigned int *load_order;
+  int n;
   int i;
 
   if (! himemce_map)
-    return NULL;
+    return;
 
-  for (i = 0; i < himemce_map->nr_modules; i++)
-    if (himemce_mod_loaded[modidx])
-      {
-	char *ptr = himemce_map->module[i].base;
-	IMAGE_DOS_HEADER *dos = (IMAGE_DOS_HEADER *)ptr;
-	IMAGE_NT_HEADERS *nt = (IMAGE_NT_HEADERS *)(ptr + dos->e_lfanew);
-	BOOL WINAPI (*dllmain) (HINSTANCE, DWORD, LPVOID);
-	BOOL res;
-
-	dllmain = nt->OptionalHeader.AddressOfEntryPoint;
-	res = (*dllmain) (ptr, reason, reserved);
-	if (reason == DLL_PROCESS_ATTACH && !res)
-	  {
-	    ERR ("attaching %s failed (ignored)", himemce_map->module[i].name);
-	  }
-      }
+  load_order = himemce_map_load_order (himemce_map);
+  for (n = 0; n < himemce_map->nr_modules; n++)
+    {
+      char *ptr;
+      IMAGE_DOS_HEADER *dos;
+      IMAGE_NT_HEADERS *nt;
+      BOOL (WINAPI *dllmain) (HINSTANCE, DWORD, LPVOID);
+      BOOL res;
+      struct himemce_module *mod;
+
+      /* Dependencies are attached first, and detached last.  */
+      i = n;
+      if (load_order)
+	i = load_order[reason == DLL_PROCESS_DETACH
+		       ? himemce_map->nr_modules - 1 - n : n];
+      if (! himemce_mod_loaded[i])
+	continue;
+
+      if (reason == DLL_PROCESS_ATTACH)
+	{
+	  if (InterlockedExchange (&himemce_mod_attached[i], 1))
+	    continue;
+	}
+      else if (! himemce_mod_attached[i])
+	continue;
+      else if (reason == DLL_PROCESS_DETACH)
+	himemce_mod_attached[i] = 0;
+
+      mod = himemce_map_module (himemce_map, i);
+      ptr = mod->base;
+      dos = (IMAGE_DOS_HEADER *)ptr;
+      nt = (IMAGE_NT_HEADERS *)(ptr + dos->e_lfanew);
+      if (! nt->OptionalHeader.AddressOfEntryPoint)
+	continue;
+#ifdef HIMEMCE_HOST
+      /* Images are mapped, but never run on the host.  */
+      continue;
+#endif
+      dllmain = (void *) (ptr + nt->OptionalHeader.AddressOfEntryPoint);
+      res = (*dllmain) (ptr, reason, reserved);
+      if (reason == DLL_PROCESS_ATTACH && !res)
+	{
+	  ERR ("attaching %s failed (ignored)",
+	       himemce_module_name (himemce_map, mod));
+	}
+    }
 }
 
 
 static void
 himemce_map_init ()
 {
-  void *ptr;
+  int granules;
+
   /* Only try once.  */
   if (himemce_map_initialized)
     return;
@@ -91,64 +144,349 @@ himemce_map_init ()
       TRACE ("can not open himemce map\n");
       return;
     }
-  TRACE ("himemce map found at %p (reserving 0x%x bytes at %p)\n", himemce_map,
-	 himemce_map->low_start, himemce_map->low_size);
-  ptr = VirtualAlloc(himemce_map->low_start, himemce_map->low_size,
-		     MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-  if (! ptr)
+  TRACE ("himemce map found at %p (low memory 0x%x bytes at %p)\n",
+	 himemce_map, himemce_map->low_size, himemce_map->low_start);
+  himemce_mod_loaded = calloc (himemce_map->nr_modules + 1,
+			       sizeof (*himemce_mod_loaded));
+  himemce_mod_attached = calloc (himemce_map->nr_modules + 1,
+				 sizeof (*himemce_mod_attached));
+  /* Low memory is reserved as the modules that need it are
+     loaded.  */
+  granules = ((char *) himemce_map->low_start + himemce_map->low_size
+	      - HIMEMCE_LOW_BASE + HIMEMCE_MAP_LOW_GRANULE - 1)
+    / HIMEMCE_MAP_LOW_GRANULE;
+  himemce_low_reserved = calloc (granules + 1, 1);
+  if (! himemce_mod_loaded || ! himemce_mod_attached
+      || ! himemce_low_reserved)
     {
-      TRACE ("failed to reserve memory: %i\n", GetLastError ());
-      himemce_map_close (himemce_map);
-      himemce_map = NULL;
-      return;
+      TRACE ("out of memory for %i modules\n", himemce_map->nr_modules);
+      goto fail;
     }
+  if (himemce_map_lazy_low
+      && ! virtual_copy_area_init (himemce_map->low_start,
+				   himemce_map->low_size))
+    himemce_map_lazy_low = 0;
 
   himemce_set_dllmain_cb (himemce_invoke_dll_mains);
+  return;
+
+ fail:
+  free (himemce_mod_loaded);
+  himemce_mod_loaded = NULL;
+  free (himemce_mod_attached);
+  himemce_mod_attached = NULL;
+  free (himemce_low_reserved);
+  himemce_low_reserved = NULL;
+  himemce_map_close (himemce_map);
+  himemce_map = NULL;
 }
 
 
-# define page_mask  0xfff
-# define page_shift 12
-# define page_size  0x1000
+/* The values of himemce_low_reserved.  A granule that starts a
+   reservation is marked as such, as a commit must not span two of
+   them.  */
+#define HIMEMCE_LOW_FREE 0
+#define HIMEMCE_LOW_RESERVED 1
+#define HIMEMCE_LOW_RESERVED_START 2
+#define HIMEMCE_LOW_WANTED 3
 
-#define ROUND_SIZE(size)			\
-  (((SIZE_T)(size) + page_mask) & ~page_mask)
+#define HIMEMCE_LOW_GRANULE_OF(ptr) \
+  (((char *) (ptr) - HIMEMCE_LOW_BASE) / HIMEMCE_MAP_LOW_GRANULE)
 
-static SIZE_T
-section_size (IMAGE_SECTION_HEADER *sec)
+
+/* Reserve the low memory of the NR modules in WORK that is not
+   reserved yet, with one call for every run of free granules.
+   Returns the number of calls, or -1 on failure.  */
+static int
+himemce_map_reserve_low (const unsigned int *work, int nr)
 {
-  static const SIZE_T sector_align = 0x1ff;
-  SIZE_T map_size, file_size, end;
-  
-  if (!sec->Misc.VirtualSize)
-    map_size = ROUND_SIZE( sec->SizeOfRawData );
-  else
-    map_size = ROUND_SIZE( sec->Misc.VirtualSize );
-  
-  file_size = (sec->SizeOfRawData + (sec->PointerToRawData & sector_align)
-	       + sector_align) & ~sector_align;
-  if (file_size > map_size) file_size = map_size;
-  end = ROUND_SIZE( file_size );
-  if (end > map_size) end = map_size;
-  return end;
+  int first = -1;
+  int last = -1;
+  int calls = 0;
+  int i;
+  int g;
+
+  for (i = 0; i < nr; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (himemce_map, work[i]);
+      int end;
+
+      if (! mod->low_size)
+	continue;
+      g = HIMEMCE_LOW_GRANULE_OF (mod->low);
+      end = HIMEMCE_LOW_GRANULE_OF (mod->low + mod->low_size - 1);
+      if (first < 0 || g < first)
+	first = g;
+      if (end > last)
+	last = end;
+      for (; g <= end; g++)
+	if (himemce_low_reserved[g] == HIMEMCE_LOW_FREE)
+	  himemce_low_reserved[g] = HIMEMCE_LOW_WANTED;
+    }
+
+  for (g = first; first >= 0 && g <= last; g++)
+    {
+      char *start;
+      int end;
+
+      if (himemce_low_reserved[g] != HIMEMCE_LOW_WANTED)
+	continue;
+      for (end = g + 1;
+	   end <= last && himemce_low_reserved[end] == HIMEMCE_LOW_WANTED;
+	   end++)
+	;
+      start = HIMEMCE_LOW_BASE + g * HIMEMCE_MAP_LOW_GRANULE;
+      if (! VirtualAlloc (start, (end - g) * HIMEMCE_MAP_LOW_GRANULE,
+			  MEM_RESERVE, PAGE_EXECUTE_READWRITE))
+	{
+	  TRACE ("failed to reserve low memory at %p: %i\n", start,
+		 GetLastError ());
+	  for (; g <= last; g++)
+	    if (himemce_low_reserved[g] == HIMEMCE_LOW_WANTED)
+	      himemce_low_reserved[g] = HIMEMCE_LOW_FREE;
+	  return -1;
+	}
+      himemce_low_reserved[g] = HIMEMCE_LOW_RESERVED_START;
+      memset (&himemce_low_reserved[g + 1], HIMEMCE_LOW_RESERVED,
+	      end - g - 1);
+      himemce_low_nr_reserved += end - g;
+      calls++;
+      g = end - 1;
+    }
+  return calls;
+}
+
+
+/* A range of low memory pages to commit.  */
+struct himemce_low_run
+{
+  char *start;
+  char *end;
+};
+
+
+static int
+compare_low_runs (const void *a, const void *b)
+{
+  const struct himemce_low_run *ra = a;
+  const struct himemce_low_run *rb = b;
+
+  if (ra->start != rb->start)
+    return ra->start < rb->start ? -1 : 1;
+  return 0;
+}
+
+
+/* Commit START to END, which must be reserved, with one call for
+   every reservation it touches.  Returns the number of calls, or -1
+   on failure.  */
+static int
+himemce_map_commit_low (char *start, char *end)
+{
+  int calls = 0;
+
+  while (start < end)
+    {
+      char *stop = end;
+      int g;
+
+      /* Stop at the next reservation.  */
+      for (g = HIMEMCE_LOW_GRANULE_OF (start) + 1;
+	   HIMEMCE_LOW_BASE + g * HIMEMCE_MAP_LOW_GRANULE < end; g++)
+	if (himemce_low_reserved[g] == HIMEMCE_LOW_RESERVED_START)
+	  {
+	    stop = HIMEMCE_LOW_BASE + g * HIMEMCE_MAP_LOW_GRANULE;
+	    break;
+	  }
+      if (! VirtualAlloc (start, stop - start, MEM_COMMIT,
+			  PAGE_EXECUTE_READWRITE))
+	{
+	  TRACE ("could not commit 0x%x bytes of low memory at %p: %i\n",
+		 stop - start, start, GetLastError ());
+	  return -1;
+	}
+      calls++;
+      start = stop;
+    }
+  return calls;
+}
+
+
+/* Commit the low sections of the NR modules in WORK, merging the
+   ranges of all of them into as few calls as possible.  Returns the
+   number of calls, or -1 on failure.  */
+static int
+himemce_map_commit_sections (const unsigned int *work, int nr,
+			     int nr_sections)
+{
+  struct himemce_low_run *runs;
+  int nr_runs = 0;
+  int calls = 0;
+  int i;
+  int j;
+
+  if (! nr_sections)
+    return 0;
+  runs = malloc (nr_sections * sizeof (*runs));
+  if (! runs)
+    return -1;
+  for (i = 0; i < nr; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (himemce_map, work[i]);
+      struct himemce_low_section *low
+	= himemce_module_low_sections (himemce_map, mod);
+
+      for (j = 0; j < mod->nr_low_sections; j++)
+	{
+	  if (! low[j].size)
+	    continue;
+	  runs[nr_runs].start = (char *) ((UINT_PTR) low[j].low
+					  & ~(UINT_PTR) (HIMEMCE_MAP_LOW_PAGE
+							 - 1));
+	  runs[nr_runs].end = (char *) (((UINT_PTR) low[j].low + low[j].size
+					 + HIMEMCE_MAP_LOW_PAGE - 1)
+					& ~(UINT_PTR) (HIMEMCE_MAP_LOW_PAGE
+						       - 1));
+	  nr_runs++;
+	}
+    }
+  qsort (runs, nr_runs, sizeof (*runs), compare_low_runs);
+
+  /* Pages that are committed already are simply committed again.  */
+  for (i = 0; i < nr_runs; i = j)
+    {
+      char *end = runs[i].end;
+      int res;
+
+      for (j = i + 1; j < nr_runs && runs[j].start <= end; j++)
+	if (runs[j].end > end)
+	  end = runs[j].end;
+      res = himemce_map_commit_low (runs[i].start, end);
+      if (res < 0)
+	{
+	  calls = -1;
+	  break;
+	}
+      calls += res;
+    }
+  free (runs);
+  return calls;
+}
+
+
+/* Register the low sections of MOD to be copied as they are touched.
+   Returns 0 if that is not possible.  */
+static int
+himemce_map_copy_lazily (struct himemce_module *mod)
+{
+  struct himemce_low_section *low
+    = himemce_module_low_sections (himemce_map, mod);
+  int i;
+
+  for (i = 0; i < mod->nr_low_sections; i++)
+    {
+      struct himemce_low_section *sec = &low[i];
+
+      if ((sec->init_size
+	   && ! virtual_copy_lazily (sec->low, (char *) mod->base + sec->rva,
+				     sec->init_size))
+	  || (sec->init_size < sec->size
+	      && ! virtual_copy_lazily (sec->low + sec->init_size, NULL,
+					sec->size - sec->init_size)))
+	return 0;
+    }
+  return 1;
+}
+
+
+/* Load the NR modules in WORK, in that order: reserve and commit the
+   low memory of all of them, copy their sections, and load the system
+   DLLs they need.  Returns 0 on failure.  */
+static int
+himemce_map_load_modules (const unsigned int *work, int nr, int nr_sections)
+{
+  int reserves;
+  int commits = 0;
+  int i;
+  int j;
+
+  reserves = himemce_map_reserve_low (work, nr);
+  if (reserves < 0)
+    return 0;
+
+  /* Pages of the copy area can be shared with modules loaded before,
+     so there is no falling back to copying right away.  */
+  for (i = 0; himemce_map_lazy_low && i < nr; i++)
+    if (! himemce_map_copy_lazily (himemce_map_module (himemce_map,
+						       work[i])))
+      {
+	TRACE ("out of memory for the sections of %s\n",
+	       himemce_module_name (himemce_map,
+				    himemce_map_module (himemce_map,
+							work[i])));
+	return 0;
+      }
+  if (! himemce_map_lazy_low)
+    {
+      commits = himemce_map_commit_sections (work, nr, nr_sections);
+      if (commits < 0)
+	return 0;
+
+      /* Only the initialized data is copied, the zero-filled rest is
+	 fine as committed.  */
+      for (i = 0; i < nr; i++)
+	{
+	  struct himemce_module *mod = himemce_map_module (himemce_map,
+							   work[i]);
+	  struct himemce_low_section *low
+	    = himemce_module_low_sections (himemce_map, mod);
+
+	  for (j = 0; j < mod->nr_low_sections; j++)
+	    memcpy (low[j].low, (char *) mod->base + low[j].rva,
+		    low[j].init_size);
+	}
+    }
+
+  for (i = 0; i < nr; i++)
+    {
+      struct himemce_module *mod = himemce_map_module (himemce_map, work[i]);
+
+      for (j = 0; j < mod->nr_sys_dlls; j++)
+	{
+	  const char *name = himemce_module_sys_dll (himemce_map, mod, j);
+
+	  if (! himemce_dll_load (name, strlen (name)))
+	    {
+	      TRACE ("Could not find %s, dependency of %s\n", name,
+		     himemce_module_name (himemce_map, mod));
+	      return 0;
+	    }
+	}
+    }
+
+  for (i = 0; i < nr; i++)
+    himemce_mod_loaded[work[i]]++;
+  TRACE ("loaded %i modules with %i sections: %i reservations, "
+	 "%i commits\n", nr, nr_sections, reserves, commits);
+  return 1;
 }
 
 
 /* Returns the base of the module after loading it, if necessary.
-   NULL if not found, -1 if a fatal error occurs.  */
+   NULL if not found, -1 if a fatal error occurs.  The module and
+   the modules it depends on that are not loaded yet are loaded as
+   one batch, in the order planned by the preloader.  */
 void *
 himemce_map_load_dll (const char *name)
 {
   struct himemce_module *mod;
+  unsigned int *closure;
+  unsigned int *work;
+  int nr = 0;
+  int nr_sections = 0;
   int modidx;
-  char *ptr;
-  IMAGE_DOS_HEADER *dos;
-  IMAGE_NT_HEADERS *nt;
-  IMAGE_SECTION_HEADER *sec;
-  int sec_cnt;
   int idx;
-  const IMAGE_IMPORT_DESCRIPTOR *imports;
-  DWORD imports_size;
+  int ok;
   
   himemce_map_init ();
   if (! himemce_map)
@@ -157,105 +495,62 @@ himemce_map_load_dll (const char *name)
   mod = himemce_map_find_module (himemce_map, name);
   if (!mod)
     return NULL;
-  modidx = mod - himemce_map->module;
+  modidx = mod->index;
   if (himemce_mod_loaded[modidx])
     return mod->base;
-  
-  /* First map the sections low.  */
-  ptr = mod->base;
-  dos = (IMAGE_DOS_HEADER *) ptr;
-  nt = (IMAGE_NT_HEADERS *) (ptr + dos->e_lfanew);
-  sec = (IMAGE_SECTION_HEADER *) ((char*) &nt->OptionalHeader
-                                  + nt->FileHeader.SizeOfOptionalHeader);
-  sec_cnt = nt->FileHeader.NumberOfSections;
-  for (idx = 0; idx < sec_cnt; idx++)
-    {
-      size_t secsize;
-      char *secptr;
-      
-      if (! sec[idx].PointerToLinenumbers)
-	continue;
-      secsize = section_size (&sec[idx]);
-      secptr = VirtualAlloc ((void *) sec[idx].PointerToLinenumbers,
-			     secsize, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-      if (! secptr)
-	{
-	  TRACE ("could not allocate 0x%x bytes of low memory at %p: %i\n",
-		 secsize, sec[idx].PointerToLinenumbers, GetLastError ());
-	  return (void *) -1;
-	}
-      memcpy (secptr, ptr + sec[idx].VirtualAddress, secsize);
-    }
-  
-  /* To break circles, we claim that we loaded before recursing.  */
-  himemce_mod_loaded[modidx]++;
-  imports = MyRtlImageDirectoryEntryToData ((HMODULE) ptr, TRUE,
-                                            IMAGE_DIRECTORY_ENTRY_IMPORT,
-                                            &imports_size);
-  if (imports)
+
+  /* The work list: the modules of the closure that are not loaded
+     yet, in load order.  */
+  closure = himemce_module_closure (himemce_map, mod);
+  work = malloc (mod->nr_closure * sizeof (*work));
+  if (! work)
+    return (void *) -1;
+  for (idx = 0; idx < mod->nr_closure; idx++)
+    if (! himemce_mod_loaded[closure[idx]])
+      {
+	work[nr++] = closure[idx];
+	nr_sections += himemce_map_module (himemce_map,
+					   closure[idx])->nr_low_sections;
+      }
+  ok = himemce_map_load_modules (work, nr, nr_sections);
+  free (work);
+  if (! ok)
+    return (void *) -1;
+  TRACE ("low memory: 0x%x of 0x%x bytes reserved\n",
+	 himemce_low_nr_reserved * HIMEMCE_MAP_LOW_GRANULE,
+	 himemce_map->low_size);
+  if (himemce_map_lazy_low)
     {
-      idx = 0;
-      while (imports[idx].Name && imports[idx].FirstThunk)
-	{
-	  char *iname = ptr + imports[idx].Name;
-	  void *ibase;
-	  
-	  /* Recursion!  */
-	  ibase = himemce_map_load_dll (iname);
-	  if (ibase == (void *) -1)
-	    return (void *) -1;
-	  /* Nothing to do if ibase !=0: Successful loading of high DLL.  */
-	  if (ibase == 0)
-	    {
-	      ibase = LoadLibrary (iname);
-	      if (!ibase)
-		{
-		  TRACE ("Could not find %s, dependency of %s\n", iname, name);
-		  return (void *) -1;
-		}
-	    }
-	  idx++;
-	}
+      DWORD committed, total;
+
+      if (virtual_get_copy_area_pages (&committed, &total))
+	TRACE ("low memory: %u of %u pages committed\n", committed, total);
     }
-  return ptr;
+  return mod->base;
 }
 
 
 static void *
-get_rva_low (char *module, size_t rva)
+get_rva_low (struct himemce_module *mod, size_t rva)
 {
-  IMAGE_DOS_HEADER *dos = (IMAGE_DOS_HEADER *)module;
-  IMAGE_NT_HEADERS *nt = (IMAGE_NT_HEADERS *)(module + dos->e_lfanew);
-  IMAGE_SECTION_HEADER *sec;
-  int sec_cnt;
-  int idx;
-  
-  sec = (IMAGE_SECTION_HEADER*)((char*)&nt->OptionalHeader
-				+ nt->FileHeader.SizeOfalHeader);
-  sec_cnt = nt->FileHeader.NumberOfSections;
+  struct himemce_low_section *sec;
 
-  for (idx = 0; idx < sec_cnt; idx++)
-    {
-      if (! sec[idx].PointerToLinenumbers)
-        continue;
-      if (rva >= sec[idx].VirtualAddress
-          && rva < sec[idx].VirtualAddress + section_size (&sec[idx]))
-	break;
-    }
-  if (idx == sec_cnt)
-    return (void *)((char *)module + rva);
-  
-  return (void *)((char *)sec[idx].PointerToLinenumbers
-                  + (rva - sec[idx].VirtualAddress));
+  sec = himemce_map_find_low_section (himemce_map, mod, rva);
+  if (! sec)
+    return (void *)((char *)mod->base + rva);
+
+  return (void *)(sec->low + (rva - sec->rva));
 }
 
 
 static FARPROC
-find_ordinal_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
+find_ordinal_export (struct himemce_module *mod,
+		     const IMAGE_EXPORT_DIRECTORY *exports,
                      DWORD exp_size, DWORD ordinal, LPCWSTR load_path)
 {
   FARPROC proc;
-  const DWORD *functions = get_rva (module, exports->AddressOfFunctions);
+  const DWORD *functions = get_rva (mod->base, exports->AddressOfFunctions);
+  DWORD exp_rva = (const char *)exports - (const char *)mod->base;
   
   if (ordinal >= exports->NumberOfFunctions)
     {
@@ -264,22 +559,31 @@ find_ordinal_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
     }
   if (!functions[ordinal]) return NULL;
   
-#if 0
-  /* if the address falls into the export dir, it's a forward */
-  if (((const char *)proc >= (const char *)exports) &&
-      ((const char *)proc < (const char *)exports + exp_size))
-    return find_forwarded_export( module, (const char *)proc, load_path );
-#endif
+  /* if the address falls into the export dir, it's a forward, which
+     the preloader resolved, and whose dll was loaded with MOD */
+  if (functions[ordinal] >= exp_rva && functions[ordinal] < exp_rva + exp_size)
+    {
+      struct himemce_forward *fwd = himemce_map_find_forward( himemce_map, mod,
+                                                              ordinal );
 
-  proc = get_rva_low (module, functions[ordinal]);
+      if (fwd) return fwd->target;
+      TRACE(" forward %s of %s not resolved\n",
+            (const char *)get_rva( mod->base, functions[ordinal] ),
+            himemce_module_name( himemce_map, mod ) );
+      return NULL;
+    }
+
+  proc = get_rva_low (mod, functions[ordinal]);
   return proc;
 }
 
 static FARPROC
-find_named_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
+find_named_export (struct himemce_module *mod,
+		   const IMAGE_EXPORT_DIRECTORY *exports,
                    DWORD exp_size, const char *name, int hint,
 		   LPCWSTR load_path)
 {
+  void *module = mod->base;
   const WORD *ordinals = get_rva (module, exports->AddressOfNameOrdinals);
   const DWORD *names = get_rva (module, exports->AddressOfNames);
   int min = 0, max = exports->NumberOfNames - 1;
@@ -289,17 +593,28 @@ find_named_export (void *module, const IMAGE_EXPORT_DIRECTORY *exports,
     {
       char *ename = get_rva( module, names[hint] );
       if (!strcmp( ename, name ))
-        return find_ordinal_export( module, exports, exp_size,
+        return find_ordinal_export( mod, exports, exp_size,
 				    ordinals[hint], load_path);
     }
   
-  /* then do a binary search */
+  /* then look it up in the index built by the preloader */
+  if (mod->exports)
+    {
+      int pos = himemce_map_find_export( himemce_module_exports( himemce_map, mod ),
+                                         module, name );
+
+      if (pos < 0) return NULL;
+      return find_ordinal_export( mod, exports, exp_size,
+				  ordinals[pos], load_path );
+    }
+
+  /* or do a binary search */
   while (min <= max)
     {
       int res, pos = (min + max) / 2;
       char *ename = get_rva( module, names[pos] );
       if (!(res = strcmp( ename, name )))
-        return find_ordinal_export( module, exports, exp_size,
+        return find_ordinal_export( mod, exports, exp_size,
 				    ordinals[pos], load_path);
       if (res > 0) max = pos - 1;
       else min = pos + 1;
@@ -331,24 +646,24 @@ typedef struct _wine_modref
     LDR_MODULE            ldr;
     int                   nDeps;
     struct _wine_modref **deps;
+    DWORD                 load_flags;    /* HIMEMCE_* load flags */
+    struct himemce_lazy_block *lazy;     /* trampolines for lazy binding */
+    struct import_source *sources;       /* and where they bind to */
+    struct himemce_lazy_block *delay;    /* trampolines for delay loading */
+    struct delay_source *delay_sources;  /* and where they bind to */
+    int                   nr_discarded;  /* decommitted after loading */
+    struct himemce_discarded discarded[HIMEMCE_MAX_DISCARDED];
 } WINE_MODREF;
 
-/* FIXME: cmp with himemce-map.h */
-#define MAX_MODREFS 64
-WINE_MODREF *modrefs[MAX_MODREFS];
+/* The modules loaded by us, in a table that grows as needed.  */
+WINE_MODREF **modrefs;
 int nr_modrefs;
+static int max_modrefs;
 
 
 static WINE_MODREF *current_modref;
 
 
-/* convert from straight ASCII to Unicode without depending on the current codepage */
-static void ascii_to_unicode( WCHAR *dst, const char *src, size_t len )
-{
-  while (len--) *dst++ = (unsigned char)*src++;
-}
-
-
 /***********************************************************************
  *           RtlImageDirectoryEntryToData   (NTDLL.@)
  */
@@ -392,27 +707,195 @@ PVOID MyRtlImageDirectoryEntryToData( HMODULE module, BOOL image, WORD dir, ULON
 }
 
 
-#define allocate_stub(x,y) (0xdeadbeef)
+/* Where the imports of one import descriptor come from.  Kept with the
+   module while imports from it are bound lazily.  */
+struct import_source
+{
+  HMODULE module;           /* the importing module */
+  LPCWSTR importer;         /* and its file name */
+  const char *name;         /* the imported dll */
+  HMODULE imp_mod;
+#ifdef USE_HIMEMCE_MAP
+  void *imp_base;
+  struct himemce_module *imp_map_mod;
+  const IMAGE_EXPORT_DIRECTORY *exports;
+  DWORD exp_size;
+#endif
+#ifdef USE_DLMALLOC
+  int iscoredll;
+#endif
+  BOOL missing;             /* a stub was bound for a missing import */
+};
+
+
+/*************************************************************************
+ *              resolve_import
+ *
+ * Find the address of one import from SRC, or a stub if it is missing.
+ */
+static FARPROC resolve_import( struct import_source *src, const IMAGE_THUNK_DATA *import,
+                               LPCWSTR load_path )
+{
+  FARPROC proc = NULL;
+
+  if (IMAGE_SNAP_BY_ORDINAL(import->u1.Ordinal))
+    {
+      int ordinal = IMAGE_ORDINAL(import->u1.Ordinal);
+
+#ifdef USE_HIMEMCE_MAP
+      if (src->imp_base)
+        {
+          if (src->exports)
+            proc = find_ordinal_export( src->imp_map_mod, src->exports, src->exp_size,
+                                        ordinal - src->exports->Base, load_path );
+        }
+      else
+#endif
+
+#ifdef USE_DLMALLOC
+      if (src->iscoredll)
+        {
+#define COREDLL_MALLOC 1041
+#define COREDLL_CALLOC 1346
+#define COREDLL_FREE 1018
+#define COREDLL_REALLOC 1054
+
+          if (ordinal == COREDLL_MALLOC)
+            proc = (FARPROC) dlmalloc;
+          else if (ordinal == COREDLL_CALLOC)
+            proc = (FARPROC) dlcalloc;
+          else if (ordinal == COREDLL_FREE)
+            proc = (FARPROC) dlfree;
+          else if (ordinal == COREDLL_REALLOC)
+            proc = (FARPROC) dlrealloc;
+          else
+            proc = himemce_dll_proc (src->imp_mod, (void *) (ordinal & 0xffff));
+        }
+      else
+#endif
+        proc = himemce_dll_proc (src->imp_mod, (void *) (ordinal & 0xffff));
+
+      if (!proc)
+        {
+          proc = himemce_stub_missing( src->name, IntToPtr(ordinal) );
+          src->missing = TRUE;
+          ERR("No implementation for %s.%d imported from %S, setting to %p\n",
+              src->name, ordinal, src->importer, (void *)proc );
+        }
+      TRACE("--- Ordinal %s.%d = %p\n", src->name, ordinal, (void *)proc );
+    }
+  else  /* import by name */
+    {
+      IMAGE_IMPORT_BY_NAME *pe_name;
+      const char *symname;
+      pe_name = get_rva( src->module, (DWORD)import->u1.AddressOfData );
+      symname = (const char*)pe_name->Name;
+
+#ifdef USE_HIMEMCE_MAP
+      if (src->imp_base)
+        {
+          if (src->exports)
+            proc = find_named_export( src->imp_map_mod, src->exports, src->exp_size,
+                                      symname, pe_name->Hint, load_path );
+        }
+      else
+#endif
+#ifdef USE_DLMALLOC
+      if (src->iscoredll)
+        {
+          if (! strcmp (symname, "malloc"))
+            proc = (FARPROC) dlmalloc;
+          else if (! strcmp (symname, "calloc"))
+            proc = (FARPROC) dlcalloc;
+          else if (! strcmp (symname, "free"))
+            proc = (FARPROC) dlfree;
+          else if (! strcmp (symname, "realloc"))
+            proc = (FARPROC) dlrealloc;
+          else
+            proc = himemce_dll_proc (src->imp_mod, symname);
+        }
+      else
+#endif
+        proc = himemce_dll_proc (src->imp_mod, symname);
+
+      if (!proc)
+        {
+          proc = himemce_stub_missing (src->name, symname);
+          src->missing = TRUE;
+          ERR("No implementation for %s.%s imported from %S, setting to %p\n",
+              src->name, symname, src->importer, (void *)proc );
+        }
+      TRACE("--- %s %s.%d = %p\n", symname, src->name, pe_name->Hint, (void *)proc);
+    }
+  return proc;
+}
+
+
+/* The resolver of lazily bound imports.  */
+static void *resolve_lazy_import( struct himemce_lazy_import *imp )
+{
+  return resolve_import( imp->source, imp->import, NULL );
+}
+
+
+/* Return TRUE if IMPORT from MODULE can be bound lazily: only
+   functions can, as data is not accessed through a call.  */
+static BOOL is_lazy_import( HMODULE module, const IMAGE_THUNK_DATA *import )
+{
+  const IMAGE_IMPORT_BY_NAME *pe_name;
+
+  if (IMAGE_SNAP_BY_ORDINAL(import->u1.Ordinal)) return TRUE;
+  pe_name = get_rva( module, (DWORD)import->u1.AddressOfData );
+  return himemce_lazy_is_code( (const char*)pe_name->Name );
+}
+
+
+/*************************************************************************
+ *              get_import_stamp
+ *
+ * Get the key of an imported dll for the bound imports snapshot: the
+ * map generation for dlls from the himemce map, and the write time of
+ * the file for others.  Returns FALSE if there is none.
+ */
+static BOOL get_import_stamp( HMODULE imp_mod, BOOL mapped, FILETIME *stamp )
+{
+  stamp->dwLowDateTime = 0;
+  stamp->dwHighDateTime = 0;
+#ifdef USE_HIMEMCE_MAP
+  if (mapped)
+    {
+      stamp->dwLowDateTime = himemce_map->generation;
+      return himemce_map->generation != 0;
+    }
+#endif
+  return himemce_bind_module_stamp( imp_mod, stamp );
+}
+
 
 /*************************************************************************
  *              import_dll
  *
- * Import the dll specified by the given import descriptor.
+ * Import the dll specified by the given import descriptor, which is
+ * number IDX in BIND if that is not NULL.  If LAZY is not NULL, the
+ * functions are bound to its trampolines from *LAZY_IDX on, with SRC
+ * as the source, and *LAZY_IDX is advanced.
  * The loader_section must be locked while calling this function.
  */
-static WINE_MODREF *import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *descr, LPCWSTR load_path )
+static WINE_MODREF *import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *descr, LPCWSTR load_path,
+                                struct himemce_bind *bind, int idx, struct import_source *src,
+                                struct himemce_lazy_block *lazy, int *lazy_idx )
 {
   NTSTATUS status = STATUS_SUCCESS;
   //  WINE_MODREF *wmImp;
-  HMODULE imp_mod;
+  HMODULE imp_mod = NULL;
+  FILETIME imp_stamp;
+  DWORD imp_key = 0;
 #ifdef USE_HIMEMCE_MAP
   void *imp_base = 0;
-  const IMAGE_EXPORT_DIRECTORY *exports;
-  DWORD exp_size;
+  struct himemce_module *imp_map_mod = NULL;
 #endif
   const IMAGE_THUNK_DATA *import_list;
   IMAGE_THUNK_DATA *thunk_list;
-  WCHAR buffer[32];
   const char *name = get_rva( module, descr->Name );
   DWORD len = strlen(name);
 #if 0
@@ -420,9 +903,6 @@ static WINE_MODREF *import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *d
   SIZE_T protect_size = 0;
   DWORD protect_old;
 #endif
-#ifdef USE_DLMALLOC
-  int iscoredll = 0;
-#endif
 
   thunk_list = get_rva( module, (DWORD)descr->FirstThunk );
   if (descr->OriginalFirstThunk)
@@ -432,40 +912,20 @@ static WINE_MODREF *import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *d
 
   while (len && name[len-1] == ' ') len--;  /* remove trailing spaces */
 
-#ifdef USE_DLMALLOC
-  if (! _stricmp (name, "coredll.dll"))
-    iscoredll = 1;
-#endif
-
 #ifdef USE_HIMEMCE_MAP
   imp_base = himemce_map_load_dll (name);
   if (imp_base == (void *) -1)
     status = GetLastError ();
+  else if (imp_base)
+    imp_map_mod = himemce_map_find_module (himemce_map, name);
   if (imp_base)
     goto loaded;
 #endif
 
-  if (len * sizeof(WCHAR) < sizeof(buffer))
-    {
-      ascii_to_unicode( buffer, name, len );
-      buffer[len] = 0;
-      //      status = load_dll( load_path, buffer, 0, &wmImp );
-      imp_mod = LoadLibrary (buffer);
-	  if (imp_mod == INVALID_HANDLE_VALUE)
-	    status = GetLastError ();
-  }
-  else  /* need to allocate a larger buffer */
-    {
-      WCHAR *ptr = malloc ((len + 1) * sizeof(WCHAR) );
-      if (!ptr) return NULL;
-      ascii_to_unicode( ptr, name, len );
-      ptr[len] = 0;
-      // status = load_dll( load_path, ptr, 0, &wmImp );
-	  imp_mod = LoadLibrary (ptr);
-	  if (imp_mod == INVALID_HANDLE_VALUE)
-	    status = GetLastError ();
-	  free (ptr);
-    }
+  /* The cache loads every system DLL only once per process.  */
+  imp_mod = himemce_dll_load( name, len );
+  if (!imp_mod)
+    status = GetLastError();
 #ifdef USE_HIMEMCE_MAP
 loaded:
 #endif
@@ -490,129 +950,74 @@ loaded:
 			  &protect_size, PAGE_WRITECOPY, &protect_old );
 #endif
 
-#ifdef USE_HIMEMCE_MAP
- if (imp_base)
- {
-   exports = MyRtlImageDirectoryEntryToData( imp_base, TRUE, IMAGE_DIRECTORY_ENTRY_EXPORT, &exp_size );
-
-  if (!exports)
+  src->missing = FALSE;
+  if (bind)
     {
-      /* set all imported function to deadbeef */
-      while (import_list->u1.Ordinal)
+#ifdef USE_HIMEMCE_MAP
+      if (imp_base)
         {
-	  if (IMAGE_SNAP_BY_ORDINAL(import_list->u1.Ordinal))
-            {
-	      int ordinal = IMAGE_ORDINAL(import_list->u1.Ordinal);
-	      TRACE("No implementation for %s.%d", name, ordinal );
-	      thunk_list->u1.Function = (PDWORD)(ULONG_PTR)allocate_stub( name, IntToPtr(ordinal) );
-            }
-	  else
-            {
-	      IMAGE_IMPORT_BY_NAME *pe_name = get_rva( module, (DWORD)import_list->u1.AddressOfData );
-	      TRACE("No implementation for %s.%s", name, pe_name->Name );
-	      thunk_list->u1.Function = (PDWORD)(ULONG_PTR)allocate_stub( name, (const char*)pe_name->Name );
-            }
-	  TRACE(" imported from %s, allocating stub %p\n",
-	       current_modref->ldr.FullDllName,
-	       (void *)thunk_list->u1.Function );
-	  import_list++;
-	  thunk_list++;
+          imp_key = (DWORD)imp_base;
+          get_import_stamp( NULL, TRUE, &imp_stamp );
         }
-      goto done;
-    }
- }
+      else
 #endif
-
-  while (import_list->u1.Ordinal)
-    {
-      if (IMAGE_SNAP_BY_ORDINAL(import_list->u1.Ordinal))
+      {
+        imp_key = (DWORD)imp_mod;
+        /* Without a file time, check the first import instead.  */
+        if (!get_import_stamp( imp_mod, FALSE, &imp_stamp ) && import_list->u1.Ordinal)
+          {
+            if (IMAGE_SNAP_BY_ORDINAL(import_list->u1.Ordinal))
+              imp_stamp.dwLowDateTime = (DWORD)himemce_dll_proc( imp_mod,
+                                                                 (void *)(IMAGE_ORDINAL(import_list->u1.Ordinal) & 0xffff) );
+            else
+              {
+                IMAGE_IMPORT_BY_NAME *pe_name = get_rva( module, (DWORD)import_list->u1.AddressOfData );
+                imp_stamp.dwLowDateTime = (DWORD)himemce_dll_proc( imp_mod, (const char*)pe_name->Name );
+              }
+          }
+      }
+      if (himemce_bind_apply( bind, idx, imp_key, &imp_stamp ))
         {
-	  int ordinal = IMAGE_ORDINAL(import_list->u1.Ordinal);
-
-#ifdef USE_HIMEMCE_MAP
-	  if (imp_base)
-		thunk_list->u1.Function = (PDWORD)(ULONG_PTR)find_ordinal_export( imp_base, exports, exp_size,
-	                                                              ordinal - exports->Base, load_path );
-	  else
-#endif
-
-#ifdef USE_DLMALLOC
-	  if (iscoredll)
-	    {
-#define COREDLL_MALLOC 1041
-#define COREDLL_CALLOC 1346
-#define COREDLL_FREE 1018
-#define COREDLL_REALLOC 1054
-
-	      if (ordinal == COREDLL_MALLOC)
-		thunk_list->u1.Function = (PWORD) dlmalloc;
-	      else if (ordinal == COREDLL_CALLOC)
-		thunk_list->u1.Function = (PWORD) dlcalloc;
-	      else if (ordinal == COREDLL_FREE)
-		thunk_list->u1.Function = (PWORD) dlfree;
-	      else if (ordinal == COREDLL_REALLOC)
-		thunk_list->u1.Function = (PWORD) dlrealloc;
-	      else
-		thunk_list->u1.Function = (PWORD)(ULONG_PTR)GetProcAddress (imp_mod, (void *) (ordinal & 0xffff));
-	    }
-	  else
-#endif
-	    thunk_list->u1.Function = (PDWORD)(ULONG_PTR)GetProcAddress (imp_mod, (void *) (ordinal & 0xffff));
-
-	  if (!thunk_list->u1.Function)
-            {
-	      thunk_list->u1.Function = (PDWORD) allocate_stub( name, IntToPtr(ordinal) );
-	      TRACE("No implementation for %s.%d imported from %s, setting to %p\n",
-		    name, ordinal, current_modref->ldr.FullDllName,
-		    (void *)thunk_list->u1.Function );
-            }
-	  TRACE("--- Ordinal %s.%d = %p\n", name, ordinal, (void *)thunk_list->u1.Function );
+          TRACE("bound imports from %s from snapshot\n", name);
+          goto done;
         }
-      else  /* import by name */
-        {
-	  IMAGE_IMPORT_BY_NAME *pe_name;
-	  const char *symname;
-	  pe_name = get_rva( module, (DWORD)import_list->u1.AddressOfData );
-	  symname = (const char*)pe_name->Name;
+    }
 
+  src->module = module;
+  src->importer = current_modref->ldr.FullDllName;
+  src->name = name;
+  src->imp_mod = imp_mod;
 #ifdef USE_HIMEMCE_MAP
-	  if (imp_base)
-		  thunk_list->u1.Function = (PDWORD)(ULONG_PTR)find_named_export( imp_base, exports, exp_size,
-	  								  (const char*)pe_name->Name,
-	  								  pe_name->Hint, load_path );
-	  else
+  src->imp_base = imp_base;
+  src->imp_map_mod = imp_map_mod;
+  src->exports = NULL;
+  if (imp_base)
+    {
+      src->exports = MyRtlImageDirectoryEntryToData( imp_base, TRUE, IMAGE_DIRECTORY_ENTRY_EXPORT,
+                                                     &src->exp_size );
+      if (!src->exports)
+        TRACE("No exports in %s, imported from %S\n", name, src->importer );
+    }
 #endif
 #ifdef USE_DLMALLOC
-	  if (iscoredll)
-	    {
-	      if (! strcmp (symname, "malloc"))
-		thunk_list->u1.Function = (PWORD) dlmalloc;
-	      else if (! strcmp (symname, "calloc"))
-		thunk_list->u1.Function = (PWORD) dlcalloc;
-	      else if (! strcmp (symname, "free"))
-		thunk_list->u1.Function = (PWORD) dlfree;
-	      else if (! strcmp (symname, "realloc"))
-		thunk_list->u1.Function = (PWORD) dlrealloc;
-	      else
-		thunk_list->u1.Function = (PDWORD)(ULONG_PTR)GetProcAddressA (imp_mod, symname);
-	    }
-	  else
+  src->iscoredll = ! _stricmp (name, "coredll.dll");
 #endif
-	    thunk_list->u1.Function = (PDWORD)(ULONG_PTR)GetProcAddressA (imp_mod, symname);
-	  if (!thunk_list->u1.Function)
-            {
-	      thunk_list->u1.Function = (PDWORD) allocate_stub (name, symname);
-	      TRACE("No implementation for %s.%s imported from %s, setting to %p\n",
-		    name, symname, current_modref->ldr.FullDllName,
-		    (void *)thunk_list->u1.Function );
-            }
-	  TRACE("--- %s %s.%d = %p\n",
-		symname, name, pe_name->Hint, (void *)thunk_list->u1.Function);
-        }
+
+  while (import_list->u1.Ordinal)
+    {
+      if (lazy && is_lazy_import( module, import_list ))
+        himemce_lazy_set( lazy, (*lazy_idx)++, (DWORD *)&thunk_list->u1.Function,
+                          resolve_lazy_import, src, import_list );
+      else
+        thunk_list->u1.Function = (PDWORD)(ULONG_PTR)resolve_import( src, import_list, load_path );
       import_list++;
       thunk_list++;
     }
 done:
+  /* The stubs for missing imports are made anew by every process, so
+     a table with one of them is not kept.  */
+  if (bind)
+    himemce_bind_record( bind, idx, src->missing ? 0 : imp_key, &imp_stamp );
 #if 0
   /* restore old protection of the import address table */
   NtProtectVirtualMemory( NtCurrentProcess(), &protect_base, &protect_size, protect_old, NULL );
@@ -623,6 +1028,161 @@ done:
 
 
 
+/* A delay loaded dll of a module.  The dll is loaded on the first
+   call of one of its imports, through the same trampolines as for
+   lazy binding.  */
+struct delay_source
+{
+  struct import_source src;
+  DWORD *hmod;              /* the module handle in the image, or NULL */
+  LONG loaded;              /* 1 once SRC is set up, -1 if it failed */
+};
+
+/* Delay loaded dlls are loaded from any thread.  */
+static LONG delay_lock;
+
+
+/*************************************************************************
+ *              load_delay_dll
+ *
+ * Load the dll of DELAY, from the himemce map or by the system loader.
+ */
+static void load_delay_dll( struct delay_source *delay )
+{
+  struct import_source *src = &delay->src;
+  HMODULE hmod = NULL;
+
+  while (InterlockedExchange( &delay_lock, 1 )) Sleep( 0 );
+  if (!delay->loaded)
+    {
+#ifdef USE_HIMEMCE_MAP
+      src->imp_base = himemce_map_load_dll( src->name );
+      if (src->imp_base == (void *)-1)
+        src->imp_base = NULL;
+      else if (src->imp_base)
+        {
+          hmod = src->imp_base;
+          src->imp_map_mod = himemce_map_find_module( himemce_map, src->name );
+          src->exports = MyRtlImageDirectoryEntryToData( src->imp_base, TRUE,
+                                                         IMAGE_DIRECTORY_ENTRY_EXPORT,
+                                                         &src->exp_size );
+        }
+      if (!hmod)
+#endif
+        hmod = src->imp_mod = himemce_dll_load( src->name, strlen(src->name) );
+#ifdef USE_DLMALLOC
+      src->iscoredll = ! _stricmp (src->name, "coredll.dll");
+#endif
+      if (hmod)
+        {
+          TRACE("delay loaded %s for %S\n", src->name, src->importer);
+          if (delay->hmod) *delay->hmod = (DWORD)hmod;
+        }
+      else
+        ERR("Could not delay load %s for %S: %i\n", src->name, src->importer, GetLastError());
+      InterlockedExchange( &delay->loaded, hmod ? 1 : -1 );
+    }
+  InterlockedExchange( &delay_lock, 0 );
+
+#ifdef USE_HIMEMCE_MAP
+  /* Outside of the lock, as DllMain may call delay loaded imports.  */
+  if (src->imp_base)
+    himemce_invoke_dll_mains( DLL_PROCESS_ATTACH, NULL );
+#endif
+}
+
+
+/* The resolver of delay loaded imports.  */
+static void *resolve_delay_import( struct himemce_lazy_import *imp )
+{
+  struct delay_source *delay = imp->source;
+
+  if (!delay->loaded) load_delay_dll( delay );
+  if (delay->loaded > 0)
+    return resolve_import( &delay->src, imp->import, NULL );
+
+  if (IMAGE_SNAP_BY_ORDINAL(imp->import->u1.Ordinal))
+    return himemce_stub_missing( delay->src.name,
+                                 IntToPtr(IMAGE_ORDINAL(imp->import->u1.Ordinal)) );
+  else
+    {
+      const IMAGE_IMPORT_BY_NAME *pe_name = get_rva( delay->src.module,
+                                                     (DWORD)imp->import->u1.AddressOfData );
+      return himemce_stub_missing( delay->src.name, (const char*)pe_name->Name );
+    }
+}
+
+
+/****************************************************************
+ *       fixup_delay_imports
+ *
+ * Point the delay loaded imports of a module to trampolines that load
+ * their dll on the first call.  The delay load helper linked into the
+ * image is not used, as it can not find the dlls in the himemce map.
+ */
+static NTSTATUS fixup_delay_imports( WINE_MODREF *wm )
+{
+  HMODULE module = wm->ldr.BaseAddress;
+  const struct himemce_delay_descr *descr;
+  int i, nb_delay, nr_thunks = 0, lazy_idx = 0;
+  DWORD size;
+
+  if (!(descr = MyRtlImageDirectoryEntryToData( module, TRUE, IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT,
+                                                &size )))
+    return STATUS_SUCCESS;
+
+  nb_delay = 0;
+  while ((nb_delay + 1) * sizeof(*descr) <= size
+         && descr[nb_delay].rvaDLLName && descr[nb_delay].rvaIAT)
+    nb_delay++;
+
+  for (i = 0; i < nb_delay; i++)
+    {
+      const IMAGE_THUNK_DATA *import_list;
+
+      if (!(descr[i].grAttrs & HIMEMCE_DELAY_RVA) || !descr[i].rvaINT)
+        {
+          TRACE("delay loaded dll %d of %S is left to the image\n", i, wm->ldr.FullDllName);
+          continue;
+        }
+      import_list = get_rva( module, descr[i].rvaINT );
+      while (import_list++->u1.Ordinal) nr_thunks++;
+    }
+  if (!nr_thunks) return STATUS_SUCCESS;
+
+  wm->delay_sources = calloc( nb_delay, sizeof(*wm->delay_sources) );
+  wm->delay = himemce_lazy_alloc( nr_thunks );
+  if (!wm->delay_sources || !wm->delay) return STATUS_NO_MEMORY;
+
+  for (i = 0; i < nb_delay; i++)
+    {
+      struct delay_source *delay = &wm->delay_sources[i];
+      const IMAGE_THUNK_DATA *import_list;
+      IMAGE_THUNK_DATA *thunk_list;
+
+      if (!(descr[i].grAttrs & HIMEMCE_DELAY_RVA) || !descr[i].rvaINT) continue;
+
+      delay->src.module = module;
+      delay->src.importer = wm->ldr.FullDllName;
+      delay->src.name = get_rva( module, descr[i].rvaDLLName );
+      if (descr[i].rvaHmod) delay->hmod = get_rva( module, descr[i].rvaHmod );
+
+      import_list = get_rva( module, descr[i].rvaINT );
+      thunk_list = get_rva( module, descr[i].rvaIAT );
+      while (import_list->u1.Ordinal)
+        {
+          himemce_lazy_set( wm->delay, lazy_idx++, (DWORD *)&thunk_list->u1.Function,
+                            resolve_delay_import, delay, import_list );
+          import_list++;
+          thunk_list++;
+        }
+    }
+  himemce_lazy_commit( wm->delay );
+  TRACE("%i imports of %S are delay loaded\n", lazy_idx, wm->ldr.FullDllName);
+  return STATUS_SUCCESS;
+}
+
+
 /****************************************************************
  *       fixup_imports
  *
@@ -636,10 +1196,14 @@ static NTSTATUS fixup_imports( WINE_MODREF *wm, LPCWSTR load_path )
   WINE_MODREF *prev;
   DWORD size;
   NTSTATUS status;
+  struct himemce_bind *bind = NULL;
+  int lazy_idx = 0;
   //  ULONG_PTR cookie;
 
   if (!(wm->ldr.Flags & LDR_DONT_RESOLVE_REFS)) return STATUS_SUCCESS;  /* already done */
   wm->ldr.Flags &= ~LDR_DONT_RESOLVE_REFS;
+
+  if ((status = fixup_delay_imports( wm )) != STATUS_SUCCESS) return status;
   
   if (!(imports = MyRtlImageDirectoryEntryToData( wm->ldr.BaseAddress, TRUE,
 						  IMAGE_DIRECTORY_ENTRY_IMPORT, &size )))
@@ -664,16 +1228,45 @@ static NTSTATUS fixup_imports( WINE_MODREF *wm, LPCWSTR load_path )
   /* load the imported modules. They are automatically
    * added to the modref list of the process.
    */
+  if (!(wm->sources = malloc( nb_imports * sizeof(*wm->sources) )))
+    return STATUS_NO_MEMORY;
+
+  /* The snapshot would keep the trampolines, so lazy binding goes
+     without.  */
+  if (wm->load_flags & HIMEMCE_LAZY_BIND)
+    {
+      int nr_thunks = 0;
+
+      for (i = 0; i < nb_imports; i++)
+        {
+          const IMAGE_THUNK_DATA *import_list;
+
+          import_list = get_rva( wm->ldr.BaseAddress, imports[i].OriginalFirstThunk
+                                 ? imports[i].OriginalFirstThunk : imports[i].FirstThunk );
+          while (import_list++->u1.Ordinal) nr_thunks++;
+        }
+      wm->lazy = himemce_lazy_alloc( nr_thunks );
+    }
+  else if (wm->load_flags & HIMEMCE_BIND_IMPORTS)
+    bind = himemce_bind_open( wm->ldr.FullDllName, wm->ldr.BaseAddress, imports, nb_imports );
+
   prev = current_modref;
   current_modref = wm;
   status = STATUS_SUCCESS;
   for (i = 0; i < nb_imports; i++)
     {
       //      if (!(wm->deps[i] = import_dll( wm->ldr.BaseAddress, &imports[i], load_path )))
-      if (! import_dll( wm->ldr.BaseAddress, &imports[i], load_path ))
+      if (! import_dll( wm->ldr.BaseAddress, &imports[i], load_path, bind, i,
+                        &wm->sources[i], wm->lazy, &lazy_idx ))
 	status = STATUS_DLL_NOT_FOUND;
     }
   current_modref = prev;
+  if (bind) himemce_bind_close( bind );
+  if (wm->lazy)
+    {
+      himemce_lazy_commit( wm->lazy );
+      TRACE("%i of the imports of %S are bound lazily\n", lazy_idx, wm->ldr.FullDllName);
+    }
   //  if (wm->ldr.ActivationContext) RtlDeactivateActivationContext( 0, cookie );
 
 #ifdef USE_HIMEMCE_MAP
@@ -716,10 +1309,25 @@ static WINE_MODREF *alloc_module( HMODULE hModule, LPCWSTR filename )
     PLIST_ENTRY entry, mark;
 #endif
 
+    if (nr_modrefs == max_modrefs)
+    {
+        int max = max_modrefs ? 2 * max_modrefs : 64;
+        WINE_MODREF **table = realloc( modrefs, max * sizeof(*table) );
+
+        if (!table) return NULL;
+        modrefs = table;
+        max_modrefs = max;
+    }
     if (!(wm = malloc (sizeof(*wm)))) return NULL;
 
     wm->nDeps    = 0;
     wm->deps     = NULL;
+    wm->load_flags   = 0;
+    wm->lazy         = NULL;
+    wm->sources      = NULL;
+    wm->delay        = NULL;
+    wm->delay_sources = NULL;
+    wm->nr_discarded = 0;
 
     wm->ldr.BaseAddress   = hModule;
     wm->ldr.EntryPoint    = NULL;
@@ -780,23 +1388,55 @@ static NTSTATUS load_native_dll( LPCWSTR load_path, LPCWSTR name, HANDLE file,
   SIZE_T len = 0;
   WINE_MODREF *wm;
   NTSTATUS status;
+  struct image_header *header;
 
   TRACE("Trying native dll %S\n", name);
   
-  size.QuadPart = 0;
-  status = MyNtCreateSection( &mapping, STANDARD_RIGHTS_REQUIRED | SECTION_QUERY | SECTION_MAP_READ,
-			      NULL, &size, PAGE_READONLY, SEC_IMAGE, file );
-  if (status != STATUS_SUCCESS) return status;
-  
+  /* The headers are read once for the cache and the mapping.  */
+  if (!(header = malloc( sizeof(*header) ))) return STATUS_NO_MEMORY;
+  image_header_read( header, file );
+
   module = NULL;
-  status = MyNtMapViewOfSection( mapping, NtCurrentProcess(),
-				 &module, 0, 0, &size, &len, ViewShare, 0, PAGE_READONLY );
-  CloseHandle( mapping );
-  if (status < 0) return status;
+  if (flags & HIMEMCE_CACHE_LOAD)
+    module = himemce_cache_map( name, file, header );
+
+  if (!module)
+    {
+      size.QuadPart = 0;
+      status = MyNtCreateSection( &mapping, STANDARD_RIGHTS_REQUIRED | SECTION_QUERY | SECTION_MAP_READ,
+				  NULL, &size, PAGE_READONLY, SEC_IMAGE, file, header );
+      if (status != STATUS_SUCCESS)
+        {
+          free( header );
+          return status;
+        }
+
+      /* The cache is written from the complete image.  */
+      if (flags & HIMEMCE_CACHE_LOAD) flags &= ~HIMEMCE_LAZY_LOAD;
+
+      status = MyNtMapViewOfSection( mapping, NtCurrentProcess(),
+				     &module, 0, 0, &size, &len, ViewShare,
+				     flags & (HIMEMCE_LAZY_LOAD | HIMEMCE_PARALLEL_RELOC),
+				     PAGE_READONLY );
+      SERVER_close_mapping( mapping );
+      if (status < 0)
+        {
+          free( header );
+          return status;
+        }
+
+      if (flags & HIMEMCE_CACHE_LOAD)
+	himemce_cache_save( name, file, header, module );
+    }
+  free( header );
   
   /* create the MODREF */
   
   if (!(wm = alloc_module( module, name ))) return STATUS_NO_MEMORY;
+  wm->load_flags = flags & (HIMEMCE_BIND_IMPORTS | HIMEMCE_LAZY_BIND);
+#ifdef USE_HIMEMCE_MAP
+  if (flags & HIMEMCE_LAZY_LOW) himemce_map_lazy_low = 1;
+#endif
   
   /* fixup imports */
   
@@ -864,7 +1504,10 @@ static NTSTATUS find_dll_file( const WCHAR *load_path, const WCHAR *libname,
 }
 
 
-static NTSTATUS load_dll( LPCWSTR load_path, LPCWSTR libname, DWORD flags, WINE_MODREF** pwm )
+/* Load LIBNAME.  If FILE is not 0, it is LIBNAME, already opened by
+   the caller, and LIBNAME must be a full path.  */
+static NTSTATUS load_dll( LPCWSTR load_path, LPCWSTR libname, HANDLE file, DWORD flags,
+                          WINE_MODREF** pwm )
 {
     WCHAR filename[MAX_PATH];
     ULONG size;
@@ -875,7 +1518,14 @@ static NTSTATUS load_dll( LPCWSTR load_path, LPCWSTR libname, DWORD flags, WINE_
 
     *pwm = NULL;
     size = MAX_PATH;
-    find_dll_file( load_path, libname, filename, &size, pwm, &handle );
+    if (file)
+      {
+        wcsncpy( filename, libname, MAX_PATH - 1 );
+        filename[MAX_PATH - 1] = 0;
+        handle = file;
+      }
+    else
+      find_dll_file( load_path, libname, filename, &size, pwm, &handle );
     
     if (!handle)
       nts = STATUS_DLL_NOT_FOUND;
@@ -886,29 +1536,27 @@ static NTSTATUS load_dll( LPCWSTR load_path, LPCWSTR libname, DWORD flags, WINE_
       {
         /* Initialize DLL just loaded */
         TRACE("Loaded module %S at %p\n", filename, (*pwm)->ldr.BaseAddress);
-        if (handle)
-	  CloseHandle( handle );
+        if (handle && handle != file) CloseHandle( handle );
         return nts;
       }
     
     TRACE("Failed to load module %S; status=%x\n", libname, nts);
-    if (handle)
-      CloseHandle( handle );
+    if (handle && handle != file) CloseHandle( handle );
     return nts;
 }
 
 
-NTSTATUS MyLdrLoadDll(LPCWSTR path_name, DWORD flags,
-		      LPCWSTR libname, HMODULE* hModule)
+static NTSTATUS ldr_load_dll( LPCWSTR path_name, DWORD flags, LPCWSTR libname,
+			      HANDLE file, HMODULE* hModule )
 {
   WINE_MODREF *wm;
   NTSTATUS nts;
 
   /* Support for dll path removed.  */
-  nts = load_dll( path_name, libname, flags, &wm );
+  nts = load_dll( path_name, libname, file, flags, &wm );
 
   /* For now.  */
-  assert (wm->ldr.Flags & LDR_DONT_RESOLVE_REFS);
+  assert (!wm || (wm->ldr.Flags & LDR_DONT_RESOLVE_REFS));
 #if 0
   if (nts == STATUS_SUCCESS && !(wm->ldr.Flags & LDR_DONT_RESOLVE_REFS))
     {
@@ -926,6 +1574,85 @@ NTSTATUS MyLdrLoadDll(LPCWSTR path_name, DWORD flags,
 }
 
 
+NTSTATUS MyLdrLoadDll(LPCWSTR path_name, DWORD flags,
+		      LPCWSTR libname, HMODULE* hModule)
+{
+  return ldr_load_dll( path_name, flags, libname, 0, hModule );
+}
+
+
+/* Load the image LIBNAME (a full path) from FILE, which the caller
+   has opened, and keeps open, so that the headers it already read
+   can be reused.  */
+NTSTATUS MyLdrLoadDllFile (LPCWSTR libname, HANDLE file, DWORD flags,
+			   HMODULE* hModule)
+{
+  return ldr_load_dll( NULL, flags, libname, file, hModule );
+}
+
+
+/* Resolve the imports of HMODULE, which must have been loaded with
+   DONT_RESOLVE_DLL_REFERENCES, without starting it.  */
+NTSTATUS MyLdrResolveImports (HMODULE hModule)
+{
+  WINE_MODREF *wm = get_modref( hModule );
+
+  if (!wm) return STATUS_DLL_NOT_FOUND;
+  return fixup_imports( wm, NULL );
+}
+
+
+int MyLdrBindLazyImports (HMODULE hModule)
+{
+  WINE_MODREF *wm = get_modref( hModule );
+
+  if (!wm || !wm->lazy) return 0;
+  return himemce_lazy_bind_all( wm->lazy );
+}
+
+
+/* Decommit the parts of HMODULE that are not needed after its
+   imports are resolved, and record them in its modref.  */
+NTSTATUS MyLdrDiscardImage (HMODULE hModule)
+{
+  WINE_MODREF *wm = get_modref( hModule );
+  SIZE_T total = 0;
+  int i;
+
+  if (!wm) return STATUS_DLL_NOT_FOUND;
+  if (wm->nr_discarded) return STATUS_SUCCESS;
+  wm->nr_discarded = virtual_discard_image( hModule, wm->discarded,
+                                            HIMEMCE_MAX_DISCARDED );
+  for (i = 0; i < wm->nr_discarded; i++)
+    total += wm->discarded[i].size;
+  if (total)
+    TRACE( "discarded 0x%lx bytes of %S in %i ranges\n",
+           total, wm->ldr.FullDllName, wm->nr_discarded );
+  return STATUS_SUCCESS;
+}
+
+
+/* Release the image HMODULE and its modref.  */
+NTSTATUS MyLdrUnloadDll (HMODULE hModule)
+{
+  int i;
+
+  for (i = 0; i < nr_modrefs; i++)
+    if (modrefs[i]->ldr.BaseAddress == hModule)
+      break;
+  if (i == nr_modrefs)
+    return STATUS_DLL_NOT_FOUND;
+
+  if (modrefs[i]->lazy) himemce_lazy_free (modrefs[i]->lazy);
+  free (modrefs[i]->sources);
+  if (modrefs[i]->delay) himemce_lazy_free (modrefs[i]->delay);
+  free (modrefs[i]->delay_sources);
+  free (modrefs[i]);
+  modrefs[i] = modrefs[--nr_modrefs];
+  return MyNtUnmapViewOfSection (NtCurrentProcess (), hModule);
+}
+
+
 
 /***********************************************************************
  *           LdrProcessRelocationBlock  (NTDLL.@)
@@ -935,6 +1662,17 @@ NTSTATUS MyLdrLoadDll(LPCWSTR path_name, DWORD flags,
 IMAGE_BASE_RELOCATION * MyLdrProcessRelocationBlock( void *page, UINT count,
 						     USHORT *relocs, INT_PTR delta )
 {
+  /* Blocks are mostly or only HIGHLOW fixups, apply those in one
+     batch.  */
+  UINT nr = himemce_reloc_count_highlow( relocs, count );
+
+  if (nr)
+    {
+      himemce_reloc_highlow( page, relocs, nr, delta );
+      relocs += nr;
+      count -= nr;
+    }
+
   while (count--)
     {
       USHORT offset = *relocs & 0xfff;
@@ -1008,6 +1746,7 @@ void MyLdrInitializeThunk( void *kernel_start, ULONG_PTR unknown2,
   //  actctx_init();
   //  load_path = NtCurrentTeb()->Peb->ProcessParameters->DllPath.Buffer;
   if ((status = fixup_imports( wm, load_path )) != STATUS_SUCCESS) goto error;
+  MyLdrDiscardImage( peb->ImageBaseAddress );
   //  if ((status = alloc_process_tls()) != STATUS_SUCCESS) goto error;
   //  if ((status = alloc_thread_tls()) != STATUS_SUCCESS) goto error;
   //  heap_set_debug_flags( GetProcessHeap() );
@@ -26,6 +26,9 @@
 #include <assert.h>
 
 #include "wine.h"
+#include "himemce.h"
+#include "himemce-reloc.h"
+#include "himemce-map.h"
 
 /* File view */
 typedef struct file_view
@@ -119,12 +122,17 @@ static NTSTATUS map_view( struct file_view **view_ret, void *base, size_t size,
       free (view);
       return GetLastError();
     }
-  /* We have to zero map the whole thing.  */
-  new_ptr = VirtualAlloc (ptr, size, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-  if (new_ptr != ptr)
+  /* We have to zero map the whole thing, unless the pages are
+     committed on demand.  */
+  if (vprot & VPROT_COMMITTED)
     {
-      free (view);
-      return GetLastError();
+      new_ptr = VirtualAlloc (ptr, size, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+      if (new_ptr != ptr)
+        {
+          VirtualFree (ptr, 0, MEM_RELEASE);
+          free (view);
+          return GetLastError();
+        }
     }
   view->base = ptr;
   view->size = size;
@@ -185,8 +193,1070 @@ static NTSTATUS map_file_into_view( struct file_view *view, HANDLE fhandle, size
 }
 
 
+/* A section to be read in by read_sections.  */
+struct section_read
+{
+  SIZE_T rva;
+  SIZE_T file_start;
+  SIZE_T file_size;
+};
+
+#define READ_MERGE_GAP   0x4000   /* Read over holes in the file up to this size.  */
+#define READ_BUFFER_SIZE 0x40000  /* Largest read through the bounce buffer.  */
+
+
+static int compare_section_reads( const void *a, const void *b )
+{
+  const struct section_read *ra = a;
+  const struct section_read *rb = b;
+
+  if (ra->file_start != rb->file_start)
+    return ra->file_start < rb->file_start ? -1 : 1;
+  return 0;
+}
+
+
+/* One read planned by plan_reads: the sections FIRST to LAST of the
+   sorted read list are covered by the file range START to END.  A
+   direct read goes straight into the view at RVA, otherwise the data
+   goes through a bounce buffer.  */
+struct read_run
+{
+  int first;
+  int last;
+  SIZE_T start;
+  SIZE_T end;
+  SIZE_T rva;
+  int direct;
+};
+
+
+/* Plan the reads for the sections READS with few, large reads.
+   Sections that follow each other in the file and in memory are read
+   with one read straight into the view.  Smaller sections that are
+   close in the file, but not in memory (FileAlignment is smaller than
+   SectionAlignment), are read together into a bounce buffer and copied
+   into place.  Direct reads are split into pieces of at most
+   MAX_DIRECT bytes, if that is not 0.  Returns the number of runs, or
+   -1 if out of memory.  */
+static int plan_reads( struct section_read *reads, int nr_reads, SIZE_T max_direct,
+                       struct read_run **runs_ret )
+{
+  struct read_run *runs = NULL;
+  int nr_runs = 0, max_runs = 0;
+  int first, last;
+
+  qsort( reads, nr_reads, sizeof(*reads), compare_section_reads );
+
+  for (first = 0; first < nr_reads; first = last + 1)
+    {
+      SIZE_T start = reads[first].file_start;
+      SIZE_T end = start + reads[first].file_size;
+      int direct = 1;
+
+      for (last = first; last + 1 < nr_reads; last++)
+        {
+          struct section_read *cur = &reads[last];
+          struct section_read *next = &reads[last + 1];
+          SIZE_T next_end = next->file_start + next->file_size;
+
+          if (direct && next->file_start == cur->file_start + cur->file_size
+              && next->rva == cur->rva + cur->file_size)
+            {
+              end = next_end;
+              continue;
+            }
+          if (direct && last > first) break;
+          if (next->file_start > end + READ_MERGE_GAP) break;
+          if (max( end, next_end ) - start > READ_BUFFER_SIZE) break;
+          direct = 0;
+          end = max( end, next_end );
+        }
+
+      do
+        {
+          struct read_run *run;
+
+          if (nr_runs == max_runs)
+            {
+              struct read_run *new_runs;
+
+              max_runs = max_runs ? 2 * max_runs : 16;
+              if (!(new_runs = realloc( runs, max_runs * sizeof(*runs) )))
+                {
+                  free( runs );
+                  return -1;
+                }
+              runs = new_runs;
+            }
+          run = &runs[nr_runs++];
+          run->first = first;
+          run->last = last;
+          run->start = start;
+          run->end = end;
+          run->rva = reads[first].rva + (start - reads[first].file_start);
+          run->direct = direct;
+          if (direct && max_direct && end - start > max_direct) run->end = start + max_direct;
+          start = run->end;
+        }
+      while (start < end);
+    }
+  *runs_ret = runs;
+  return nr_runs;
+}
+
+
+/* Perform the read RUN into the view at PTR.  *BUFFER is the bounce
+   buffer, which is allocated on first use.  Short reads at the end of
+   the file leave zeros, as before.  */
+static NTSTATUS read_run( HANDLE hfile, char *ptr, const struct section_read *reads,
+                          const struct read_run *run, char **buffer )
+{
+  size_t got;
+  int i;
+
+  if (run->direct)
+    {
+      TRACE( "reading %lx bytes at %lx to %p\n", run->end - run->start, run->start, ptr + run->rva );
+      pread( hfile, ptr + run->rva, run->end - run->start, run->start );
+      return STATUS_SUCCESS;
+    }
+
+  if (!*buffer && !(*buffer = malloc( READ_BUFFER_SIZE ))) return STATUS_NO_MEMORY;
+  TRACE( "reading %lx bytes at %lx for %i sections\n", run->end - run->start, run->start,
+         run->last - run->first + 1 );
+  got = pread( hfile, *buffer, run->end - run->start, run->start );
+  if (got == (size_t) -1) got = 0;
+  for (i = run->first; i <= run->last; i++)
+    {
+      SIZE_T sec_end = min( reads[i].file_start + reads[i].file_size, run->start + got );
+
+      if (sec_end > reads[i].file_start)
+        memcpy( ptr + reads[i].rva, *buffer + (reads[i].file_start - run->start),
+                sec_end - reads[i].file_start );
+    }
+  return STATUS_SUCCESS;
+}
+
+
+/* Read the sections READS into the view at PTR.  */
+static NTSTATUS read_sections( HANDLE hfile, char *ptr, struct section_read *reads, int nr_reads )
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  struct read_run *runs = NULL;
+  char *buffer = NULL;
+  int nr_runs, i;
+
+  if ((nr_runs = plan_reads( reads, nr_reads, 0, &runs )) < 0) return STATUS_NO_MEMORY;
+  for (i = 0; i < nr_runs && status == STATUS_SUCCESS; i++)
+    status = read_run( hfile, ptr, reads, &runs[i], &buffer );
+  free( buffer );
+  free( runs );
+  return status;
+}
+
+
+/* Pipelined loading.  For images with many relocations, the sections
+   are read by a reader thread in file order, while the loading thread
+   applies the fixup blocks of every page as soon as the reads covering
+   it are done.  The relocation table itself is read first.  */
+
+#define PIPELINE_MIN_RELOCS  0x4000   /* Smallest relocation table worth a thread.  */
+#define PIPELINE_CHUNK_SIZE  0x100000  /* Largest direct read in a pipelined load.  */
+
+struct section_reader
+{
+  HANDLE hfile;
+  char *ptr;
+  const struct section_read *reads;
+  const struct read_run *runs;
+  int nr_runs;
+  LONG *done;             /* for each run: set when its data is in the view */
+  HANDLE event;           /* auto-reset, set after every run */
+  NTSTATUS status;
+};
+
+
+static DWORD WINAPI section_reader_thread( LPVOID arg )
+{
+  struct section_reader *rd = arg;
+  char *buffer = NULL;
+  int i;
+
+  for (i = 0; i < rd->nr_runs; i++)
+    {
+      NTSTATUS status;
+
+      if (rd->done[i]) continue;
+      status = read_run( rd->hfile, rd->ptr, rd->reads, &rd->runs[i], &buffer );
+      if (status != STATUS_SUCCESS) rd->status = status;
+      InterlockedExchange( &rd->done[i], 1 );
+      SetEvent( rd->event );
+    }
+  free( buffer );
+  return 0;
+}
+
+
+/* Wait until the page at RVA is in the view.  */
+static void wait_for_page( struct section_reader *rd, const int *page_run, SIZE_T rva )
+{
+  int run = page_run[rva >> page_shift];
+
+  if (run < 0) return;
+  while (!InterlockedCompareExchange( &rd->done[run], 1, 1 ))
+    WaitForSingleObject( rd->event, INFINITE );
+}
+
+
+/* Read the sections READS into the view at PTR of TOTAL_SIZE bytes and
+   apply the relocations RELOCS for DELTA, overlapping both.  */
+static NTSTATUS read_and_relocate( HANDLE hfile, char *ptr, SIZE_T total_size,
+                                   struct section_read *reads, int nr_reads,
+                                   const IMAGE_DATA_DIRECTORY *relocs, INT_PTR delta )
+{
+  NTSTATUS status = STATUS_NO_MEMORY;
+  IMAGE_BASE_RELOCATION *rel, *end;
+  struct section_reader rd;
+  struct read_run *runs = NULL;
+  int *page_run = NULL;
+  char *buffer = NULL;
+  HANDLE thread = NULL;
+  SIZE_T nr_pages = total_size >> page_shift;
+  SIZE_T page, rva;
+  int nr_runs, i, j;
+
+  memset( &rd, 0, sizeof(rd) );
+  if ((nr_runs = plan_reads( reads, nr_reads, PIPELINE_CHUNK_SIZE, &runs )) < 0) goto done;
+  if (!(rd.done = calloc( nr_runs + 1, sizeof(*rd.done) ))) goto done;
+  if (!(page_run = malloc( nr_pages * sizeof(*page_run) ))) goto done;
+
+  /* find the run that brings in every page; sections are page aligned */
+  for (page = 0; page < nr_pages; page++) page_run[page] = -1;
+  for (i = 0; i < nr_runs; i++)
+    {
+      if (runs[i].direct)
+        {
+          for (rva = runs[i].rva; rva < runs[i].rva + (runs[i].end - runs[i].start); rva += page_mask + 1)
+            page_run[rva >> page_shift] = i;
+          continue;
+        }
+      for (j = runs[i].first; j <= runs[i].last; j++)
+        for (rva = reads[j].rva; rva < reads[j].rva + reads[j].file_size; rva += page_mask + 1)
+          page_run[rva >> page_shift] = i;
+    }
+
+  /* the relocation table comes first */
+  for (rva = relocs->VirtualAddress & ~page_mask;
+       rva < relocs->VirtualAddress + relocs->Size && (rva >> page_shift) < nr_pages;
+       rva += page_mask + 1)
+    {
+      int run = page_run[rva >> page_shift];
+
+      if (run < 0 || rd.done[run]) continue;
+      if ((status = read_run( hfile, ptr, reads, &runs[run], &buffer )) != STATUS_SUCCESS) goto done;
+      rd.done[run] = 1;
+    }
+
+  rd.hfile = hfile;
+  rd.ptr = ptr;
+  rd.reads = reads;
+  rd.runs = runs;
+  rd.nr_runs = nr_runs;
+  rd.status = STATUS_SUCCESS;
+  if ((rd.event = CreateEvent( NULL, FALSE, FALSE, NULL )))
+    thread = himemce_create_thread( NULL, 0, section_reader_thread, &rd, 0, NULL );
+  if (!thread)
+    {
+      TRACE( "can not start reader thread, reading all sections first\n" );
+      section_reader_thread( &rd );
+    }
+
+  TRACE( "relocating %p-%p while reading %i runs\n", ptr, ptr + total_size, nr_runs );
+  status = STATUS_SUCCESS;
+  rel = (IMAGE_BASE_RELOCATION *)(ptr + relocs->VirtualAddress);
+  end = (IMAGE_BASE_RELOCATION *)(ptr + relocs->VirtualAddress + relocs->Size);
+  while (rel < end - 1 && rel->SizeOfBlock)
+    {
+      if (rel->VirtualAddress >= total_size)
+        {
+          TRACE( "invalid address %p in relocation %p\n", ptr + rel->VirtualAddress, rel );
+          status = STATUS_ACCESS_VIOLATION;
+          break;
+        }
+      /* a fixup at the end of the page may reach into the next one */
+      wait_for_page( &rd, page_run, rel->VirtualAddress );
+      if ((rel->VirtualAddress >> page_shift) + 1 < nr_pages)
+        wait_for_page( &rd, page_run, rel->VirtualAddress + page_mask + 1 );
+      rel = MyLdrProcessRelocationBlock( ptr + rel->VirtualAddress,
+                                         (rel->SizeOfBlock - sizeof(*rel)) / sizeof(USHORT),
+                                         (USHORT *)(rel + 1), delta );
+      if (!rel)
+        {
+          status = STATUS_INVALID_IMAGE_FORMAT;
+          break;
+        }
+    }
+
+  /* the reader must be done with the view in any case */
+  if (thread)
+    {
+      WaitForSingleObject( thread, INFINITE );
+      CloseHandle( thread );
+    }
+  if (status == STATUS_SUCCESS) status = rd.status;
+
+ done:
+  if (rd.event) CloseHandle( rd.event );
+  free( buffer );
+  free( page_run );
+  free( rd.done );
+  free( runs );
+  return status;
+}
+
+
+/* Compute the size of section SEC in memory, and the range of the
+   file that is read into it.  File positions are rounded to sector
+   boundaries regardless of OptionalHeader.FileAlignment.  */
+static void get_section_range( const IMAGE_SECTION_HEADER *sec, SIZE_T *map_size,
+                               SIZE_T *file_start, SIZE_T *file_size )
+{
+  static const SIZE_T sector_align = 0x1ff;
+
+  if (!sec->Misc.VirtualSize)
+    *map_size = ROUND_SIZE( 0, sec->SizeOfRawData );
+  else
+    *map_size = ROUND_SIZE( 0, sec->Misc.VirtualSize );
+
+  *file_start = sec->PointerToRawData & ~sector_align;
+  *file_size = (sec->SizeOfRawData + (sec->PointerToRawData & sector_align) + sector_align) & ~sector_align;
+  if (*file_size > *map_size) *file_size = *map_size;
+}
+
+
+/* Parallel relocation.  With HIMEMCE_PARALLEL_RELOC, the relocation
+   blocks of an image with a large relocation table are split into
+   shares of about the same size, one per processor, and applied by a
+   small pool of threads.  The blocks are independent, as no two fixups
+   overlap.  All threads are joined before the image is used.  */
+
+#define PARALLEL_MIN_RELOCS  0x4000   /* Smallest relocation table worth a thread.  */
+#define MAX_RELOC_THREADS    16
+
+int virtual_reloc_threads;
+
+struct reloc_share
+{
+  char                  *ptr;
+  SIZE_T                 total_size;
+  IMAGE_BASE_RELOCATION *first;     /* the blocks of this share */
+  IMAGE_BASE_RELOCATION *end;
+  INT_PTR                delta;
+  NTSTATUS               status;
+};
+
+
+static DWORD WINAPI reloc_thread( LPVOID arg )
+{
+  struct reloc_share *share = arg;
+  IMAGE_BASE_RELOCATION *rel = share->first;
+
+  share->status = STATUS_SUCCESS;
+  while (rel < share->end)
+    {
+      if (rel->VirtualAddress >= share->total_size)
+        {
+          TRACE( "invalid address %p in relocation %p\n", share->ptr + rel->VirtualAddress, rel );
+          share->status = STATUS_ACCESS_VIOLATION;
+          break;
+        }
+      rel = MyLdrProcessRelocationBlock( share->ptr + rel->VirtualAddress,
+                                         (rel->SizeOfBlock - sizeof(*rel)) / sizeof(USHORT),
+                                         (USHORT *)(rel + 1), share->delta );
+      if (!rel)
+        {
+          share->status = STATUS_INVALID_IMAGE_FORMAT;
+          break;
+        }
+    }
+  return 0;
+}
+
+
+/* Apply the relocations RELOCS of the image at PTR of TOTAL_SIZE bytes
+   for DELTA, with NR_THREADS threads, or one per processor if that is
+   0.  */
+NTSTATUS virtual_relocate( char *ptr, SIZE_T total_size, const IMAGE_DATA_DIRECTORY *relocs,
+                           INT_PTR delta, int nr_threads )
+{
+  struct reloc_share share[MAX_RELOC_THREADS];
+  HANDLE thread[MAX_RELOC_THREADS];
+  IMAGE_BASE_RELOCATION *rel, *end, *last;
+  SIZE_T share_size;
+  NTSTATUS status = STATUS_SUCCESS;
+  int nr_shares, i;
+
+  rel = (IMAGE_BASE_RELOCATION *)(ptr + relocs->VirtualAddress);
+  end = (IMAGE_BASE_RELOCATION *)(ptr + relocs->VirtualAddress + relocs->Size);
+
+  if (nr_threads <= 0)
+    {
+      SYSTEM_INFO info;
+
+      GetSystemInfo( &info );
+      nr_threads = info.dwNumberOfProcessors;
+    }
+  if (nr_threads > MAX_RELOC_THREADS) nr_threads = MAX_RELOC_THREADS;
+  if (nr_threads < 1) nr_threads = 1;
+
+  /* find the end of the blocks, and cut them into shares */
+  for (last = rel; last < end - 1 && last->SizeOfBlock;
+       last = (IMAGE_BASE_RELOCATION *)((char *)last + last->SizeOfBlock))
+    if (last->SizeOfBlock < sizeof(*last)) return STATUS_INVALID_IMAGE_FORMAT;
+  share_size = ((char *)last - (char *)rel + nr_threads - 1) / nr_threads;
+
+  for (nr_shares = 0; nr_shares < nr_threads && rel < last; nr_shares++)
+    {
+      share[nr_shares].ptr = ptr;
+      share[nr_shares].total_size = total_size;
+      share[nr_shares].delta = delta;
+      share[nr_shares].first = rel;
+      while (rel < last && (char *)rel - (char *)share[nr_shares].first < share_size)
+        rel = (IMAGE_BASE_RELOCATION *)((char *)rel + rel->SizeOfBlock);
+      share[nr_shares].end = rel;
+    }
+
+  TRACE( "relocating %p-%p in %i shares\n", ptr, ptr + total_size, nr_shares );
+  for (i = 1; i < nr_shares; i++)
+    thread[i] = himemce_create_thread( NULL, 0, reloc_thread, &share[i], 0, NULL );
+  if (nr_shares) reloc_thread( &share[0] );
+  for (i = 1; i < nr_shares; i++)
+    {
+      if (thread[i])
+        {
+          WaitForSingleObject( thread[i], INFINITE );
+          CloseHandle( thread[i] );
+        }
+      else reloc_thread( &share[i] );
+    }
+
+  for (i = 0; i < nr_shares && status == STATUS_SUCCESS; i++)
+    status = share[i].status;
+  return status;
+}
+
+
+/* Lazily loaded images.  Only the address space of such an image is
+   reserved by map_image.  Every other page is committed, read from a
+   view of the image file and relocated when it is first touched (see
+   virtual_handle_fault).  For this, the relocations are indexed by
+   page (see himemce-reloc.h).  A fixup that straddles a page boundary
+   ties the pages on both sides together, and such pages are always
+   brought in as one group.  The headers, and the sections the loader itself works on
+   (imports, exports, TLS), are brought in right away.  */
+
+#define LAZY_PAGE_COMMITTED 1
+#define LAZY_PAGE_SPANS     2   /* A fixup crosses into the next page.  */
+
+struct lazy_image
+{
+  struct lazy_image *next;
+  char              *base;
+  SIZE_T             size;
+  INT_PTR            delta;
+  const char        *file;          /* Read-only view of the image file.  */
+  DWORD              file_size;
+  const IMAGE_SECTION_HEADER *sec;  /* Section table in the image header.  */
+  int                nr_sec;
+  struct himemce_relocs *relocs;    /* The relocation index, or NULL.  */
+  BYTE              *page_flags;    /* Per page: LAZY_PAGE_*.  */
+  DWORD              nr_pages;
+  DWORD              nr_committed;
+};
+
+static struct lazy_image *lazy_images;
+
+/* Faults come from any thread.  The lock covers the lazy images and
+   the copy area (see below), so that a page is filled and relocated
+   only once.  */
+static LONG lazy_lock;
+
+
+static void lock_lazy( void )
+{
+  while (InterlockedExchange( &lazy_lock, 1 ))
+    Sleep( 0 );
+}
+
+
+static void unlock_lazy( void )
+{
+  InterlockedExchange( &lazy_lock, 0 );
+}
+
+
+static struct lazy_image *find_lazy_image( const void *addr )
+{
+  struct lazy_image *img;
+
+  for (img = lazy_images; img; img = img->next)
+    if ((const char *)addr >= img->base && (const char *)addr < img->base + img->size)
+      return img;
+  return NULL;
+}
+
+
+/* Return the section of IMG that contains RVA, or NULL.  */
+static const IMAGE_SECTION_HEADER *lazy_find_section( struct lazy_image *img, DWORD rva )
+{
+  SIZE_T map_size, file_start, file_size;
+  int i;
+
+  for (i = 0; i < img->nr_sec; i++)
+    {
+      get_section_range( &img->sec[i], &map_size, &file_start, &file_size );
+      if (rva >= img->sec[i].VirtualAddress && rva - img->sec[i].VirtualAddress < map_size)
+        return &img->sec[i];
+    }
+  return NULL;
+}
+
+
+/* Return a pointer to SIZE bytes of file data that end up at RVA, or
+   NULL if they are not all in the file.  */
+static const char *lazy_file_data( struct lazy_image *img, DWORD rva, DWORD size )
+{
+  const IMAGE_SECTION_HEADER *sec = lazy_find_section( img, rva );
+  SIZE_T map_size, file_start, file_size, off;
+
+  if (!sec) return NULL;
+  get_section_range( sec, &map_size, &file_start, &file_size );
+  off = rva - sec->VirtualAddress;
+  if (!sec->PointerToRawData || off + size > file_size || off + size < off
+      || file_start + off + size > img->file_size)
+    return NULL;
+  return img->file + file_start + off;
+}
+
+
+/* Copy the file data for PAGE of IMG to the zeroed page at DST.  */
+static void lazy_fill_page( struct lazy_image *img, DWORD page, char *dst )
+{
+  DWORD rva = page << page_shift;
+  const IMAGE_SECTION_HEADER *sec = lazy_find_section( img, rva );
+  SIZE_T map_size, file_start, file_size, off, len;
+
+  if (!sec || !sec->PointerToRawData) return;
+  get_section_range( sec, &map_size, &file_start, &file_size );
+  off = rva - sec->VirtualAddress;
+  if (off >= file_size || file_start + off >= img->file_size) return;
+  len = min( page_size, file_size - off );
+  len = min( len, img->file_size - (file_start + off) );
+  memcpy( dst, img->file + file_start + off, len );
+}
+
+
+/* Commit, read and relocate PAGE of IMG, together with the pages it
+   shares fixups with.  Other threads do not take the lock when the
+   page is committed already, so the pages are read and relocated in
+   a staging buffer first, and only committed once they are
+   complete.  */
+static BOOL lazy_commit( struct lazy_image *img, DWORD page )
+{
+  DWORD first = page;
+  DWORD last = page;
+  char *stage;
+  DWORD p;
+
+  while (first > 0 && (img->page_flags[first - 1] & LAZY_PAGE_SPANS)) first--;
+  while (last + 1 < img->nr_pages && (img->page_flags[last] & LAZY_PAGE_SPANS)) last++;
+
+  if (!(stage = calloc( last - first + 1, page_size )))
+    {
+      ERR( "can not stage pages %p-%p\n", img->base + (first << page_shift),
+           img->base + ((last + 1) << page_shift) );
+      return FALSE;
+    }
+
+  for (p = first; p <= last; p++)
+    {
+      char *dst = stage + ((p - first) << page_shift);
+
+      if (img->page_flags[p] & LAZY_PAGE_COMMITTED)
+        memcpy( dst, img->base + (p << page_shift), page_size );
+      else
+        lazy_fill_page( img, p, dst );
+    }
+
+  /* Only relocate once all the data is in, as fixups may span pages.  */
+  for (p = first; p <= last; p++)
+    {
+      if (img->page_flags[p] & LAZY_PAGE_COMMITTED) continue;
+      if (img->delta && img->relocs)
+        {
+          const struct himemce_reloc_page *rpage = himemce_relocs_find( img->relocs, p << page_shift );
+
+          if (rpage) himemce_relocs_apply_page( img->relocs, rpage,
+                                                stage - (first << page_shift), img->delta );
+        }
+    }
+
+  for (p = first; p <= last; p++)
+    {
+      if (img->page_flags[p] & LAZY_PAGE_COMMITTED) continue;
+      if (!VirtualAlloc( img->base + (p << page_shift), page_size, MEM_COMMIT,
+                         PAGE_EXECUTE_READWRITE ))
+        {
+          ERR( "can not commit page %p: %i\n", img->base + (p << page_shift), GetLastError() );
+          free( stage );
+          return FALSE;
+        }
+      memcpy( img->base + (p << page_shift), stage + ((p - first) << page_shift), page_size );
+      img->page_flags[p] |= LAZY_PAGE_COMMITTED;
+      img->nr_committed++;
+    }
+  free( stage );
+  return TRUE;
+}
+
+
+static void lazy_image_free( struct lazy_image *img )
+{
+  struct lazy_image **prevp;
+
+  lock_lazy();
+  for (prevp = &lazy_images; *prevp; prevp = &(*prevp)->next)
+    if (*prevp == img)
+      {
+        *prevp = img->next;
+        break;
+      }
+  unlock_lazy();
+  if (img->file) UnmapViewOfFile( img->file );
+  free( img->relocs );
+  free( img->page_flags );
+  free( img );
+}
+
+
+/* Prepare the image at PTR, of which only the headers are committed,
+   for loading on demand.  Returns NULL if that is not possible, and
+   the image has to be loaded as a whole.  */
+static struct lazy_image *lazy_image_create( char *ptr, SIZE_T total_size, HANDLE hmap,
+                                             DWORD fsize, IMAGE_NT_HEADERS *nt,
+                                             IMAGE_SECTION_HEADER *sec, SIZE_T header_size )
+{
+  const IMAGE_DATA_DIRECTORY *dir;
+  struct lazy_image *img;
+  DWORD page;
+  DWORD i;
+
+  if (!(img = calloc( 1, sizeof(*img) ))) return NULL;
+  img->base = ptr;
+  img->size = total_size;
+  img->nr_pages = total_size >> page_shift;
+  img->sec = sec;
+  img->nr_sec = nt->FileHeader.NumberOfSections;
+  img->file_size = fsize;
+  img->page_flags = calloc( img->nr_pages, sizeof(BYTE) );
+  if (!img->page_flags) goto error;
+
+  img->file = MapViewOfFile( hmap, FILE_MAP_READ, 0, 0, 0 );
+  if (!img->file) goto error;
+
+  for (page = 0; page < (ROUND_SIZE( 0, header_size ) >> page_shift); page++)
+    {
+      img->page_flags[page] |= LAZY_PAGE_COMMITTED;
+      img->nr_committed++;
+    }
+
+  dir = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
+  if (dir->VirtualAddress && dir->Size)
+    {
+      const char *relocs = lazy_file_data( img, dir->VirtualAddress, dir->Size );
+
+      /* Leave it to the eager path to complain about bad relocations.  */
+      if (!relocs) goto error;
+      if (!(img->relocs = himemce_relocs_build( relocs, dir->Size, total_size ))) goto error;
+      for (i = 0; i < img->relocs->nr_pages; i++)
+        if (img->relocs->page[i].flags & HIMEMCE_RELOC_SPANS)
+          img->page_flags[img->relocs->page[i].rva >> page_shift] |= LAZY_PAGE_SPANS;
+    }
+  return img;
+
+ error:
+  lazy_image_free( img );
+  return NULL;
+}
+
+
+/* Start serving faults for IMG, now that it is known to be relocated
+   by DELTA, and bring in the sections the loader needs.  */
+static NTSTATUS lazy_image_activate( struct lazy_image *img, IMAGE_NT_HEADERS *nt, INT_PTR delta )
+{
+  static const WORD eager_dirs[] =
+    {
+      IMAGE_DIRECTORY_ENTRY_EXPORT, IMAGE_DIRECTORY_ENTRY_IMPORT,
+      IMAGE_DIRECTORY_ENTRY_TLS, IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG,
+      IMAGE_DIRECTORY_ENTRY_IAT, IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT
+    };
+  int i;
+
+  lock_lazy();
+  img->delta = delta;
+  img->next = lazy_images;
+  lazy_images = img;
+
+  for (i = 0; i < sizeof(eager_dirs) / sizeof(eager_dirs[0]); i++)
+    {
+      const IMAGE_DATA_DIRECTORY *dir = &nt->OptionalHeader.DataDirectory[eager_dirs[i]];
+      const IMAGE_SECTION_HEADER *sec;
+      SIZE_T map_size, file_start, file_size;
+      DWORD page, end;
+
+      if (!dir->VirtualAddress || !dir->Size) continue;
+      if (!(sec = lazy_find_section( img, dir->VirtualAddress ))) continue;
+      get_section_range( sec, &map_size, &file_start, &file_size );
+      end = (sec->VirtualAddress + map_size) >> page_shift;
+      for (page = sec->VirtualAddress >> page_shift; page < end; page++)
+        if (!(img->page_flags[page] & LAZY_PAGE_COMMITTED)
+            && !lazy_commit( img, page ))
+          {
+            unlock_lazy();
+            return STATUS_NO_MEMORY;
+          }
+    }
+
+  TRACE( "lazy image %p: %u of %u pages committed\n",
+         img->base, img->nr_committed, img->nr_pages );
+  unlock_lazy();
+  return STATUS_SUCCESS;
+}
+
+
+/* Copy areas.  The read-write sections of preloaded DLLs are copied
+   from their image, which is shared by all processes and never
+   written after the preloader is done, to the low memory of the
+   process.  In a copy area, which is only reserved, the copy of a
+   page is made when it is first touched (see virtual_handle_fault),
+   so pages that a process never uses cost no memory and no time.
+   Sections of different modules can share a page, so a page is filled
+   from all ranges that overlap it.  */
+
+struct copy_range
+{
+  char       *dst;
+  const char *src;
+  SIZE_T      size;
+};
+
+struct copy_area
+{
+  char              *base;
+  SIZE_T             size;
+  BYTE              *page_flags;    /* Per page: LAZY_PAGE_COMMITTED.  */
+  DWORD              nr_pages;
+  DWORD              nr_committed;
+  struct copy_range *ranges;
+  int                nr_ranges;
+  int                max_ranges;
+};
+
+static struct copy_area copy_area;
+
+
+/* Copy the part of RANGE that is in PAGE of the copy area.  */
+static void copy_area_fill( const struct copy_range *range, DWORD page, char *dst )
+{
+  char *start = copy_area.base + (page << page_shift);
+  char *end = start + page_size;
+
+  if (!range->src) return;
+  if (range->dst > start) start = range->dst;
+  if (range->dst + range->size < end) end = range->dst + range->size;
+  if (start < end)
+    memcpy( dst + (start - (copy_area.base + (page << page_shift))),
+            range->src + (start - range->dst), end - start );
+}
+
+
+/* Commit PAGE of the copy area, with all ranges copied.  The page is
+   put together in a staging buffer (under the lock), so that another
+   thread never sees it half copied.  */
+static BOOL copy_area_commit( DWORD page )
+{
+  static char stage[page_size];
+  char *ptr = copy_area.base + (page << page_shift);
+  int i;
+
+  memset( stage, 0, page_size );
+  for (i = 0; i < copy_area.nr_ranges; i++)
+    copy_area_fill( &copy_area.ranges[i], page, stage );
+  if (!VirtualAlloc( ptr, page_size, MEM_COMMIT, PAGE_EXECUTE_READWRITE ))
+    {
+      ERR( "can not commit page %p: %i\n", ptr, GetLastError() );
+      return FALSE;
+    }
+  memcpy( ptr, stage, page_size );
+  copy_area.page_flags[page] |= LAZY_PAGE_COMMITTED;
+  copy_area.nr_committed++;
+  return TRUE;
+}
+
+
+/* Make the reserved SIZE bytes at BASE the copy area.  */
+BOOL virtual_copy_area_init (void *base, SIZE_T size)
+{
+  BYTE *page_flags;
+  DWORD nr_pages;
+
+  nr_pages = ROUND_SIZE( base, size ) >> page_shift;
+  if (!(page_flags = calloc( nr_pages, 1 ))) return FALSE;
+  lock_lazy();
+  if (copy_area.base)
+    {
+      unlock_lazy();
+      free( page_flags );
+      return FALSE;
+    }
+  copy_area.nr_pages = nr_pages;
+  copy_area.page_flags = page_flags;
+  copy_area.size = nr_pages << page_shift;
+  copy_area.base = (char *)((UINT_PTR)base & ~page_mask);
+  unlock_lazy();
+  return TRUE;
+}
+
+
+/* Copy the SIZE bytes at SRC to DST in the copy area as they are
+   touched.  Pages that are in use already get their part right
+   away.  If SRC is NULL, the pages are only committed, and stay
+   zero.  */
+BOOL virtual_copy_lazily (void *dst, const void *src, SIZE_T size)
+{
+  struct copy_range *range;
+  DWORD page, last;
+
+  lock_lazy();
+  if (!copy_area.base || !size || (char *)dst < copy_area.base
+      || (char *)dst - copy_area.base > copy_area.size
+      || size > copy_area.size - ((char *)dst - copy_area.base))
+    {
+      unlock_lazy();
+      return FALSE;
+    }
+
+  if (copy_area.nr_ranges == copy_area.max_ranges)
+    {
+      int max = copy_area.max_ranges ? 2 * copy_area.max_ranges : 64;
+      struct copy_range *ranges = realloc( copy_area.ranges, max * sizeof(*ranges) );
+
+      if (!ranges)
+        {
+          unlock_lazy();
+          return FALSE;
+        }
+      copy_area.ranges = ranges;
+      copy_area.max_ranges = max;
+    }
+  range = &copy_area.ranges[copy_area.nr_ranges++];
+  range->dst = dst;
+  range->src = src;
+  range->size = size;
+
+  last = ((char *)dst + size - 1 - copy_area.base) >> page_shift;
+  for (page = ((char *)dst - copy_area.base) >> page_shift; page <= last; page++)
+    if (copy_area.page_flags[page] & LAZY_PAGE_COMMITTED)
+      copy_area_fill( range, page, copy_area.base + (page << page_shift) );
+  unlock_lazy();
+  return TRUE;
+}
+
+
+/* Return the number of pages of the copy area that are committed,
+   and of all of them.  Returns FALSE if there is no copy area.  */
+BOOL virtual_get_copy_area_pages (DWORD *committed, DWORD *total)
+{
+  BOOL res = FALSE;
+
+  lock_lazy();
+  if (copy_area.base)
+    {
+      *committed = copy_area.nr_committed;
+      *total = copy_area.nr_pages;
+      res = TRUE;
+    }
+  unlock_lazy();
+  return res;
+}
+
+
+/* Bring in the page of a lazily loaded image or of the copy area at
+   ADDR, which caused an access violation.  Returns nonzero if the
+   access can be retried.  A page that another thread brought in
+   while this one waited for the lock is retried as well.  */
+static int handle_fault( void *addr )
+{
+  struct lazy_image *img = find_lazy_image( addr );
+  DWORD page;
+
+  if (!img && copy_area.base && (char *)addr >= copy_area.base
+      && (char *)addr - copy_area.base < copy_area.size)
+    {
+      char *start;
+      int i;
+
+      page = ((char *)addr - copy_area.base) >> page_shift;
+      if (copy_area.page_flags[page] & LAZY_PAGE_COMMITTED) return 1;
+      /* Only pages with sections of loaded modules are brought in.  */
+      start = copy_area.base + (page << page_shift);
+      for (i = 0; i < copy_area.nr_ranges; i++)
+        {
+          const struct copy_range *range = &copy_area.ranges[i];
+
+          if (range->dst < start + page_size && range->dst + range->size > start)
+            return copy_area_commit( page );
+        }
+      return 0;
+    }
+  if (!img) return 0;
+  page = ((char *)addr - img->base) >> page_shift;
+  if (img->page_flags[page] & LAZY_PAGE_COMMITTED) return 1;
+  if (!lazy_find_section( img, page << page_shift )) return 0;
+  return lazy_commit( img, page );
+}
+
+
+int virtual_handle_fault (void *addr)
+{
+  int res;
+
+  lock_lazy();
+  res = handle_fault( addr );
+  unlock_lazy();
+  return res;
+}
+
+
+/* Return the number of committed pages and of all pages of the image
+   at BASE.  Returns FALSE if it is not loaded lazily.  */
+BOOL virtual_get_image_pages (void *base, DWORD *committed, DWORD *total)
+{
+  struct lazy_image *img;
+
+  lock_lazy();
+  img = find_lazy_image( base );
+  if (img)
+    {
+      *committed = img->nr_committed;
+      *total = img->nr_pages;
+    }
+  unlock_lazy();
+  return img != NULL;
+}
+
+
+/* Discarding.  Once an image is relocated and bound, its relocations
+   and the sections marked IMAGE_SCN_MEM_DISCARDABLE are not used
+   anymore, and their pages are decommitted.  Only whole pages are
+   freed.  Writable sections are kept (the preloader copies them to
+   low memory later), and so is every section that holds other
+   directory data.  Lazily loaded images are left alone, as they do
+   not commit these pages unless touched, and so are images mapped
+   from the cache, whose pages are clean.  */
+
+static BOOL section_has_directory( const IMAGE_NT_HEADERS *nt, const IMAGE_SECTION_HEADER *sec,
+                                   SIZE_T map_size )
+{
+  DWORD i;
+
+  for (i = 0; i < nt->OptionalHeader.NumberOfRvaAndSizes && i < IMAGE_NUMBEROF_DIRECTORY_ENTRIES; i++)
+    {
+      const IMAGE_DATA_DIRECTORY *dir = &nt->OptionalHeader.DataDirectory[i];
+
+      /* The security directory holds a file offset.  */
+      if (i == IMAGE_DIRECTORY_ENTRY_BASERELOC || i == IMAGE_DIRECTORY_ENTRY_DEBUG
+          || i == IMAGE_DIRECTORY_ENTRY_SECURITY) continue;
+      if (!dir->VirtualAddress || !dir->Size) continue;
+      if (dir->VirtualAddress < sec->VirtualAddress + map_size
+          && dir->VirtualAddress + dir->Size > sec->VirtualAddress)
+        return TRUE;
+    }
+  return FALSE;
+}
+
+
+static int discard_range( char *ptr, const IMAGE_NT_HEADERS *nt, DWORD rva, SIZE_T size,
+                          const char *name, struct himemce_discarded *range )
+{
+  SIZE_T start = (rva + page_mask) & ~page_mask;
+  SIZE_T end = (rva + size) & ~page_mask;
+
+  if (start < ROUND_SIZE( 0, nt->OptionalHeader.SizeOfHeaders ))
+    start = ROUND_SIZE( 0, nt->OptionalHeader.SizeOfHeaders );
+  if (end > ROUND_SIZE( 0, nt->OptionalHeader.SizeOfImage ))
+    end = ROUND_SIZE( 0, nt->OptionalHeader.SizeOfImage );
+  if (end <= start) return 0;
+
+  if (!VirtualFree( ptr + start, end - start, MEM_DECOMMIT ))
+    {
+      TRACE( "can not decommit %.8s at %p: %i\n", name, ptr + start, GetLastError() );
+      return 0;
+    }
+  TRACE( "discarded %.8s at %p (0x%lx bytes)\n", name, ptr + start, end - start );
+  range->rva = start;
+  range->size = end - start;
+  strncpy( range->name, name, sizeof(range->name) );
+  return 1;
+}
+
+
+int virtual_discard_image( void *base, struct himemce_discarded *ranges, int max_ranges )
+{
+  char *ptr = base;
+  IMAGE_NT_HEADERS *nt = MyRtlImageNtHeader( base );
+  const IMAGE_SECTION_HEADER *sec;
+  const IMAGE_DATA_DIRECTORY *dir;
+  int nr = 0;
+  int lazy;
+  int i;
+
+  lock_lazy();
+  lazy = find_lazy_image( base ) != NULL;
+  unlock_lazy();
+  if (!nt || lazy || himemce_cache_is_mapped( base )) return 0;
+
+  sec = (const IMAGE_SECTION_HEADER *)((const char *)&nt->OptionalHeader
+                                       + nt->FileHeader.SizeOfOptionalHeader);
+  for (i = 0; i < nt->FileHeader.NumberOfSections && nr < max_ranges; i++)
+    {
+      SIZE_T map_size, file_start, file_size;
+
+      if (!(sec[i].Characteristics & IMAGE_SCN_MEM_DISCARDABLE)) continue;
+      if (sec[i].Characteristics & IMAGE_SCN_MEM_WRITE) continue;
+      get_section_range( &sec[i], &map_size, &file_start, &file_size );
+      if (section_has_directory( nt, &sec[i], map_size )) continue;
+      nr += discard_range( ptr, nt, sec[i].VirtualAddress, map_size,
+                           (const char *)sec[i].Name, &ranges[nr] );
+    }
+
+  /* The relocations, if they are not in a discardable section.  */
+  if (nt->OptionalHeader.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_BASERELOC) return nr;
+  dir = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
+  if (!dir->VirtualAddress || !dir->Size || nr == max_ranges) return nr;
+  for (i = 0; i < nr; i++)
+    if (dir->VirtualAddress >= ranges[i].rva
+        && dir->VirtualAddress + dir->Size <= ranges[i].rva + ranges[i].size)
+      return nr;
+  nr += discard_range( ptr, nt, dir->VirtualAddress, dir->Size, ".reloc", &ranges[nr] );
+  return nr;
+}
+
+
 static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *base, SIZE_T total_size, SIZE_T mask,
-			   SIZE_T header_size, int shared_fd, HANDLE dup_mapping, PVOID *addr_ptr)
+			   SIZE_T header_size, const struct image_header *header, int shared_fd,
+			   HANDLE dup_mapping, ULONG alloc_type, PVOID *addr_ptr)
 {
     IMAGE_DOS_HEADER *dos;
     IMAGE_NT_HEADERS *nt;
@@ -197,19 +1267,23 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
     off_t pos;
     DWORD fsize;
     struct file_view *view = NULL;
+    struct lazy_image *limg = NULL;
+    struct section_read *reads = NULL;
+    int nr_reads = 0;
+    unsigned int vprot = VPROT_READ | VPROT_EXEC | VPROT_WRITECOPY | VPROT_IMAGE;
     char *ptr, *header_end;
     INT_PTR delta = 0;
 
 
-    /* zero-map the whole range */
+    /* zero-map the whole range, or only reserve it for a lazy load */
+
+    if (!(alloc_type & HIMEMCE_LAZY_LOAD)) vprot |= VPROT_COMMITTED;
 
     if (base >= (char *)0x110000)  /* make sure the DOS area remains free */
-      status = map_view( &view, base, total_size, mask, FALSE,
-			 VPROT_COMMITTED | VPROT_READ | VPROT_EXEC | VPROT_WRITECOPY | VPROT_IMAGE );
+      status = map_view( &view, base, total_size, mask, FALSE, vprot );
 
     if (status != STATUS_SUCCESS)
-      status = map_view( &view, NULL, total_size, mask, FALSE,
-			 VPROT_COMMITTED | VPROT_READ | VPROT_EXEC | VPROT_WRITECOPY | VPROT_IMAGE );
+      status = map_view( &view, NULL, total_size, mask, FALSE, vprot );
 
     if (status != STATUS_SUCCESS) goto error;
 
@@ -226,8 +1300,11 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
       }
     status = STATUS_INVALID_IMAGE_FORMAT;  /* generic error */
     header_size = min( header_size, fsize );
-    if (map_file_into_view( view, hfile, 0, header_size, 0, VPROT_COMMITTED | VPROT_READ | VPROT_WRITECOPY,
-                            !dup_mapping ) != STATUS_SUCCESS) goto error;
+    if (!(vprot & VPROT_COMMITTED)
+        && VirtualAlloc( ptr, ROUND_SIZE( 0, header_size ), MEM_COMMIT,
+                         PAGE_EXECUTE_READWRITE ) != ptr) goto error;
+    /* the headers were read already for get_image_params */
+    if (image_header_pread( header, hfile, ptr, header_size, 0 ) != header_size) goto error;
     dos = (IMAGE_DOS_HEADER *)ptr;
     nt = (IMAGE_NT_HEADERS *)(ptr + dos->e_lfanew);
     header_end = ptr + ROUND_SIZE( 0, header_size );
@@ -263,6 +1340,23 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
 	  goto error;
 	}
     
+    /* prepare for a lazy load, or fall back to committing everything */
+
+    if (!(vprot & VPROT_COMMITTED))
+      {
+        if (nt->OptionalHeader.SectionAlignment > page_mask)
+          limg = lazy_image_create( ptr, total_size, hmap, fsize, nt, sec, header_size );
+        if (!limg)
+          {
+            TRACE( "can not load %p on demand, committing all of it\n", ptr );
+            if (VirtualAlloc( ptr, total_size, MEM_COMMIT, PAGE_EXECUTE_READWRITE ) != ptr)
+              {
+                status = GetLastError();
+                goto error;
+              }
+          }
+      }
+
     /* check for non page-aligned binary */
 
     if (nt->OptionalHeader.SectionAlignment <= page_mask)
@@ -297,20 +1391,18 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
 
     /* map all the sections */
 
+    if (!(reads = malloc( nt->FileHeader.NumberOfSections * sizeof(*reads) )))
+      {
+        status = STATUS_NO_MEMORY;
+        goto error;
+      }
+
     for (i = pos = 0; i < nt->FileHeader.NumberOfSections; i++, sec++)
       {
         static const SIZE_T sector_align = 0x1ff;
         SIZE_T map_size, file_start, file_size, end;
 
-        if (!sec->Misc.VirtualSize)
-	  map_size = ROUND_SIZE( 0, sec->SizeOfRawData );
-        else
-	  map_size = ROUND_SIZE( 0, sec->Misc.VirtualSize );
-
-        /* file positions are rounded to sector boundaries regardless of OptionalHeader.FileAlignment */
-        file_start = sec->PointerToRawData & ~sector_align;
-        file_size = (sec->SizeOfRawData + (sec->PointerToRawData & sector_align) + sector_align) & ~sector_align;
-        if (file_size > map_size) file_size = map_size;
+        get_section_range( sec, &map_size, &file_start, &file_size );
 
         /* a few sanity checks */
         end = sec->VirtualAddress + ROUND_SIZE( sec->VirtualAddress, map_size );
@@ -321,6 +1413,9 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
             goto error;
 	  }
 
+        /* the pages are brought in by virtual_handle_fault */
+        if (limg) continue;
+
         if ((sec->Characteristics & IMAGE_SCN_MEM_SHARED) &&
             (sec->Characteristics & IMAGE_SCN_MEM_WRITE))
 	  {
@@ -353,27 +1448,28 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
             continue;
 	  }
 
-        ERR( "mapping section %.8s at %p off %x size %x virt %x flags %x\n",
+        TRACE( "mapping section %.8s at %p off %x size %x virt %x flags %x\n",
 	     sec->Name, ptr + sec->VirtualAddress,
 	     sec->PointerToRawData, sec->SizeOfRawData,
 	     sec->Misc.VirtualSize, sec->Characteristics );
 	
         if (!sec->PointerToRawData || !file_size) continue;
 
-        /* Note: if the section is not aligned properly map_file_into_view will magically
-         *       fall back to read(), so we don't need to check anything here.
+        /* Note: the sections are read in by read_sections after this loop, which
+         *       does not care about alignment, so we don't need to check anything here.
          */
         end = file_start + file_size;
         if (sec->PointerToRawData >= fsize ||
             end > ((fsize + sector_align) & ~sector_align) ||
-            end < file_start ||
-            map_file_into_view( view, hfile, sec->VirtualAddress, file_size, file_start,
-                                VPROT_COMMITTED | VPROT_READ | VPROT_WRITECOPY,
-                                !dup_mapping ) != STATUS_SUCCESS)
+            end < file_start)
 	  {
             ERR( "Could not map section %.8s, file probably truncated\n", sec->Name );
             goto error;
 	  }
+        reads[nr_reads].rva = sec->VirtualAddress;
+        reads[nr_reads].file_start = file_start;
+        reads[nr_reads].file_size = file_size;
+        nr_reads++;
 
         if (file_size & page_mask)
 	  {
@@ -386,15 +1482,48 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
 	  }
       }
 
+    /* with many relocations, relocate while the sections come in (unless
+       the relocation is spread over several threads) */
+
+    if (!limg && !(alloc_type & HIMEMCE_PARALLEL_RELOC) && ptr != base && !(nt->FileHeader.Characteristics & IMAGE_FILE_RELOCS_STRIPPED)
+        && nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size >= PIPELINE_MIN_RELOCS)
+      {
+        delta = ptr - base;
+        status = read_and_relocate( hfile, ptr, total_size, reads, nr_reads,
+                                    &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC],
+                                    delta );
+        if (status != STATUS_SUCCESS) goto error;
+        goto done;
+      }
+
+    if (read_sections( hfile, ptr, reads, nr_reads ) != STATUS_SUCCESS)
+      {
+        status = STATUS_NO_MEMORY;
+        goto error;
+      }
+
  reloc:
+    if (limg)
+      {
+        /* relocation happens page by page as the pages come in */
+        if (ptr != base && (nt->FileHeader.Characteristics & IMAGE_FILE_RELOCS_STRIPPED))
+	  {
+            TRACE( "Need to relocate module from %p to %p, but there are no relocation records\n",
+		   base, ptr );
+            status = STATUS_CONFLICTING_ADDRESSES;
+            goto error;
+	  }
+        delta = ptr - base;
+        if ((status = lazy_image_activate( limg, nt, delta )) != STATUS_SUCCESS) goto error;
+      }
+
     /* perform base relocation, if necessary */
 
-    if (ptr != base)
+    else if (ptr != base)
       // &&
       //        ((nt->FileHeader.Characteristics & IMAGE_FILE_DLL) ||
       //	 !NtCurrentTeb()->Peb->ImageBaseAddress) )
       {
-        IMAGE_BASE_RELOCATION *rel, *end;
         const IMAGE_DATA_DIRECTORY *relocs;
 
         if (nt->FileHeader.Characteristics & IMAGE_FILE_RELOCS_STRIPPED)
@@ -409,23 +1538,11 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
 	       base, base + total_size, ptr, ptr + total_size );
 
         relocs = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
-        rel = (IMAGE_BASE_RELOCATION *)(ptr + relocs->VirtualAddress);
-        end = (IMAGE_BASE_RELOCATION *)(ptr + relocs->VirtualAddress + relocs->Size);
         delta = ptr - base;
-
-        while (rel < end - 1 && rel->SizeOfBlock)
-	  {
-            if (rel->VirtualAddress >= total_size)
-	      {
-                TRACE( "invalid address %p in relocation %p\n", ptr + rel->VirtualAddress, rel );
-                status = STATUS_ACCESS_VIOLATION;
-                goto error;
-	      }
-            rel = MyLdrProcessRelocationBlock( ptr + rel->VirtualAddress,
-					       (rel->SizeOfBlock - sizeof(*rel)) / sizeof(USHORT),
-					       (USHORT *)(rel + 1), delta );
-            if (!rel) goto error;
-	  }
+        status = virtual_relocate( ptr, total_size, relocs, delta,
+                                   (alloc_type & HIMEMCE_PARALLEL_RELOC)
+                                   && relocs->Size >= PARALLEL_MIN_RELOCS ? virtual_reloc_threads : 1 );
+        if (status != STATUS_SUCCESS) goto error;
       }
 #if 0
     /* set the image protections */
@@ -455,7 +1572,8 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
       }
 #endif
 
-    // done:
+ done:
+    free( reads );
     *addr_ptr = ptr;
 #ifdef VALGRIND_LOAD_PDB_DEBUGINFO
     VALGRIND_LOAD_PDB_DEBUGINFO(fd, ptr, total_size, delta);
@@ -464,15 +1582,21 @@ static NTSTATUS map_image (HANDLE hmapping, HANDLE hfile, HANDLE hmap, char *bas
     return STATUS_SUCCESS;
 
  error:
+    free( reads );
+    if (limg) lazy_image_free( limg );
     if (view) delete_view( view );
     return status;
 }
 
 
+/* For SEC_IMAGE, HEADER is the start of FILE, read by
+   image_header_read, and must stay valid until the section is
+   closed.  */
 NTSTATUS MyNtCreateSection (HANDLE *handle, ACCESS_MASK access,
 			    /* const OBJECT_ATTRIBUTES *attr */ void *attr,
 			    const LARGE_INTEGER *size, ULONG protect,
-			    ULONG sec_flags, HANDLE file)
+			    ULONG sec_flags, HANDLE file,
+			    const struct image_header *header)
 {
     NTSTATUS ret;
     unsigned int vprot;
@@ -485,8 +1609,8 @@ NTSTATUS MyNtCreateSection (HANDLE *handle, ACCESS_MASK access,
     if (sec_flags & SEC_NOCACHE) vprot |= VPROT_NOCACHE;
     if (sec_flags & SEC_IMAGE) vprot |= VPROT_IMAGE;
 
-    ret = SERVER_create_mapping (access, attr, file, size ? size->QuadPart : 0,
-				 vprot, handle);
+    ret = SERVER_create_mapping (access, attr, file, header,
+				 size ? size->QuadPart : 0, vprot, handle);
 
     return ret;
 }
@@ -507,6 +1631,7 @@ NTSTATUS MyNtMapViewOfSection (HANDLE handle, HANDLE process, PVOID *addr_ptr, U
   DWORD header_size;
   HANDLE fhandle;
   HANDLE mhandle;
+  const struct image_header *header;
   LARGE_INTEGER offset;
 
   offset.QuadPart = offset_ptr ? offset_ptr->QuadPart : 0;
@@ -539,7 +1664,8 @@ NTSTATUS MyNtMapViewOfSection (HANDLE handle, HANDLE process, PVOID *addr_ptr, U
       return STATUS_INVALID_PARAMETER;
     }
 
-  res = SERVER_get_mapping_info (handle, access, &map_vprot, &base, &full_size, &header_size, &fhandle, &mhandle);
+  res = SERVER_get_mapping_info (handle, access, &map_vprot, &base, &full_size, &header_size, &fhandle, &mhandle,
+                                 &header);
   if (res) return res;
 
   if (map_vprot & VPROT_IMAGE)
@@ -551,8 +1677,8 @@ NTSTATUS MyNtMapViewOfSection (HANDLE handle, HANDLE process, PVOID *addr_ptr, U
 	  res = STATUS_INVALID_PARAMETER;
 	  goto done;
         }
-      res = map_image( handle, fhandle, mhandle, base, size, mask, header_size,
-		       -1, INVALID_HANDLE_VALUE, addr_ptr );
+      res = map_image( handle, fhandle, mhandle, base, size, mask, header_size, header,
+		       -1, INVALID_HANDLE_VALUE, alloc_type, addr_ptr );
       if (res >= 0) *size_ptr = size;
       return res;
     }
@@ -627,3 +1753,17 @@ NTSTATUS MyNtMapViewOfSection (HANDLE handle, HANDLE process, PVOID *addr_ptr, U
   //
   //  return STATUS_SUCCESS;
 }
+
+
+NTSTATUS MyNtUnmapViewOfSection (HANDLE process, PVOID addr)
+{
+  struct lazy_image *img;
+
+  if (himemce_cache_unmap( addr )) return STATUS_SUCCESS;
+  lock_lazy();
+  img = find_lazy_image( addr );
+  unlock_lazy();
+  if (img) lazy_image_free( img );
+  if (!VirtualFree( addr, 0, MEM_RELEASE )) return GetLastError();
+  return STATUS_SUCCESS;
+}
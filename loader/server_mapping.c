@@ -44,12 +44,14 @@ struct mapping
   HANDLE         *hnd;             /* handle for mapped file */
   int             header_size;     /* size of headers (for PE image mapping) */
   void           *base;            /* default base addr (for PE image mapping) */
+  const struct image_header *header; /* start of the file (for PE image mapping) */
 };
 
 
 
 /* retrieve the mapping parameters for an executable (PE) image */
-static int get_image_params( struct mapping *mapping, HANDLE unix_fd )
+static int get_image_params( struct mapping *mapping, HANDLE unix_fd,
+                             const struct image_header *header )
 {
   IMAGE_DOS_HEADER dos;
   IMAGE_SECTION_HEADER *sec = NULL;
@@ -68,11 +70,11 @@ static int get_image_params( struct mapping *mapping, HANDLE unix_fd )
 
     /* load the headers */
 
-    if (pread( unix_fd, (char *) &dos, sizeof(dos), 0 ) != sizeof(dos)) goto error;
+    if (image_header_pread( header, unix_fd, (char *) &dos, sizeof(dos), 0 ) != sizeof(dos)) goto error;
     if (dos.e_magic != IMAGE_DOS_SIGNATURE) goto error;
     pos = dos.e_lfanew;
 
-    size = pread( unix_fd, (char *) &nt, sizeof(nt), pos );
+    size = image_header_pread( header, unix_fd, (char *) &nt, sizeof(nt), pos );
     if (size < sizeof(nt.Signature) + sizeof(nt.FileHeader)) goto error;
     /* zero out Optional header in the case it's not present or partial */
     if (size < sizeof(nt)) memset( (char *)&nt + size, 0, sizeof(nt) - size );
@@ -101,7 +103,7 @@ static int get_image_params( struct mapping *mapping, HANDLE unix_fd )
     if (pos + size > mapping->size) goto error;
     if (pos + size > mapping->header_size) mapping->header_size = pos + size;
     if (!(sec = malloc( size ))) goto error;
-    if (pread( unix_fd, (void *) sec, size, pos ) != size) goto error;
+    if (image_header_pread( header, unix_fd, (void *) sec, size, pos ) != size) goto error;
 
     // if (!build_shared_mapping( mapping, unix_fd, sec, nt.FileHeader.NumberOfSections )) goto error;
 
@@ -121,7 +123,8 @@ static int get_image_params( struct mapping *mapping, HANDLE unix_fd )
 void *create_mapping(/* struct directory *root */ void *root,
 		     /* const struct unicode_str *name */ void *name,
 		     unsigned int attr, mem_size_t size, int protect,
-		     HANDLE handle, /* const struct security_descriptor *sd */ void *sd)
+		     HANDLE handle, const struct image_header *header,
+		     /* const struct security_descriptor *sd */ void *sd)
 {
   struct mapping *mapping;
 #if 0
@@ -143,6 +146,7 @@ void *create_mapping(/* struct directory *root */ void *root,
   mapping->base        = 0;
   mapping->fhnd        = handle;
   mapping->hnd         = 0;
+  mapping->header      = header;
 
   if (protect & VPROT_READ) access |= FILE_READ_DATA;
   if (protect & VPROT_WRITE) access |= FILE_WRITE_DATA;
@@ -159,7 +163,7 @@ void *create_mapping(/* struct directory *root */ void *root,
     
       mapping->hnd = CreateFileMapping (handle, NULL, get_prot_flags (protect),
 					0, size, NULL);
-      if (mapping->hnd == INVALID_HANDLE_VALUE)
+      if (!mapping->hnd || mapping->hnd == INVALID_HANDLE_VALUE)
 	goto error;
 
 #if 0
@@ -170,7 +174,7 @@ void *create_mapping(/* struct directory *root */ void *root,
 
       if (protect & VPROT_IMAGE)
         {
-	  if (!get_image_params( mapping, handle )) goto error;
+	  if (!header || !get_image_params( mapping, handle, header )) goto error;
 	  return &mapping->obj;
         }
 #if 0
@@ -221,14 +225,15 @@ void *create_mapping(/* struct directory *root */ void *root,
 
 
 /* create a file mapping */
-NTSTATUS SERVER_create_mapping (ACCESS_MASK access, const OBJECT_ATTRIBUTES *attr,
-				HANDLE file_handle, long long size, unsigned int protect, HANDLE *handle)
+NTSTATUS SERVER_create_mapping (ACCESS_MASK access, OBJECT_ATTRIBUTES *attr,
+				HANDLE file_handle, const struct image_header *header,
+				long long size, unsigned int protect, HANDLE *handle)
 {
   void *obj;
   
   *handle = 0;
 
-  obj = create_mapping( NULL, NULL, 0, (mem_size_t) size, protect, file_handle, NULL );
+  obj = create_mapping( NULL, NULL, 0, (mem_size_t) size, protect, file_handle, header, NULL );
   if (! obj)
     return GetLastError ();
 
@@ -240,7 +245,7 @@ NTSTATUS SERVER_create_mapping (ACCESS_MASK access, const OBJECT_ATTRIBUTES *att
 
 NTSTATUS SERVER_get_mapping_info (HANDLE _mapping, ACCESS_MASK access, unsigned int *protect,
 				  void **base, mem_size_t *size, int *header_size, HANDLE *fhandle,
-				  HANDLE *handle)
+				  HANDLE *handle, const struct image_header **header)
 {
   struct mapping *mapping = (struct mapping *) _mapping;
 
@@ -252,7 +257,20 @@ NTSTATUS SERVER_get_mapping_info (HANDLE _mapping, ACCESS_MASK access, unsigned
   *handle      = mapping->hnd;
   *header_size = mapping->header_size;
   *base        = mapping->base;
+  *header      = mapping->header;
 
   return STATUS_SUCCESS;
 }
 
+
+/* close a file mapping */
+NTSTATUS SERVER_close_mapping (HANDLE _mapping)
+{
+  struct mapping *mapping = (struct mapping *) _mapping;
+
+  if (mapping->hnd)
+    CloseHandle (mapping->hnd);
+  free (mapping);
+
+  return STATUS_SUCCESS;
+}
@@ -47,10 +47,13 @@ typedef int mem_size_t; // Normally 64 bit, but good enough.
 
 
 /* Server mapping.  */
+struct image_header;
 NTSTATUS SERVER_create_mapping (ACCESS_MASK access, /* const OBJECT_ATTRIBUTES *attr */ void *attr,
-				HANDLE file_handle, long long size, unsigned int protect, HANDLE *handle);
+				HANDLE file_handle, const struct image_header *header,
+				long long size, unsigned int protect, HANDLE *handle);
 NTSTATUS SERVER_get_mapping_info (HANDLE _mapping, ACCESS_MASK access, unsigned int *protect,
 				  void **base, mem_size_t *size, int *header_size, HANDLE *fhandle,
-				  HANDLE *handle);
+				  HANDLE *handle, const struct image_header **header);
+NTSTATUS SERVER_close_mapping (HANDLE _mapping);
 
 #endif
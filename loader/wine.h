@@ -35,11 +35,29 @@ extern struct _PEB _peb;
 
 #define OBJECT_ATTRIBUTES void
 
+#ifdef HIMEMCE_HOST
+/* The host C library has its own off_t and pread.  */
+#include <sys/types.h>
+#define pread himemce_pread
+#else
 typedef int off_t;
+#endif
 
 /* compat.c */
 size_t pread(HANDLE handle, char *buffer, size_t len, off_t offset);
 
+/* The start of an image file, which holds its headers.  */
+#define IMAGE_HEADER_BUFFER 0x1000
+struct image_header
+{
+  size_t len;
+  char data[IMAGE_HEADER_BUFFER];
+};
+
+BOOL image_header_read (struct image_header *header, HANDLE handle);
+size_t image_header_pread (const struct image_header *header, HANDLE handle,
+			   char *buffer, size_t len, off_t offset);
+
 int get_prot_flags (int vprot);
 
 
@@ -50,6 +68,14 @@ ULONG MyRtlNtStatusToDosError (NTSTATUS status);
 PIMAGE_NT_HEADERS MyRtlImageNtHeader (HMODULE hModule);
 NTSTATUS MyLdrLoadDll (LPCWSTR path_name, DWORD flags,
 		       LPCWSTR libname, HMODULE* hModule);
+NTSTATUS MyLdrLoadDllFile (LPCWSTR libname, HANDLE file, DWORD flags,
+			   HMODULE* hModule);
+NTSTATUS MyLdrResolveImports (HMODULE hModule);
+NTSTATUS MyLdrDiscardImage (HMODULE hModule);
+/* Bind the lazily bound imports of HMODULE that were not called yet,
+   and return their number.  */
+int MyLdrBindLazyImports (HMODULE hModule);
+NTSTATUS MyLdrUnloadDll (HMODULE hModule);
 void MyLdrInitializeThunk( void *kernel_start, ULONG_PTR unknown2,
 			   ULONG_PTR unknown3, ULONG_PTR unknown4 );
 IMAGE_BASE_RELOCATION *MyLdrProcessRelocationBlock (void *page, UINT count,
@@ -58,12 +84,67 @@ IMAGE_BASE_RELOCATION *MyLdrProcessRelocationBlock (void *page, UINT count,
 PVOID MyRtlImageDirectoryEntryToData( HMODULE module, BOOL image,
 				      WORD dir, ULONG *size );
 
+/* An entry of IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT, the same as
+   ImgDelayDescr in delayimp.h of Visual C++.  The list ends with an
+   entry of zeroes.  */
+struct himemce_delay_descr
+{
+  DWORD grAttrs;
+  DWORD rvaDLLName;
+  DWORD rvaHmod;		/* where the module handle is kept */
+  DWORD rvaIAT;
+  DWORD rvaINT;
+  DWORD rvaBoundIAT;
+  DWORD rvaUnloadIAT;
+  DWORD dwTimeStamp;
+};
+
+/* In grAttrs if the fields are RVAs.  Older linkers (Visual C++ 6)
+   stored addresses, which are left to the delay load helper linked
+   into the image.  */
+#define HIMEMCE_DELAY_RVA 1
+
 
 /* ntdll_virtual.c */
+
+/* Private flag for MyLoadLibraryExW and MyNtMapViewOfSection: only
+   reserve the image and bring in each page on first access.  */
+#define HIMEMCE_LAZY_LOAD 0x80000000
+
+/* Private flag for MyLoadLibraryExW: map the image from its relocated
+   image cache, and create the cache if there is none.  */
+#define HIMEMCE_CACHE_LOAD 0x40000000
+
+/* Private flag for MyLoadLibraryExW and MyNtMapViewOfSection: apply
+   large relocation tables with several threads.  */
+#define HIMEMCE_PARALLEL_RELOC 0x20000000
+
+/* Private flag for MyLoadLibraryExW: bind the imports of the image
+   from its bound imports snapshot, and update the snapshot.  */
+#define HIMEMCE_BIND_IMPORTS 0x10000000
+
+/* Private flag for MyLoadLibraryExW: bind the functions imported by
+   the image on their first call.  */
+#define HIMEMCE_LAZY_BIND 0x08000000
+
+/* Private flag for MyLoadLibraryExW: copy the read-write sections of
+   the preloaded DLLs the image uses to low memory page by page, when
+   they are first touched.  */
+#define HIMEMCE_LAZY_LOW 0x04000000
+
+/* The number of threads for HIMEMCE_PARALLEL_RELOC, or 0 for one per
+   processor.  */
+extern int virtual_reloc_threads;
+
+NTSTATUS virtual_relocate (char *ptr, SIZE_T total_size,
+			   const IMAGE_DATA_DIRECTORY *relocs, INT_PTR delta,
+			   int nr_threads);
+
 NTSTATUS MyNtCreateSection (HANDLE *handle, ACCESS_MASK access,
-			    const OBJECT_ATTRIBUTES *attr,
+			    OBJECT_ATTRIBUTES *attr,
 			    const LARGE_INTEGER *size, ULONG protect,
-			    ULONG sec_flags, HANDLE file);
+			    ULONG sec_flags, HANDLE file,
+			    const struct image_header *header);
 NTSTATUS MyNtMapViewOfSection (HANDLE handle, HANDLE process,
 			       PVOID *addr_ptr, ULONG zero_bits,
 			       SIZE_T commit_size,
@@ -71,11 +152,60 @@ NTSTATUS MyNtMapViewOfSection (HANDLE handle, HANDLE process,
 			       SIZE_T *size_ptr,
 			       SECTION_INHERIT inherit, ULONG alloc_type,
 			       ULONG protect);
+NTSTATUS MyNtUnmapViewOfSection (HANDLE process, PVOID addr);
+int virtual_handle_fault (void *addr);
+BOOL virtual_get_image_pages (void *base, DWORD *committed, DWORD *total);
+BOOL virtual_copy_area_init (void *base, SIZE_T size);
+BOOL virtual_copy_lazily (void *dst, const void *src, SIZE_T size);
+BOOL virtual_get_copy_area_pages (DWORD *committed, DWORD *total);
+
+/* Decommit the discardable sections and the relocations of the
+   loaded image at BASE, and store up to MAX_RANGES of the decommitted
+   ranges in RANGES.  Returns the number of ranges.  */
+struct himemce_discarded;
+int virtual_discard_image (void *base, struct himemce_discarded *ranges,
+			   int max_ranges);
+
+/* himemce-cache.c */
+void *himemce_cache_map (LPCWSTR name, HANDLE file,
+			 const struct image_header *header);
+void himemce_cache_save (LPCWSTR name, HANDLE file,
+			 const struct image_header *header, void *image);
+BOOL himemce_cache_unmap (void *image);
+BOOL himemce_cache_is_mapped (void *image);
+void *himemce_cache_rva (void *image, DWORD rva);
+
+/* himemce-bind.c */
+struct himemce_bind;
+struct himemce_bind *himemce_bind_open (LPCWSTR name, HMODULE module,
+					const IMAGE_IMPORT_DESCRIPTOR *imports,
+					int nr_imports);
+BOOL himemce_bind_apply (struct himemce_bind *bind, int idx, DWORD base,
+			 const FILETIME *stamp);
+void himemce_bind_record (struct himemce_bind *bind, int idx, DWORD base,
+			  const FILETIME *stamp);
+void himemce_bind_close (struct himemce_bind *bind);
+BOOL himemce_bind_module_stamp (HMODULE module, FILETIME *stamp);
+
+/* himemce-dlls.c */
+struct himemce_dll_stats
+{
+  /* LoadLibrary calls, and the calls avoided.  */
+  unsigned long dll_loads;
+  unsigned long dll_hits;
+  /* GetProcAddress calls, and the calls avoided.  */
+  unsigned long proc_lookups;
+  unsigned long proc_hits;
+};
+extern struct himemce_dll_stats himemce_dll_stats;
+HMODULE himemce_dll_load (const char *name, size_t len);
+FARPROC himemce_dll_proc (HMODULE module, const char *name);
 
 /* kernel32_module.c */
 HMODULE MyLoadLibraryExW (LPCWSTR libnameW, HANDLE hfile, DWORD flags);
 
 /* kernel32_process.c */
-BOOL MyCreateProcessW (LPCWSTR app_name, LPWSTR cmd_line, int *exit_code);
+BOOL MyCreateProcessW (LPCWSTR app_name, LPWSTR cmd_line, DWORD flags,
+		       int *exit_code);
 
 #endif